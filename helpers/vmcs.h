@@ -97,4 +97,16 @@ static inline void __invept(int ext, u64 eptp, gpa_t gpa) {
       : : "a" (&operand), "c" (ext) : "cc", "memory");
 }
 
+static inline void __invvpid(int ext, u16 vpid, u64 gva) {
+  struct {
+    u64 vpid : 16;
+    u64 rsvd : 48;
+    u64 gva;
+  } operand = { vpid, 0, gva };
+
+  asm volatile (__ex(ASM_VMX_INVVPID)
+      /* CF==1 or ZF==1 --> rc = -1 */
+      : : "a" (&operand), "c" (ext) : "cc", "memory");
+}
+
 
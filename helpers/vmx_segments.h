@@ -43,13 +43,35 @@ static const struct kvm_vmx_segment_field {
 
 static void kvm_get_segment(struct vcpu *vcpu, struct kvm_segment *var, int seg) {
 	const struct kvm_vmx_segment_field *sf = &kvm_vmx_segment_fields[seg];
-  var->base = vmcs_readl(sf->base);
-  var->limit = vmcs_read32(sf->limit);
-  var->selector = vmcs_read16(sf->selector);
+	u32 ar;
+
+	var->base = vmcs_readl(sf->base);
+	var->limit = vmcs_read32(sf->limit);
+	var->selector = vmcs_read16(sf->selector);
+	ar = vmcs_read32(sf->ar_bytes);
+	var->unusable = (ar >> 16) & 1;
+	var->type = ar & 15;
+	var->s = (ar >> 4) & 1;
+	var->dpl = (ar >> 5) & 3;
+	/* the cpu's own p bit, unusable and not present aren't the same thing */
+	var->present = (ar >> 7) & 1;
+	var->avl = (ar >> 12) & 1;
+	var->l = (ar >> 13) & 1;
+	var->db = (ar >> 14) & 1;
+	var->g = (ar >> 15) & 1;
 }
 
 static void kvm_set_segment(struct vcpu *vcpu, struct kvm_segment *var, int seg) {
 	const struct kvm_vmx_segment_field *sf = &kvm_vmx_segment_fields[seg];
+	struct kvm_segment tr;
+
+	/* vm entry only takes a busy tss, userspace often hands us an available one */
+	if (seg == VCPU_SREG_TR && !var->unusable && var->present) {
+		tr = *var;
+		tr.type |= 2;
+		var = &tr;
+	}
+
 	vmcs_writel(sf->base, var->base);
 	vmcs_write32(sf->limit, var->limit);
 	vmcs_write16(sf->selector, var->selector);
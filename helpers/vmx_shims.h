@@ -31,6 +31,7 @@
 #include <mach/i386/vm_param.h>
 #include <mach/i386/kern_return.h>
 #include <vm/vm_kern.h>
+#include <mach/vm_statistics.h>
 
 #include <i386/proc_reg.h>
 
@@ -47,6 +48,12 @@ typedef struct pmap *pmap_t;
 extern vm_map_t kernel_map;
 extern pmap_t kernel_pmap;
 extern ppnum_t pmap_find_phys(pmap_t pmap, addr64_t va);
+extern vm_map_t get_task_map(task_t t);
+extern unsigned int ml_phys_read_word_64(addr64_t paddr);
+extern unsigned long long ml_phys_read_double_64(addr64_t paddr);
+extern void ml_phys_write_word_64(addr64_t paddr, unsigned int data);
+extern void ml_phys_write_double_64(addr64_t paddr, unsigned long long data);
+extern kern_return_t mach_vm_page_query(vm_map_t map, mach_vm_offset_t offset, integer_t *disposition, integer_t *ref_count);
 }
 
 void *vmx_pcalloc(void) {
@@ -62,6 +69,13 @@ addr64_t vmx_paddr(void *va) {
   return ret;
 }
 
+// true if the user page has never been written, so it still reads as zero
+int vmx_user_page_untouched(task_t task, mach_vm_address_t va) {
+  integer_t disposition = 0, ref_count = 0;
+  if (mach_vm_page_query(get_task_map(task), va, &disposition, &ref_count) != KERN_SUCCESS) return 0;
+  return (disposition & (VM_PAGE_QUERY_PAGE_PRESENT | VM_PAGE_QUERY_PAGE_PAGED_OUT)) == 0;
+}
+
 void vmx_pfree(void *va) {
 	IOFreeAligned(va, PAGE_SIZE);
 }
@@ -2,10 +2,16 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 
-static int __ioctl(int fd, unsigned int type, void *arg) {
-  if (type == KVM_SET_CPUID || type == KVM_SET_CPUID2 || type == KVM_SET_MSRS ||
+// these end in a 0 length array the kext copies in from the self field
+static int __ioctl_has_self(unsigned int type) {
+  return type == KVM_SET_CPUID || type == KVM_SET_CPUID2 || type == KVM_SET_MSRS ||
       type == KVM_GET_MSRS || type == KVM_GET_MSR_INDEX_LIST ||
-      type == KVM_GET_SUPPORTED_CPUID) {
+      type == KVM_GET_SUPPORTED_CPUID || type == KVM_BALLOON_OP ||
+      type == KVM_SET_GSI_ROUTING;
+}
+
+static int __ioctl(int fd, unsigned int type, void *arg) {
+  if (__ioctl_has_self(type)) {
     // need user pointer to copyin the rest of the data not in the ioctl sizeof
     *(__u64 *)arg = (__u64)arg;
   }
@@ -126,6 +126,157 @@ struct kvm_userspace_memory_region {
  */
 #define KVM_MEM_LOG_DIRTY_PAGES	(1UL << 0)
 #define KVM_MEM_READONLY	(1UL << 1)
+/* added for mac os x, read faults on untouched pages map a shared zero page */
+#define KVM_MEM_SHARE_ZERO	(1UL << 15)
+
+/* for KVM_BALLOON_OP, added for mac os x */
+struct kvm_balloon_range {
+	__u64 gfn;
+	__u64 npages;
+};
+
+struct kvm_balloon_op {
+	__u64 self;
+	__s32 npages; /* out: number of pages given back to the host */
+	__u32 nranges;
+	struct kvm_balloon_range ranges[0];
+};
+
+/* for KVM_BATCH_SETUP and KVM_BATCH_SUBMIT, added for mac os x */
+#define KVM_BATCH_ENTRIES 64
+
+struct kvm_batch_sqe {
+	__u32 cmd;       /* any vm or vcpu ioctl except KVM_RUN */
+	__u32 flags;     /* must be 0 */
+	__u64 addr;      /* ioctl argument, as it would be passed to ioctl */
+	__u64 user_data; /* copied to the completion */
+};
+
+struct kvm_batch_cqe {
+	__u64 user_data;
+	__s32 result;    /* 0 or a positive errno, like the ioctl would return */
+	__u32 pad;
+};
+
+/*
+ * one page shared by libkvm and the kext.  userspace fills sqes and bumps
+ * sq_tail, the kext consumes up to sq_tail and posts a cqe for each op.
+ * indexes are free running, mask with KVM_BATCH_ENTRIES - 1.
+ */
+struct kvm_batch_ring {
+	__u32 sq_head;   /* written by the kext */
+	__u32 sq_tail;   /* written by userspace */
+	__u32 cq_head;   /* written by userspace */
+	__u32 cq_tail;   /* written by the kext */
+	struct kvm_batch_sqe sqes[KVM_BATCH_ENTRIES];
+	struct kvm_batch_cqe cqes[KVM_BATCH_ENTRIES];
+};
+
+/* for KVM_PROF_SETUP, added for mac os x */
+#define KVM_PROF_TIMER 1 /* preemption timer, period in ns */
+#define KVM_PROF_INTR  2 /* every period'th exit for a host interrupt */
+
+#define KVM_PROF_SAMPLE_LONG 1 /* guest was in long mode */
+
+struct kvm_prof_setup {
+	__u64 addr;      /* page aligned struct kvm_prof_ring, 0 stops */
+	__u32 size;      /* bytes, a multiple of the page size */
+	__u32 mode;
+	__u64 period;
+};
+
+struct kvm_prof_sample {
+	__u64 tsc;
+	__u64 rip;
+	__u64 cr3;
+	__u32 cpl;
+	__u32 flags;
+};
+
+/*
+ * wired and filled by the kext while the vcpu runs, userspace reads from
+ * tail to head and advances tail.  indexes are free running, mask with
+ * entries - 1.  a full ring drops samples instead of blocking the vcpu.
+ */
+struct kvm_prof_ring {
+	__u32 head;      /* written by the kext */
+	__u32 tail;      /* written by userspace */
+	__u32 entries;   /* written by the kext, a power of two */
+	__u32 pad;
+	__u64 dropped;   /* samples lost to a full ring */
+	__u64 exits;     /* exits only the profiler's timer caused */
+	__u64 overhead;  /* tsc cycles spent sampling and in those exits */
+	struct kvm_prof_sample samples[0];
+};
+
+/*
+ * for KVM_SET_CPU_QUOTA, added for mac os x.  the vcpu gets runtime ns of
+ * guest time in every period ns, then sleeps until the next period starts.
+ * a runtime of 0 lifts the quota.
+ */
+struct kvm_cpu_quota {
+	__u64 period;
+	__u64 runtime;
+};
+
+/*
+ * for KVM_TRANSLATE_READ, added for mac os x.  every entry's gva is walked
+ * through the guest page tables under cr3, in the paging mode given, and
+ * len bytes from there are copied to addr.  the tables and the data are
+ * read through the memory slots, accessed and dirty bits are left alone
+ * and the vcpu keeps running.  what comes back is a snapshot, the guest
+ * can change it as it's read.
+ */
+#define KVM_PAGING_NONE    0 /* gva is the gpa */
+#define KVM_PAGING_32      1 /* two levels, 4k pages only */
+#define KVM_PAGING_32_PSE  2 /* two levels, 4mb pages too */
+#define KVM_PAGING_PAE     3
+#define KVM_PAGING_LONG    4
+#define KVM_TRANSLATE_READ_MAX 65536
+
+struct kvm_translate_read_entry {
+	__u64 gva;
+	__u64 addr;      /* where the data goes, a len of 0 only translates */
+	__u64 gpa;       /* out: where gva is in guest physical memory */
+	__u32 len;       /* in: bytes to read, out: bytes read */
+	__s32 result;    /* out: 0, ENOENT for a page the guest hasn't mapped,
+			    ENXIO for one that isn't ram, EFAULT for addr */
+	__u8  writeable; /* out: like struct kvm_translation's */
+	__u8  usermode;
+	__u8  pad[6];
+};
+
+struct kvm_translate_read {
+	__u64 cr3;
+	__u32 paging;    /* KVM_PAGING_* */
+	__u32 nr;        /* up to KVM_TRANSLATE_READ_MAX */
+	__u64 entries;   /* user address of nr struct kvm_translate_read_entry */
+};
+
+/*
+ * read with sysctl kvm.stats, one per vm with a vcpu, added for mac os x.
+ * counters only go up, tools take two reads and look at the difference.
+ */
+#define KVM_STATS_EXIT_REASONS 64
+
+struct kvm_vm_stats {
+	__u32 pid;
+	__u32 vcpu;
+	__u64 tsc;            /* when this copy was taken */
+	__u64 run_tsc;        /* cycles spent in KVM_RUN */
+	__u64 guest_tsc;      /* of those, cycles from entry to exit */
+	__u64 exits[KVM_STATS_EXIT_REASONS];
+	__u64 injected_irqs;  /* external interrupts delivered to the guest */
+	__u64 injected_nmis;
+	__u64 irq_lines;      /* rising edges from KVM_IRQ_LINE */
+	__u64 msis;           /* from KVM_SIGNAL_MSI and msi routes */
+	__u64 demand_faults;  /* guest pages wired on first touch */
+	__u64 quota_periods;  /* cpu quota periods started */
+	__u64 throttled;      /* times the vcpu ran out of cpu quota */
+	__u64 throttled_tsc;  /* cycles spent waiting for the next period */
+	__u64 coalesced_pio;  /* port writes queued on the coalesced ring */
+	__u64 mmio_exits;     /* device accesses sent out as KVM_EXIT_MMIO */
+};
 
 /* for KVM_IRQ_LINE */
 struct kvm_irq_level {
@@ -351,13 +502,19 @@ struct kvm_run {
 struct kvm_coalesced_mmio_zone {
 	__u64 addr;
 	__u32 size;
-	__u32 pad;
+	union {
+		__u32 pad;
+		__u32 pio;
+	};
 };
 
 struct kvm_coalesced_mmio {
 	__u64 phys_addr;
 	__u32 len;
-	__u32 pad;
+	union {
+		__u32 pad;
+		__u32 pio;
+	};
 	__u8  data[8];
 };
 
@@ -370,6 +527,9 @@ struct kvm_coalesced_mmio_ring {
 	((PAGE_SIZE - sizeof(struct kvm_coalesced_mmio_ring)) / \
 	 sizeof(struct kvm_coalesced_mmio))
 
+/* the ring is this page of the vcpu mapping, the kernel fills in last */
+#define KVM_COALESCED_MMIO_PAGE_OFFSET 2
+
 /* for KVM_TRANSLATE */
 struct kvm_translation {
 	/* in */
@@ -783,6 +943,7 @@ struct kvm_ppc_smmu_info {
 #define KVM_CAP_PPC_FIXUP_HCALL 103
 #define KVM_CAP_PPC_ENABLE_HCALL 104
 #define KVM_CAP_CHECK_EXTENSION_VM 105
+#define KVM_CAP_COALESCED_PIO 162
 
 #ifdef KVM_CAP_IRQ_ROUTING
 
@@ -825,6 +986,7 @@ struct kvm_irq_routing_entry {
 };
 
 struct kvm_irq_routing {
+	__u64 self;
 	__u32 nr;
 	__u32 flags;
 	struct kvm_irq_routing_entry entries[0];
@@ -997,6 +1159,17 @@ struct kvm_device_attr {
 /* added for mac os x */
 // IOWR works, IOW and IOR don't
 #define KVM_MMAP_VCPU           _IOWR(KVMIO,   0x49, void *)
+#define KVM_BALLOON_OP          _IOWR(KVMIO,   0x4a, struct kvm_balloon_op)
+/* takes a single range, same layout as the balloon ones */
+#define KVM_UNSHARE_ZERO        _IOWR(KVMIO,   0x4b, struct kvm_balloon_range)
+/* takes the page aligned user address of a struct kvm_batch_ring */
+#define KVM_BATCH_SETUP         _IOWR(KVMIO,   0x4c, __u64)
+/* in: max ops to run, 0 for all queued.  out: ops completed */
+#define KVM_BATCH_SUBMIT        _IOWR(KVMIO,   0x4d, __u32)
+#define KVM_PROF_SETUP          _IOWR(KVMIO,   0x4e, struct kvm_prof_setup)
+#define KVM_SET_CPU_QUOTA       _IOWR(KVMIO,   0x4f, struct kvm_cpu_quota)
+/* 0x50-0x52 are s390's */
+#define KVM_TRANSLATE_READ      _IOWR(KVMIO,   0x53, struct kvm_translate_read)
 
 /* enable ucontrol for s390 */
 struct kvm_s390_ucas_mapping {
@@ -8,17 +8,23 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/param.h>
+#include <sys/systm.h>               // for msleep
 
 // in Kernel.framework headers
 #include <IOKit/IOMemoryDescriptor.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
+#include <libkern/OSAtomic.h>
 #include <i386/vmx.h>                // for host_vmxon and host_vmxoff
 #include <miscfs/devfs/devfs.h>
+#include <sys/sysctl.h>              // for the tsc frequency
 
 #define LOAD_VMCS(vcpu) { lck_spin_lock(vcpu->ioctl_lock); vmcs_load(vcpu->vmcs); vcpu->vmcs_loaded = 1; }
 #define RELEASE_VMCS(vcpu) { vmcs_clear(vcpu->vmcs); lck_spin_unlock(vcpu->ioctl_lock); vcpu->vmcs_loaded = 0; }
 
 // includes from linux
 #include <asm/uapi_vmx.h>
+#include <asm/processor-flags.h>
 #include <linux/kvm.h>
 
 // code in these files
@@ -46,7 +52,16 @@ void *IOCallocAligned(vm_size_t size, vm_size_t alignment) {
   return ret;
 }
 
-#define VCPU_SIZE (PAGE_SIZE*2)
+// c++98 has no static_assert, a negative array size stops the build instead
+#define BUILD_ASSERT_NAME2(line) build_assert_##line
+#define BUILD_ASSERT_NAME(line) BUILD_ASSERT_NAME2(line)
+#define BUILD_ASSERT(cond) typedef char BUILD_ASSERT_NAME(__LINE__)[(cond) ? 1 : -1]
+
+#define CACHE_LINE 64
+// struct vcpu's lines that the exit path and the next entry touch
+#define VCPU_HOT_LINES 7
+
+#define VCPU_SIZE (PAGE_SIZE*3)
 #define KVM_PIO_PAGE_OFFSET 1
 
 #define DEBUG printf
@@ -59,145 +74,1957 @@ extern const void* vmexit_handler;
 #include <signal.h>
 
 #define IRQ_MAX 16
+#define GSI_MAX 1024
+// these take irq_lock instead of ioctl_lock so they can land while the vcpu runs
+#define IS_IRQ_IOCTL(cmd) ((cmd) == KVM_IRQ_LINE || (cmd) == KVM_SIGNAL_MSI)
+// and these take mem_lock, they only read guest memory through the memslots
+#define IS_MEM_IOCTL(cmd) ((cmd) == KVM_TRANSLATE_READ)
+#define KVM_MAX_MEMSLOTS 32
+#define COALESCED_ZONE_MAX 16
+#define PENDING_FAULT_READ 1
+#define PENDING_FAULT_WRITE 2
+// an mmio access, decoded and sent to userspace once interrupts are back on.
+// _MARK is the first one to its page, which gets a misconfigured ept entry
+#define PENDING_FAULT_MMIO 3
+#define PENDING_FAULT_MMIO_MARK 4
+// mmio pages with misconfigured ept entries, the rest take ept violations
+#define MMIO_GFNS_MAX 64
+
+struct kvm_memslot {
+  unsigned long base_gfn;
+  unsigned long npages;
+  unsigned long userspace_addr;
+  unsigned int flags;
+
+  // one wired descriptor per guest page, NULL until the guest touches it
+  IOMemoryDescriptor **pages;
+  // pages mapped read only to zero_page, only with KVM_MEM_SHARE_ZERO
+  unsigned long *zero_bitmap;
+};
 
-/* aggressively uniprocessor, one CREATE_VM = one processor */
-struct vcpu {
-  vmcs *vmcs;
+// a decoded mmio instruction, reg is -1 for an immediate
+struct mmio_insn {
+  int len;
+  int is_write;
+  int size;
+  int reg;
+  int high_byte;
+  // what a read writes back into reg, 8 and 4 clear the rest
+  int reg_size;
+  u64 imm;
+};
 
-  struct kvm_run *kvm_vcpu;
-  IOMemoryDescriptor *md;
-  IOMemoryMap *mm;
+#define BITS_PER_ULONG (sizeof(unsigned long) * 8)
+#define ZERO_BITMAP_SIZE(npages) (((npages) + BITS_PER_ULONG - 1) / BITS_PER_ULONG * sizeof(unsigned long))
+
+// one read only page of zeros shared by every guest
+static void *zero_page;
+static unsigned long zero_page_pa;
+
+// what the cpu supports, filled in at kext start
+static int vmx_has_ept, vmx_has_ug, vmx_has_vpid, vmx_has_load_efer, vmx_has_load_perf_global;
+// architectural pmu, 0 counters if there's none we can virtualize
+static int pmu_version, pmu_nr_gp, pmu_nr_fixed, pmu_gp_width, pmu_fixed_width;
+static u32 pmu_events_mask;
+static int pmu_full_width_writes;
+// what the guest reads from IA32_PERF_CAPABILITIES
+static u64 pmu_perf_caps;
+// the preemption timer ticks once every 1 << rate tsc cycles
+static int vmx_has_preemption_timer, vmx_preemption_timer_rate;
+// monitor trap flag, for single stepping the guest
+static int vmx_has_mtf;
+static u64 tsc_frequency;
+static volatile SInt32 vmx_vpid_counter;
+
+// set to test the shadow mmu on hosts that have ept
+static int force_shadow_mmu = 0;
+
+#define SHADOW_POOL_PAGES 512
+#define SHADOW_ROOTS 4
+#define SHADOW_ENTRIES 512
+#define SHADOW_DIRECT (~0UL)        // gfn of a shadow page that doesn't shadow a guest table
+#define SHADOW_NO_PAGING (~0UL)     // root key while guest paging is off
+
+struct shadow_page {
+  u64 *table;                 // what the cpu walks
+  unsigned long pa;
+  struct shadow_page **children;
+  unsigned long gfn;          // guest table this shadows, writes to it zap us
+  int level;                  // 1 is a page table
+  int in_use;
+  struct shadow_page *parent;
+  int parent_idx;
+  struct shadow_page *next_free;
+};
+
+// msrs the cpu swaps on entry and exit, efer has to be last
+static const u32 vmx_switched_msrs[] = {
+  MSR_IA32_STAR, MSR_IA32_LSTAR, MSR_IA32_CSTAR, MSR_IA32_FMASK, MSR_IA32_KERNEL_GS_BASE, MSR_IA32_EFER
+};
+// efer only goes through the msr lists on cpus without the efer controls
+#define NR_SWITCHED_MSRS (ARRAY_SIZE(vmx_switched_msrs) - (vmx_has_load_efer ? 1 : 0))
+
+struct shadow_root {
+  unsigned long cr3;
+  struct shadow_page *sp;
+};
+
+struct shadow_mmu {
+  // the pool has to live below 4GB, pae cr3 is only 32 bits
+  IOBufferMemoryDescriptor *pool_md;
+  struct shadow_page **children;
+  struct shadow_page pages[SHADOW_POOL_PAGES];
+  struct shadow_page *free_list;
+
+  // most recently used guest cr3s and their trees
+  struct shadow_root roots[SHADOW_ROOTS];
+  int current;
+  int next_victim;
+  int reload;
+};
+
+// the guest's view of the counters. while global_ctrl is on the counters
+// live in the hardware between entry and exit, and the host's are parked here
+#define PMU_MAX_GP 8
+#define PMU_MAX_FIXED 3
+struct vcpu_pmu {
+  u64 global_ctrl;
+  u64 global_status;
+  u64 fixed_ctrl;
+  u64 evtsel[PMU_MAX_GP];
+  u64 gp[PMU_MAX_GP];
+  u64 fixed[PMU_MAX_FIXED];
+
+  int loaded;
+  u64 host_global_ctrl;
+  u64 host_fixed_ctrl;
+  u64 host_evtsel[PMU_MAX_GP];
+  u64 host_gp[PMU_MAX_GP];
+  u64 host_fixed[PMU_MAX_FIXED];
+};
 
+/* aggressively uniprocessor, one CREATE_VM = one processor */
+// laid out by how often things get touched: what the kvm_run asm saves and
+// loads, then what the run loop and the common exit handlers use every time
+// round, then everything ioctls set up.  vcpu_alloc_pages hands it out cache
+// line aligned so those first VCPU_HOT_LINES lines stay packed.  they aren't
+// all an exit touches: stats.guest_tsc and the exit's stats.exits counter are
+// written every time, pmu's first line is read on entry, and the pmu and
+// profiler state beyond that when they're in use
+struct vcpu {
+  // the entry and exit asm, regs first so rax-r15 get one byte displacements
   unsigned long regs[NR_VCPU_REGS];
-  unsigned long rflags;
   unsigned long cr2;
-  struct dtr host_gdtr, host_idtr;
-  unsigned short int host_ldtr;
-  void *pio_data;
-
   unsigned long __launched;
   unsigned long fail;
   unsigned long host_rsp;
+  struct dtr host_gdtr, host_idtr;
+  unsigned short int host_ldtr;
+
+  // every exit and every entry
+  unsigned long rflags;
+  vmcs *vmcs;
+  struct kvm_run *kvm_vcpu;
+  void *pio_data;
+  unsigned long exit_qualification;
+  unsigned long phys;
+  int exit_instruction_len;
   int pending_io;
+  int pending_fault;
+  int vmcs_loaded;
+
+// using a spinlock here seems to fix the problem of the thread
+//  being migrated to a different CPU while i'm working
+  lck_spin_t *ioctl_lock;
 
+  u64 efer;
   unsigned long cr3_shadow;
+  // cpus that may still hold translations for EPT entries we removed
+  unsigned long long tlb_flush_cpus;
 
-  unsigned long exit_qualification;
-  int exit_instruction_len;
-  unsigned long phys;
+  // shadow paging, used when the cpu lacks ept or unrestricted guest
+  int shadow;
+  int paging;
+  unsigned long guest_cr0, guest_cr4;
+  struct shadow_mmu *smmu;
+  u16 vpid;
+  // GUEST_DR_*, whether the guest's debug registers go in around a run
+  u16 guest_dr_state;
 
-  int irq_level[IRQ_MAX];
   int pending_irq;
+  // only the pmu raises these, as the overflow interrupt
+  int pending_nmi;
+  // vectors from MSIs, injected after the ISA lines
+  volatile u32 pending_vectors[256/32];
+
+  // guest and host values for vmx_switched_msrs, point of the vmcs msr lists
+  struct vmx_msr_entry *guest_msrs, *host_msrs;
+
+  // cpu quota in tsc cycles, quota_period is 0 when there's no limit
+  u64 quota_period;
+  u64 quota_runtime;
+  u64 quota_start;
+  // guest time used since quota_start
+  u64 quota_used;
+
+  u32 prof_mode;
+  // KVM_GUESTDBG_* from KVM_SET_GUEST_DEBUG, 0 when nobody's debugging
+  u32 guest_debug;
+  u64 prof_period;
+  // tsc deadline for KVM_PROF_TIMER, interrupt exits to go for KVM_PROF_INTR
+  u64 prof_next;
+  // tsc when the profiler's own timer exit started, 0 for other exits
+  u64 prof_exit_tsc;
+
+  // from here on, only some exits and the ioctls.  global_ctrl leads, it's
+  // the one field of this every entry reads
+  struct vcpu_pmu pmu __attribute__((aligned(CACHE_LINE)));
+
+  // only the vcpu thread writes these, kvm.stats reads them without a lock
+  struct kvm_vm_stats stats;
+
+  // KVM_REGISTER_COALESCED_MMIO ranges, ports only
+  struct kvm_coalesced_mmio_zone coalesced_zones[COALESCED_ZONE_MAX];
+  int coalesced_zone_count;
+
+  struct kvm_memslot memslots[KVM_MAX_MEMSLOTS];
+  // bumped by every KVM_SET_USER_MEMORY_REGION
+  u64 memslot_gen;
+  // the mmio pages marked in the ept, valid while mmio_gen is memslot_gen
+  u64 mmio_gen;
+  unsigned long mmio_gfns[MMIO_GFNS_MAX];
+  int mmio_gfn_count;
+  // the last mmio exit, a read finishes on the next KVM_RUN
+  struct mmio_insn mmio;
+  int mmio_read_pending;
+  // cs when the access exited, for the decoder
+  unsigned long mmio_rip;
+  int mmio_mode;
+  // last "can't emulate" message, a guest can fail the decode on purpose
+  u64 mmio_warn_tsc;
+  // store the physical addresses on the first page, and the virtual addresses on the second page
+  unsigned long *pml4;
 
+  int irq_level[IRQ_MAX];
+  // KVM_SET_GSI_ROUTING table, NULL is the identity map onto the ISA lines
+  struct gsi_routing * volatile routing;
+
+  // 4k of read and write intercept bits, all set except what the pmu passes through
+  void *msr_bitmap;
+  void *virtual_apic_page, *apic_access;
+
+  // the debugger's breakpoints, in the hardware while KVM_GUESTDBG_USE_HW_BP
+  // is set, and the host's registers while they're out
+  unsigned long debug_dr[4], debug_dr7;
+  unsigned long host_dr[4], host_dr6, host_dr7;
+  // the guest's own debug registers. while GUEST_DR_WONT_EXIT the cpu has
+  // them and dr7 is GUEST_DR7, and they're copied back after every exit
+  unsigned long guest_dr[4], guest_dr6, guest_dr7;
+
+  // sampling profiler ring, wired like the batch ring
+  IOMemoryDescriptor *prof_md;
+  IOMemoryMap *prof_map;
+  struct kvm_prof_ring *prof_ring;
+  // the kext's own copies, userspace can write anything to the ring's
+  u32 prof_head, prof_entries;
+
+  // configuration, nothing on the exit path reads it
+  IOMemoryDescriptor *md;
+  IOMemoryMap *mm;
   struct kvm_cpuid_entry2 *cpuids;
   struct kvm_msr_entry *msrs;
   int cpuid_count;
   int msr_count;
+  struct kvm_pit_state pit_state;
+  struct kvm_irqchip irqchip;
 
-  void *virtual_apic_page, *apic_access;
+  // next free vcpu in vcpu_pool
+  struct vcpu *pool_next;
 
-// using a spinlock here seems to fix the problem of the thread
-//  being migrated to a different CPU while i'm working
-  lck_spin_t *ioctl_lock;
-  int vmcs_loaded;
+  // ioctl batching ring, a user page wired and mapped into the kernel
+  IOMemoryDescriptor *batch_md;
+  IOMemoryMap *batch_map;
+  struct kvm_batch_ring *batch_ring;
+  void *batch_buf;
+  // the indexes the kext owns, only ever copied out to the ring
+  u32 batch_sq_head, batch_cq_tail;
+};
 
-  // store the physical addresses on the first page, and the virtual addresses on the second page
-  unsigned long *pml4;
+/* *********************** */
+/* ept functions */
+/* *********************** */
 
-  struct kvm_pit_state pit_state;
-  struct kvm_irqchip irqchip;
+static void ept_init(struct vcpu *vcpu) {
+  // EPT allocation
+	vcpu->pml4 = (unsigned long *)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
+}
 
-  int paging;
-};
+#define PAGE_OFFSET 512
+#define EPT_CACHE_WRITEBACK (6 << 3)
+#define EPT_DEFAULTS (VMX_EPT_EXECUTABLE_MASK | VMX_EPT_WRITABLE_MASK | VMX_EPT_READABLE_MASK)
+
+static void ept_free(struct vcpu *vcpu) {
+  unsigned long *pdpt, *pd, *pt;
+  int pml4_idx, pdpt_idx, pd_idx;
+  for (pml4_idx = 0; pml4_idx < PAGE_OFFSET; pml4_idx++) {
+    pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
+    if (pdpt == NULL) continue;
+    for (pdpt_idx = 0; pdpt_idx < PAGE_OFFSET; pdpt_idx++) {
+      pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
+      if (pd == NULL) continue;
+      for (pd_idx = 0; pd_idx < PAGE_OFFSET; pd_idx++) {
+        pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
+        if (pt == NULL) continue;
+        IOFree(pt, PAGE_SIZE);
+      }
+      IOFree(pd, PAGE_SIZE*2);
+    }
+    IOFree(pdpt, PAGE_SIZE*2);
+  }
+  // the root belongs to the vcpu's page set and goes back to the pool
+  bzero(vcpu->pml4, PAGE_SIZE*2);
+
+  // the pages are still wired in in the process, they free when the process frees them
+}
+
+
+static unsigned long ept_translate(struct vcpu *vcpu, unsigned long virtual_address) {
+  int pml4_idx = (virtual_address >> 39) & 0x1FF;
+  int pdpt_idx = (virtual_address >> 30) & 0x1FF;
+  int pd_idx = (virtual_address >> 21) & 0x1FF;
+  int pt_idx = (virtual_address >> 12) & 0x1FF;
+  unsigned long *pdpt, *pd, *pt;
+  pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
+  if (pdpt == NULL) return 0;
+  pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
+  if (pd == NULL) return 0;
+  pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
+  if (pt == NULL) return 0;
+
+  return pt[pt_idx] & ~(PAGE_SIZE-1);
+}
+
+// could probably be managed by http://fxr.watson.org/fxr/source/osfmk/i386/pmap.h
+static void ept_map_page(struct vcpu *vcpu, unsigned long virtual_address, unsigned long physical_address, unsigned long prot) {
+  int pml4_idx = (virtual_address >> 39) & 0x1FF;
+  int pdpt_idx = (virtual_address >> 30) & 0x1FF;
+  int pd_idx = (virtual_address >> 21) & 0x1FF;
+  int pt_idx = (virtual_address >> 12) & 0x1FF;
+  unsigned long *pdpt, *pd, *pt;
+  //printf("%p @ %d %d %d %d\n", virtual_address, pml4_idx, pdpt_idx, pd_idx, pt_idx);
+
+  // allocate the pdpt in the pml4 if NULL
+  pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
+  if (pdpt == NULL) {
+    pdpt = (unsigned long*)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
+    vcpu->pml4[PAGE_OFFSET + pml4_idx] = (unsigned long)pdpt;
+    vcpu->pml4[pml4_idx] = __pa(pdpt) | EPT_DEFAULTS;
+  }
+
+  // allocate the pd in the pdpt
+  pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
+  if (pd == NULL) {
+    pd = (unsigned long*)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
+    pdpt[PAGE_OFFSET + pdpt_idx] = (unsigned long)pd;
+    pdpt[pdpt_idx] = __pa(pd) | EPT_DEFAULTS;
+  }
+
+  // allocate the pt in the pd
+  pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
+  if (pt == NULL) {
+    pt = (unsigned long*)IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
+    pd[PAGE_OFFSET + pd_idx] = (unsigned long)pt;
+    pd[pd_idx] = __pa(pt) | EPT_DEFAULTS;
+  }
+
+  // set the entry in the page table
+  pt[pt_idx] = physical_address | prot | EPT_CACHE_WRITEBACK;
+}
+
+static void ept_add_page(struct vcpu *vcpu, unsigned long virtual_address, unsigned long physical_address) {
+  ept_map_page(vcpu, virtual_address, physical_address, EPT_DEFAULTS);
+}
+
+static void ept_remove_page(struct vcpu *vcpu, unsigned long virtual_address) {
+  int pml4_idx = (virtual_address >> 39) & 0x1FF;
+  int pdpt_idx = (virtual_address >> 30) & 0x1FF;
+  int pd_idx = (virtual_address >> 21) & 0x1FF;
+  int pt_idx = (virtual_address >> 12) & 0x1FF;
+  unsigned long *pdpt, *pd, *pt;
+  pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
+  if (pdpt == NULL) return;
+  pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
+  if (pd == NULL) return;
+  pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
+  if (pt == NULL) return;
+
+  pt[pt_idx] = 0;
+
+  // every cpu we ran on may have it cached, invept before the next entry there
+  vcpu->tlb_flush_cpus = ~0ULL;
+}
+
+// must be called before vmlaunch/vmresume with interrupts off
+static void kvm_tlb_sync(struct vcpu *vcpu) {
+  unsigned long long mask = 1ULL << (cpu_number() & 63);
+  if (vcpu->tlb_flush_cpus & mask) {
+    if (!vcpu->shadow) {
+      __invept(VMX_EPT_EXTENT_CONTEXT, vmcs_read64(EPT_POINTER), 0);
+    } else if (vcpu->vpid != 0) {
+      // without a vpid every entry flushes anyway
+      __invvpid(VMX_VPID_EXTENT_SINGLE_CONTEXT, vcpu->vpid, 0);
+    }
+    vcpu->tlb_flush_cpus &= ~mask;
+  }
+}
+
+/* *********************** */
+/* memslot functions */
+/* *********************** */
+
+static struct kvm_memslot *gfn_to_memslot(struct vcpu *vcpu, unsigned long gfn) {
+  int i;
+  for (i = 0; i < KVM_MAX_MEMSLOTS; i++) {
+    struct kvm_memslot *slot = &vcpu->memslots[i];
+    if (gfn >= slot->base_gfn && gfn < slot->base_gfn + slot->npages) return slot;
+  }
+  return NULL;
+}
+
+// the slot holding all of [gfn, gfn + npages), NULL when the range leaves it
+// or wraps, which the subtraction catches without computing gfn + npages
+static struct kvm_memslot *range_to_memslot(struct vcpu *vcpu, unsigned long gfn, unsigned long npages) {
+  struct kvm_memslot *slot = gfn_to_memslot(vcpu, gfn);
+  if (slot == NULL || npages > slot->npages - (gfn - slot->base_gfn)) return NULL;
+  return slot;
+}
+
+static void memslot_release_page(struct vcpu *vcpu, struct kvm_memslot *slot, unsigned long idx) {
+  IOMemoryDescriptor *md = slot->pages[idx];
+  if (md == NULL) return;
+
+  ept_remove_page(vcpu, (slot->base_gfn + idx) << PAGE_SHIFT);
+
+  // unwire, the host can take the page back now
+  md->complete(kIODirectionInOut);
+  md->release();
+  slot->pages[idx] = NULL;
+}
+
+static int memslot_test_zero(struct kvm_memslot *slot, unsigned long idx) {
+  if (slot->zero_bitmap == NULL) return 0;
+  return (slot->zero_bitmap[idx / BITS_PER_ULONG] >> (idx % BITS_PER_ULONG)) & 1;
+}
+
+// drop a shared zero mapping, the next access faults and takes a fresh look.
+// 1 if there was one, the shadow mmu may still have it
+static int memslot_unshare_page(struct vcpu *vcpu, struct kvm_memslot *slot, unsigned long idx) {
+  if (!memslot_test_zero(slot, idx)) return 0;
+  ept_remove_page(vcpu, (slot->base_gfn + idx) << PAGE_SHIFT);
+  slot->zero_bitmap[idx / BITS_PER_ULONG] &= ~(1UL << (idx % BITS_PER_ULONG));
+  return 1;
+}
+
+static void memslot_free(struct vcpu *vcpu, struct kvm_memslot *slot) {
+  unsigned long idx;
+  if (slot->pages == NULL) return;
+  for (idx = 0; idx < slot->npages; idx++) {
+    memslot_unshare_page(vcpu, slot, idx);
+    memslot_release_page(vcpu, slot, idx);
+  }
+  IOFree(slot->pages, slot->npages * sizeof(IOMemoryDescriptor *));
+  if (slot->zero_bitmap != NULL) IOFree(slot->zero_bitmap, ZERO_BITMAP_SIZE(slot->npages));
+  bzero(slot, sizeof(struct kvm_memslot));
+}
+
+// wires in a guest page on first touch, can block so interrupts must be on
+static int kvm_fault_in_page(struct vcpu *vcpu, unsigned long gpa, int write) {
+  unsigned long gfn = gpa >> PAGE_SHIFT;
+  struct kvm_memslot *slot = gfn_to_memslot(vcpu, gfn);
+  if (slot == NULL) return EFAULT;
+
+  unsigned long idx = gfn - slot->base_gfn;
+  IOMemoryDescriptor *md = slot->pages[idx];
+  if (md == NULL) {
+    unsigned long va = slot->userspace_addr + (idx << PAGE_SHIFT);
+
+    // reading a page nobody wrote yet, don't make the host commit memory for it
+    if (!write && slot->zero_bitmap != NULL && vmx_user_page_untouched(current_task(), va)) {
+      slot->zero_bitmap[idx / BITS_PER_ULONG] |= 1UL << (idx % BITS_PER_ULONG);
+      ept_map_page(vcpu, gfn << PAGE_SHIFT, zero_page_pa, VMX_EPT_EXECUTABLE_MASK | VMX_EPT_READABLE_MASK);
+      return 0;
+    }
+
+    // first write to a zero page, the ept violation already flushed the old entry
+    if (memslot_test_zero(slot, idx)) {
+      slot->zero_bitmap[idx / BITS_PER_ULONG] &= ~(1UL << (idx % BITS_PER_ULONG));
+    }
+    md = IOMemoryDescriptor::withAddressRange(va, PAGE_SIZE, kIODirectionInOut, current_task());
+    if (md == NULL) return ENOMEM;
+    if (md->prepare(kIODirectionInOut) != 0) {
+      printf("wire page %lx failed :(\n", va);
+      md->release();
+      return EFAULT;
+    }
+    slot->pages[idx] = md;
+  }
+
+  addr64_t pa = md->getPhysicalSegment(0, NULL, kIOMemoryMapperNone);
+  if (pa == 0) return EFAULT;
+  ept_add_page(vcpu, gfn << PAGE_SHIFT, pa);
+  return 0;
+}
+
+// drop every mmio mark, some of those pages may be ram now. doesn't
+// allocate, so it's fine with interrupts off
+static void mmio_zap(struct vcpu *vcpu) {
+  int i;
+  for (i = 0; i < vcpu->mmio_gfn_count; i++) ept_remove_page(vcpu, vcpu->mmio_gfns[i] << PAGE_SHIFT);
+  vcpu->mmio_gfn_count = 0;
+  vcpu->mmio_gen = vcpu->memslot_gen;
+}
+
+// write without read is an ept misconfiguration, so accesses to the page exit
+// with EXIT_REASON_EPT_MISCONFIG and skip the memslot lookup. can allocate
+// page tables, interrupts must be on
+static void mmio_mark(struct vcpu *vcpu, unsigned long gfn) {
+  if (vcpu->mmio_gen != vcpu->memslot_gen) mmio_zap(vcpu);
+  // past the limit the page just keeps taking violations
+  if (vcpu->mmio_gfn_count == MMIO_GFNS_MAX) return;
+  ept_map_page(vcpu, gfn << PAGE_SHIFT, 0, VMX_EPT_WRITABLE_MASK);
+  vcpu->mmio_gfns[vcpu->mmio_gfn_count++] = gfn;
+}
+
+/* *********************** */
+/* guest pmu, require VMCS lock */
+/* *********************** */
+
+#define PMU_MSR_GP_COUNTER0 0xc1
+#define PMU_MSR_GP_COUNTER0_FULL 0x4c1
+#define PMU_MSR_EVTSEL0 0x186
+#define PMU_MSR_FIXED_COUNTER0 0x309
+#define PMU_MSR_PERF_CAPABILITIES 0x345
+#define PMU_MSR_FIXED_CTRL 0x38d
+#define PMU_MSR_GLOBAL_STATUS 0x38e
+#define PMU_MSR_GLOBAL_CTRL 0x38f
+#define PMU_MSR_GLOBAL_OVF_CTRL 0x390
+
+#define PMU_EVTSEL_INT (1ULL << 20)
+#define PMU_EVTSEL_ANY (1ULL << 21)
+#define PMU_FIXED_CTRL_PMI 8
+// enable bits and pmi per fixed counter, no AnyThread
+#define PMU_FIXED_CTRL_BITS 0xb
+#define PMU_RDPMC_FIXED (1 << 30)
+#define PMU_PERF_CAP_FW_WRITE (1ULL << 13)
+
+#define PMU_WIDTH_MASK(w) ((w) >= 64 ? ~0ULL : (1ULL << (w)) - 1)
+
+static u64 pmu_global_mask() {
+  return ((1ULL << pmu_nr_gp) - 1) | (((1ULL << pmu_nr_fixed) - 1) << 32);
+}
+
+static u64 pmu_fixed_ctrl_mask() {
+  u64 mask = 0;
+  int i;
+  for (i = 0; i < pmu_nr_fixed; i++) mask |= (u64)PMU_FIXED_CTRL_BITS << (4*i);
+  return mask;
+}
+
+// cpuid 0xa, only version 2 and up has the global registers we switch with
+static void pmu_probe() {
+  u32 eax, ebx, ecx, edx;
+
+  vmx_has_load_perf_global = ((rdmsr64(MSR_IA32_VMX_ENTRY_CTLS) >> 32) & VM_ENTRY_LOAD_IA32_PERF_GLOBAL_CTRL) &&
+    ((rdmsr64(MSR_IA32_VMX_EXIT_CTLS) >> 32) & VM_EXIT_LOAD_IA32_PERF_GLOBAL_CTRL);
+
+  asm("push %%rbx\n cpuid\n mov %%rbx, %%rsi\n pop %%rbx\n"
+    : "=a"(eax), "=S"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xa), "c"(0));
+  if (!vmx_has_load_perf_global || (eax & 0xff) < 2) return;
+
+  pmu_version = 2;
+  pmu_nr_gp = min((eax >> 8) & 0xff, PMU_MAX_GP);
+  pmu_gp_width = (eax >> 16) & 0xff;
+  pmu_events_mask = ebx;
+  pmu_nr_fixed = min(edx & 0x1f, PMU_MAX_FIXED);
+  pmu_fixed_width = (edx >> 5) & 0xff;
+
+  // 0x4c1 writes all the counter bits, 0xc1 sign extends bit 31. the guest
+  // doesn't get the 0x4c1 aliases so it isn't told about them either
+  asm("push %%rbx\n cpuid\n mov %%rbx, %%rsi\n pop %%rbx\n"
+    : "=a"(eax), "=S"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+  if (ecx & (1 << 15)) {
+    pmu_perf_caps = rdmsr64(PMU_MSR_PERF_CAPABILITIES);
+    pmu_full_width_writes = (pmu_perf_caps & PMU_PERF_CAP_FW_WRITE) != 0;
+    pmu_perf_caps &= ~PMU_PERF_CAP_FW_WRITE;
+  }
+}
+
+static void pmu_cpuid(u32 *eax, u32 *ebx, u32 *ecx, u32 *edx) {
+  if (pmu_version == 0) {
+    *eax = *ebx = *ecx = *edx = 0;
+    return;
+  }
+  // ebx length stays at 7, the events we don't have are marked in the mask
+  *eax = pmu_version | (pmu_nr_gp << 8) | (pmu_gp_width << 16) | (7 << 24);
+  *ebx = pmu_events_mask;
+  *ecx = 0;
+  *edx = pmu_nr_fixed | (pmu_fixed_width << 5);
+}
+
+static void msr_bitmap_intercept(struct vcpu *vcpu, u32 msr, int intercept) {
+  u8 *bitmap = (u8 *)vcpu->msr_bitmap;
+  // only the low msr range, reads then writes 2k apart
+  if (msr > 0x1fff) return;
+  if (intercept) {
+    bitmap[msr / 8] |= 1 << (msr % 8);
+    bitmap[2048 + msr / 8] |= 1 << (msr % 8);
+  } else {
+    bitmap[msr / 8] &= ~(1 << (msr % 8));
+    bitmap[2048 + msr / 8] &= ~(1 << (msr % 8));
+  }
+}
+
+// counters go straight to the hardware while the guest's are in it, and
+// rdpmc only has to exit when they aren't. the selects and fixed ctrl always
+// exit, pmu_set_msr is what keeps AnyThread and the reserved bits out
+static void pmu_update_intercepts(struct vcpu *vcpu) {
+  int intercept = vcpu->pmu.global_ctrl == 0;
+  u32 cpu_based = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL);
+  int i;
+
+  for (i = 0; i < pmu_nr_gp; i++) {
+    msr_bitmap_intercept(vcpu, PMU_MSR_GP_COUNTER0 + i, intercept);
+  }
+  for (i = 0; i < pmu_nr_fixed; i++) {
+    msr_bitmap_intercept(vcpu, PMU_MSR_FIXED_COUNTER0 + i, intercept);
+  }
+
+  if (intercept) cpu_based |= CPU_BASED_RDPMC_EXITING;
+  else cpu_based &= ~CPU_BASED_RDPMC_EXITING;
+  vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, cpu_based);
+}
+
+// 0 if it's a pmu msr
+static int pmu_get_msr(struct vcpu *vcpu, u32 index, u64 *data) {
+  struct vcpu_pmu *pmu = &vcpu->pmu;
+
+  if (index >= PMU_MSR_GP_COUNTER0 && index < PMU_MSR_GP_COUNTER0 + pmu_nr_gp) {
+    *data = pmu->gp[index - PMU_MSR_GP_COUNTER0];
+  } else if (index >= PMU_MSR_EVTSEL0 && index < PMU_MSR_EVTSEL0 + pmu_nr_gp) {
+    *data = pmu->evtsel[index - PMU_MSR_EVTSEL0];
+  } else if (index >= PMU_MSR_FIXED_COUNTER0 && index < PMU_MSR_FIXED_COUNTER0 + pmu_nr_fixed) {
+    *data = pmu->fixed[index - PMU_MSR_FIXED_COUNTER0];
+  } else if (index == PMU_MSR_PERF_CAPABILITIES) {
+    *data = pmu_perf_caps;
+  } else if (pmu_version == 0) {
+    return 1;
+  } else if (index == PMU_MSR_FIXED_CTRL) {
+    *data = pmu->fixed_ctrl;
+  } else if (index == PMU_MSR_GLOBAL_CTRL) {
+    *data = pmu->global_ctrl;
+  } else if (index == PMU_MSR_GLOBAL_STATUS) {
+    *data = pmu->global_status;
+  } else if (index == PMU_MSR_GLOBAL_OVF_CTRL) {
+    *data = 0;
+  } else {
+    return 1;
+  }
+  return 0;
+}
+
+static int pmu_set_msr(struct vcpu *vcpu, u32 index, u64 data) {
+  struct vcpu_pmu *pmu = &vcpu->pmu;
+
+  if (index >= PMU_MSR_GP_COUNTER0 && index < PMU_MSR_GP_COUNTER0 + pmu_nr_gp) {
+    // same as the hardware, bit 31 is sign extended
+    pmu->gp[index - PMU_MSR_GP_COUNTER0] = (u64)(int64_t)(int32_t)data & PMU_WIDTH_MASK(pmu_gp_width);
+  } else if (index >= PMU_MSR_EVTSEL0 && index < PMU_MSR_EVTSEL0 + pmu_nr_gp) {
+    pmu->evtsel[index - PMU_MSR_EVTSEL0] = data & 0xffffffff & ~PMU_EVTSEL_ANY;
+  } else if (index >= PMU_MSR_FIXED_COUNTER0 && index < PMU_MSR_FIXED_COUNTER0 + pmu_nr_fixed) {
+    pmu->fixed[index - PMU_MSR_FIXED_COUNTER0] = data & PMU_WIDTH_MASK(pmu_fixed_width);
+  } else if (pmu_version == 0) {
+    return 1;
+  } else if (index == PMU_MSR_FIXED_CTRL) {
+    pmu->fixed_ctrl = data & pmu_fixed_ctrl_mask();
+  } else if (index == PMU_MSR_GLOBAL_CTRL) {
+    pmu->global_ctrl = data & pmu_global_mask();
+    vmcs_write64(GUEST_IA32_PERF_GLOBAL_CTRL, pmu->global_ctrl);
+    pmu_update_intercepts(vcpu);
+  } else if (index == PMU_MSR_GLOBAL_OVF_CTRL) {
+    pmu->global_status &= ~data;
+  } else if (index != PMU_MSR_GLOBAL_STATUS) {
+    return 1;
+  }
+  return 0;
+}
+
+// with interrupts off right before entry. the host's counters are stopped
+// and swapped out, the exit controls keep them stopped until pmu_put_guest
+static void pmu_load_guest(struct vcpu *vcpu) {
+  struct vcpu_pmu *pmu = &vcpu->pmu;
+  u32 gp_base = pmu_full_width_writes ? PMU_MSR_GP_COUNTER0_FULL : PMU_MSR_GP_COUNTER0;
+  u64 host_global;
+  int i;
+
+  if (!vmx_has_load_perf_global) return;
+  host_global = rdmsr64(PMU_MSR_GLOBAL_CTRL);
+
+  if (pmu->global_ctrl == 0) {
+    // guest isn't counting, the cpu just stops the host's counters for us
+    vmcs_write64(HOST_IA32_PERF_GLOBAL_CTRL, host_global);
+    return;
+  }
+
+  wrmsr64(PMU_MSR_GLOBAL_CTRL, 0);
+  pmu->host_global_ctrl = host_global;
+  vmcs_write64(HOST_IA32_PERF_GLOBAL_CTRL, 0);
+
+  for (i = 0; i < pmu_nr_gp; i++) {
+    pmu->host_evtsel[i] = rdmsr64(PMU_MSR_EVTSEL0 + i);
+    pmu->host_gp[i] = rdmsr64(PMU_MSR_GP_COUNTER0 + i);
+    wrmsr64(PMU_MSR_EVTSEL0 + i, pmu->evtsel[i]);
+    wrmsr64(gp_base + i, pmu->gp[i]);
+  }
+  pmu->host_fixed_ctrl = rdmsr64(PMU_MSR_FIXED_CTRL);
+  for (i = 0; i < pmu_nr_fixed; i++) {
+    pmu->host_fixed[i] = rdmsr64(PMU_MSR_FIXED_COUNTER0 + i);
+    wrmsr64(PMU_MSR_FIXED_COUNTER0 + i, pmu->fixed[i]);
+  }
+  wrmsr64(PMU_MSR_FIXED_CTRL, pmu->fixed_ctrl);
+  pmu->loaded = 1;
+}
+
+// right after the exit, interrupts still off. overflows with the pmi bit
+// set become an nmi for the guest
+static void pmu_put_guest(struct vcpu *vcpu) {
+  struct vcpu_pmu *pmu = &vcpu->pmu;
+  u32 gp_base = pmu_full_width_writes ? PMU_MSR_GP_COUNTER0_FULL : PMU_MSR_GP_COUNTER0;
+  u64 status, pmi = 0;
+  int i;
+
+  if (!pmu->loaded) return;
+
+  // the selects and fixed ctrl can't have changed, writes to them exit
+  for (i = 0; i < pmu_nr_gp; i++) {
+    pmu->gp[i] = rdmsr64(PMU_MSR_GP_COUNTER0 + i);
+    if (pmu->evtsel[i] & PMU_EVTSEL_INT) pmi |= 1ULL << i;
+  }
+  for (i = 0; i < pmu_nr_fixed; i++) {
+    pmu->fixed[i] = rdmsr64(PMU_MSR_FIXED_COUNTER0 + i);
+    if ((pmu->fixed_ctrl >> (4*i)) & PMU_FIXED_CTRL_PMI) pmi |= 1ULL << (32 + i);
+  }
+
+  // the host never sees the guest's overflow bits
+  status = rdmsr64(PMU_MSR_GLOBAL_STATUS) & pmu_global_mask();
+  if (status) {
+    wrmsr64(PMU_MSR_GLOBAL_OVF_CTRL, status);
+    pmu->global_status |= status;
+    if (status & pmi) vcpu->pending_nmi = 1;
+  }
+
+  for (i = 0; i < pmu_nr_gp; i++) {
+    wrmsr64(PMU_MSR_EVTSEL0 + i, pmu->host_evtsel[i]);
+    wrmsr64(gp_base + i, pmu->host_gp[i]);
+  }
+  for (i = 0; i < pmu_nr_fixed; i++) {
+    wrmsr64(PMU_MSR_FIXED_COUNTER0 + i, pmu->host_fixed[i]);
+  }
+  wrmsr64(PMU_MSR_FIXED_CTRL, pmu->host_fixed_ctrl);
+  wrmsr64(PMU_MSR_GLOBAL_CTRL, pmu->host_global_ctrl);
+  pmu->loaded = 0;
+}
+
+/* *********************** */
+/* guest debugging, require VMCS lock */
+/* *********************** */
+
+#define DR6_FIXED_1 0xffff0ff0UL
+#define DR6_BS (1UL << 14)
+// b0-3, bd, bs and bt, what the guest can write
+#define DR6_VOLATILE 0xe00fUL
+#define DR7_FIXED_1 0x400UL
+// l0-3 and g0-3
+#define DR7_BP_EN 0xffUL
+// the bits of dr7 that aren't reserved, 10 reads as one
+#define DR7_VALID 0xffff23ffUL
+#define KVM_GUESTDBG_VALID (KVM_GUESTDBG_ENABLE | KVM_GUESTDBG_SINGLESTEP | KVM_GUESTDBG_USE_SW_BP | \
+  KVM_GUESTDBG_USE_HW_BP | KVM_GUESTDBG_INJECT_DB | KVM_GUESTDBG_INJECT_BP)
+
+#define get_dr(n) ({ unsigned long __v; asm volatile ("mov %%dr" #n ", %0" : "=r"(__v)); __v; })
+#define set_dr(n, v) asm volatile ("mov %0, %%dr" #n : : "r"((unsigned long)(v)))
+
+// the guest's dr7 has a breakpoint on, its dr0-3 and dr6 go in on every entry
+#define GUEST_DR_BP_ENABLED 1
+// mov dr runs without exits until KVM_RUN returns, the first one set it
+#define GUEST_DR_WONT_EXIT 2
+
+// after guest_dr7 changed, with the vmcs loaded and mov dr exiting on
+static void guest_dr_update(struct vcpu *vcpu) {
+  vcpu->guest_dr_state &= ~GUEST_DR_BP_ENABLED;
+  if (vcpu->guest_dr7 & DR7_BP_EN) vcpu->guest_dr_state |= GUEST_DR_BP_ENABLED;
+  // the debugger's dr7 stays in while it has the hardware
+  if (!(vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP)) vmcs_writel(GUEST_DR7, vcpu->guest_dr7);
+}
+
+// when KVM_RUN goes back to userspace, so the ioctls see the guest's dr7
+// and a guest that's done with its debug registers stops paying for them
+static void guest_dr_rearm(struct vcpu *vcpu) {
+  if (!(vcpu->guest_dr_state & GUEST_DR_WONT_EXIT)) return;
+  LOAD_VMCS(vcpu);
+  vcpu->guest_dr7 = vmcs_readl(GUEST_DR7);
+  vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, vmcs_read32(CPU_BASED_VM_EXEC_CONTROL) | CPU_BASED_MOV_DR_EXITING);
+  vcpu->guest_dr_state &= ~GUEST_DR_WONT_EXIT;
+  guest_dr_update(vcpu);
+  RELEASE_VMCS(vcpu);
+}
+
+static int kvm_get_debugregs(struct vcpu *vcpu, struct kvm_debugregs *dbgregs) {
+  int i;
+
+  bzero(dbgregs, sizeof(*dbgregs));
+  for (i = 0; i < 4; i++) dbgregs->db[i] = vcpu->guest_dr[i];
+  dbgregs->dr6 = vcpu->guest_dr6;
+  dbgregs->dr7 = vcpu->guest_dr7;
+  return 0;
+}
+
+static int kvm_set_debugregs(struct vcpu *vcpu, struct kvm_debugregs *dbgregs) {
+  int i;
+
+  if (dbgregs->flags) return EINVAL;
+  if ((dbgregs->dr6 | dbgregs->dr7) >> 32) return EINVAL;
+
+  for (i = 0; i < 4; i++) vcpu->guest_dr[i] = dbgregs->db[i];
+  vcpu->guest_dr6 = (dbgregs->dr6 & DR6_VOLATILE) | DR6_FIXED_1;
+  vcpu->guest_dr7 = (dbgregs->dr7 & DR7_VALID) | DR7_FIXED_1;
+  LOAD_VMCS(vcpu);
+  guest_dr_update(vcpu);
+  RELEASE_VMCS(vcpu);
+  return 0;
+}
+
+// the shadow mmu's page faults, and what the debugger wants to see
+static void update_exception_bitmap(struct vcpu *vcpu) {
+  u32 bitmap = 0;
+  if (vcpu->shadow) bitmap |= 1 << PF_VECTOR;
+  if (vcpu->guest_debug & KVM_GUESTDBG_USE_SW_BP) bitmap |= 1 << BP_VECTOR;
+  if (vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP) bitmap |= 1 << DB_VECTOR;
+  vmcs_write32(EXCEPTION_BITMAP, bitmap);
+}
+
+static int kvm_set_guest_debug(struct vcpu *vcpu, struct kvm_guest_debug *dbg) {
+  u32 control = dbg->control;
+  u32 cpu_based;
+  int i;
+
+  if (control & ~KVM_GUESTDBG_VALID) return EINVAL;
+  if ((control & KVM_GUESTDBG_INJECT_DB) && (control & KVM_GUESTDBG_INJECT_BP)) return EINVAL;
+  if ((control & KVM_GUESTDBG_ENABLE) && (control & KVM_GUESTDBG_SINGLESTEP) && !vmx_has_mtf) return EINVAL;
+
+  LOAD_VMCS(vcpu);
+  // hand an exception the debugger caught but doesn't own back to the guest
+  if (control & (KVM_GUESTDBG_INJECT_DB | KVM_GUESTDBG_INJECT_BP)) {
+    if (vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK) {
+      RELEASE_VMCS(vcpu);
+      return EBUSY;
+    }
+    if (control & KVM_GUESTDBG_INJECT_DB) {
+      vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | INTR_TYPE_HARD_EXCEPTION | DB_VECTOR);
+    } else {
+      // rip is still on the int3, the guest's handler gets the address after it
+      vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | INTR_TYPE_SOFT_EXCEPTION | BP_VECTOR);
+      vmcs_write32(VM_ENTRY_INSTRUCTION_LEN, 1);
+    }
+  }
+
+  if (!(control & KVM_GUESTDBG_ENABLE)) control = 0;
+  vcpu->guest_debug = control & ~(KVM_GUESTDBG_INJECT_DB | KVM_GUESTDBG_INJECT_BP);
+  for (i = 0; i < 4; i++) vcpu->debug_dr[i] = dbg->arch.debugreg[i];
+  vcpu->debug_dr7 = (dbg->arch.debugreg[7] & DR7_VALID) | DR7_FIXED_1;
+
+  update_exception_bitmap(vcpu);
+  cpu_based = vmcs_read32(CPU_BASED_VM_EXEC_CONTROL) & ~CPU_BASED_MONITOR_TRAP_FLAG;
+  if (vcpu->guest_debug & KVM_GUESTDBG_SINGLESTEP) cpu_based |= CPU_BASED_MONITOR_TRAP_FLAG;
+  vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, cpu_based);
+  // mov dr exits keep the guest away from it while the debugger has it
+  if (vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP) vmcs_writel(GUEST_DR7, vcpu->debug_dr7);
+  else guest_dr_update(vcpu);
+  RELEASE_VMCS(vcpu);
+  return 0;
+}
+
+// with interrupts off right before entry. dr7 comes from the vmcs, but
+// dr0-3 are only in the cpu, so the debugger's or the guest's go in and the
+// host's come out.  a guest that never touched them costs nothing here
+static void debug_load_guest(struct vcpu *vcpu) {
+  unsigned long *dr;
+
+  if (vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP) dr = vcpu->debug_dr;
+  else if (vcpu->guest_dr_state) dr = vcpu->guest_dr;
+  else return;
+  vcpu->host_dr7 = get_dr(7);
+  // no host breakpoint at a guest address on the way in
+  if (vcpu->host_dr7 & 0xff) set_dr(7, 0);
+  vcpu->host_dr[0] = get_dr(0);
+  vcpu->host_dr[1] = get_dr(1);
+  vcpu->host_dr[2] = get_dr(2);
+  vcpu->host_dr[3] = get_dr(3);
+  vcpu->host_dr6 = get_dr(6);
+  set_dr(0, dr[0]);
+  set_dr(1, dr[1]);
+  set_dr(2, dr[2]);
+  set_dr(3, dr[3]);
+  if (dr == vcpu->guest_dr) set_dr(6, vcpu->guest_dr6);
+}
+
+// right after the exit, interrupts still off. the exit left dr7 at 0x400
+static void debug_put_guest(struct vcpu *vcpu) {
+  if (vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP) {
+    // nothing of the debugger's changes in the guest
+  } else if (vcpu->guest_dr_state) {
+    // the guest's own #DBs set dr6, and without exits mov dr sets the rest
+    vcpu->guest_dr[0] = get_dr(0);
+    vcpu->guest_dr[1] = get_dr(1);
+    vcpu->guest_dr[2] = get_dr(2);
+    vcpu->guest_dr[3] = get_dr(3);
+    vcpu->guest_dr6 = get_dr(6);
+  } else {
+    return;
+  }
+  set_dr(0, vcpu->host_dr[0]);
+  set_dr(1, vcpu->host_dr[1]);
+  set_dr(2, vcpu->host_dr[2]);
+  set_dr(3, vcpu->host_dr[3]);
+  set_dr(6, vcpu->host_dr6);
+  set_dr(7, vcpu->host_dr7);
+}
+
+// stop and tell userspace, the way linux's kvm reports a debug exit
+static int kvm_debug_exit(struct vcpu *vcpu, int vector, unsigned long dr6) {
+  struct kvm_run *run = vcpu->kvm_vcpu;
+
+  run->exit_reason = KVM_EXIT_DEBUG;
+  run->debug.arch.exception = vector;
+  run->debug.arch.pc = vmcs_readl(GUEST_CS_BASE) + vcpu->regs[VCPU_REGS_RIP];
+  run->debug.arch.dr6 = dr6;
+  run->debug.arch.dr7 = vmcs_readl(GUEST_DR7);
+  return 0;
+}
+
+/* *********************** */
+/* msr and efer functions, require VMCS lock */
+/* *********************** */
+
+// lma follows lme and cr0.pg, and the entry controls follow lma
+static void kvm_update_efer(struct vcpu *vcpu) {
+  unsigned long cr0 = vcpu->shadow ? vcpu->guest_cr0 : vmcs_readl(GUEST_CR0);
+  u32 entry = vmcs_read32(VM_ENTRY_CONTROLS);
+  u64 efer = vcpu->efer & ~(u64)MSR_IA32_EFER_LMA;
+
+  if ((efer & MSR_IA32_EFER_LME) && (cr0 & X86_CR0_PG)) {
+    efer |= MSR_IA32_EFER_LMA;
+    entry |= VM_ENTRY_IA32E_MODE;
+  } else {
+    entry &= ~VM_ENTRY_IA32E_MODE;
+  }
+  vcpu->efer = efer;
+  vmcs_write32(VM_ENTRY_CONTROLS, entry);
+
+  if (vmx_has_load_efer) {
+    vmcs_write64(GUEST_IA32_EFER, efer);
+  } else {
+    vcpu->guest_msrs[NR_SWITCHED_MSRS - 1].value = efer;
+  }
+}
+
+static int kvm_get_msr(struct vcpu *vcpu, u32 index, u64 *data) {
+  unsigned int i;
+  if (pmu_get_msr(vcpu, index, data) == 0) return 0;
+  switch (index) {
+    case MSR_IA32_EFER: *data = vcpu->efer; return 0;
+    case MSR_IA32_FS_BASE: *data = vmcs_readl(GUEST_FS_BASE); return 0;
+    case MSR_IA32_GS_BASE: *data = vmcs_readl(GUEST_GS_BASE); return 0;
+    case MSR_IA32_SYSENTER_CS: *data = vmcs_read32(GUEST_SYSENTER_CS); return 0;
+    case MSR_IA32_SYSENTER_ESP: *data = vmcs_readl(GUEST_SYSENTER_ESP); return 0;
+    case MSR_IA32_SYSENTER_EIP: *data = vmcs_readl(GUEST_SYSENTER_EIP); return 0;
+  }
+  for (i = 0; i < NR_SWITCHED_MSRS; i++) {
+    if (vcpu->guest_msrs[i].index == index) {
+      *data = vcpu->guest_msrs[i].value;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int kvm_set_msr(struct vcpu *vcpu, u32 index, u64 data) {
+  unsigned int i;
+  if (pmu_set_msr(vcpu, index, data) == 0) return 0;
+  switch (index) {
+    case MSR_IA32_EFER:
+      // lma is read only, kvm_update_efer works it out
+      vcpu->efer = data;
+      kvm_update_efer(vcpu);
+      return 0;
+    case MSR_IA32_FS_BASE: vmcs_writel(GUEST_FS_BASE, data); return 0;
+    case MSR_IA32_GS_BASE: vmcs_writel(GUEST_GS_BASE, data); return 0;
+    case MSR_IA32_SYSENTER_CS: vmcs_write32(GUEST_SYSENTER_CS, data); return 0;
+    case MSR_IA32_SYSENTER_ESP: vmcs_writel(GUEST_SYSENTER_ESP, data); return 0;
+    case MSR_IA32_SYSENTER_EIP: vmcs_writel(GUEST_SYSENTER_EIP, data); return 0;
+  }
+  for (i = 0; i < NR_SWITCHED_MSRS; i++) {
+    if (vcpu->guest_msrs[i].index == index) {
+      vcpu->guest_msrs[i].value = data;
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* *********************** */
+/* shadow mmu functions, used instead of ept */
+/* *********************** */
+
+static void skip_emulated_instruction(struct vcpu *vcpu);
+static int mmio_pending(struct vcpu *vcpu, int pending);
+
+#define PT_PRESENT_MASK (1ULL << 0)
+#define PT_WRITABLE_MASK (1ULL << 1)
+#define PT_USER_MASK (1ULL << 2)
+#define PT_ACCESSED_MASK (1ULL << 5)
+#define PT_DIRTY_MASK (1ULL << 6)
+#define PT_PAGE_SIZE_MASK (1ULL << 7)
+#define PT64_ADDR_MASK 0x000ffffffffff000ULL
+#define PT32_ADDR_MASK 0xfffff000ULL
+#define PT32_LARGE_ADDR_MASK 0xffc00000ULL
+
+#define PFERR_PRESENT_MASK (1U << 0)
+#define PFERR_WRITE_MASK (1U << 1)
+#define PFERR_USER_MASK (1U << 2)
+#define PFERR_FETCH_MASK (1U << 4)
+
+// cr0 and cr4 bits the guest sees differently from what the cpu runs with
+#define SHADOW_CR0_MASK (X86_CR0_PE | X86_CR0_WP | X86_CR0_PG)
+#define SHADOW_CR0_ON (X86_CR0_PE | X86_CR0_NE | X86_CR0_WP | X86_CR0_PG)
+#define SHADOW_CR4_MASK (X86_CR4_VMXE | X86_CR4_PAE | X86_CR4_PSE | X86_CR4_PGE | X86_CR4_PCIDE)
+
+enum {
+  WALK_OK,
+  WALK_GUEST_FAULT,   // the guest tables say no, give the guest its #PF
+  WALK_NOT_WIRED,     // guest ram that needs faulting in first
+  WALK_MMIO,          // not guest ram
+  WALK_TABLE_MMIO,    // a guest page table that isn't guest ram
+};
+
+struct guest_walk {
+  unsigned long gpa;
+  unsigned long table_gfn[5];   // guest table read at each level, SHADOW_DIRECT if none
+  int writable, user, dirty;
+  u32 error;
+};
+
+static int guest_gpa_to_hpa(struct vcpu *vcpu, unsigned long gpa, unsigned long *hpa) {
+  unsigned long gfn = gpa >> PAGE_SHIFT;
+  struct kvm_memslot *slot;
+  IOMemoryDescriptor *md;
+
+  if (gfn == (0xfee00000 >> PAGE_SHIFT)) {
+    *hpa = __pa(vcpu->apic_access) + (gpa & (PAGE_SIZE-1));
+    return 0;
+  }
+
+  slot = gfn_to_memslot(vcpu, gfn);
+  if (slot == NULL) return EFAULT;
+  md = slot->pages[gfn - slot->base_gfn];
+  if (md == NULL) return EAGAIN;
+  *hpa = md->getPhysicalSegment(0, NULL, kIOMemoryMapperNone) + (gpa & (PAGE_SIZE-1));
+  return 0;
+}
+
+// walk the guest page tables for va like the cpu would, setting accessed and dirty bits
+static int guest_walk(struct vcpu *vcpu, unsigned long va, u32 access, struct guest_walk *w) {
+  int level, levels, bits, size, r;
+  unsigned long table, gpa, hpa;
+  u64 pte = 0;
+
+  w->writable = w->user = w->dirty = 1;
+  w->error = 0;
+  for (level = 0; level < 5; level++) w->table_gfn[level] = SHADOW_DIRECT;
+
+  if (!(vcpu->guest_cr0 & X86_CR0_PG)) {
+    w->gpa = va & ~(PAGE_SIZE-1);
+    return guest_gpa_to_hpa(vcpu, w->gpa, &hpa) == EFAULT ? WALK_MMIO : WALK_OK;
+  }
+
+  if (vcpu->efer & MSR_IA32_EFER_LMA) {
+    levels = 4; bits = 9; size = 8;
+    table = vcpu->cr3_shadow & PT64_ADDR_MASK;
+  } else if (vcpu->guest_cr4 & X86_CR4_PAE) {
+    levels = 3; bits = 9; size = 8;
+    table = vcpu->cr3_shadow & ~0x1fUL;
+  } else {
+    levels = 2; bits = 10; size = 4;
+    table = vcpu->cr3_shadow & PT32_ADDR_MASK;
+  }
+
+  for (level = levels; level >= 1; level--) {
+    int shift = PAGE_SHIFT + bits * (level - 1);
+    gpa = table + ((va >> shift) & ((1UL << bits) - 1)) * size;
+    w->table_gfn[level] = gpa >> PAGE_SHIFT;
+
+    r = guest_gpa_to_hpa(vcpu, gpa, &hpa);
+    if (r == EAGAIN) {
+      vcpu->phys = gpa;
+      return WALK_NOT_WIRED;
+    } else if (r != 0) {
+      return WALK_TABLE_MMIO;
+    }
+    pte = (size == 8) ? ml_phys_read_double_64(hpa) : ml_phys_read_word_64(hpa);
+
+    if (!(pte & PT_PRESENT_MASK)) {
+      w->error = access & (PFERR_WRITE_MASK | PFERR_USER_MASK);
+      return WALK_GUEST_FAULT;
+    }
+
+    // pae pdptes have no permission or accessed bits
+    if (levels == 3 && level == 3) {
+      table = pte & PT64_ADDR_MASK;
+      continue;
+    }
+
+    w->writable &= (pte & PT_WRITABLE_MASK) != 0;
+    w->user &= (pte & PT_USER_MASK) != 0;
+
+    if (!(pte & PT_ACCESSED_MASK)) {
+      pte |= PT_ACCESSED_MASK;
+      if (size == 8) ml_phys_write_double_64(hpa, pte);
+      else ml_phys_write_word_64(hpa, pte);
+    }
+
+    // 2mb/4mb pages in the directory, 1gb pages in a long mode pdpt
+    if ((level == 2 || (levels == 4 && level == 3)) && (pte & PT_PAGE_SIZE_MASK) && (size == 8 || (vcpu->guest_cr4 & X86_CR4_PSE))) {
+      // large page, the shadow side maps it a page at a time
+      unsigned long base = (size == 8) ? (pte & PT64_ADDR_MASK & ~((1UL << shift) - 1)) : (pte & PT32_LARGE_ADDR_MASK);
+      w->gpa = base + (va & ((1UL << shift) - 1) & ~(PAGE_SIZE-1));
+      break;
+    }
+
+    table = pte & ((size == 8) ? PT64_ADDR_MASK : PT32_ADDR_MASK);
+    if (level == 1) w->gpa = table;
+  }
+
+  // the leaf is in pte and hpa still points at it
+  if ((access & PFERR_USER_MASK) && !w->user) {
+    w->error = PFERR_PRESENT_MASK | (access & (PFERR_WRITE_MASK | PFERR_USER_MASK));
+    return WALK_GUEST_FAULT;
+  }
+  if ((access & PFERR_WRITE_MASK) && !w->writable &&
+      ((access & PFERR_USER_MASK) || (vcpu->guest_cr0 & X86_CR0_WP))) {
+    w->error = PFERR_PRESENT_MASK | (access & (PFERR_WRITE_MASK | PFERR_USER_MASK));
+    return WALK_GUEST_FAULT;
+  }
+
+  if ((access & PFERR_WRITE_MASK) && !(pte & PT_DIRTY_MASK)) {
+    pte |= PT_DIRTY_MASK;
+    if (size == 8) ml_phys_write_double_64(hpa, pte);
+    else ml_phys_write_word_64(hpa, pte);
+  }
+  w->dirty = (pte & PT_DIRTY_MASK) != 0;
+
+  return guest_gpa_to_hpa(vcpu, w->gpa, &hpa) == EFAULT ? WALK_MMIO : WALK_OK;
+}
+
+static struct shadow_page *shadow_alloc(struct shadow_mmu *smmu, int level, unsigned long gfn) {
+  struct shadow_page *sp = smmu->free_list;
+  if (sp == NULL) return NULL;
+  smmu->free_list = sp->next_free;
+  sp->in_use = 1;
+  sp->level = level;
+  sp->gfn = gfn;
+  sp->parent = NULL;
+  return sp;
+}
+
+static void shadow_free_tree(struct shadow_mmu *smmu, struct shadow_page *sp) {
+  int i;
+  if (sp->level > 1) {
+    for (i = 0; i < SHADOW_ENTRIES; i++) {
+      if (sp->children[i] != NULL) shadow_free_tree(smmu, sp->children[i]);
+    }
+    bzero(sp->children, SHADOW_ENTRIES * sizeof(struct shadow_page *));
+  }
+  bzero(sp->table, PAGE_SIZE);
+  sp->in_use = 0;
+  sp->next_free = smmu->free_list;
+  smmu->free_list = sp;
+}
+
+static void shadow_zap(struct vcpu *vcpu, struct shadow_page *sp) {
+  struct shadow_mmu *smmu = vcpu->smmu;
+  int i;
+
+  if (sp->parent != NULL) {
+    sp->parent->table[sp->parent_idx] = 0;
+    sp->parent->children[sp->parent_idx] = NULL;
+  } else {
+    for (i = 0; i < SHADOW_ROOTS; i++) {
+      if (smmu->roots[i].sp != sp) continue;
+      smmu->roots[i].sp = NULL;
+      if (i == smmu->current) smmu->reload = 1;
+    }
+  }
+
+  shadow_free_tree(smmu, sp);
+  vcpu->tlb_flush_cpus = ~0ULL;
+}
+
+static void shadow_reset(struct vcpu *vcpu) {
+  int i;
+  if (vcpu->smmu == NULL) return;
+  for (i = 0; i < SHADOW_ROOTS; i++) {
+    if (vcpu->smmu->roots[i].sp != NULL) shadow_zap(vcpu, vcpu->smmu->roots[i].sp);
+  }
+  vcpu->smmu->reload = 1;
+}
+
+static int shadow_gfn_tracked(struct shadow_mmu *smmu, unsigned long gfn) {
+  int i;
+  for (i = 0; i < SHADOW_POOL_PAGES; i++) {
+    if (smmu->pages[i].in_use && smmu->pages[i].gfn == gfn) return 1;
+  }
+  return 0;
+}
+
+// the guest is about to use gfn as a page table, take away write access to it
+// before the shadow page for it is allocated
+static void shadow_protect_gfn(struct vcpu *vcpu, unsigned long gfn) {
+  struct shadow_mmu *smmu = vcpu->smmu;
+  unsigned long hpa;
+  int i, j;
+
+  if (shadow_gfn_tracked(smmu, gfn)) return;
+  if (guest_gpa_to_hpa(vcpu, gfn << PAGE_SHIFT, &hpa) != 0) return;
+
+  // no reverse map, the pool is small enough to just look
+  for (i = 0; i < SHADOW_POOL_PAGES; i++) {
+    struct shadow_page *sp = &smmu->pages[i];
+    if (!sp->in_use || sp->level != 1) continue;
+    for (j = 0; j < SHADOW_ENTRIES; j++) {
+      if ((sp->table[j] & PT64_ADDR_MASK) == hpa && (sp->table[j] & PT_WRITABLE_MASK)) {
+        sp->table[j] &= ~PT_WRITABLE_MASK;
+        vcpu->tlb_flush_cpus = ~0ULL;
+      }
+    }
+  }
+}
+
+// the guest wrote one of its page tables, drop everything built from it
+static int shadow_unprotect_gfn(struct vcpu *vcpu, unsigned long gfn) {
+  struct shadow_mmu *smmu = vcpu->smmu;
+  int i, zapped = 0;
+  for (i = 0; i < SHADOW_POOL_PAGES; i++) {
+    if (smmu->pages[i].in_use && smmu->pages[i].gfn == gfn) {
+      shadow_zap(vcpu, &smmu->pages[i]);
+      zapped++;
+    }
+  }
+  return zapped;
+}
+
+// point GUEST_CR3 at the tree for the current guest cr3, building an empty one if needed
+static void shadow_load_cr3(struct vcpu *vcpu) {
+  struct shadow_mmu *smmu = vcpu->smmu;
+  unsigned long key = vcpu->paging ? vcpu->cr3_shadow : SHADOW_NO_PAGING;
+  unsigned long gfn = SHADOW_DIRECT;
+  struct shadow_page *sp;
+  int i, level = (vcpu->efer & MSR_IA32_EFER_LMA) ? 4 : 3;
+
+  for (i = 0; i < SHADOW_ROOTS; i++) {
+    if (smmu->roots[i].sp != NULL && smmu->roots[i].cr3 == key) goto found;
+  }
+
+  for (i = 0; i < SHADOW_ROOTS; i++) {
+    if (smmu->roots[i].sp == NULL) break;
+  }
+  if (i == SHADOW_ROOTS) {
+    i = smmu->next_victim;
+    smmu->next_victim = (smmu->next_victim + 1) % SHADOW_ROOTS;
+    shadow_zap(vcpu, smmu->roots[i].sp);
+  }
+
+  // a pae guest's pdpt or a long mode guest's pml4 is a table we shadow too
+  if (vcpu->paging && (vcpu->guest_cr4 & X86_CR4_PAE)) gfn = vcpu->cr3_shadow >> PAGE_SHIFT;
+  if (gfn != SHADOW_DIRECT) shadow_protect_gfn(vcpu, gfn);
+  sp = shadow_alloc(smmu, level, gfn);
+  if (sp == NULL) {
+    shadow_reset(vcpu);
+    sp = shadow_alloc(smmu, level, gfn);
+  }
+  smmu->roots[i].cr3 = key;
+  smmu->roots[i].sp = sp;
+
+found:
+  if (i != smmu->current) vcpu->tlb_flush_cpus = ~0ULL;
+  smmu->current = i;
+  smmu->reload = 0;
+  vmcs_writel(GUEST_CR3, smmu->roots[i].sp->pa);
+}
+
+// install the translation found by the walk, returns ENOMEM when the pool ran dry
+static int shadow_map(struct vcpu *vcpu, unsigned long va, u32 access, struct guest_walk *w) {
+  struct shadow_mmu *smmu = vcpu->smmu;
+  struct shadow_page *sp = smmu->roots[smmu->current].sp;
+  int pae_root = (sp->level == 3);
+  unsigned long hpa;
+  u64 spte;
+  int level, idx, user;
+
+  for (level = sp->level; level > 1; level--) {
+    idx = (va >> (PAGE_SHIFT + 9 * (level - 1))) & (SHADOW_ENTRIES - 1);
+    if (sp->children[idx] == NULL) {
+      struct shadow_page *child;
+      if (w->table_gfn[level - 1] != SHADOW_DIRECT) shadow_protect_gfn(vcpu, w->table_gfn[level - 1]);
+      child = shadow_alloc(smmu, level - 1, w->table_gfn[level - 1]);
+      if (child == NULL) return ENOMEM;
+      child->parent = sp;
+      child->parent_idx = idx;
+      sp->children[idx] = child;
+      // pae pdptes can't have permission bits, the leaves do the checking
+      sp->table[idx] = child->pa | PT_PRESENT_MASK | ((pae_root && level == 3) ? 0 : (PT_WRITABLE_MASK | PT_USER_MASK));
+    }
+    sp = sp->children[idx];
+  }
+
+  guest_gpa_to_hpa(vcpu, w->gpa, &hpa);
+  user = w->user;
+  spte = hpa | PT_PRESENT_MASK;
+
+  // cr0.wp is always on for real, so a supervisor write to a read only page
+  // with wp off gets a writable kernel only mapping
+  if (!w->writable && !(vcpu->guest_cr0 & X86_CR0_WP) && (access & (PFERR_WRITE_MASK | PFERR_USER_MASK)) == PFERR_WRITE_MASK) {
+    spte |= PT_WRITABLE_MASK;
+    user = 0;
+  } else if (w->writable && w->dirty && !shadow_gfn_tracked(smmu, w->gpa >> PAGE_SHIFT)) {
+    // clean pages stay read only so the first write sets the dirty bit
+    spte |= PT_WRITABLE_MASK;
+  }
+  if (user) spte |= PT_USER_MASK;
+
+  idx = (va >> PAGE_SHIFT) & (SHADOW_ENTRIES - 1);
+  if (sp->table[idx] & PT_PRESENT_MASK) vcpu->tlb_flush_cpus = ~0ULL;
+  sp->table[idx] = spte;
+  return 0;
+}
+
+static int shadow_page_fault(struct vcpu *vcpu, unsigned long va, u32 error) {
+  struct guest_walk w;
+  unsigned long hpa;
+  int i;
+
+  switch (guest_walk(vcpu, va, error, &w)) {
+    case WALK_GUEST_FAULT:
+      vcpu->cr2 = va;
+      vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, w.error);
+      vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | INTR_TYPE_HARD_EXCEPTION | INTR_INFO_DELIVER_CODE_MASK | PF_VECTOR);
+      return 1;
+    case WALK_NOT_WIRED:
+      // vcpu->phys was set by the walk, the guest retries after it's wired
+      vcpu->pending_fault = PENDING_FAULT_WRITE;
+      return 1;
+    case WALK_MMIO:
+      // a device, out to userspace the way the ept path does it. the
+      // instruction's length comes from the decoder, a #PF exit has none
+      if (!(error & PFERR_FETCH_MASK)) {
+        vcpu->phys = w.gpa | (va & (PAGE_SIZE-1));
+        return mmio_pending(vcpu, PENDING_FAULT_MMIO);
+      }
+      // running code out of a device, fall through
+    case WALK_TABLE_MMIO:
+      vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+      vcpu->kvm_vcpu->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+      return 0;
+  }
+
+  if (guest_gpa_to_hpa(vcpu, w.gpa, &hpa) == EAGAIN) {
+    vcpu->phys = w.gpa;
+    vcpu->pending_fault = PENDING_FAULT_WRITE;
+    return 1;
+  }
+
+  if ((error & PFERR_WRITE_MASK) && shadow_gfn_tracked(vcpu->smmu, w.gpa >> PAGE_SHIFT)) {
+    // writing a page table that maps itself would need the write emulated
+    for (i = 1; i < 5; i++) {
+      if (w.table_gfn[i] == (w.gpa >> PAGE_SHIFT)) {
+        printf("guest page table %lx maps itself, can't shadow\n", w.gpa);
+        vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+        vcpu->kvm_vcpu->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+        return 0;
+      }
+    }
+    shadow_unprotect_gfn(vcpu, w.gpa >> PAGE_SHIFT);
+    if (vcpu->smmu->reload) shadow_load_cr3(vcpu);
+  }
+
+  if (shadow_map(vcpu, va, error, &w) == ENOMEM) {
+    // pool is full, start over and let the guest fault things back in
+    shadow_reset(vcpu);
+    shadow_load_cr3(vcpu);
+  }
+  return 1;
+}
+
+static void shadow_set_cr0(struct vcpu *vcpu, unsigned long val) {
+  unsigned long old = vcpu->guest_cr0;
+  vcpu->guest_cr0 = val;
+  vcpu->paging = (val & X86_CR0_PG) != 0;
+  vmcs_writel(GUEST_CR0, val | SHADOW_CR0_ON);
+  vmcs_writel(CR0_READ_SHADOW, val);
+  kvm_update_efer(vcpu);
+  if ((old ^ val) & (X86_CR0_PG | X86_CR0_WP)) shadow_reset(vcpu);
+}
+
+static void shadow_set_cr4(struct vcpu *vcpu, unsigned long val) {
+  unsigned long old = vcpu->guest_cr4;
+  vcpu->guest_cr4 = val;
+  // always pae underneath, it's the only format that fits every 32 bit guest
+  vmcs_writel(GUEST_CR4, (val | X86_CR4_PAE | X86_CR4_VMXE) & ~X86_CR4_PCIDE);
+  vmcs_writel(CR4_READ_SHADOW, val);
+  if ((old ^ val) & (X86_CR4_PAE | X86_CR4_PSE | X86_CR4_PGE)) shadow_reset(vcpu);
+}
+
+// allocates, so call without the vmcs lock
+static int shadow_init(struct vcpu *vcpu) {
+  struct shadow_mmu *smmu;
+  int i;
+
+  smmu = (struct shadow_mmu *)IOCalloc(sizeof(struct shadow_mmu));
+  if (smmu == NULL) return ENOMEM;
+  smmu->pool_md = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task, kIODirectionInOut,
+    SHADOW_POOL_PAGES * PAGE_SIZE, 0x00000000FFFFF000ULL);
+  smmu->children = (struct shadow_page **)IOCalloc(SHADOW_POOL_PAGES * SHADOW_ENTRIES * sizeof(struct shadow_page *));
+  if (smmu->pool_md == NULL || smmu->children == NULL) {
+    if (smmu->pool_md != NULL) smmu->pool_md->release();
+    if (smmu->children != NULL) IOFree(smmu->children, SHADOW_POOL_PAGES * SHADOW_ENTRIES * sizeof(struct shadow_page *));
+    IOFree(smmu, sizeof(struct shadow_mmu));
+    return ENOMEM;
+  }
+  bzero(smmu->pool_md->getBytesNoCopy(), SHADOW_POOL_PAGES * PAGE_SIZE);
+
+  for (i = SHADOW_POOL_PAGES - 1; i >= 0; i--) {
+    struct shadow_page *sp = &smmu->pages[i];
+    sp->table = (u64 *)((char *)smmu->pool_md->getBytesNoCopy() + i * PAGE_SIZE);
+    sp->pa = smmu->pool_md->getPhysicalSegment(i * PAGE_SIZE, NULL, kIOMemoryMapperNone);
+    sp->children = &smmu->children[i * SHADOW_ENTRIES];
+    sp->next_free = smmu->free_list;
+    smmu->free_list = sp;
+  }
+  smmu->reload = 1;
+
+  vcpu->smmu = smmu;
+  return 0;
+}
+
+static void shadow_destroy(struct vcpu *vcpu) {
+  if (vcpu->smmu == NULL) return;
+  vcpu->smmu->pool_md->release();
+  IOFree(vcpu->smmu->children, SHADOW_POOL_PAGES * SHADOW_ENTRIES * sizeof(struct shadow_page *));
+  IOFree(vcpu->smmu, sizeof(struct shadow_mmu));
+  vcpu->smmu = NULL;
+}
+
+/* *********************** */
+/* gsi routing and msi */
+/* *********************** */
+
+// the kernel's copy of a routing entry, irqchip pins are flattened to an ISA line
+struct gsi_route {
+  u32 gsi;
+  u32 type;
+  union {
+    u32 line;
+    struct {
+      u64 address;
+      u32 data;
+    } msi;
+  } u;
+};
+
+struct gsi_routing {
+  u32 nr;
+  struct gsi_route entries[0];
+};
+
+// the header and nr entries, without any tail padding sizeof would add
+#define GSI_ROUTING_SIZE(nr) (offsetof(struct gsi_routing, entries) + (nr) * sizeof(struct gsi_route))
+
+#define MSI_ADDR_BASE 0xfee00000
+#define MSI_ADDR_DEST_ID(addr) (((addr) >> 12) & 0xff)
+#define MSI_DATA_VECTOR(data) ((data) & 0xff)
+#define MSI_DATA_DELIVERY_MODE(data) (((data) >> 8) & 7)
+#define MSI_DELIVERY_FIXED 0
+#define MSI_DELIVERY_LOWPRI 1
+
+static void gsi_routing_free(struct gsi_routing *routing) {
+  if (routing != NULL) IOFree(routing, GSI_ROUTING_SIZE(routing->nr));
+}
+
+static int kvm_irq_pending(struct vcpu *vcpu) {
+  int i;
+  if (vcpu->pending_irq) return 1;
+  for (i = 0; i < 256/32; i++) {
+    if (vcpu->pending_vectors[i]) return 1;
+  }
+  return 0;
+}
+
+// highest pending msi vector, like the apic's irr. -1 if there's none
+static int kvm_pop_vector(struct vcpu *vcpu) {
+  int i;
+  u32 bits;
+  for (i = 256/32 - 1; i >= 0; i--) {
+    bits = vcpu->pending_vectors[i];
+    if (bits) {
+      bits = 31 - __builtin_clz(bits);
+      OSBitAndAtomic(~(1U << bits), &vcpu->pending_vectors[i]);
+      return i*32 + bits;
+    }
+  }
+  return -1;
+}
+
+// there's one vcpu with apic id 0, so it's the only target
+static int kvm_deliver_msi(struct vcpu *vcpu, u64 address, u32 data) {
+  u32 vector = MSI_DATA_VECTOR(data);
+  u32 dest = MSI_ADDR_DEST_ID(address);
+
+  if ((address & 0xfff00000) != MSI_ADDR_BASE) return EINVAL;
+  if (MSI_DATA_DELIVERY_MODE(data) != MSI_DELIVERY_FIXED &&
+      MSI_DATA_DELIVERY_MODE(data) != MSI_DELIVERY_LOWPRI) return EINVAL;
+  // 0-15 are exceptions and reserved
+  if (vector < 16) return EINVAL;
+  if (dest != 0 && dest != 0xff) return 0;
+
+  OSBitOrAtomic(1U << (vector & 31), &vcpu->pending_vectors[vector / 32]);
+  vcpu->stats.msis++;
+  return 0;
+}
+
+static void kvm_set_line(struct vcpu *vcpu, u32 line, int level) {
+  // don't ask about the interrupt thing, i'm mad too
+  asm volatile ("cli");
+  if (vcpu->irq_level[line] == 0 && level == 1) {
+    // trigger on rising edge?
+    vcpu->pending_irq |= 1 << line;
+    vcpu->stats.irq_lines++;
+  }
+  vcpu->irq_level[line] = level;
+  asm volatile ("sti");
+}
+
+static int kvm_irq_line(struct vcpu *vcpu, struct kvm_irq_level *irq) {
+  struct gsi_routing *routing;
+  struct gsi_route *route;
+  u32 i;
+  //if (irq->level != 0) printf("irq %d = %d\n", irq->irq, irq->level);
+
+  // no lock on the table, the writer waits out irq_lock before freeing the old one
+  routing = vcpu->routing;
+  if (routing == NULL) {
+    if (irq->irq < IRQ_MAX) kvm_set_line(vcpu, irq->irq, irq->level);
+    return 0;
+  }
+
+  // a gsi can have more than one route, e.g. a pic and an ioapic pin
+  for (i = 0; i < routing->nr; i++) {
+    route = &routing->entries[i];
+    if (route->gsi != irq->irq) continue;
+    if (route->type == KVM_IRQ_ROUTING_IRQCHIP) {
+      kvm_set_line(vcpu, route->u.line, irq->level);
+    } else if (irq->level == 1) {
+      kvm_deliver_msi(vcpu, route->u.msi.address, route->u.msi.data);
+    }
+  }
+  return 0;
+}
+
+static int kvm_signal_msi(struct vcpu *vcpu, struct kvm_msi *msi) {
+  if (msi->flags != 0) return EINVAL;
+  return kvm_deliver_msi(vcpu, ((u64)msi->address_hi << 32) | msi->address_lo, msi->data);
+}
+
+// builds the new table and swaps it in, the caller frees *old once no
+// injection can still be reading it
+static int kvm_set_gsi_routing(struct vcpu *vcpu, struct kvm_irq_routing *irq_routing, struct gsi_routing **old) {
+  struct kvm_irq_routing_entry *ue = NULL;
+  struct gsi_routing *routing;
+  struct gsi_route *route;
+  int ret = 0;
+  u32 i;
+
+  *old = NULL;
+  // at most one route per gsi, which also bounds the sizes below
+  if (irq_routing->nr > GSI_MAX || irq_routing->flags != 0) return EINVAL;
+
+  routing = (struct gsi_routing *)IOCalloc(GSI_ROUTING_SIZE(irq_routing->nr));
+  if (routing == NULL) return ENOMEM;
+  // an empty table is fine, it just routes nothing
+  if (irq_routing->nr != 0) {
+    ue = (struct kvm_irq_routing_entry *)IOMalloc(irq_routing->nr * sizeof(struct kvm_irq_routing_entry));
+    if (ue == NULL) {
+      ret = ENOMEM;
+      goto out;
+    }
+  }
+  if (ue != NULL && copyin(irq_routing->self + offsetof(struct kvm_irq_routing, entries), ue,
+             irq_routing->nr * sizeof(struct kvm_irq_routing_entry)) != 0) {
+    ret = EFAULT;
+    goto out;
+  }
+
+  for (i = 0; i < irq_routing->nr; i++) {
+    route = &routing->entries[i];
+    if (ue[i].gsi >= GSI_MAX || ue[i].flags != 0) {
+      ret = EINVAL;
+      goto out;
+    }
+    route->gsi = ue[i].gsi;
+    route->type = ue[i].type;
+    if (ue[i].type == KVM_IRQ_ROUTING_IRQCHIP) {
+      // the pic pins stack into the 16 lines, ioapic pins past 15 have nowhere to go
+      switch (ue[i].u.irqchip.irqchip) {
+        case KVM_IRQCHIP_PIC_MASTER:
+          route->u.line = ue[i].u.irqchip.pin;
+          if (ue[i].u.irqchip.pin >= 8) ret = EINVAL;
+          break;
+        case KVM_IRQCHIP_PIC_SLAVE:
+          route->u.line = ue[i].u.irqchip.pin + 8;
+          if (ue[i].u.irqchip.pin >= 8) ret = EINVAL;
+          break;
+        case KVM_IRQCHIP_IOAPIC:
+          route->u.line = ue[i].u.irqchip.pin;
+          if (ue[i].u.irqchip.pin >= IRQ_MAX) ret = EINVAL;
+          break;
+        default:
+          ret = EINVAL;
+          break;
+      }
+    } else if (ue[i].type == KVM_IRQ_ROUTING_MSI) {
+      route->u.msi.address = ((u64)ue[i].u.msi.address_hi << 32) | ue[i].u.msi.address_lo;
+      route->u.msi.data = ue[i].u.msi.data;
+    } else {
+      ret = EINVAL;
+    }
+    if (ret != 0) goto out;
+  }
+  routing->nr = irq_routing->nr;
+
+  // publish, readers see either the whole old table or the whole new one
+  OSMemoryBarrier();
+  *old = vcpu->routing;
+  vcpu->routing = routing;
+  routing = NULL;
+
+out:
+  if (ue != NULL) IOFree(ue, irq_routing->nr * sizeof(struct kvm_irq_routing_entry));
+  if (routing != NULL) IOFree(routing, GSI_ROUTING_SIZE(irq_routing->nr));
+  return ret;
+}
+
+/* *********************** */
+/* guest profiling */
+/* *********************** */
+
+// keeps the timer exits to at most 100k a second
+#define PROF_MIN_PERIOD_NS 10000
+
+// the preemption timer is shared with the cpu quota, it runs while either wants it. requires VMCS lock
+static void kvm_timer_update(struct vcpu *vcpu) {
+  u32 pin = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL) & ~PIN_BASED_VMX_PREEMPTION_TIMER;
+  if (vcpu->prof_mode == KVM_PROF_TIMER || vcpu->quota_period != 0) pin |= PIN_BASED_VMX_PREEMPTION_TIMER;
+  vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin);
+}
+
+static void kvm_prof_free(struct vcpu *vcpu) {
+  if (vcpu->prof_map != NULL) vcpu->prof_map->release();
+  if (vcpu->prof_md != NULL) {
+    vcpu->prof_md->complete();
+    vcpu->prof_md->release();
+  }
+  vcpu->prof_map = NULL;
+  vcpu->prof_md = NULL;
+  vcpu->prof_ring = NULL;
+  vcpu->prof_mode = 0;
+}
+
+// requires VMCS lock
+static int kvm_prof_setup(struct vcpu *vcpu, struct kvm_prof_setup *setup) {
+  IOMemoryDescriptor *md;
+  IOMemoryMap *map;
+  struct kvm_prof_ring *ring;
+  u32 entries;
+
+  kvm_prof_free(vcpu);
+  kvm_timer_update(vcpu);
+  if (setup->addr == 0) return 0;
+
+  if ((setup->addr & (PAGE_SIZE-1)) || setup->size == 0 || (setup->size & (PAGE_SIZE-1))) return EINVAL;
+  if (setup->mode == KVM_PROF_TIMER) {
+    if (!vmx_has_preemption_timer || tsc_frequency == 0) return EINVAL;
+    if (setup->period < PROF_MIN_PERIOD_NS) return EINVAL;
+    // converted to tsc cycles below, that mustn't overflow
+    if (setup->period > ~0ULL / tsc_frequency) return EINVAL;
+  } else if (setup->mode == KVM_PROF_INTR) {
+    if (setup->period == 0) return EINVAL;
+  } else {
+    return EINVAL;
+  }
+
+  // round down to a power of two so the kext can mask
+  entries = (setup->size - sizeof(struct kvm_prof_ring)) / sizeof(struct kvm_prof_sample);
+  if (entries == 0) return EINVAL;
+  while (entries & (entries - 1)) entries &= entries - 1;
+
+  md = IOMemoryDescriptor::withAddressRange(setup->addr, setup->size, kIODirectionInOut, current_task());
+  if (md == NULL) return ENOMEM;
+  if (md->prepare() != kIOReturnSuccess) {
+    md->release();
+    return EFAULT;
+  }
+  map = md->map();
+  if (map == NULL) {
+    md->complete();
+    md->release();
+    return ENOMEM;
+  }
+
+  ring = (struct kvm_prof_ring *)map->getVirtualAddress();
+  ring->head = ring->tail = 0;
+  ring->entries = entries;
+  ring->dropped = ring->exits = ring->overhead = 0;
+
+  vcpu->prof_md = md;
+  vcpu->prof_map = map;
+  vcpu->prof_ring = ring;
+  vcpu->prof_head = 0;
+  vcpu->prof_entries = entries;
+  vcpu->prof_mode = setup->mode;
+  vcpu->prof_exit_tsc = 0;
+  if (setup->mode == KVM_PROF_TIMER) {
+    vcpu->prof_period = setup->period * tsc_frequency / 1000000000ULL;
+    vcpu->prof_next = rdtsc64() + vcpu->prof_period;
+    kvm_timer_update(vcpu);
+  } else {
+    vcpu->prof_period = setup->period;
+    vcpu->prof_next = setup->period;
+  }
+  return 0;
+}
+
+// right before entry, the tsc deadline for the next sample or 0 when the
+// profiler doesn't need the timer
+static u64 kvm_prof_deadline(struct vcpu *vcpu) {
+  if (vcpu->prof_mode != KVM_PROF_TIMER) return 0;
+  if (vcpu->prof_exit_tsc != 0) {
+    vcpu->prof_ring->overhead += rdtsc64() - vcpu->prof_exit_tsc;
+    vcpu->prof_exit_tsc = 0;
+  }
+  return vcpu->prof_next;
+}
+
+static void kvm_prof_sample(struct vcpu *vcpu, u64 now) {
+  struct kvm_prof_ring *ring = vcpu->prof_ring;
+  struct kvm_prof_sample *sample;
+  u32 head = vcpu->prof_head;
+
+  // only tail comes from userspace. one that's ahead of head makes this
+  // huge, and the sample is dropped like on a full ring
+  if (head - *(volatile u32 *)&ring->tail >= vcpu->prof_entries) {
+    ring->dropped++;
+    return;
+  }
+  sample = &ring->samples[head & (vcpu->prof_entries - 1)];
+  sample->tsc = now;
+  sample->rip = vcpu->regs[VCPU_REGS_RIP];
+  sample->cr3 = vcpu->shadow ? vcpu->cr3_shadow : vmcs_readl(GUEST_CR3);
+  // cpl is ss.dpl
+  sample->cpl = (vmcs_read32(GUEST_SS_AR_BYTES) >> 5) & 3;
+  sample->flags = (vcpu->efer & MSR_IA32_EFER_LMA) ? KVM_PROF_SAMPLE_LONG : 0;
+  // the sample has to be there before userspace sees the new head
+  OSMemoryBarrier();
+  vcpu->prof_head = head + 1;
+  ring->head = head + 1;
+}
+
+// after every exit, with the VMCS loaded
+static void kvm_prof_exit(struct vcpu *vcpu, unsigned long exit_reason) {
+  u64 now;
+
+  if (vcpu->prof_mode == KVM_PROF_TIMER) {
+    now = rdtsc64();
+    if (now < vcpu->prof_next) return;
+    kvm_prof_sample(vcpu, now);
+    // don't try to catch up on the samples missed while in the host
+    vcpu->prof_next += vcpu->prof_period;
+    if (vcpu->prof_next <= now) vcpu->prof_next = now + vcpu->prof_period;
+    if (exit_reason == EXIT_REASON_PREEMPTION_TIMER) {
+      vcpu->prof_ring->exits++;
+      vcpu->prof_exit_tsc = now;
+    } else {
+      vcpu->prof_ring->overhead += rdtsc64() - now;
+    }
+  } else if (vcpu->prof_mode == KVM_PROF_INTR && exit_reason == EXIT_REASON_EXTERNAL_INTERRUPT) {
+    if (--vcpu->prof_next != 0) return;
+    now = rdtsc64();
+    kvm_prof_sample(vcpu, now);
+    vcpu->prof_next = vcpu->prof_period;
+    vcpu->prof_ring->overhead += rdtsc64() - now;
+  }
+}
 
 /* *********************** */
-/* ept functions */
+/* cpu quota */
 /* *********************** */
 
-static void ept_init(struct vcpu *vcpu) {
-  // EPT allocation
-	vcpu->pml4 = (unsigned long *)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
+// like a cfs bandwidth limit: the vcpu gets quota_runtime cycles of guest
+// time every quota_period, the preemption timer takes it out of the guest
+// when they're used up and it sleeps until the next period. only guest time
+// is charged, the host scheduler already sees the rest.
+#define QUOTA_MIN_PERIOD_NS 1000000
+#define QUOTA_MAX_PERIOD_NS 1000000000ULL
+// below this the timer exits cost more than the guest gets to run
+#define QUOTA_MIN_RUNTIME_NS 100000
+
+static void kvm_quota_refill(struct vcpu *vcpu, u64 now) {
+  vcpu->quota_start = now;
+  vcpu->quota_used = 0;
+  vcpu->stats.quota_periods++;
 }
 
-#define PAGE_OFFSET 512
-#define EPT_CACHE_WRITEBACK (6 << 3)
-#define EPT_DEFAULTS (VMX_EPT_EXECUTABLE_MASK | VMX_EPT_WRITABLE_MASK | VMX_EPT_READABLE_MASK)
+// requires VMCS lock
+static int kvm_set_cpu_quota(struct vcpu *vcpu, struct kvm_cpu_quota *quota) {
+  if (quota->runtime == 0) {
+    vcpu->quota_period = 0;
+    kvm_timer_update(vcpu);
+    return 0;
+  }
+  if (!vmx_has_preemption_timer || tsc_frequency == 0) return EINVAL;
+  if (quota->period < QUOTA_MIN_PERIOD_NS || quota->period > QUOTA_MAX_PERIOD_NS) return EINVAL;
+  if (quota->runtime < QUOTA_MIN_RUNTIME_NS || quota->runtime > quota->period) return EINVAL;
+
+  vcpu->quota_period = quota->period * tsc_frequency / 1000000000ULL;
+  vcpu->quota_runtime = quota->runtime * tsc_frequency / 1000000000ULL;
+  kvm_quota_refill(vcpu, rdtsc64());
+  kvm_timer_update(vcpu);
+  return 0;
+}
 
-static void ept_free(struct vcpu *vcpu) {
-  unsigned long *pdpt, *pd, *pt;
-  int pml4_idx, pdpt_idx, pd_idx;
-  for (pml4_idx = 0; pml4_idx < PAGE_OFFSET; pml4_idx++) {
-    pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
-    if (pdpt == NULL) continue;
-    for (pdpt_idx = 0; pdpt_idx < PAGE_OFFSET; pdpt_idx++) {
-      pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
-      if (pd == NULL) continue;
-      for (pd_idx = 0; pd_idx < PAGE_OFFSET; pd_idx++) {
-        pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
-        if (pt == NULL) continue;
-        IOFree(pt, PAGE_SIZE);
-      }
-      IOFree(pd, PAGE_SIZE*2);
-    }
-    IOFree(pdpt, PAGE_SIZE*2);
+// before every entry, with interrupts on and the VMCS not loaded. starts the
+// next period when this one is over, and sleeps out the rest of it once the
+// runtime is used up. only a signal cuts the sleep short, then it's EINTR
+static int kvm_quota_wait(struct vcpu *vcpu) {
+  struct timespec ts;
+  u64 now, end, ns;
+  int ret;
+
+  if (vcpu->quota_period == 0) return 0;
+  now = rdtsc64();
+  end = vcpu->quota_start + vcpu->quota_period;
+  if (now >= end) {
+    kvm_quota_refill(vcpu, now);
+    return 0;
   }
-  IOFree(vcpu->pml4, PAGE_SIZE*2);
+  if (vcpu->quota_used < vcpu->quota_runtime) return 0;
+
+  vcpu->stats.throttled++;
+  ns = (end - now) * 1000000000ULL / tsc_frequency;
+  ts.tv_sec = ns / 1000000000ULL;
+  ts.tv_nsec = ns % 1000000000ULL;
+  // nothing wakes the channel, interrupts for the guest wait for the period too
+  ret = msleep(&vcpu->quota_start, NULL, PCATCH | PZERO, "kvmquota", &ts);
+  vcpu->stats.throttled_tsc += rdtsc64() - now;
+  if (ret != 0 && ret != EWOULDBLOCK) return EINTR;
+  kvm_quota_refill(vcpu, rdtsc64());
+  return 0;
+}
 
-  // the pages are still wired in in the process, they free when the process frees them
+// right before entry, with the VMCS loaded. the timer counts from every
+// entry, so give it what's left until the nearest deadline
+static void kvm_timer_arm(struct vcpu *vcpu) {
+  u64 now, deadline, ticks = 0;
+
+  deadline = kvm_prof_deadline(vcpu);
+  now = rdtsc64();
+  if (vcpu->quota_period != 0) {
+    u64 left = vcpu->quota_used < vcpu->quota_runtime ? vcpu->quota_runtime - vcpu->quota_used : 0;
+    if (deadline == 0 || now + left < deadline) deadline = now + left;
+  }
+  if (deadline == 0) return;
+  if (deadline > now) ticks = (deadline - now) >> vmx_preemption_timer_rate;
+  vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, ticks > 0xffffffffULL ? 0xffffffff : ticks);
 }
 
+/* *********************** */
+/* coalesced pio */
+/* *********************** */
 
-static unsigned long ept_translate(struct vcpu *vcpu, unsigned long virtual_address) {
-  int pml4_idx = (virtual_address >> 39) & 0x1FF;
-  int pdpt_idx = (virtual_address >> 30) & 0x1FF;
-  int pd_idx = (virtual_address >> 21) & 0x1FF;
-  int pt_idx = (virtual_address >> 12) & 0x1FF;
-  unsigned long *pdpt, *pd, *pt;
-  pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
-  if (pdpt == NULL) return 0;
-  pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
-  if (pd == NULL) return 0;
-  pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
-  if (pt == NULL) return 0;
+// writes to a registered port range go on the ring page of the vcpu mapping
+// instead of exiting, and userspace replays them before it handles the next
+// exit. good for devices whose writes don't need an answer, like a uart's
+// transmit register. the vcpu is the only producer, userspace moves first
 
-  return pt[pt_idx] & ~(PAGE_SIZE-1);
+static struct kvm_coalesced_mmio_ring *coalesced_ring(struct vcpu *vcpu) {
+  return (struct kvm_coalesced_mmio_ring *)((char *)vcpu->kvm_vcpu + KVM_COALESCED_MMIO_PAGE_OFFSET * PAGE_SIZE);
 }
 
-// could probably be managed by http://fxr.watson.org/fxr/source/osfmk/i386/pmap.h
-static void ept_add_page(struct vcpu *vcpu, unsigned long virtual_address, unsigned long physical_address) {
-  int pml4_idx = (virtual_address >> 39) & 0x1FF;
-  int pdpt_idx = (virtual_address >> 30) & 0x1FF;
-  int pd_idx = (virtual_address >> 21) & 0x1FF;
-  int pt_idx = (virtual_address >> 12) & 0x1FF;
-  unsigned long *pdpt, *pd, *pt;
-  //printf("%p @ %d %d %d %d\n", virtual_address, pml4_idx, pdpt_idx, pd_idx, pt_idx);
+static int kvm_register_coalesced(struct vcpu *vcpu, struct kvm_coalesced_mmio_zone *zone) {
+  // ports only, mmio writes still exit one at a time
+  if (!zone->pio) return EINVAL;
+  if (zone->size == 0 || zone->addr + zone->size > 0x10000) return EINVAL;
+  if (vcpu->coalesced_zone_count == COALESCED_ZONE_MAX) return ENOSPC;
+  vcpu->coalesced_zones[vcpu->coalesced_zone_count++] = *zone;
+  return 0;
+}
 
-  // allocate the pdpt in the pml4 if NULL
-  pdpt = (unsigned long*)vcpu->pml4[PAGE_OFFSET + pml4_idx];
-  if (pdpt == NULL) {
-    pdpt = (unsigned long*)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
-    vcpu->pml4[PAGE_OFFSET + pml4_idx] = (unsigned long)pdpt;
-    vcpu->pml4[pml4_idx] = __pa(pdpt) | EPT_DEFAULTS;
-  }
+static int kvm_unregister_coalesced(struct vcpu *vcpu, struct kvm_coalesced_mmio_zone *zone) {
+  int i;
 
-  // allocate the pd in the pdpt
-  pd = (unsigned long*)pdpt[PAGE_OFFSET + pdpt_idx];
-  if (pd == NULL) {
-    pd = (unsigned long*)IOCallocAligned(PAGE_SIZE*2, PAGE_SIZE);
-    pdpt[PAGE_OFFSET + pdpt_idx] = (unsigned long)pd;
-    pdpt[pdpt_idx] = __pa(pd) | EPT_DEFAULTS;
+  for (i = 0; i < vcpu->coalesced_zone_count; i++) {
+    if (vcpu->coalesced_zones[i].pio == zone->pio && vcpu->coalesced_zones[i].addr == zone->addr &&
+        vcpu->coalesced_zones[i].size == zone->size) {
+      vcpu->coalesced_zones[i] = vcpu->coalesced_zones[--vcpu->coalesced_zone_count];
+      return 0;
+    }
   }
+  return ENOENT;
+}
 
-  // allocate the pt in the pd
-  pt = (unsigned long*)pd[PAGE_OFFSET + pd_idx];
-  if (pt == NULL) {
-    pt = (unsigned long*)IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
-    pd[PAGE_OFFSET + pd_idx] = (unsigned long)pt;
-    pd[pd_idx] = __pa(pt) | EPT_DEFAULTS;
-  }
+// 1 if the write went on the ring, 0 if it has to exit like any other
+static int coalesced_pio_write(struct vcpu *vcpu, u16 port, u32 size, unsigned long val) {
+  struct kvm_coalesced_mmio_ring *ring = coalesced_ring(vcpu);
+  struct kvm_coalesced_mmio *entry;
+  u32 last;
+  int i;
 
-  // set the entry in the page table
-  pt[pt_idx] = physical_address | EPT_DEFAULTS | EPT_CACHE_WRITEBACK;
+  for (i = 0; i < vcpu->coalesced_zone_count; i++) {
+    if (port >= vcpu->coalesced_zones[i].addr &&
+        port + size <= vcpu->coalesced_zones[i].addr + vcpu->coalesced_zones[i].size) break;
+  }
+  if (i == vcpu->coalesced_zone_count) return 0;
+
+  // full, the exit makes userspace drain it
+  last = ring->last;
+  if (last >= KVM_COALESCED_MMIO_MAX || (last + 1) % KVM_COALESCED_MMIO_MAX == *(volatile u32 *)&ring->first) return 0;
+
+  entry = &ring->coalesced_mmio[last];
+  entry->phys_addr = port;
+  entry->len = size;
+  entry->pio = 1;
+  memcpy(entry->data, &val, size);
+  // the entry before the index that publishes it
+  __asm__ volatile ("sfence" ::: "memory");
+  ring->last = (last + 1) % KVM_COALESCED_MMIO_MAX;
+  vcpu->stats.coalesced_pio++;
+  return 1;
 }
 
 /* *********************** */
@@ -219,6 +2046,12 @@ static int handle_io(struct vcpu *vcpu) {
   vcpu->kvm_vcpu->io.data_offset = KVM_PIO_PAGE_OFFSET * PAGE_SIZE;
 
   unsigned long val = 0;
+  // ins and outs still go out one at a time
+  if (!in && !(exit_qualification & 16) &&
+      coalesced_pio_write(vcpu, exit_qualification >> 16, (exit_qualification & 7) + 1, vcpu->regs[VCPU_REGS_RAX])) {
+    skip_emulated_instruction(vcpu);
+    return 1;
+  }
   if (!in) {
     val = vcpu->regs[VCPU_REGS_RAX];
     unsigned int size = vcpu->kvm_vcpu->io.size * vcpu->kvm_vcpu->io.count;
@@ -292,6 +2125,14 @@ static int handle_cpuid(struct vcpu *vcpu) {
     
     // no xsave
     ecx &= ~(1<<26 | 1<<27);
+
+    // the shadow mmu doesn't do pcid
+    if (vcpu->shadow) ecx &= ~(1<<17);
+  }
+
+  // the pmu is only what we can switch, userspace can still hide it
+  if (function == 0xa && !(found && (eax & 0xff) == 0)) {
+    pmu_cpuid(&eax, &ebx, &ecx, &edx);
   }
 
 	vcpu->regs[VCPU_REGS_RAX] = eax;
@@ -304,32 +2145,132 @@ static int handle_cpuid(struct vcpu *vcpu) {
 }
 
 static int handle_rdmsr(struct vcpu *vcpu) {
+  u64 data;
   printf("rdmsr 0x%lX\n", vcpu->regs[VCPU_REGS_RCX]);
 
-  // emulation is lol
-  asm("rdmsr\n"
-    : "=a"   (vcpu->regs[VCPU_REGS_RAX]),
-      "=d"   (vcpu->regs[VCPU_REGS_RDX])
-    : "c"    (vcpu->regs[VCPU_REGS_RCX]));
+  if (kvm_get_msr(vcpu, vcpu->regs[VCPU_REGS_RCX], &data) == 0) {
+    vcpu->regs[VCPU_REGS_RAX] = (u32)data;
+    vcpu->regs[VCPU_REGS_RDX] = data >> 32;
+  } else {
+    // emulation is lol
+    asm("rdmsr\n"
+      : "=a"   (vcpu->regs[VCPU_REGS_RAX]),
+        "=d"   (vcpu->regs[VCPU_REGS_RDX])
+      : "c"    (vcpu->regs[VCPU_REGS_RCX]));
+  }
 
   skip_emulated_instruction(vcpu);
   return 1;
 }
 
 static int handle_wrmsr(struct vcpu *vcpu) {
+  u64 data = (vcpu->regs[VCPU_REGS_RDX] << 32) | (u32)vcpu->regs[VCPU_REGS_RAX];
   printf("wrmsr 0x%lX\n", vcpu->regs[VCPU_REGS_RCX]);
+  // the ones we don't know about are still dropped
+  kvm_set_msr(vcpu, vcpu->regs[VCPU_REGS_RCX], data);
   skip_emulated_instruction(vcpu);
   return 1;
 }
 
-static int handle_ept_violation(struct vcpu *vcpu) {
-  //u64 phys = vmcs_readl(GUEST_PHYSICAL_ADDRESS);
-  printf("!!ept violation at %lx\n", vcpu->phys);
-  //return 0;
+// only exits while the guest's counters aren't in the hardware
+static int handle_rdpmc(struct vcpu *vcpu) {
+  u32 index = vcpu->regs[VCPU_REGS_RCX];
+  u64 data = 0;
+
+  if (index & PMU_RDPMC_FIXED) {
+    index &= ~PMU_RDPMC_FIXED;
+    if (index < pmu_nr_fixed) data = vcpu->pmu.fixed[index];
+  } else if (index < pmu_nr_gp) {
+    data = vcpu->pmu.gp[index];
+  }
+  vcpu->regs[VCPU_REGS_RAX] = (u32)data;
+  vcpu->regs[VCPU_REGS_RDX] = data >> 32;
+
   skip_emulated_instruction(vcpu);
   return 1;
 }
 
+// the exit hit while an event was being delivered, through a page that
+// wasn't wired or a shadow entry we just filled in. the cpu dropped the
+// event, so queue it again for the next entry unless the handler already
+// queued one of its own (a #PF for the guest wins)
+static void kvm_requeue_event(struct vcpu *vcpu) {
+  u32 idt_info = vmcs_read32(IDT_VECTORING_INFO_FIELD);
+
+  if (!(idt_info & VECTORING_INFO_VALID_MASK)) return;
+  if (vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK) return;
+
+  // bit 12 is undefined here and reserved on entry
+  vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, idt_info & (VECTORING_INFO_VALID_MASK | VECTORING_INFO_DELIVER_CODE_MASK |
+    VECTORING_INFO_TYPE_MASK | VECTORING_INFO_VECTOR_MASK));
+  if (idt_info & VECTORING_INFO_DELIVER_CODE_MASK) {
+    vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, vmcs_read32(IDT_VECTORING_ERROR_CODE));
+  }
+  // only means something for software interrupts and exceptions, the exit
+  // saved it for exactly those
+  vmcs_write32(VM_ENTRY_INSTRUCTION_LEN, vcpu->exit_instruction_len);
+}
+
+// exit qualification bits of an ept violation
+#define EPT_VIOLATION_FETCH (1 << 2)
+#define EPT_VIOLATION_GLA_VALID (1 << 7)
+#define EPT_VIOLATION_GLA_TRANSLATED (1 << 8)
+
+// where the instruction is and how to decode it, the fetch needs interrupts on.
+// an access made delivering an event (idt, stack) has no instruction behind
+// it, so that's an error for userspace, the event stays queued
+static int mmio_pending(struct vcpu *vcpu, int pending) {
+  u32 ar = vmcs_read32(GUEST_CS_AR_BYTES);
+
+  if (vmcs_read32(IDT_VECTORING_INFO_FIELD) & VECTORING_INFO_VALID_MASK) {
+    kvm_requeue_event(vcpu);
+    vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+    vcpu->kvm_vcpu->internal.suberror = KVM_INTERNAL_ERROR_DELIVERY_EV;
+    return 0;
+  }
+
+  vcpu->mmio_rip = vmcs_readl(GUEST_CS_BASE) + vcpu->regs[VCPU_REGS_RIP];
+  if ((vmcs_read32(VM_ENTRY_CONTROLS) & VM_ENTRY_IA32E_MODE) && (ar & (1 << 13))) vcpu->mmio_mode = 8;
+  else vcpu->mmio_mode = (ar & (1 << 14)) ? 4 : 2;
+  vcpu->pending_fault = pending;
+  return 1;
+}
+
+static int handle_ept_violation(struct vcpu *vcpu) {
+  //u64 phys = vmcs_readl(GUEST_PHYSICAL_ADDRESS);
+  if (gfn_to_memslot(vcpu, vcpu->phys >> PAGE_SHIFT) != NULL) {
+    // guest ram that isn't wired yet, can't block here so fault it in after the exit
+    vcpu->pending_fault = (vcpu->exit_qualification & 2) ? PENDING_FAULT_WRITE : PENDING_FAULT_READ;
+    kvm_requeue_event(vcpu);
+    return 1;
+  }
+  // code running out of a device, or a guest page table in one, isn't a
+  // load or store the decoder can find at rip
+  if ((vcpu->exit_qualification & EPT_VIOLATION_FETCH) ||
+      !(vcpu->exit_qualification & EPT_VIOLATION_GLA_VALID) ||
+      !(vcpu->exit_qualification & EPT_VIOLATION_GLA_TRANSLATED)) {
+    kvm_requeue_event(vcpu);
+    vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+    vcpu->kvm_vcpu->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+    return 0;
+  }
+  // no memslot, so it's a device. mark the page so the next access skips this
+  return mmio_pending(vcpu, PENDING_FAULT_MMIO_MARK);
+}
+
+// only mmio_mark makes these, so it's a device access without a memslot lookup.
+// there's no qualification to tell a fetch apart, but then the decoder's own
+// fetch from rip finds no ram and fails the same way
+static int handle_ept_misconfig(struct vcpu *vcpu) {
+  if (vcpu->mmio_gen != vcpu->memslot_gen) {
+    // marked under an older memslot layout, take the slow path once more
+    mmio_zap(vcpu);
+    kvm_requeue_event(vcpu);
+    return 1;
+  }
+  return mmio_pending(vcpu, PENDING_FAULT_MMIO);
+}
+
 static int handle_preemption_timer(struct vcpu *vcpu) {
   return 1;
   //return 0;
@@ -364,8 +2305,109 @@ static int handle_interrupt_window(struct vcpu *vcpu) {
   return 1;
 }
 
+// single stepping, one instruction or one event delivery went by
+static int handle_monitor_trap(struct vcpu *vcpu) {
+  return kvm_debug_exit(vcpu, DB_VECTOR, DR6_FIXED_1 | DR6_BS);
+}
+
 static int handle_dr(struct vcpu *vcpu) {
-  // TODO: maybe actually do something here?
+  int dr = vcpu->exit_qualification & DEBUG_REG_ACCESS_NUM;
+  int reg = DEBUG_REG_ACCESS_REG(vcpu->exit_qualification);
+  unsigned long val;
+
+  if (!(vcpu->guest_debug & KVM_GUESTDBG_USE_HW_BP)) {
+    // only the first access exits. the guest's registers go in with the
+    // next entry and the instruction runs again, on the real ones
+    vcpu->guest_dr_state |= GUEST_DR_WONT_EXIT;
+    vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, vmcs_read32(CPU_BASED_VM_EXEC_CONTROL) & ~CPU_BASED_MOV_DR_EXITING);
+    return 1;
+  }
+
+  // the debugger has the hardware, the guest gets the copies. its own
+  // breakpoints don't fire until the debugger lets go.  dr4 and dr5 are
+  // dr6 and dr7 here, with cr4.de set they #UD before the exit
+  if (dr == 4 || dr == 5) dr += 2;
+  if (vcpu->exit_qualification & DEBUG_REG_ACCESS_TYPE) {
+    // mov from dr
+    if (dr < 4) val = vcpu->guest_dr[dr];
+    else if (dr == 6) val = vcpu->guest_dr6;
+    else val = vcpu->guest_dr7;
+    vcpu->regs[reg] = val;
+  } else {
+    // mov to dr
+    val = vcpu->regs[reg];
+    if (dr < 4) {
+      vcpu->guest_dr[dr] = val;
+    } else if (dr == 6) {
+      vcpu->guest_dr6 = (val & DR6_VOLATILE) | DR6_FIXED_1;
+    } else {
+      vcpu->guest_dr7 = (val & DR7_VALID) | DR7_FIXED_1;
+      guest_dr_update(vcpu);
+    }
+  }
+  skip_emulated_instruction(vcpu);
+  return 1;
+}
+
+// #DB and #BP are only intercepted for KVM_SET_GUEST_DEBUG
+static int handle_debug_exception(struct vcpu *vcpu, int vector) {
+  unsigned long dr6, dr7;
+  int i;
+
+  if (vector == BP_VECTOR) return kvm_debug_exit(vcpu, BP_VECTOR, DR6_FIXED_1);
+
+  // the qualification has the dr6 bits this #DB would have set
+  dr6 = DR6_FIXED_1 | (vcpu->exit_qualification & 0x600f);
+  dr7 = vmcs_readl(GUEST_DR7);
+  // an instruction breakpoint is a fault, going back would hit it again. the
+  // cpu sets rf in the rflags it pushes for the guest's handler, do the same
+  for (i = 0; i < 4; i++) {
+    if ((dr6 & (1 << i)) && ((dr7 >> (16 + i * 4)) & 3) == 0) vcpu->rflags |= X86_EFLAGS_RF;
+  }
+  return kvm_debug_exit(vcpu, DB_VECTOR, dr6);
+}
+
+static int handle_exception(struct vcpu *vcpu) {
+  u32 intr_info = vmcs_read32(VM_EXIT_INTR_INFO);
+  int vector = intr_info & INTR_INFO_VECTOR_MASK;
+  int ret;
+
+  if ((vector == DB_VECTOR || vector == BP_VECTOR) && vcpu->guest_debug) return handle_debug_exception(vcpu, vector);
+
+  if (vector != PF_VECTOR || !vcpu->shadow) {
+    // nothing else is intercepted
+    return 0;
+  }
+
+  ret = shadow_page_fault(vcpu, vcpu->exit_qualification, vmcs_read32(VM_EXIT_INTR_ERROR_CODE));
+  if (ret) kvm_requeue_event(vcpu);
+  return ret;
+}
+
+static int handle_cr_shadow(struct vcpu *vcpu, int cr_num, int cr_type, int cr_to_reg) {
+  if (cr_num == 3) {
+    if (cr_type == 0) {
+      // mov to cr3, switch to the tree for the new address space
+      vcpu->cr3_shadow = vcpu->regs[cr_to_reg];
+      shadow_load_cr3(vcpu);
+    } else if (cr_type == 1) {
+      // mov from cr3
+      vcpu->regs[cr_to_reg] = vcpu->cr3_shadow;
+    }
+  } else if (cr_num == 0) {
+    if (cr_type == 0) {
+      // mov to cr0
+      shadow_set_cr0(vcpu, vcpu->regs[cr_to_reg]);
+    } else if (cr_type == 3) {
+      // lmsw, can set pe but not clear it
+      shadow_set_cr0(vcpu, (vcpu->guest_cr0 & ~0xeUL) | ((vcpu->exit_qualification >> 16) & 0xf));
+    }
+  } else if (cr_num == 4 && cr_type == 0) {
+    shadow_set_cr4(vcpu, vcpu->regs[cr_to_reg]);
+  } else {
+    printf("can't emulate cr%d\n", cr_num);
+  }
+
   skip_emulated_instruction(vcpu);
   return 1;
 }
@@ -375,6 +2417,8 @@ static int handle_cr(struct vcpu *vcpu) {
   int cr_type = (vcpu->exit_qualification & CONTROL_REG_ACCESS_TYPE) >> 4;
   int cr_to_reg = (vcpu->exit_qualification & CONTROL_REG_ACCESS_REG) >> 8;
 
+  if (vcpu->shadow) return handle_cr_shadow(vcpu, cr_num, cr_type, cr_to_reg);
+
   if (cr_num == 3) {
     if (cr_type == 0) {
       // mov to cr3
@@ -405,6 +2449,8 @@ static int handle_cr(struct vcpu *vcpu) {
         vmcs_write32(SECONDARY_VM_EXEC_CONTROL, vmcs_read32(SECONDARY_VM_EXEC_CONTROL) | SECONDARY_EXEC_UNRESTRICTED_GUEST);
         vmcs_write64(CR0_READ_SHADOW, 0);
       }
+      // paging with lme set is the switch into long mode
+      kvm_update_efer(vcpu);
     }
   } else {
     printf("can't emulate cr%d\n", cr_num);
@@ -423,17 +2469,21 @@ static int handle_task_switch(struct vcpu *vcpu) {
 // 0xfee00000 = APIC
 
 static int (*const kvm_vmx_exit_handlers[])(struct vcpu *vcpu) = {
+  [EXIT_REASON_EXCEPTION_NMI]           = handle_exception,
   [EXIT_REASON_EXTERNAL_INTERRUPT]      = handle_external_interrupt,
 	[EXIT_REASON_CPUID]                   = handle_cpuid,
   [EXIT_REASON_IO_INSTRUCTION]          = handle_io,
   [EXIT_REASON_MSR_READ]                = handle_rdmsr,
   [EXIT_REASON_MSR_WRITE]               = handle_wrmsr,
+  [EXIT_REASON_RDPMC]                   = handle_rdpmc,
   [EXIT_REASON_EPT_VIOLATION]           = handle_ept_violation,
+  [EXIT_REASON_EPT_MISCONFIG]           = handle_ept_misconfig,
   [EXIT_REASON_PREEMPTION_TIMER]        = handle_preemption_timer,
   [EXIT_REASON_APIC_ACCESS]             = handle_apic_access,
   [EXIT_REASON_PENDING_INTERRUPT]       = handle_interrupt_window,
   [EXIT_REASON_CR_ACCESS]               = handle_cr,
   [EXIT_REASON_DR_ACCESS]               = handle_dr,
+  [EXIT_REASON_MONITOR_TRAP_FLAG]       = handle_monitor_trap,
   [EXIT_REASON_TASK_SWITCH]             = handle_task_switch,
 };
 
@@ -478,79 +2528,165 @@ void init_host_values() {
   vmcs_writel(HOST_IA32_SYSENTER_ESP, rdmsr64(MSR_IA32_SYSENTER_ESP));
   vmcs_writel(HOST_IA32_SYSENTER_EIP, rdmsr64(MSR_IA32_SYSENTER_EIP));
 
-  // PERF_GLOBAL_CTRL, PAT, and EFER are all disabled
+  // PAT is disabled, pmu_load_guest fills in PERF_GLOBAL_CTRL
+  if (vmx_has_load_efer) vmcs_write64(HOST_IA32_EFER, rdmsr64(MSR_IA32_EFER));
 
   vmcs_writel(HOST_RIP, (unsigned long)&vmexit_handler);
   // HOST_RSP is set in run
 }
 
-static void vcpu_init(struct vcpu *vcpu) {
-  vmcs_write32(EXCEPTION_BITMAP, 0);
+// vmcs fields that don't depend on the vcpu, worked out once at load and
+// replayed by vcpu_init
+struct vmcs_field_value {
+  u32 field;
+  unsigned long value;
+};
 
-  vmcs_writel(EPT_POINTER, __pa(vcpu->pml4) | (3 << 3));
+#define VMCS_TEMPLATE_MAX 48
+static struct vmcs_field_value vmcs_template[VMCS_TEMPLATE_MAX];
+static unsigned int vmcs_template_count;
 
-  vcpu->virtual_apic_page = IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
-  vmcs_writel(VIRTUAL_APIC_PAGE_ADDR, __pa(vcpu->virtual_apic_page));
+static void vmcs_template_add(u32 field, unsigned long value) {
+  if (vmcs_template_count == VMCS_TEMPLATE_MAX) {
+    printf("vmcs template is full\n");
+    return;
+  }
+  vmcs_template[vmcs_template_count].field = field;
+  vmcs_template[vmcs_template_count].value = value;
+  vmcs_template_count++;
+}
 
-  vcpu->apic_access = IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
-  vmcs_writel(APIC_ACCESS_ADDR, __pa(vcpu->apic_access));
+static void vmcs_template_init() {
+  u32 exit, entry;
 
-  // right?
-  ept_add_page(vcpu, 0xfee00000, __pa(vcpu->apic_access));
+  vmcs_template_count = 0;
 
-  vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, PIN_BASED_ALWAYSON_WITHOUT_TRUE_MSR | PIN_BASED_NMI_EXITING | PIN_BASED_EXT_INTR_MASK);
-  //vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, (CPU_BASED_ALWAYSON_WITHOUT_TRUE_MSR) |
-  vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, (CPU_BASED_ALWAYSON_WITHOUT_TRUE_MSR & ~(CPU_BASED_CR3_LOAD_EXITING | CPU_BASED_CR3_STORE_EXITING)) |
-    CPU_BASED_TPR_SHADOW | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS | CPU_BASED_UNCOND_IO_EXITING | CPU_BASED_MOV_DR_EXITING);
-  vmcs_write32(SECONDARY_VM_EXEC_CONTROL, SECONDARY_EXEC_UNRESTRICTED_GUEST | SECONDARY_EXEC_ENABLE_EPT | SECONDARY_EXEC_VIRTUALIZE_APIC_ACCESSES);
+  vmcs_template_add(PIN_BASED_VM_EXEC_CONTROL, PIN_BASED_ALWAYSON_WITHOUT_TRUE_MSR | PIN_BASED_NMI_EXITING | PIN_BASED_EXT_INTR_MASK);
 
-  // better not include PAT, EFER, or PERF_GLOBAL
-  vmcs_write32(VM_EXIT_CONTROLS, VM_EXIT_ALWAYSON_WITHOUT_TRUE_MSR | VM_EXIT_HOST_ADDR_SPACE_SIZE);
-  vmcs_write32(VM_ENTRY_CONTROLS, VM_ENTRY_ALWAYSON_WITHOUT_TRUE_MSR);
+  // better not include PAT, EFER goes through the msr lists if the cpu can't switch it
+  exit = VM_EXIT_ALWAYSON_WITHOUT_TRUE_MSR | VM_EXIT_HOST_ADDR_SPACE_SIZE;
+  entry = VM_ENTRY_ALWAYSON_WITHOUT_TRUE_MSR;
+  if (vmx_has_load_efer) {
+    exit |= VM_EXIT_LOAD_IA32_EFER;
+    entry |= VM_ENTRY_LOAD_IA32_EFER;
+  }
+  // the host's counters stop at entry and start again at exit, and the guest's the other way round
+  if (vmx_has_load_perf_global) {
+    exit |= VM_EXIT_LOAD_IA32_PERF_GLOBAL_CTRL;
+    entry |= VM_ENTRY_LOAD_IA32_PERF_GLOBAL_CTRL;
+    vmcs_template_add(GUEST_IA32_PERF_GLOBAL_CTRL, 0);
+  }
+  vmcs_template_add(VM_EXIT_CONTROLS, exit);
+  vmcs_template_add(VM_ENTRY_CONTROLS, entry);
 
-  vmcs_write32(PAGE_FAULT_ERROR_CODE_MASK, 0);
-  vmcs_write32(PAGE_FAULT_ERROR_CODE_MATCH, 0);
-  vmcs_write32(CR3_TARGET_COUNT, 0);  // 0 is less than 4
-  
-  // because these are 0 we don't need addresses
-  vmcs_write32(VM_EXIT_MSR_STORE_COUNT, 0);
-  vmcs_write32(VM_EXIT_MSR_LOAD_COUNT, 0);
-  vmcs_write32(VM_ENTRY_MSR_LOAD_COUNT, 0);
+  vmcs_template_add(PAGE_FAULT_ERROR_CODE_MASK, 0);
+  vmcs_template_add(PAGE_FAULT_ERROR_CODE_MATCH, 0);
+  vmcs_template_add(CR3_TARGET_COUNT, 0);  // 0 is less than 4
+
+  vmcs_template_add(VM_EXIT_MSR_STORE_COUNT, NR_SWITCHED_MSRS);
+  vmcs_template_add(VM_EXIT_MSR_LOAD_COUNT, NR_SWITCHED_MSRS);
+  vmcs_template_add(VM_ENTRY_MSR_LOAD_COUNT, NR_SWITCHED_MSRS);
 
   // VMCS shadowing isn't set, from 24.4
-  vmcs_write64(VMCS_LINK_POINTER, ~0LL);
-  vmcs_write64(GUEST_IA32_DEBUGCTL, 0);
+  vmcs_template_add(VMCS_LINK_POINTER, ~0UL);
+  vmcs_template_add(GUEST_IA32_DEBUGCTL, 0);
+  vmcs_template_add(GUEST_DR7, DR7_FIXED_1);
 
-  vmcs_write64(VM_EXIT_MSR_STORE_ADDR, ~0LL);
-  vmcs_write64(VM_EXIT_MSR_LOAD_ADDR, ~0LL);
-  vmcs_write64(VM_ENTRY_MSR_LOAD_ADDR, ~0LL);
-  //vmcs_write64(EPT_POINTER, ~0LL);
+  vmcs_template_add(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
+  vmcs_template_add(VM_ENTRY_INSTRUCTION_LEN, 0);
+  vmcs_template_add(TPR_THRESHOLD, 0);
+
+  vmcs_template_add(CR0_READ_SHADOW, 0);
+  vmcs_template_add(CR4_READ_SHADOW, 0);
+
+  vmcs_template_add(CR3_TARGET_VALUE0, 0);
+  vmcs_template_add(CR3_TARGET_VALUE1, 0);
+  vmcs_template_add(CR3_TARGET_VALUE2, 0);
+  vmcs_template_add(CR3_TARGET_VALUE3, 0);
+
+  vmcs_template_add(GUEST_PENDING_DBG_EXCEPTIONS, 0);
+
+  vmcs_template_add(GUEST_INTERRUPTIBILITY_INFO, 0);
+  vmcs_template_add(GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_ACTIVE);
+
+  vmcs_template_add(VMX_PREEMPTION_TIMER_VALUE, 0);
+
+  vmcs_template_add(GUEST_SYSENTER_CS, rdmsr64(MSR_IA32_SYSENTER_CS));
+  vmcs_template_add(GUEST_SYSENTER_ESP, rdmsr64(MSR_IA32_SYSENTER_ESP));
+  vmcs_template_add(GUEST_SYSENTER_EIP, rdmsr64(MSR_IA32_SYSENTER_EIP));
+}
+
+// kernel gs base belongs to the thread, so refresh these on every entry
+static void save_host_msrs(struct vcpu *vcpu) {
+  unsigned int i;
+  for (i = 0; i < NR_SWITCHED_MSRS; i++) {
+    vcpu->host_msrs[i].value = rdmsr64(vcpu->host_msrs[i].index);
+  }
+}
+
+static void vcpu_init(struct vcpu *vcpu) {
+  unsigned int i;
+  u32 cpu_based = CPU_BASED_ALWAYSON_WITHOUT_TRUE_MSR |
+    CPU_BASED_TPR_SHADOW | CPU_BASED_ACTIVATE_SECONDARY_CONTROLS | CPU_BASED_UNCOND_IO_EXITING | CPU_BASED_MOV_DR_EXITING |
+    CPU_BASED_USE_MSR_BITMAPS | CPU_BASED_RDPMC_EXITING;
+  u32 secondary = SECONDARY_EXEC_VIRTUALIZE_APIC_ACCESSES;
+
+  // debug registers at reset, mov dr exiting stays on until the guest uses them
+  vcpu->guest_dr6 = DR6_FIXED_1;
+  vcpu->guest_dr7 = DR7_FIXED_1;
+
+  if (vcpu->shadow) {
+    // guest page faults and cr3 go through the shadow mmu
+    update_exception_bitmap(vcpu);
+    if (vcpu->vpid != 0) {
+      vmcs_write16(VIRTUAL_PROCESSOR_ID, vcpu->vpid);
+      secondary |= SECONDARY_EXEC_ENABLE_VPID;
+    }
+  } else {
+    update_exception_bitmap(vcpu);
+    vmcs_writel(EPT_POINTER, __pa(vcpu->pml4) | (3 << 3));
+    cpu_based &= ~(CPU_BASED_CR3_LOAD_EXITING | CPU_BASED_CR3_STORE_EXITING);
+    secondary |= SECONDARY_EXEC_UNRESTRICTED_GUEST | SECONDARY_EXEC_ENABLE_EPT;
+  }
 
-  vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, 0);
-  vmcs_write32(VM_ENTRY_INSTRUCTION_LEN, 0);
-  vmcs_write32(TPR_THRESHOLD, 0);
+  // the apic pages come with the vcpu from the pool
+  vmcs_writel(VIRTUAL_APIC_PAGE_ADDR, __pa(vcpu->virtual_apic_page));
+  vmcs_writel(APIC_ACCESS_ADDR, __pa(vcpu->apic_access));
 
-  vmcs_write64(CR0_GUEST_HOST_MASK, (1 << 31));
-  vmcs_write64(CR0_READ_SHADOW, 0);
+  // right?
+  ept_add_page(vcpu, 0xfee00000, __pa(vcpu->apic_access));
 
-  vmcs_write64(CR4_GUEST_HOST_MASK, (1 << 13));  // guest can't disable vm
-  vmcs_write64(CR4_READ_SHADOW, 0);
+  vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, cpu_based);
+  vmcs_write32(SECONDARY_VM_EXEC_CONTROL, secondary);
 
-  vmcs_write64(CR3_TARGET_VALUE0, 0);
-  vmcs_write64(CR3_TARGET_VALUE1, 0);
-  vmcs_write64(CR3_TARGET_VALUE2, 0);
-  vmcs_write64(CR3_TARGET_VALUE3, 0);
+  // everything that's the same for every vcpu
+  for (i = 0; i < vmcs_template_count; i++) {
+    vmcs_writel(vmcs_template[i].field, vmcs_template[i].value);
+  }
 
-  vmcs_write64(GUEST_PENDING_DBG_EXCEPTIONS, 0);
+  // syscall msrs are swapped by the cpu, the guest values are stored back on exit
+  for (i = 0; i < NR_SWITCHED_MSRS; i++) {
+    vcpu->guest_msrs[i].index = vcpu->host_msrs[i].index = vmx_switched_msrs[i];
+  }
+  vmcs_write64(VM_EXIT_MSR_STORE_ADDR, __pa(vcpu->guest_msrs));
+  vmcs_write64(VM_EXIT_MSR_LOAD_ADDR, __pa(vcpu->host_msrs));
+  vmcs_write64(VM_ENTRY_MSR_LOAD_ADDR, __pa(vcpu->guest_msrs));
+  //vmcs_write64(EPT_POINTER, ~0LL);
 
-  vmcs_write32(GUEST_INTERRUPTIBILITY_INFO, 0); 
-  vmcs_write32(GUEST_ACTIVITY_STATE, GUEST_ACTIVITY_ACTIVE); 
+  // everything exits until the guest turns its counters on
+  vmcs_write64(MSR_BITMAP, __pa(vcpu->msr_bitmap));
 
-  vmcs_writel(VMX_PREEMPTION_TIMER_VALUE, 0);
+  if (vcpu->shadow) {
+    vmcs_write64(CR0_GUEST_HOST_MASK, SHADOW_CR0_MASK);
+    vmcs_write64(CR4_GUEST_HOST_MASK, SHADOW_CR4_MASK);
+  } else {
+    vmcs_write64(CR0_GUEST_HOST_MASK, (1 << 31));
+    vmcs_write64(CR4_GUEST_HOST_MASK, (1 << 13));  // guest can't disable vm
+  }
 
-  vmcs_writel(GUEST_SYSENTER_CS, rdmsr64(MSR_IA32_SYSENTER_CS));
-  vmcs_writel(GUEST_SYSENTER_ESP, rdmsr64(MSR_IA32_SYSENTER_ESP));
-  vmcs_writel(GUEST_SYSENTER_EIP, rdmsr64(MSR_IA32_SYSENTER_EIP));
+  // starts out of long mode
+  vcpu->efer = 0;
+  kvm_update_efer(vcpu);
 }
 
 
@@ -597,7 +2733,6 @@ int kvm_set_regs(struct vcpu *vcpu, struct kvm_regs* kvm_regs) {
   vcpu->regs[VCPU_REGS_R14] = kvm_regs->r14; vcpu->regs[VCPU_REGS_R15] = kvm_regs->r15;
 
   vcpu->regs[VCPU_REGS_RIP] = kvm_regs->rip;
-  printf("setting rip: %llx\n", kvm_regs->rip);
 
   vcpu->rflags = kvm_regs->rflags;
   return 0;
@@ -606,10 +2741,16 @@ int kvm_set_regs(struct vcpu *vcpu, struct kvm_regs* kvm_regs) {
 int kvm_get_sregs(struct vcpu *vcpu, struct kvm_sregs *sregs) {
   LOAD_VMCS(vcpu);
 
-  sregs->cr0 = vmcs_readl(GUEST_CR0);
+  if (vcpu->shadow) {
+    sregs->cr0 = vcpu->guest_cr0;
+    sregs->cr3 = vcpu->cr3_shadow;
+    sregs->cr4 = vcpu->guest_cr4;
+  } else {
+    sregs->cr0 = vmcs_readl(GUEST_CR0);
+    sregs->cr3 = vmcs_readl(GUEST_CR3);
+    sregs->cr4 = vmcs_readl(GUEST_CR4);
+  }
   sregs->cr2 = vcpu->cr2;
-  sregs->cr3 = vmcs_readl(GUEST_CR3);
-  sregs->cr4 = vmcs_readl(GUEST_CR4);
 
   // guest segment registers
 	kvm_get_segment(vcpu, &sregs->cs, VCPU_SREG_CS);
@@ -627,7 +2768,7 @@ int kvm_get_sregs(struct vcpu *vcpu, struct kvm_sregs *sregs) {
   sregs->gdt.limit = vmcs_read32(GUEST_GDTR_LIMIT);
   sregs->gdt.base = vmcs_readl(GUEST_GDTR_BASE);
 
-  sregs->efer = vmcs_readl(GUEST_IA32_EFER);
+  sregs->efer = vcpu->efer;
   //sregs->apic_base = vmcs_readl(VIRTUAL_APIC_PAGE_ADDR);
 
   RELEASE_VMCS(vcpu);
@@ -644,37 +2785,148 @@ int kvm_set_sregs(struct vcpu *vcpu, struct kvm_sregs *sregs) {
   printf("cr3 %lx %lx\n", sregs->cr3, vmcs_readl(GUEST_CR3));
   printf("cr4 %lx %lx\n", sregs->cr4, vmcs_readl(GUEST_CR4));*/
 
-  vmcs_writel(GUEST_CR0, sregs->cr0 | 0x20);
   vcpu->cr2 = sregs->cr2;
-  vmcs_writel(GUEST_CR3, sregs->cr3);
-  vmcs_writel(GUEST_CR4, sregs->cr4 | (1<<13));
+  // lma gets worked out from this and cr0.pg
+  vcpu->efer = sregs->efer;
+  if (vcpu->shadow) {
+    // GUEST_CR3 gets pointed at a shadow root before the next entry
+    vcpu->cr3_shadow = sregs->cr3;
+    shadow_set_cr0(vcpu, sregs->cr0);
+    shadow_set_cr4(vcpu, sregs->cr4);
+    shadow_reset(vcpu);
+  } else {
+    vmcs_writel(GUEST_CR0, sregs->cr0 | 0x20);
+    vmcs_writel(GUEST_CR3, sregs->cr3);
+    vmcs_writel(GUEST_CR4, sregs->cr4 | (1<<13));
+    kvm_update_efer(vcpu);
+  }
+
+  // sysenter msrs?
+
+  // guest segment registers
+	kvm_set_segment(vcpu, &sregs->cs, VCPU_SREG_CS);
+	kvm_set_segment(vcpu, &sregs->ss, VCPU_SREG_SS);
+	kvm_set_segment(vcpu, &sregs->ds, VCPU_SREG_DS);
+	kvm_set_segment(vcpu, &sregs->es, VCPU_SREG_ES);
+	kvm_set_segment(vcpu, &sregs->fs, VCPU_SREG_FS);
+	kvm_set_segment(vcpu, &sregs->gs, VCPU_SREG_GS);
+	kvm_set_segment(vcpu, &sregs->tr, VCPU_SREG_TR);
+	kvm_set_segment(vcpu, &sregs->ldt, VCPU_SREG_LDTR);
+
+  // idtr and gdtr
+  vmcs_write32(GUEST_IDTR_LIMIT, sregs->idt.limit);
+  vmcs_writel(GUEST_IDTR_BASE, sregs->idt.base);
+  vmcs_write32(GUEST_GDTR_LIMIT, sregs->gdt.limit);
+  vmcs_writel(GUEST_GDTR_BASE, sregs->gdt.base);
+  RELEASE_VMCS(vcpu);
+
+  //vmcs_writel(VIRTUAL_APIC_PAGE_ADDR, sregs->apic_base);
+	return 0;
+}
+
+int kvm_get_vcpu_events(struct vcpu *vcpu, struct kvm_vcpu_events *events) {
+  u32 intr_info, interruptibility;
+
+  LOAD_VMCS(vcpu);
+  intr_info = vmcs_read32(VM_ENTRY_INTR_INFO_FIELD);
+  interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
+  bzero(events, sizeof(struct kvm_vcpu_events));
+
+  // anything still queued for the next entry
+  if (intr_info & INTR_INFO_VALID_MASK) {
+    if ((intr_info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_HARD_EXCEPTION) {
+      events->exception.injected = 1;
+      events->exception.nr = intr_info & INTR_INFO_VECTOR_MASK;
+      events->exception.has_error_code = (intr_info & INTR_INFO_DELIVER_CODE_MASK) != 0;
+      events->exception.error_code = vmcs_read32(VM_ENTRY_EXCEPTION_ERROR_CODE);
+    } else if ((intr_info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_NMI_INTR) {
+      events->nmi.injected = 1;
+    } else {
+      events->interrupt.injected = 1;
+      events->interrupt.nr = intr_info & INTR_INFO_VECTOR_MASK;
+      events->interrupt.soft = (intr_info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_SOFT_INTR;
+    }
+  }
+  if (interruptibility & GUEST_INTR_STATE_STI) events->interrupt.shadow |= KVM_X86_SHADOW_INT_STI;
+  if (interruptibility & GUEST_INTR_STATE_MOV_SS) events->interrupt.shadow |= KVM_X86_SHADOW_INT_MOV_SS;
+  events->nmi.masked = (interruptibility & GUEST_INTR_STATE_NMI) != 0;
+  events->nmi.pending = vcpu->pending_nmi;
+  events->flags = KVM_VCPUEVENT_VALID_SHADOW | KVM_VCPUEVENT_VALID_NMI_PENDING;
+  RELEASE_VMCS(vcpu);
+
+  return 0;
+}
+
+int kvm_set_vcpu_events(struct vcpu *vcpu, struct kvm_vcpu_events *events) {
+  u32 interruptibility;
+
+  LOAD_VMCS(vcpu);
+  if (events->exception.injected) {
+    vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | INTR_TYPE_HARD_EXCEPTION | events->exception.nr |
+      (events->exception.has_error_code ? INTR_INFO_DELIVER_CODE_MASK : 0));
+    vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, events->exception.error_code);
+  } else if (events->nmi.injected) {
+    vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | INTR_TYPE_NMI_INTR | 2);
+  } else if (events->interrupt.injected) {
+    vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, INTR_INFO_VALID_MASK | events->interrupt.nr |
+      (events->interrupt.soft ? INTR_TYPE_SOFT_INTR : INTR_TYPE_EXT_INTR));
+    vmcs_write32(VM_ENTRY_INSTRUCTION_LEN, vcpu->exit_instruction_len);
+  } else {
+    vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, 0);
+  }
+
+  interruptibility = vmcs_read32(GUEST_INTERRUPTIBILITY_INFO);
+  if (events->flags & KVM_VCPUEVENT_VALID_SHADOW) {
+    interruptibility &= ~(GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS);
+    if (events->interrupt.shadow & KVM_X86_SHADOW_INT_STI) interruptibility |= GUEST_INTR_STATE_STI;
+    if (events->interrupt.shadow & KVM_X86_SHADOW_INT_MOV_SS) interruptibility |= GUEST_INTR_STATE_MOV_SS;
+  }
+  if (events->flags & KVM_VCPUEVENT_VALID_NMI_PENDING) vcpu->pending_nmi = events->nmi.pending;
+  if (events->nmi.masked) interruptibility |= GUEST_INTR_STATE_NMI;
+  else interruptibility &= ~GUEST_INTR_STATE_NMI;
+  vmcs_write32(GUEST_INTERRUPTIBILITY_INFO, interruptibility);
+  RELEASE_VMCS(vcpu);
+
+  return 0;
+}
 
-  // sysenter msrs?
+// pick up whatever userspace changed in the kvm_run page since the last exit
+static int kvm_sync_regs_in(struct vcpu *vcpu) {
+  struct kvm_run *run = vcpu->kvm_vcpu;
 
-  // guest segment registers
-	kvm_set_segment(vcpu, &sregs->cs, VCPU_SREG_CS);
-	kvm_set_segment(vcpu, &sregs->ss, VCPU_SREG_SS);
-	kvm_set_segment(vcpu, &sregs->ds, VCPU_SREG_DS);
-	kvm_set_segment(vcpu, &sregs->es, VCPU_SREG_ES);
-	kvm_set_segment(vcpu, &sregs->fs, VCPU_SREG_FS);
-	kvm_set_segment(vcpu, &sregs->gs, VCPU_SREG_GS);
-	kvm_set_segment(vcpu, &sregs->tr, VCPU_SREG_TR);
-	kvm_set_segment(vcpu, &sregs->ldt, VCPU_SREG_LDTR);
+  if ((run->kvm_valid_regs | run->kvm_dirty_regs) & ~KVM_SYNC_X86_VALID_FIELDS) return EINVAL;
 
-  // idtr and gdtr
-  vmcs_write32(GUEST_IDTR_LIMIT, sregs->idt.limit);
-  vmcs_writel(GUEST_IDTR_BASE, sregs->idt.base);
-  vmcs_write32(GUEST_GDTR_LIMIT, sregs->gdt.limit);
-  vmcs_writel(GUEST_GDTR_BASE, sregs->gdt.base);
+  if (run->kvm_dirty_regs & KVM_SYNC_X86_REGS) kvm_set_regs(vcpu, &run->s.regs.regs);
+  if (run->kvm_dirty_regs & KVM_SYNC_X86_SREGS) kvm_set_sregs(vcpu, &run->s.regs.sregs);
+  if (run->kvm_dirty_regs & KVM_SYNC_X86_EVENTS) kvm_set_vcpu_events(vcpu, &run->s.regs.events);
+  run->kvm_dirty_regs = 0;
+  return 0;
+}
 
-  vmcs_writel(GUEST_IA32_EFER, sregs->efer);
-  RELEASE_VMCS(vcpu);
+// copy out the classes userspace asked for, saves it a GET ioctl per exit
+static void kvm_sync_regs_out(struct vcpu *vcpu) {
+  struct kvm_run *run = vcpu->kvm_vcpu;
 
-  printf("apic base: %llx\n", sregs->apic_base);
-  //vmcs_writel(VIRTUAL_APIC_PAGE_ADDR, sregs->apic_base);
-	return 0;
+  if (run->kvm_valid_regs & KVM_SYNC_X86_REGS) kvm_get_regs(vcpu, &run->s.regs.regs);
+  if (run->kvm_valid_regs & KVM_SYNC_X86_SREGS) kvm_get_sregs(vcpu, &run->s.regs.sregs);
+  if (run->kvm_valid_regs & KVM_SYNC_X86_EVENTS) kvm_get_vcpu_events(vcpu, &run->s.regs.events);
 }
 
+// the asm gets these as immediates so they're always right, these keep them
+// short to encode and on the lines the rest of the exit path touches anyway
+BUILD_ASSERT(offsetof(struct vcpu, regs[VCPU_REGS_RAX]) == 0);
+BUILD_ASSERT(offsetof(struct vcpu, regs[VCPU_REGS_R15]) < 128);
+BUILD_ASSERT(offsetof(struct vcpu, cr2) < VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, __launched) < VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, fail) < VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, host_rsp) < VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, host_gdtr) + sizeof(struct dtr) <= VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, host_idtr) + sizeof(struct dtr) <= VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(offsetof(struct vcpu, host_ldtr) + sizeof(unsigned short) <= VCPU_HOT_LINES * CACHE_LINE);
+// and the hot block still ends where the cold part starts
+BUILD_ASSERT(offsetof(struct vcpu, pmu) == VCPU_HOT_LINES * CACHE_LINE);
+BUILD_ASSERT(__alignof__(struct vcpu) == CACHE_LINE);
+
 void kvm_run(struct vcpu *vcpu) {
   // all the pages go bye bye?
   //__invept(VMX_EPT_EXTENT_GLOBAL, 0, 0);
@@ -689,6 +2941,9 @@ void kvm_run(struct vcpu *vcpu) {
 
   asm volatile ("cli\n\t");
   init_host_values();
+  save_host_msrs(vcpu);
+  pmu_load_guest(vcpu);
+  debug_load_guest(vcpu);
 
 	asm(
 		/* Store host registers */
@@ -809,32 +3064,421 @@ void kvm_run(struct vcpu *vcpu) {
 }
 
 static int kvm_set_user_memory_region(struct vcpu *vcpu, struct kvm_userspace_memory_region *mr) {
-  // check alignment
-  unsigned long off;
-  IOMemoryDescriptor *md = IOMemoryDescriptor::withAddressRange(mr->userspace_addr, mr->memory_size, kIODirectionInOut, current_task());
+  struct kvm_memslot *slot;
   DEBUG("MAPPING 0x%llx WITH FLAGS %x SLOT %d IN GUEST AT 0x%llx-0x%llx\n", mr->userspace_addr, mr->flags, mr->slot, mr->guest_phys_addr, mr->guest_phys_addr + mr->memory_size);
-  // wire in the memory
-  IOReturn ret = md->prepare(kIODirectionInOut);
-  if (ret != 0) {
-    printf("wire pages failed :(\n");
-    return EINVAL;
-  }
+
+  // check alignment
+  if ((mr->userspace_addr | mr->guest_phys_addr | mr->memory_size) & (PAGE_SIZE-1)) return EINVAL;
+  if (mr->slot >= KVM_MAX_MEMSLOTS) return EINVAL;
+
+  // replacing or deleting a slot drops everything we had wired for it
+  slot = &vcpu->memslots[mr->slot];
+  memslot_free(vcpu, slot);
+  // mmio marks are checked against this on their next exit
+  vcpu->memslot_gen++;
+  // shadow entries point straight at host pages, drop them with the slot
+  shadow_reset(vcpu);
+  if (mr->memory_size == 0) return 0;
 
   // TODO: support KVM_MEM_READONLY
-  for (off = 0; off < mr->memory_size; off += PAGE_SIZE) {
-    unsigned long va = mr->userspace_addr + off;
-    addr64_t pa = md->getPhysicalSegment(off, NULL, kIOMemoryMapperNone);
-    if (pa != 0) {
-      ept_add_page(vcpu, mr->guest_phys_addr + off, pa);
-    } else {
-      printf("couldn't find vpage %lx\n", va);
+  // nothing is wired here, pages come in on the first ept violation so the
+  // host keeps the rest pageable and the balloon can give them back
+  slot->pages = (IOMemoryDescriptor **)IOMalloc((mr->memory_size >> PAGE_SHIFT) * sizeof(IOMemoryDescriptor *));
+  if (slot->pages == NULL) return ENOMEM;
+  bzero(slot->pages, (mr->memory_size >> PAGE_SHIFT) * sizeof(IOMemoryDescriptor *));
+  slot->base_gfn = mr->guest_phys_addr >> PAGE_SHIFT;
+  slot->npages = mr->memory_size >> PAGE_SHIFT;
+  slot->userspace_addr = mr->userspace_addr;
+  slot->flags = mr->flags;
+
+  if (mr->flags & KVM_MEM_SHARE_ZERO) {
+    slot->zero_bitmap = (unsigned long *)IOCalloc(ZERO_BITMAP_SIZE(slot->npages));
+    if (slot->zero_bitmap == NULL) {
+      memslot_free(vcpu, slot);
+      return ENOMEM;
+    }
+  }
+
+  return 0;
+}
+
+static int kvm_balloon_op(struct vcpu *vcpu, struct kvm_balloon_op *op) {
+  struct kvm_balloon_range range;
+  struct kvm_memslot *slot;
+  unsigned int i;
+  unsigned long idx;
+  int ret = 0, unshared = 0;
+
+  op->npages = 0;
+  for (i = 0; i < op->nranges; i++) {
+    if (copyin(op->self + offsetof(struct kvm_balloon_op, ranges) + i * sizeof(range), &range, sizeof(range))) {
+      ret = EFAULT;
+      break;
+    }
+    // each range has to sit inside one slot, earlier ranges stay released
+    slot = range_to_memslot(vcpu, range.gfn, range.npages);
+    if (slot == NULL) {
+      ret = EINVAL;
+      break;
+    }
+    for (idx = range.gfn - slot->base_gfn; idx < range.gfn - slot->base_gfn + range.npages; idx++) {
+      unshared |= memslot_unshare_page(vcpu, slot, idx);
+      if (slot->pages[idx] == NULL) continue;
+      memslot_release_page(vcpu, slot, idx);
+      op->npages++;
+    }
+  }
+  if (op->npages != 0 || unshared) shadow_reset(vcpu);
+
+  return ret;
+}
+
+// userspace is about to write guest memory the guest may be reading as zeros
+static int kvm_unshare_zero(struct vcpu *vcpu, struct kvm_balloon_range *range) {
+  struct kvm_memslot *slot = range_to_memslot(vcpu, range->gfn, range->npages);
+  unsigned long idx;
+  int unshared = 0;
+  if (slot == NULL) return EINVAL;
+  for (idx = range->gfn - slot->base_gfn; idx < range->gfn - slot->base_gfn + range->npages; idx++)
+    unshared |= memslot_unshare_page(vcpu, slot, idx);
+  // shadow entries point straight at the zero page, drop them too
+  if (unshared && vcpu->shadow) shadow_reset(vcpu);
+  return 0;
+}
+
+// where userspace mapped gpa, ioctls run in the vm's process so copyin can read it
+static int guest_gpa_to_uaddr(struct vcpu *vcpu, unsigned long gpa, user_addr_t *uaddr) {
+  struct kvm_memslot *slot = gfn_to_memslot(vcpu, gpa >> PAGE_SHIFT);
+  if (slot == NULL) return ENXIO;
+  *uaddr = slot->userspace_addr + gpa - (slot->base_gfn << PAGE_SHIFT);
+  return 0;
+}
+
+// guest_walk for introspection: the tables are read through userspace's
+// mapping, nothing gets wired and accessed and dirty bits stay as they are
+static int guest_translate(struct vcpu *vcpu, u32 paging, unsigned long cr3, unsigned long va, struct kvm_translation *tr) {
+  int level, levels, bits, size;
+  unsigned long table;
+  user_addr_t uaddr;
+  u64 pte;
+
+  tr->physical_address = 0;
+  tr->valid = 0;
+  tr->writeable = tr->usermode = 1;
+
+  switch (paging) {
+    case KVM_PAGING_NONE:
+      tr->physical_address = va;
+      tr->valid = 1;
+      return 0;
+    case KVM_PAGING_LONG:
+      levels = 4; bits = 9; size = 8;
+      table = cr3 & PT64_ADDR_MASK;
+      break;
+    case KVM_PAGING_PAE:
+      levels = 3; bits = 9; size = 8;
+      table = cr3 & ~0x1fUL;
+      va &= 0xffffffffUL;
+      break;
+    case KVM_PAGING_32:
+    case KVM_PAGING_32_PSE:
+      levels = 2; bits = 10; size = 4;
+      table = cr3 & PT32_ADDR_MASK;
+      va &= 0xffffffffUL;
+      break;
+    default:
       return EINVAL;
+  }
+
+  for (level = levels; level >= 1; level--) {
+    int shift = PAGE_SHIFT + bits * (level - 1);
+    // a table outside ram maps nothing
+    if (guest_gpa_to_uaddr(vcpu, table + ((va >> shift) & ((1UL << bits) - 1)) * size, &uaddr) != 0) return 0;
+    pte = 0;
+    if (copyin(uaddr, &pte, size) != 0) return EFAULT;
+    if (!(pte & PT_PRESENT_MASK)) return 0;
+
+    // pae pdptes have no permission bits
+    if (levels == 3 && level == 3) {
+      table = pte & PT64_ADDR_MASK;
+      continue;
+    }
+
+    tr->writeable &= (pte & PT_WRITABLE_MASK) != 0;
+    tr->usermode &= (pte & PT_USER_MASK) != 0;
+
+    if ((level == 2 || (levels == 4 && level == 3)) && (pte & PT_PAGE_SIZE_MASK) && (size == 8 || paging == KVM_PAGING_32_PSE)) {
+      unsigned long base = (size == 8) ? (pte & PT64_ADDR_MASK & ~((1UL << shift) - 1)) : (pte & PT32_LARGE_ADDR_MASK);
+      tr->physical_address = base + (va & ((1UL << shift) - 1));
+      tr->valid = 1;
+      return 0;
+    }
+
+    table = pte & ((size == 8) ? PT64_ADDR_MASK : PT32_ADDR_MASK);
+  }
+
+  tr->physical_address = table + (va & (PAGE_SIZE-1));
+  tr->valid = 1;
+  return 0;
+}
+
+// in whatever paging mode the vcpu is in, under the ioctl lock like the other vcpu ioctls
+static int kvm_translate(struct vcpu *vcpu, struct kvm_translation *tr) {
+  unsigned long cr0, cr3, cr4;
+  u32 entry, paging;
+
+  LOAD_VMCS(vcpu);
+  if (vcpu->shadow) {
+    cr0 = vcpu->guest_cr0;
+    cr3 = vcpu->cr3_shadow;
+    cr4 = vcpu->guest_cr4;
+  } else {
+    cr0 = vmcs_readl(GUEST_CR0);
+    cr3 = vmcs_readl(GUEST_CR3);
+    cr4 = vmcs_readl(GUEST_CR4);
+  }
+  // the cpu keeps this in step with efer.lma on every exit
+  entry = vmcs_read32(VM_ENTRY_CONTROLS);
+  RELEASE_VMCS(vcpu);
+
+  if (!(cr0 & X86_CR0_PG)) paging = KVM_PAGING_NONE;
+  else if (entry & VM_ENTRY_IA32E_MODE) paging = KVM_PAGING_LONG;
+  else if (cr4 & X86_CR4_PAE) paging = KVM_PAGING_PAE;
+  else if (cr4 & X86_CR4_PSE) paging = KVM_PAGING_32_PSE;
+  else paging = KVM_PAGING_32;
+
+  return guest_translate(vcpu, paging, cr3, tr->linear_address, tr);
+}
+
+// one entry of KVM_TRANSLATE_READ, a page at a time since each one is translated on its own
+static int kvm_translate_read_one(struct vcpu *vcpu, struct kvm_translate_read *req, struct kvm_translate_read_entry *e, void *buf) {
+  struct kvm_translation tr;
+  unsigned long va = e->gva, n;
+  user_addr_t uaddr;
+  u32 done = 0;
+  int r;
+
+  e->gpa = 0;
+  e->writeable = e->usermode = 0;
+  r = guest_translate(vcpu, req->paging, req->cr3, va, &tr);
+  if (r == 0 && !tr.valid) r = ENOENT;
+  if (r == 0) {
+    e->gpa = tr.physical_address;
+    e->writeable = tr.writeable;
+    e->usermode = tr.usermode;
+  }
+
+  while (r == 0 && done < e->len) {
+    if (done != 0) {
+      r = guest_translate(vcpu, req->paging, req->cr3, va, &tr);
+      if (r != 0) break;
+      if (!tr.valid) {
+        r = ENOENT;
+        break;
+      }
+    }
+    n = PAGE_SIZE - (va & (PAGE_SIZE-1));
+    if (n > e->len - done) n = e->len - done;
+    r = guest_gpa_to_uaddr(vcpu, tr.physical_address, &uaddr);
+    if (r != 0) break;
+    if (copyin(uaddr, buf, n) != 0 || copyout(buf, e->addr + done, n) != 0) {
+      r = EFAULT;
+      break;
+    }
+    done += n;
+    va += n;
+  }
+
+  e->len = done;
+  return r;
+}
+
+// called with mem_lock instead of the ioctl lock, so it doesn't wait for KVM_RUN to come back
+static int kvm_translate_read(struct vcpu *vcpu, struct kvm_translate_read *req) {
+  struct kvm_translate_read_entry e;
+  user_addr_t addr;
+  int ret = 0;
+  u32 i;
+  void *buf;
+
+  if (req->nr > KVM_TRANSLATE_READ_MAX) return EINVAL;
+  if (req->paging > KVM_PAGING_LONG) return EINVAL;
+
+  // a page of bounce buffer, the data goes from one user address to another
+  buf = IOMalloc(PAGE_SIZE);
+  if (buf == NULL) return ENOMEM;
+  for (i = 0; i < req->nr; i++) {
+    addr = req->entries + i * sizeof(e);
+    if (copyin(addr, &e, sizeof(e)) != 0) {
+      ret = EFAULT;
+      break;
+    }
+    e.result = kvm_translate_read_one(vcpu, req, &e, buf);
+    if (copyout(&e, addr, sizeof(e)) != 0) {
+      ret = EFAULT;
+      break;
+    }
+  }
+  IOFree(buf, PAGE_SIZE);
+  return ret;
+}
+
+/* *********************** */
+/* mmio */
+/* *********************** */
+
+// reads the instruction through the guest's page tables, as much of it as is mapped
+static int mmio_fetch(struct vcpu *vcpu, unsigned long rip, u8 *buf, int len) {
+  struct kvm_translation tr;
+  user_addr_t uaddr;
+  int done = 0, n;
+
+  while (done < len) {
+    tr.linear_address = rip + done;
+    if (kvm_translate(vcpu, &tr) != 0 || !tr.valid) break;
+    n = PAGE_SIZE - ((rip + done) & (PAGE_SIZE-1));
+    if (n > len - done) n = len - done;
+    if (guest_gpa_to_uaddr(vcpu, tr.physical_address, &uaddr) != 0) break;
+    if (copyin(uaddr, buf + done, n) != 0) break;
+    done += n;
+  }
+  return done;
+}
+
+// the moves devices are driven with: mov to and from memory, mov of an
+// immediate and movzx. mode is the default operand and address size
+static int mmio_decode(const u8 *b, int n, int mode, struct mmio_insn *insn) {
+  int i = 0, opsize = mode == 2 ? 2 : 4, addr = mode, rex = 0;
+  int op, modrm, mod, rm, reg, imm = 0;
+
+  bzero(insn, sizeof(*insn));
+  for (; i < n; i++) {
+    if (b[i] == 0x66) opsize = mode == 2 ? 4 : 2;
+    else if (b[i] == 0x67) addr = mode == 4 ? 2 : 4;
+    // segment overrides and lock, the address is already known
+    else if (b[i] == 0x26 || b[i] == 0x2e || b[i] == 0x36 || b[i] == 0x3e || b[i] == 0x64 || b[i] == 0x65 || b[i] == 0xf0) continue;
+    else break;
+  }
+  if (mode == 8 && i < n && (b[i] & 0xf0) == 0x40) {
+    rex = b[i++];
+    if (rex & 8) opsize = 8;
+  }
+  if (i >= n) return EFAULT;
+  op = b[i++];
+  if (op == 0x0f) {
+    if (i >= n) return EFAULT;
+    op = 0x100 | b[i++];
+  }
+  if (i >= n) return EFAULT;
+  modrm = b[i++];
+  mod = modrm >> 6;
+  reg = ((modrm >> 3) & 7) | ((rex & 4) ? 8 : 0);
+  rm = modrm & 7;
+  // a register operand isn't an access
+  if (mod == 3) return EINVAL;
+
+  insn->reg = reg;
+  switch (op) {
+    case 0x88: insn->is_write = 1; insn->size = 1; break;
+    case 0x89: insn->is_write = 1; insn->size = opsize; break;
+    case 0x8a: insn->size = 1; break;
+    case 0x8b: insn->size = opsize; break;
+    case 0xc6: insn->is_write = 1; insn->size = 1; imm = 1; break;
+    case 0xc7: insn->is_write = 1; insn->size = opsize; imm = opsize == 2 ? 2 : 4; break;
+    case 0x1b6: insn->size = 1; insn->reg_size = opsize; break;
+    case 0x1b7: insn->size = 2; insn->reg_size = opsize; break;
+    default: return EOPNOTSUPP;
+  }
+  if (imm) {
+    // c6 and c7 are only mov with a 0 in reg
+    if ((reg & 7) != 0) return EOPNOTSUPP;
+    insn->reg = -1;
+  }
+  if (insn->reg_size == 0) insn->reg_size = insn->size;
+  // without a rex, byte registers 4-7 are ah, ch, dh and bh
+  if (insn->size == 1 && insn->reg_size == 1 && !rex && reg >= 4 && reg < 8) {
+    insn->reg = reg - 4;
+    insn->high_byte = 1;
+  }
+
+  // skip the rest of the address
+  if (addr == 2) {
+    if ((mod == 0 && rm == 6) || mod == 2) i += 2;
+    else if (mod == 1) i += 1;
+  } else {
+    if (rm == 4) {
+      if (i >= n) return EFAULT;
+      if (mod == 0 && (b[i] & 7) == 5) i += 4;
+      i++;
+    }
+    if ((mod == 0 && rm == 5) || mod == 2) i += 4;
+    else if (mod == 1) i += 1;
+  }
+  if (i + imm > n) return EFAULT;
+  if (imm == 1) insn->imm = b[i];
+  else if (imm == 2) insn->imm = *(const u16 *)(b + i);
+  else if (imm == 4) insn->imm = (u64)(long)*(const SInt32 *)(b + i);
+  insn->len = i + imm;
+  return 0;
+}
+
+// after the exit with interrupts on. fills in the KVM_EXIT_MMIO and steps
+// over the instruction, a read's value goes into the register on the next run
+static int kvm_mmio_exit(struct vcpu *vcpu) {
+  struct kvm_run *run = vcpu->kvm_vcpu;
+  struct mmio_insn *insn = &vcpu->mmio;
+  u8 buf[15];
+  u64 val, now;
+  int n, r;
+
+  n = mmio_fetch(vcpu, vcpu->mmio_rip, buf, sizeof(buf));
+  r = mmio_decode(buf, n, vcpu->mmio_mode, insn);
+  if (r != 0) {
+    // at most one a second for each vm
+    now = rdtsc64();
+    if (now - vcpu->mmio_warn_tsc >= tsc_frequency) {
+      vcpu->mmio_warn_tsc = now;
+      printf("can't emulate mmio at %lx rip %lx\n", vcpu->phys, vcpu->mmio_rip);
     }
+    run->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+    run->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+    // EOPNOTSUPP out of KVM_RUN reads as an unknown ioctl
+    return r == EOPNOTSUPP ? EINVAL : r;
   }
 
+  run->exit_reason = KVM_EXIT_MMIO;
+  run->mmio.phys_addr = vcpu->phys;
+  run->mmio.len = insn->size;
+  run->mmio.is_write = insn->is_write;
+  bzero(run->mmio.data, sizeof(run->mmio.data));
+  if (insn->is_write) {
+    if (insn->reg < 0) val = insn->imm;
+    else if (insn->high_byte) val = vcpu->regs[insn->reg] >> 8;
+    else val = vcpu->regs[insn->reg];
+    memcpy(run->mmio.data, &val, insn->size);
+  } else {
+    vcpu->mmio_read_pending = 1;
+  }
+  vcpu->regs[VCPU_REGS_RIP] += insn->len;
+  vcpu->stats.mmio_exits++;
   return 0;
 }
 
+// KVM_RUN after a read, userspace left the value in mmio.data
+static void kvm_mmio_complete(struct vcpu *vcpu) {
+  struct mmio_insn *insn = &vcpu->mmio;
+  unsigned long *reg = &vcpu->regs[insn->reg];
+  u64 val = 0;
+
+  memcpy(&val, vcpu->kvm_vcpu->mmio.data, insn->size);
+  if (insn->high_byte) *reg = (*reg & ~0xff00UL) | ((val & 0xff) << 8);
+  else if (insn->reg_size == 1) *reg = (*reg & ~0xffUL) | (val & 0xff);
+  else if (insn->reg_size == 2) *reg = (*reg & ~0xffffUL) | (val & 0xffff);
+  // 32 bit writes clear the top half
+  else if (insn->reg_size == 4) *reg = (u32)val;
+  else *reg = val;
+  vcpu->mmio_read_pending = 0;
+}
 
 static int kvm_get_supported_cpuid(struct kvm_cpuid2 *cpuid2) {
   int i;
@@ -850,6 +3494,7 @@ static int kvm_get_supported_cpuid(struct kvm_cpuid2 *cpuid2) {
     { .function = 4, .index = 1 },
     { .function = 4, .index = 2 },
     { .function = 4, .index = 3 },
+    { .function = 0xa },
     { .function = 0x80000000 },
     { .function = 0x80000001 },
     { .function = 0x80000002 },
@@ -872,6 +3517,7 @@ static int kvm_get_supported_cpuid(struct kvm_cpuid2 *cpuid2) {
         "=d"   (param[i].edx)
       : "a"    (param[i].function),
         "c"    (param[i].index));
+    if (param[i].function == 0xa) pmu_cpuid(&param[i].eax, &param[i].ebx, &param[i].ecx, &param[i].edx);
   }
 
   copyout(param, cpuid2->self + offsetof(struct kvm_cpuid2, entries), cpuid2->nent * sizeof(struct kvm_cpuid_entry2));
@@ -884,6 +3530,9 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
   int maxcont = 0;
   int cont = 1;
   unsigned int i;
+  int vector;
+  int ret;
+  u64 run_tsc;
   unsigned long val = 0;
 
   if (vcpu->pending_io) {
@@ -892,14 +3541,29 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
     vcpu->regs[VCPU_REGS_RAX] = val;
     vcpu->pending_io = 0;
   }
+  if (vcpu->mmio_read_pending) kvm_mmio_complete(vcpu);
 
 
   unsigned long exit_reason = 0;
   unsigned long error, entry_error;
   vcpu->kvm_vcpu->exit_reason = 0;
+
+  if (vcpu->shadow && !(vcpu->guest_cr0 & X86_CR0_PE)) {
+    // real mode needs unrestricted guest, which needs ept
+    printf("can't run real mode without unrestricted guest\n");
+    vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+    vcpu->kvm_vcpu->internal.suberror = KVM_INTERNAL_ERROR_EMULATION;
+    return 0;
+  }
   while (cont && (maxcont++) < 1000) {
     unsigned long intr_info = 0;
 
+    // out of cpu quota, wait for the next period before going back in
+    if ((ret = kvm_quota_wait(vcpu)) != 0) {
+      vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTR;
+      return ret;
+    }
+
     if (exit_reason == EXIT_REASON_PENDING_INTERRUPT) {
     //if (vcpu->rflags & (1 << 9)) {
       // interrupt injection?
@@ -917,15 +3581,32 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
           break;
         }
       }
+      // msis carry their own vector
+      if (intr_info == 0 && (vector = kvm_pop_vector(vcpu)) >= 0) {
+        intr_info = INTR_INFO_VALID_MASK | INTR_TYPE_EXT_INTR | vector;
+      }
     }
 
     LOAD_VMCS(vcpu);
+    if (vcpu->shadow && vcpu->smmu->reload) shadow_load_cr3(vcpu);
+    kvm_tlb_sync(vcpu);
+
+    // pmu overflow, goes ahead of interrupts when nothing else is queued
+    if (vcpu->pending_nmi && intr_info == 0 &&
+        !(vmcs_read32(VM_ENTRY_INTR_INFO_FIELD) & INTR_INFO_VALID_MASK) &&
+        !(vmcs_read32(GUEST_INTERRUPTIBILITY_INFO) & (GUEST_INTR_STATE_NMI | GUEST_INTR_STATE_STI | GUEST_INTR_STATE_MOV_SS))) {
+      intr_info = INTR_INFO_VALID_MASK | INTR_TYPE_NMI_INTR | 2;
+      vcpu->pending_nmi = 0;
+    }
 
     if (intr_info != 0) {
       vmcs_write32(VM_ENTRY_INTR_INFO_FIELD, intr_info);
+      if ((intr_info & INTR_INFO_INTR_TYPE_MASK) == INTR_TYPE_NMI_INTR) vcpu->stats.injected_nmis++;
+      else vcpu->stats.injected_irqs++;
     }
+    kvm_timer_arm(vcpu);
     
-    if (vcpu->pending_irq) {
+    if (kvm_irq_pending(vcpu)) {
       // set interrupt pending
       vmcs_write32(CPU_BASED_VM_EXEC_CONTROL, vmcs_read32(CPU_BASED_VM_EXEC_CONTROL) | CPU_BASED_VIRTUAL_INTR_PENDING);
     } else {
@@ -935,7 +3616,13 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
 
     //kvm_show_regs();
     // DISABLES INTERRUPTS!!!
+    run_tsc = rdtsc64();
     kvm_run(vcpu);
+    run_tsc = rdtsc64() - run_tsc;
+    vcpu->stats.guest_tsc += run_tsc;
+    vcpu->quota_used += run_tsc;
+    pmu_put_guest(vcpu);
+    debug_put_guest(vcpu);
 
     //printf("%lx %lx\n", vcpu->idtr.base, vcpu->gdtr.base);
     //printf("vmcs: %lx\n", vcpu->vmcs);
@@ -948,6 +3635,8 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
     entry_error = vmcs_read32(VM_ENTRY_EXCEPTION_ERROR_CODE);
 
     exit_reason = vmcs_read32(VM_EXIT_REASON);
+    if ((exit_reason & 0xffff) < KVM_STATS_EXIT_REASONS) vcpu->stats.exits[exit_reason & 0xffff]++;
+    kvm_prof_exit(vcpu, exit_reason);
 
     if (exit_reason < kvm_vmx_max_exit_handlers && kvm_vmx_exit_handlers[exit_reason] != NULL) {
       cont = kvm_vmx_exit_handlers[exit_reason](vcpu);
@@ -959,11 +3648,40 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
     asm volatile ("sti");
     // interrupt gets delivered here
 
-    if (exit_reason != EXIT_REASON_IO_INSTRUCTION &&
+    if (vcpu->pending_fault == PENDING_FAULT_MMIO || vcpu->pending_fault == PENDING_FAULT_MMIO_MARK) {
+      if (vcpu->pending_fault == PENDING_FAULT_MMIO_MARK) mmio_mark(vcpu, vcpu->phys >> PAGE_SHIFT);
+      vcpu->pending_fault = 0;
+      // exit_reason is already KVM_EXIT_INTERNAL_ERROR when it fails
+      return kvm_mmio_exit(vcpu);
+    }
+
+    if (vcpu->pending_fault) {
+      // demand faults don't count against the exit budget
+      maxcont--;
+      vcpu->stats.demand_faults++;
+      if (kvm_fault_in_page(vcpu, vcpu->phys, vcpu->pending_fault == PENDING_FAULT_WRITE) != 0) {
+        printf("couldn't fault in guest page %lx\n", vcpu->phys);
+        vcpu->kvm_vcpu->exit_reason = KVM_EXIT_INTERNAL_ERROR;
+        vcpu->pending_fault = 0;
+        cont = 0;
+        break;
+      }
+      vcpu->pending_fault = 0;
+      continue;
+    }
+
+    // shadow paging exits are too common to print
+    int shadow_exit = vcpu->shadow && (exit_reason == EXIT_REASON_EXCEPTION_NMI || exit_reason == EXIT_REASON_CR_ACCESS);
+    // and so are a debugger's, single stepping is one per instruction
+    int debug_exit = vcpu->guest_debug && (exit_reason == EXIT_REASON_EXCEPTION_NMI || exit_reason == EXIT_REASON_MONITOR_TRAP_FLAG);
+
+    if (!shadow_exit && !debug_exit &&
+        exit_reason != EXIT_REASON_IO_INSTRUCTION &&
         exit_reason != EXIT_REASON_PREEMPTION_TIMER &&
         exit_reason != EXIT_REASON_EXTERNAL_INTERRUPT &&
         exit_reason != EXIT_REASON_PENDING_INTERRUPT &&
         exit_reason != EXIT_REASON_TASK_SWITCH &&
+        exit_reason != EXIT_REASON_DR_ACCESS &&
         exit_reason != EXIT_REASON_CPUID) {
       printf("%3d -(%d,%d)- entry %ld exit %ld(0x%lx) error %ld phys 0x%lx    rip %lx  rsp %lx\n",
         maxcont, cpun, cpu_number(),
@@ -981,12 +3699,18 @@ static int kvm_run_wrapper(struct vcpu *vcpu) {
 }
 
 static int kvm_set_msrs(struct vcpu *vcpu, struct kvm_msrs *msrs) {
-  //int i;
+  int i;
   printf("got %d msrs at %p\n", msrs->nmsrs, msrs);
   vcpu->msr_count = msrs->nmsrs;
   vcpu->msrs = (struct kvm_msr_entry *)IOCalloc(vcpu->msr_count * sizeof(struct kvm_msr_entry));
   copyin(msrs->self + offsetof(struct kvm_msrs, entries), vcpu->msrs, vcpu->msr_count * sizeof(struct kvm_msr_entry));
 
+  LOAD_VMCS(vcpu);
+  for (i = 0; i < vcpu->msr_count; i++) {
+    kvm_set_msr(vcpu, vcpu->msrs[i].index, vcpu->msrs[i].data);
+  }
+  RELEASE_VMCS(vcpu);
+
   /*for (i = 0; i < vcpu->msr_count; i++) {
     printf("  got msr 0x%x = 0x%lx\n", vcpu->msrs[i].index, vcpu->msrs[i].data);
   }*/
@@ -1007,23 +3731,6 @@ static int kvm_set_cpuid2(struct vcpu *vcpu, struct kvm_cpuid2 *cpuid2) {
   return 0;
 }
 
-static int kvm_irq_line(struct vcpu *vcpu, struct kvm_irq_level *irq) {
-  //if (irq->level != 0) printf("irq %d = %d\n", irq->irq, irq->level);
-
-  // don't ask about the interrupt thing, i'm mad too
-
-  asm volatile ("cli");
-  if (irq->irq < IRQ_MAX) {
-    if (vcpu->irq_level[irq->irq] == 0 && irq->level == 1) {
-      // trigger on rising edge?
-      vcpu->pending_irq |= 1 << irq->irq;
-    }
-    vcpu->irq_level[irq->irq] = irq->level;
-  }
-  asm volatile ("sti");
-  return 0;
-}
-
 static int kvm_set_pit(struct vcpu *vcpu) {
   int channel;
   printf("KVM_SET_PIT\n");
@@ -1051,61 +3758,360 @@ static int kvm_set_irqchip(struct vcpu *vcpu) {
   return 0;
 }
 
-#define MSR_IA32_TSCDEADLINE            0x000006e0
-#define MSR_IA32_TSC_ADJUST             0x0000003b
+#define MSR_IA32_TSCDEADLINE            0x000006e0
+#define MSR_IA32_TSC_ADJUST             0x0000003b
+
+static int kvm_get_msr_index_list(struct kvm_msr_list *msr_list) {
+  static const u32 emulated_msrs[] = {
+    MSR_IA32_TSC_ADJUST,
+    MSR_IA32_TSCDEADLINE,
+    MSR_IA32_MISC_ENABLE,
+    MSR_IA32_MCG_STATUS,
+    MSR_IA32_MCG_CTL,
+  };
+
+  if (msr_list->nmsrs < ARRAY_SIZE(emulated_msrs)) return E2BIG;
+  msr_list->nmsrs = ARRAY_SIZE(emulated_msrs);
+
+  copyout(emulated_msrs, msr_list->self + offsetof(struct kvm_msr_list, indices), msr_list->nmsrs * sizeof(u32));
+  return 0;
+}
+
+
+/* *********************** */
+/* device functions */
+/* *********************** */
+
+struct state {
+  // linked list is fine, max 1 per process
+  struct state *next;
+  struct state *prev;
+  struct proc *process;
+  int open_count;
+
+  struct vcpu *vcpu;
+
+  IOLock *ioctl_lock;
+  IOLock *irq_lock;
+  // the memslots, KVM_TRANSLATE_READ reads them while KVM_RUN has the ioctl lock
+  IOLock *mem_lock;
+
+  lck_grp_attr_t *mp_lock_grp_attr;
+  lck_grp_t *mp_lock_grp;
+};
+
+IOLock *state_lock;
+struct state *head_of_state = NULL;
+
+// must be called with state_lock held
+struct state *state_find(struct proc *pProcess) {
+  struct state *state = head_of_state;
+  while (state != NULL) {
+    if ((unsigned long)state < PAGE_SIZE) {
+      printf("WTF HOW DID THIS HAPPEN\n");
+      return NULL;
+    }
+    if (state->process == pProcess) return state;
+    state = state->next;
+  }
+  return NULL;
+}
+
+// which of the state's locks an ioctl runs under
+static IOLock *state_ioctl_lock(struct state *state, u_long cmd) {
+  if (IS_IRQ_IOCTL(cmd)) return state->irq_lock;
+  if (IS_MEM_IOCTL(cmd)) return state->mem_lock;
+  return state->ioctl_lock;
+}
+
+/* *********************** */
+/* statistics */
+/* *********************** */
+
+// sysctl kvm.stats, a struct kvm_vm_stats for each vm. the vcpus keep
+// running, a read can be a few counts behind
+static int kvm_sysctl_stats SYSCTL_HANDLER_ARGS {
+  struct kvm_vm_stats stats;
+  struct state *state;
+  int error = 0;
+
+  IOLockLock(state_lock);
+  for (state = head_of_state; state != NULL && error == 0; state = state->next) {
+    if (state->vcpu == NULL) continue;
+    memcpy(&stats, &state->vcpu->stats, sizeof(stats));
+    stats.pid = proc_pid(state->process);
+    stats.vcpu = 0;
+    stats.tsc = rdtsc64();
+    error = SYSCTL_OUT(req, &stats, sizeof(stats));
+  }
+  IOLockUnlock(state_lock);
+  return error;
+}
+
+SYSCTL_NODE(, OID_AUTO, kvm, CTLFLAG_RW | CTLFLAG_LOCKED, 0, "kvm");
+SYSCTL_PROC(_kvm, OID_AUTO, stats, CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_LOCKED,
+    0, 0, kvm_sysctl_stats, "S,kvm_vm_stats", "per vm exit and injection counters");
+
+/* *********************** */
+/* vcpu page pool */
+/* *********************** */
+
+// a few vcpus with all their pages allocated and zeroed, so KVM_CREATE_VM
+// doesn't have to go to the allocator. closed vms are scrubbed and put back.
+#define VCPU_POOL_SIZE 4
+static struct vcpu *vcpu_pool;
+static int vcpu_pool_count;
+static IOLock *vcpu_pool_lock;
+
+static void vcpu_free_pages(struct vcpu *vcpu) {
+  if (vcpu->vmcs != NULL) vmx_pfree(vcpu->vmcs);
+  if (vcpu->kvm_vcpu != NULL) IOFreeAligned(vcpu->kvm_vcpu, VCPU_SIZE);
+  if (vcpu->guest_msrs != NULL) IOFreeAligned(vcpu->guest_msrs, PAGE_SIZE);
+  if (vcpu->pml4 != NULL) IOFreeAligned(vcpu->pml4, PAGE_SIZE*2);
+  if (vcpu->virtual_apic_page != NULL) IOFreeAligned(vcpu->virtual_apic_page, PAGE_SIZE);
+  if (vcpu->apic_access != NULL) IOFreeAligned(vcpu->apic_access, PAGE_SIZE);
+  if (vcpu->msr_bitmap != NULL) IOFreeAligned(vcpu->msr_bitmap, PAGE_SIZE);
+  IOFreeAligned(vcpu, sizeof(struct vcpu));
+}
+
+static struct vcpu *vcpu_alloc_pages() {
+  struct vcpu *vcpu = (struct vcpu *)IOCallocAligned(sizeof(struct vcpu), CACHE_LINE);
+  if (vcpu == NULL) return NULL;
+
+  vcpu->vmcs = allocate_vmcs();
+  vcpu->kvm_vcpu = (struct kvm_run *)IOCallocAligned(VCPU_SIZE, PAGE_SIZE);
+  // msr lists must be 16 byte aligned, give each half a page
+  vcpu->guest_msrs = (struct vmx_msr_entry *)IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
+  ept_init(vcpu);
+  vcpu->virtual_apic_page = IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
+  vcpu->apic_access = IOCallocAligned(PAGE_SIZE, PAGE_SIZE);
+  vcpu->msr_bitmap = IOMallocAligned(PAGE_SIZE, PAGE_SIZE);
+
+  if (vcpu->vmcs == NULL || vcpu->kvm_vcpu == NULL || vcpu->guest_msrs == NULL ||
+      vcpu->pml4 == NULL || vcpu->virtual_apic_page == NULL || vcpu->apic_access == NULL ||
+      vcpu->msr_bitmap == NULL) {
+    vcpu_free_pages(vcpu);
+    return NULL;
+  }
+  memset(vcpu->msr_bitmap, 0xff, PAGE_SIZE);
+
+  vcpu->pio_data = ((unsigned char *)vcpu->kvm_vcpu + KVM_PIO_PAGE_OFFSET * PAGE_SIZE);
+  vcpu->host_msrs = (struct vmx_msr_entry *)((char *)vcpu->guest_msrs + PAGE_SIZE/2);
+  return vcpu;
+}
+
+static struct vcpu *vcpu_pool_get() {
+  struct vcpu *vcpu;
+
+  IOLockLock(vcpu_pool_lock);
+  vcpu = vcpu_pool;
+  if (vcpu != NULL) {
+    vcpu_pool = vcpu->pool_next;
+    vcpu_pool_count--;
+    vcpu->pool_next = NULL;
+  }
+  IOLockUnlock(vcpu_pool_lock);
+
+  // pool ran dry, pay for the allocation now
+  if (vcpu == NULL) vcpu = vcpu_alloc_pages();
+  return vcpu;
+}
+
+// everything the vm hung off the vcpu must already be freed
+static void vcpu_pool_put(struct vcpu *vcpu) {
+  // just the page pointers, the whole vcpu is too big for the kernel stack
+  vmcs *vmcs = vcpu->vmcs;
+  struct kvm_run *kvm_vcpu = vcpu->kvm_vcpu;
+  void *pio_data = vcpu->pio_data;
+  struct vmx_msr_entry *guest_msrs = vcpu->guest_msrs, *host_msrs = vcpu->host_msrs;
+  unsigned long *pml4 = vcpu->pml4;
+  void *virtual_apic_page = vcpu->virtual_apic_page, *apic_access = vcpu->apic_access;
+  void *msr_bitmap = vcpu->msr_bitmap;
+  u32 revision_id = vcpu->vmcs->revision_id;
+
+  // back to how vcpu_alloc_pages left it, outside the pool lock
+  bzero(vcpu, sizeof(struct vcpu));
+  vcpu->vmcs = vmcs;
+  vcpu->kvm_vcpu = kvm_vcpu;
+  vcpu->pio_data = pio_data;
+  vcpu->guest_msrs = guest_msrs;
+  vcpu->host_msrs = host_msrs;
+  vcpu->pml4 = pml4;
+  vcpu->virtual_apic_page = virtual_apic_page;
+  vcpu->apic_access = apic_access;
+  vcpu->msr_bitmap = msr_bitmap;
+
+  bzero(vcpu->vmcs, PAGE_SIZE);
+  vcpu->vmcs->revision_id = revision_id;
+  bzero(vcpu->kvm_vcpu, VCPU_SIZE);
+  bzero(vcpu->guest_msrs, PAGE_SIZE);
+  bzero(vcpu->virtual_apic_page, PAGE_SIZE);
+  bzero(vcpu->apic_access, PAGE_SIZE);
+  memset(vcpu->msr_bitmap, 0xff, PAGE_SIZE);
+  // ept_free already cleared the pml4
+
+  IOLockLock(vcpu_pool_lock);
+  if (vcpu_pool_count < VCPU_POOL_SIZE) {
+    vcpu->pool_next = vcpu_pool;
+    vcpu_pool = vcpu;
+    vcpu_pool_count++;
+    vcpu = NULL;
+  }
+  IOLockUnlock(vcpu_pool_lock);
+
+  if (vcpu != NULL) vcpu_free_pages(vcpu);
+}
+
+static void vcpu_pool_init() {
+  struct vcpu *vcpu;
+  int i;
+
+  vcpu_pool_lock = IOLockAlloc();
+  for (i = 0; i < VCPU_POOL_SIZE; i++) {
+    vcpu = vcpu_alloc_pages();
+    if (vcpu == NULL) break;
+    vcpu->pool_next = vcpu_pool;
+    vcpu_pool = vcpu;
+    vcpu_pool_count++;
+  }
+}
+
+static void vcpu_pool_destroy() {
+  struct vcpu *vcpu;
+
+  while (vcpu_pool != NULL) {
+    vcpu = vcpu_pool;
+    vcpu_pool = vcpu->pool_next;
+    vcpu_free_pages(vcpu);
+  }
+  vcpu_pool_count = 0;
+  IOLockFree(vcpu_pool_lock);
+}
+
+/* *********************** */
+/* ioctl batching */
+/* *********************** */
+
+static int kvm_vm_ioctl(struct state *state, struct vcpu *vcpu, u_long iCmd, caddr_t pData);
+
+static void kvm_batch_free(struct vcpu *vcpu) {
+  if (vcpu->batch_map != NULL) vcpu->batch_map->release();
+  if (vcpu->batch_md != NULL) {
+    vcpu->batch_md->complete();
+    vcpu->batch_md->release();
+  }
+  if (vcpu->batch_buf != NULL) IOFree(vcpu->batch_buf, PAGE_SIZE);
+  vcpu->batch_map = NULL;
+  vcpu->batch_md = NULL;
+  vcpu->batch_ring = NULL;
+  vcpu->batch_buf = NULL;
+}
+
+// the ring stays wired and mapped so submits don't have to copy it in and out
+static int kvm_batch_setup(struct vcpu *vcpu, u64 uaddr) {
+  IOMemoryDescriptor *md;
+  IOMemoryMap *map;
 
-static int kvm_get_msr_index_list(struct kvm_msr_list *msr_list) {
-  static const u32 emulated_msrs[] = {
-    MSR_IA32_TSC_ADJUST,
-    MSR_IA32_TSCDEADLINE,
-    MSR_IA32_MISC_ENABLE,
-    MSR_IA32_MCG_STATUS,
-    MSR_IA32_MCG_CTL,
-  };
+  if (uaddr == 0 || (uaddr & (PAGE_SIZE-1))) return EINVAL;
+  kvm_batch_free(vcpu);
 
-  if (msr_list->nmsrs < ARRAY_SIZE(emulated_msrs)) return E2BIG;
-  msr_list->nmsrs = ARRAY_SIZE(emulated_msrs);
+  md = IOMemoryDescriptor::withAddressRange(uaddr, PAGE_SIZE, kIODirectionInOut, current_task());
+  if (md == NULL) return ENOMEM;
+  if (md->prepare() != kIOReturnSuccess) {
+    md->release();
+    return EFAULT;
+  }
+  map = md->map();
+  if (map == NULL) {
+    md->complete();
+    md->release();
+    return ENOMEM;
+  }
 
-  copyout(emulated_msrs, msr_list->self + offsetof(struct kvm_msr_list, indices), msr_list->nmsrs * sizeof(u32));
+  vcpu->batch_md = md;
+  vcpu->batch_map = map;
+  vcpu->batch_ring = (struct kvm_batch_ring *)map->getVirtualAddress();
+  vcpu->batch_buf = IOMalloc(PAGE_SIZE);
+  if (vcpu->batch_buf == NULL) {
+    // unwires and unmaps the ring again
+    kvm_batch_free(vcpu);
+    return ENOMEM;
+  }
+  vcpu->batch_sq_head = vcpu->batch_cq_tail = 0;
+  vcpu->batch_ring->sq_head = vcpu->batch_ring->cq_tail = 0;
   return 0;
 }
 
+// run one queued ioctl the way the syscall would, arguments go through a kernel buffer
+static int kvm_batch_op(struct state *state, struct vcpu *vcpu, struct kvm_batch_sqe *sqe) {
+  u32 size = IOCPARM_LEN(sqe->cmd);
+  void *buf = vcpu->batch_buf;
+  IOLock *lock;
+  int ret;
 
-/* *********************** */
-/* device functions */
-/* *********************** */
-
-struct state {
-  // linked list is fine, max 1 per process
-  struct state *next;
-  struct state *prev;
-  struct proc *process;
-  int open_count;
-
-  struct vcpu *vcpu;
+  switch (sqe->cmd) {
+    // nothing long running, and no recursion
+    case KVM_RUN:
+    case KVM_CREATE_VM:
+    case KVM_MMAP_VCPU:
+    case KVM_BATCH_SETUP:
+    case KVM_BATCH_SUBMIT:
+      return EINVAL;
+  }
+  if (sqe->flags != 0 || size > PAGE_SIZE) return EINVAL;
 
-  IOLock *ioctl_lock;
-  IOLock *irq_lock;
+  if (sqe->cmd & IOC_IN) {
+    if (copyin(sqe->addr, buf, size) != 0) return EFAULT;
+  } else if (sqe->cmd & IOC_VOID) {
+    // _IO ioctls get the argument itself
+    *(int *)buf = (int)sqe->addr;
+  } else {
+    bzero(buf, size);
+  }
 
-  lck_grp_attr_t *mp_lock_grp_attr;
-  lck_grp_t *mp_lock_grp;
-};
+  lock = state_ioctl_lock(state, sqe->cmd);
+  if (lock != state->ioctl_lock) IOLockLock(lock);
+  ret = kvm_vm_ioctl(state, vcpu, sqe->cmd, (caddr_t)buf);
+  if (lock != state->ioctl_lock) IOLockUnlock(lock);
 
-IOLock *state_lock;
-struct state *head_of_state = NULL;
+  if (ret == 0 && (sqe->cmd & IOC_OUT)) {
+    if (copyout(buf, sqe->addr, size) != 0) ret = EFAULT;
+  }
+  return ret;
+}
 
-// must be called with state_lock held
-struct state *state_find(struct proc *pProcess) {
-  struct state *state = head_of_state;
-  while (state != NULL) {
-    if ((unsigned long)state < PAGE_SIZE) {
-      printf("WTF HOW DID THIS HAPPEN\n");
-      return NULL;
-    }
-    if (state->process == pProcess) return state;
-    state = state->next;
+// called with the ioctl lock, so only one submit walks the ring at a time
+static int kvm_batch_submit(struct state *state, struct vcpu *vcpu, u32 *count) {
+  struct kvm_batch_ring *ring = vcpu->batch_ring;
+  struct kvm_batch_sqe sqe;
+  struct kvm_batch_cqe *cqe;
+  u32 tail, done = 0;
+
+  if (ring == NULL) return ENXIO;
+
+  // userspace owns sq_tail and cq_head and can write anything there, the
+  // heads and tails the kext walks are its own
+  tail = *(volatile u32 *)&ring->sq_tail;
+  if (tail - vcpu->batch_sq_head > KVM_BATCH_ENTRIES) return EINVAL;
+  while (vcpu->batch_sq_head != tail && (*count == 0 || done < *count)) {
+    // stop when userspace hasn't reaped enough completions, or claims to
+    // have reaped ones that were never posted
+    if (vcpu->batch_cq_tail - *(volatile u32 *)&ring->cq_head >= KVM_BATCH_ENTRIES) break;
+
+    // copy it, userspace can still write the ring
+    sqe = ring->sqes[vcpu->batch_sq_head & (KVM_BATCH_ENTRIES - 1)];
+    cqe = &ring->cqes[vcpu->batch_cq_tail & (KVM_BATCH_ENTRIES - 1)];
+    cqe->user_data = sqe.user_data;
+    cqe->result = kvm_batch_op(state, vcpu, &sqe);
+    cqe->pad = 0;
+
+    ring->sq_head = ++vcpu->batch_sq_head;
+    ring->cq_tail = ++vcpu->batch_cq_tail;
+    done++;
   }
-  return NULL;
+
+  *count = done;
+  return 0;
 }
 
 static int kvm_dev_open(dev_t Dev, int fFlags, int fDevType, struct proc *pProcess) {
@@ -1131,6 +4137,7 @@ static int kvm_dev_open(dev_t Dev, int fFlags, int fDevType, struct proc *pProce
     // just opened
     state->ioctl_lock = IOLockAlloc();
     state->irq_lock = IOLockAlloc();
+    state->mem_lock = IOLockAlloc();
 
     state->mp_lock_grp_attr = lck_grp_attr_alloc_init();
     state->mp_lock_grp = lck_grp_alloc_init("vmx", state->mp_lock_grp_attr);
@@ -1160,24 +4167,33 @@ static int kvm_dev_close(dev_t Dev, int fFlags, int fDevType, struct proc *pProc
     }
     IOLockUnlock(state_lock);
 
-    IOFree(state->vcpu->virtual_apic_page, PAGE_SIZE);
-    IOFree(state->vcpu->apic_access, PAGE_SIZE);
-    IOFree(state->vcpu->vmcs, PAGE_SIZE);
+    // no vm if KVM_CREATE_VM never ran or failed
+    if (state->vcpu != NULL) {
+      kvm_batch_free(state->vcpu);
+      kvm_prof_free(state->vcpu);
+      gsi_routing_free(state->vcpu->routing);
 
-    IOFree(state->vcpu->msrs, state->vcpu->msr_count * sizeof(struct kvm_msr_entry));
-    IOFree(state->vcpu->cpuids, state->vcpu->cpuid_count * sizeof(struct kvm_cpuid_entry2));
+      IOFree(state->vcpu->msrs, state->vcpu->msr_count * sizeof(struct kvm_msr_entry));
+      IOFree(state->vcpu->cpuids, state->vcpu->cpuid_count * sizeof(struct kvm_cpuid_entry2));
 
-    // can be mmaped into user space
-    state->vcpu->mm->unmap();
-    state->vcpu->mm->release();
-    state->vcpu->md->release();
-    IOFree(state->vcpu->kvm_vcpu, VCPU_SIZE);
+      // can be mmaped into user space
+      state->vcpu->mm->unmap();
+      state->vcpu->mm->release();
+      state->vcpu->md->release();
 
-    ept_free(state->vcpu);
+      // unwire guest memory before the tables go away
+      for (int slot = 0; slot < KVM_MAX_MEMSLOTS; slot++) {
+        memslot_free(state->vcpu, &state->vcpu->memslots[slot]);
+      }
+      ept_free(state->vcpu);
+      shadow_destroy(state->vcpu);
 
-    IOFree(state->vcpu, sizeof(struct vcpu));
+      // the vmcs, kvm_run and other per vm pages get reused
+      vcpu_pool_put(state->vcpu);
+    }
     IOLockFree(state->ioctl_lock);
     IOLockFree(state->irq_lock);
+    IOLockFree(state->mem_lock);
 
     IOFree(state, sizeof(struct state));
   } else {
@@ -1189,88 +4205,9 @@ static int kvm_dev_close(dev_t Dev, int fFlags, int fDevType, struct proc *pProc
   return 0;
 }
 
-static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, struct proc *pProcess) {
+static int kvm_vm_ioctl(struct state *state, struct vcpu *vcpu, u_long iCmd, caddr_t pData) {
   int ret = EOPNOTSUPP;
-  int test;
-
-  IOLockLock(state_lock);
-  struct state *state = state_find(pProcess);
-  IOLockUnlock(state_lock);
-
-  if (state == NULL) return ENOENT;
-
-  struct vcpu *vcpu = state->vcpu;
-
-  iCmd &= 0xFFFFFFFF;
-
-  // irqs must be async
-  if (iCmd != KVM_IRQ_LINE) IOLockLock(state->ioctl_lock);
-  else IOLockLock(state->irq_lock);
-
-  // saw 0x14 once?
-  if (pData == NULL || (u64)pData < PAGE_SIZE) goto fail;
-
-  /* kvm_ioctl */
-  switch (iCmd) {
-    case KVM_GET_API_VERSION:
-      ret = KVM_API_VERSION;
-      break;
-    case KVM_CREATE_VM:
-      DEBUG("create vm\n");
-      vcpu = (struct vcpu *)IOCalloc(sizeof(struct vcpu));
-
-      // set this vcpu in the state
-      state->vcpu = vcpu;
-
-      // assign an fd, must be a system fd
-      // can't do this
-      ept_init(vcpu);
-
-      // init the one CPU as well
-      vcpu->vmcs = allocate_vmcs();
-      vcpu->kvm_vcpu = (struct kvm_run *)IOCallocAligned(VCPU_SIZE, PAGE_SIZE);
-      vcpu->pio_data = ((unsigned char *)vcpu->kvm_vcpu + KVM_PIO_PAGE_OFFSET * PAGE_SIZE);
-      vcpu->pending_io = 0;
-      vcpu->ioctl_lock = lck_spin_alloc_init(state->mp_lock_grp, LCK_ATTR_NULL);
-      vmcs_clear(vcpu->vmcs);
-
-      LOAD_VMCS(vcpu);
-      vcpu_init(vcpu);
-      RELEASE_VMCS(vcpu);
-
-      ret = 0;
-      break;
-    case KVM_GET_VCPU_MMAP_SIZE:
-      ret = VCPU_SIZE;
-      break;
-    case KVM_CHECK_EXTENSION:
-      test = *(int*)pData;
-      if (test == KVM_CAP_USER_MEMORY || test == KVM_CAP_DESTROY_MEMORY_REGION_WORKS) {
-        ret = 1;
-      } else if (test == KVM_CAP_SET_TSS_ADDR || test == KVM_CAP_EXT_CPUID || test == KVM_CAP_MP_STATE) {
-        ret = 1;
-      } else if (test == KVM_CAP_SYNC_MMU || test == KVM_CAP_TSC_CONTROL) {
-        ret = 1;
-      } else if (test == KVM_CAP_DESTROY_MEMORY_REGION_WORKS || test == KVM_CAP_JOIN_MEMORY_REGIONS_WORKS) {
-        ret = 1;
-      } else {
-        // most extensions aren't available
-        ret = 0;
-      }
-      break;
-    // unimplemented
-    case KVM_GET_MSR_INDEX_LIST:
-      // struct kvm_msr_list
-      ret = kvm_get_msr_index_list((struct kvm_msr_list *)pData);
-      break;
-    case KVM_GET_SUPPORTED_CPUID:
-      ret = kvm_get_supported_cpuid((struct kvm_cpuid2 *)pData);
-      break;
-    default:
-      break;
-  }
-
-  if (vcpu == NULL) goto fail;
+  u64 run_tsc;
 
   /* kvm_vm_ioctl */
   switch (iCmd) {
@@ -1280,7 +4217,24 @@ static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, stru
       ret = 0;
       break;
     case KVM_SET_USER_MEMORY_REGION:
+      IOLockLock(state->mem_lock);
       ret = kvm_set_user_memory_region(vcpu, (struct kvm_userspace_memory_region*)pData);
+      IOLockUnlock(state->mem_lock);
+      break;
+    case KVM_TRANSLATE_READ:
+      ret = kvm_translate_read(vcpu, (struct kvm_translate_read *)pData);
+      break;
+    case KVM_BALLOON_OP:
+      ret = kvm_balloon_op(vcpu, (struct kvm_balloon_op*)pData);
+      break;
+    case KVM_UNSHARE_ZERO:
+      ret = kvm_unshare_zero(vcpu, (struct kvm_balloon_range*)pData);
+      break;
+    case KVM_BATCH_SETUP:
+      ret = kvm_batch_setup(vcpu, *(u64 *)pData);
+      break;
+    case KVM_BATCH_SUBMIT:
+      ret = kvm_batch_submit(state, vcpu, (u32 *)pData);
       break;
     case KVM_SET_IDENTITY_MAP_ADDR:
       ret = 0;
@@ -1304,6 +4258,30 @@ static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, stru
     case KVM_IRQ_LINE:
       ret = kvm_irq_line(vcpu, (struct kvm_irq_level *)pData);
       break;
+    case KVM_SIGNAL_MSI:
+      ret = kvm_signal_msi(vcpu, (struct kvm_msi *)pData);
+      break;
+    case KVM_PROF_SETUP:
+      LOAD_VMCS(vcpu);
+      ret = kvm_prof_setup(vcpu, (struct kvm_prof_setup *)pData);
+      RELEASE_VMCS(vcpu);
+      break;
+    case KVM_SET_CPU_QUOTA:
+      LOAD_VMCS(vcpu);
+      ret = kvm_set_cpu_quota(vcpu, (struct kvm_cpu_quota *)pData);
+      RELEASE_VMCS(vcpu);
+      break;
+    case KVM_SET_GSI_ROUTING: {
+      struct gsi_routing *old;
+      ret = kvm_set_gsi_routing(vcpu, (struct kvm_irq_routing *)pData, &old);
+      if (old != NULL) {
+        // injections run under irq_lock, once we get it nobody has the old table
+        IOLockLock(state->irq_lock);
+        IOLockUnlock(state->irq_lock);
+        gsi_routing_free(old);
+      }
+      break;
+    }
     /* PIT */
     case KVM_CREATE_PIT:
       //printf("KVM_CREATE_PIT\n");
@@ -1326,10 +4304,12 @@ static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, stru
     case KVM_SET_FPU:
       ret = 0;
       break;
-    /* MMIO */
-    /*case KVM_REGISTER_COALESCED_MMIO:
-      printf("KVM_REGISTER_COALESCED_MMIO\n");
-      break;*/
+    case KVM_REGISTER_COALESCED_MMIO:
+      ret = kvm_register_coalesced(vcpu, (struct kvm_coalesced_mmio_zone *)pData);
+      break;
+    case KVM_UNREGISTER_COALESCED_MMIO:
+      ret = kvm_unregister_coalesced(vcpu, (struct kvm_coalesced_mmio_zone *)pData);
+      break;
     default:
       break;
   }
@@ -1349,7 +4329,19 @@ static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, stru
       ret = kvm_set_sregs(vcpu, (struct kvm_sregs *)pData);
       break;
     case KVM_RUN:
+      ret = kvm_sync_regs_in(vcpu);
+      if (ret != 0) break;
+      run_tsc = rdtsc64();
       ret = kvm_run_wrapper(vcpu);
+      vcpu->stats.run_tsc += rdtsc64() - run_tsc;
+      guest_dr_rearm(vcpu);
+      kvm_sync_regs_out(vcpu);
+      break;
+    case KVM_GET_VCPU_EVENTS:
+      ret = kvm_get_vcpu_events(vcpu, (struct kvm_vcpu_events *)pData);
+      break;
+    case KVM_SET_VCPU_EVENTS:
+      ret = kvm_set_vcpu_events(vcpu, (struct kvm_vcpu_events *)pData);
       break;
     case KVM_MMAP_VCPU:
       vcpu->md = IOMemoryDescriptor::withAddressRange((mach_vm_address_t)vcpu->kvm_vcpu, VCPU_SIZE, kIODirectionInOut, kernel_task);
@@ -1368,10 +4360,146 @@ static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, stru
     case KVM_SET_CPUID2:
       ret = kvm_set_cpuid2(vcpu, (struct kvm_cpuid2 *)pData);
       break;
+    case KVM_TRANSLATE:
+      ret = kvm_translate(vcpu, (struct kvm_translation *)pData);
+      break;
+    case KVM_SET_GUEST_DEBUG:
+      ret = kvm_set_guest_debug(vcpu, (struct kvm_guest_debug *)pData);
+      break;
+    case KVM_GET_DEBUGREGS:
+      ret = kvm_get_debugregs(vcpu, (struct kvm_debugregs *)pData);
+      break;
+    case KVM_SET_DEBUGREGS:
+      ret = kvm_set_debugregs(vcpu, (struct kvm_debugregs *)pData);
+      break;
+    default:
+      break;
+  }
+
+  return ret;
+}
+
+static int kvm_dev_ioctl(dev_t Dev, u_long iCmd, caddr_t pData, int fFlags, struct proc *pProcess) {
+  int ret = EOPNOTSUPP;
+  IOLock *lock;
+  int test;
+
+  IOLockLock(state_lock);
+  struct state *state = state_find(pProcess);
+  IOLockUnlock(state_lock);
+
+  if (state == NULL) return ENOENT;
+
+  struct vcpu *vcpu = state->vcpu;
+
+  iCmd &= 0xFFFFFFFF;
+
+  // irqs and introspection must be async
+  lock = state_ioctl_lock(state, iCmd);
+  IOLockLock(lock);
+
+  // saw 0x14 once?
+  if (pData == NULL || (u64)pData < PAGE_SIZE) goto fail;
+
+  /* kvm_ioctl */
+  switch (iCmd) {
+    case KVM_GET_API_VERSION:
+      ret = KVM_API_VERSION;
+      break;
+    case KVM_CREATE_VM:
+      DEBUG("create vm\n");
+      // the state is per process and holds one vm, don't leak it
+      if (state->vcpu != NULL) {
+        ret = EEXIST;
+        break;
+      }
+      // comes with the vmcs, kvm_run, ept root and apic pages allocated
+      vcpu = vcpu_pool_get();
+      if (vcpu == NULL) {
+        ret = ENOMEM;
+        break;
+      }
+
+      // no ept or no unrestricted guest, shadow the guest page tables.
+      // first, so failing only has the pool vcpu to give back
+      vcpu->shadow = force_shadow_mmu || !vmx_has_ept || !vmx_has_ug;
+      if (vcpu->shadow) {
+        if (shadow_init(vcpu) != 0) {
+          printf("shadow mmu init failed\n");
+          vcpu_pool_put(vcpu);
+          ret = ENOMEM;
+          break;
+        }
+        if (vmx_has_vpid) vcpu->vpid = (OSIncrementAtomic(&vmx_vpid_counter) % (VMX_NR_VPIDS - 1)) + 1;
+        // vpids get reused, flush everywhere before the first entry
+        vcpu->tlb_flush_cpus = ~0ULL;
+      }
+
+      // set this vcpu in the state
+      state->vcpu = vcpu;
+
+      // assign an fd, must be a system fd
+      // can't do this
+
+      vcpu->pending_io = 0;
+      vcpu->ioctl_lock = lck_spin_alloc_init(state->mp_lock_grp, LCK_ATTR_NULL);
+      vmcs_clear(vcpu->vmcs);
+
+      LOAD_VMCS(vcpu);
+      vcpu_init(vcpu);
+      RELEASE_VMCS(vcpu);
+
+      ret = 0;
+      break;
+    case KVM_GET_VCPU_MMAP_SIZE:
+      ret = VCPU_SIZE;
+      break;
+    case KVM_CHECK_EXTENSION:
+      test = *(int*)pData;
+      if (test == KVM_CAP_USER_MEMORY || test == KVM_CAP_DESTROY_MEMORY_REGION_WORKS) {
+        ret = 1;
+      } else if (test == KVM_CAP_SET_TSS_ADDR || test == KVM_CAP_EXT_CPUID || test == KVM_CAP_MP_STATE) {
+        ret = 1;
+      } else if (test == KVM_CAP_SYNC_MMU || test == KVM_CAP_TSC_CONTROL) {
+        ret = 1;
+      } else if (test == KVM_CAP_DESTROY_MEMORY_REGION_WORKS || test == KVM_CAP_JOIN_MEMORY_REGIONS_WORKS) {
+        ret = 1;
+      } else if (test == KVM_CAP_VCPU_EVENTS) {
+        ret = 1;
+      } else if (test == KVM_CAP_IRQ_ROUTING) {
+        ret = GSI_MAX;
+      } else if (test == KVM_CAP_SIGNAL_MSI) {
+        ret = 1;
+      } else if (test == KVM_CAP_SET_GUEST_DEBUG) {
+        ret = 1;
+      } else if (test == KVM_CAP_DEBUGREGS) {
+        ret = 1;
+      } else if (test == KVM_CAP_COALESCED_PIO) {
+        ret = 1;
+      } else if (test == KVM_CAP_SYNC_REGS) {
+        // the classes kvm_run.s can carry
+        ret = KVM_SYNC_X86_VALID_FIELDS;
+      } else {
+        // most extensions aren't available
+        ret = 0;
+      }
+      break;
+    // unimplemented
+    case KVM_GET_MSR_INDEX_LIST:
+      // struct kvm_msr_list
+      ret = kvm_get_msr_index_list((struct kvm_msr_list *)pData);
+      break;
+    case KVM_GET_SUPPORTED_CPUID:
+      ret = kvm_get_supported_cpuid((struct kvm_cpuid2 *)pData);
+      break;
     default:
       break;
   }
 
+  if (vcpu == NULL) goto fail;
+
+  if (ret == EOPNOTSUPP) ret = kvm_vm_ioctl(state, vcpu, iCmd, pData);
+
 fail:
   if (ret == EOPNOTSUPP) {
     /* 0xa3, 0x8d, 0x99, 0x63 */
@@ -1380,8 +4508,7 @@ fail:
   }
 
 
-  if (iCmd != KVM_IRQ_LINE) IOLockUnlock(state->ioctl_lock);
-  else IOLockUnlock(state->irq_lock);
+  IOLockUnlock(lock);
 
   return ret;
 }
@@ -1425,6 +4552,39 @@ kern_return_t MyKextStart(kmod_info_t *ki, void *d) {
     return KMOD_RETURN_FAILURE;
   }
 
+  zero_page = vmx_pcalloc();
+  if (zero_page == NULL) {
+    host_vmxoff();
+    return KMOD_RETURN_FAILURE;
+  }
+  zero_page_pa = __pa(zero_page);
+
+  // secondary controls the cpu allows to be set are in the high half
+  if ((rdmsr64(MSR_IA32_VMX_PROCBASED_CTLS) >> 32) & CPU_BASED_ACTIVATE_SECONDARY_CONTROLS) {
+    u64 secondary = rdmsr64(MSR_IA32_VMX_PROCBASED_CTLS2) >> 32;
+    vmx_has_ept = (secondary & SECONDARY_EXEC_ENABLE_EPT) != 0;
+    vmx_has_ug = (secondary & SECONDARY_EXEC_UNRESTRICTED_GUEST) != 0;
+    if (secondary & SECONDARY_EXEC_ENABLE_VPID) {
+      u64 cap = rdmsr64(MSR_IA32_VMX_EPT_VPID_CAP) >> 32;
+      vmx_has_vpid = (cap & VMX_VPID_INVVPID_BIT) && (cap & VMX_VPID_EXTENT_SINGLE_CONTEXT_BIT);
+    }
+  }
+  vmx_has_load_efer = ((rdmsr64(MSR_IA32_VMX_ENTRY_CTLS) >> 32) & VM_ENTRY_LOAD_IA32_EFER) &&
+    ((rdmsr64(MSR_IA32_VMX_EXIT_CTLS) >> 32) & VM_EXIT_LOAD_IA32_EFER);
+  pmu_probe();
+
+  vmx_has_preemption_timer = (rdmsr64(MSR_IA32_VMX_PINBASED_CTLS) >> 32) & PIN_BASED_VMX_PREEMPTION_TIMER;
+  vmx_has_mtf = ((rdmsr64(MSR_IA32_VMX_PROCBASED_CTLS) >> 32) & CPU_BASED_MONITOR_TRAP_FLAG) != 0;
+  vmx_preemption_timer_rate = rdmsr64(MSR_IA32_VMX_MISC) & VMX_MISC_PREEMPTION_TIMER_RATE_MASK;
+  size_t tsc_len = sizeof(tsc_frequency);
+  if (sysctlbyname("machdep.tsc.frequency", &tsc_frequency, &tsc_len, NULL, 0) != 0) tsc_frequency = 0;
+  printf("ept %d unrestricted guest %d vpid %d load efer %d\n", vmx_has_ept, vmx_has_ug, vmx_has_vpid, vmx_has_load_efer);
+  printf("pmu version %d gp counters %d fixed counters %d\n", pmu_version, pmu_nr_gp, pmu_nr_fixed);
+
+  // depends on the capabilities above
+  vmcs_template_init();
+  vcpu_pool_init();
+
   g_kvm_major = cdevsw_add(-1, &kvm_functions);
   if (g_kvm_major < 0) {
     return KMOD_RETURN_FAILURE;
@@ -1433,17 +4593,26 @@ kern_return_t MyKextStart(kmod_info_t *ki, void *d) {
   // insecure for testing!
   g_kvm_ctl = devfs_make_node(makedev(g_kvm_major, 0), DEVFS_CHAR, UID_ROOT, GID_WHEEL, 0666, "kvm");
 
+  sysctl_register_oid(&sysctl__kvm);
+  sysctl_register_oid(&sysctl__kvm_stats);
+
   return KMOD_RETURN_SUCCESS;
 }
  
 kern_return_t MyKextStop(kmod_info_t *ki, void *d) {
   printf("MyKext has stopped.\n");
 
+  sysctl_unregister_oid(&sysctl__kvm_stats);
+  sysctl_unregister_oid(&sysctl__kvm);
+
   devfs_remove(g_kvm_ctl);
   cdevsw_remove(g_kvm_major, &kvm_functions);
 
   host_vmxoff();
 
+  vcpu_pool_destroy();
+  vmx_pfree(zero_page);
+
   return KERN_SUCCESS;
 }
 
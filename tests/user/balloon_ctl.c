@@ -31,7 +31,10 @@ static int balloon_op(int *fd, int bytes)
 	struct kvm_balloon_op bop;
         int r;
 
+	/* no ranges, the driver picks the pages; it copies in from self */
+	bop.self = (unsigned long)&bop;
 	bop.npages = bytes/PAGE_SIZE;
+	bop.nranges = 0;
 	r = ioctl(*fd, KVM_BALLOON_OP, &bop);
 	if (r == -1)
 		return -errno;
@@ -0,0 +1,142 @@
+/*
+ * Compares issuing small control ioctls one at a time with queueing them
+ * on the batch ring and submitting them together.
+ *
+ * usage: batch_bench [iterations] [ops per batch]
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "kvmctl.h"
+#include "kvm-kext-fixes.h"
+
+/* the mix a device model tick tends to produce */
+#define OPS_PER_ROUND 4
+
+static struct kvm_callbacks callbacks;
+
+static double now_ns(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e9 + tv.tv_usec * 1e3;
+}
+
+static int run_single(int fd, int rounds)
+{
+	struct kvm_sregs sregs;
+	struct kvm_vcpu_events events;
+	struct kvm_irq_level irq = { .irq = 0, .level = 0 };
+	int i, r;
+
+	for (i = 0; i < rounds; ++i) {
+		if ((r = __ioctl(fd, KVM_GET_SREGS, &sregs)) ||
+		    (r = __ioctl(fd, KVM_GET_VCPU_EVENTS, &events)) ||
+		    (r = __ioctl(fd, KVM_SET_VCPU_EVENTS, &events)) ||
+		    (r = __ioctl(fd, KVM_IRQ_LINE, &irq))) {
+			fprintf(stderr, "ioctl failed: %s\n", strerror(r));
+			return -r;
+		}
+	}
+	return 0;
+}
+
+static int run_batched(kvm_context_t kvm, int rounds, int batch)
+{
+	struct kvm_sregs sregs;
+	struct kvm_vcpu_events events;
+	struct kvm_irq_level irq = { .irq = 0, .level = 0 };
+	uint64_t user_data;
+	int i, r, result, queued = 0;
+
+	for (i = 0; i < rounds; ++i) {
+		kvm_batch_queue(kvm, KVM_GET_SREGS, &sregs, i);
+		kvm_batch_queue(kvm, KVM_GET_VCPU_EVENTS, &events, i);
+		kvm_batch_queue(kvm, KVM_SET_VCPU_EVENTS, &events, i);
+		kvm_batch_queue(kvm, KVM_IRQ_LINE, &irq, i);
+		queued += OPS_PER_ROUND;
+		if (queued + OPS_PER_ROUND <= batch && i != rounds - 1)
+			continue;
+
+		r = kvm_batch_submit(kvm);
+		if (r != queued) {
+			fprintf(stderr, "submitted %d of %d\n", r, queued);
+			return r < 0 ? r : -EIO;
+		}
+		while (kvm_batch_reap(kvm, &user_data, &result)) {
+			if (result) {
+				fprintf(stderr, "op in round %llu failed: %s\n",
+					(unsigned long long)user_data,
+					strerror(result));
+				return -result;
+			}
+		}
+		queued = 0;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	kvm_context_t kvm;
+	void *vm_mem;
+	int rounds = 100000;
+	int batch = 32;
+	int fd, r;
+	double t0, single, batched;
+
+	if (argc > 1)
+		rounds = atoi(argv[1]);
+	if (argc > 2)
+		batch = atoi(argv[2]);
+	if (batch < OPS_PER_ROUND || batch > KVM_BATCH_ENTRIES) {
+		fprintf(stderr, "ops per batch must be %d to %d\n",
+			OPS_PER_ROUND, KVM_BATCH_ENTRIES);
+		return 1;
+	}
+
+	kvm = kvm_init(&callbacks, NULL);
+	if (!kvm)
+		return 1;
+	kvm_disable_irqchip_creation(kvm);
+	if (kvm_create(kvm, 1024 * 1024, &vm_mem) < 0)
+		return 1;
+	if ((r = kvm_batch_init(kvm))) {
+		fprintf(stderr, "kvm_batch_init: %s\n", strerror(-r));
+		return 1;
+	}
+
+	/* the kext keys everything on the process, any fd reaches the same vm */
+	fd = open("/dev/kvm", O_RDWR);
+	if (fd == -1) {
+		perror("open /dev/kvm");
+		return 1;
+	}
+
+	t0 = now_ns();
+	if (run_single(fd, rounds))
+		return 1;
+	single = (now_ns() - t0) / (rounds * OPS_PER_ROUND);
+
+	t0 = now_ns();
+	if (run_batched(kvm, rounds, batch))
+		return 1;
+	batched = (now_ns() - t0) / (rounds * OPS_PER_ROUND);
+
+	printf("%d ops, %d per batch\n", rounds * OPS_PER_ROUND, batch);
+	printf("single:  %8.1f ns/op\n", single);
+	printf("batched: %8.1f ns/op (%.1fx)\n", batched, single / batched);
+
+	close(fd);
+	kvm_finalize(kvm);
+	return 0;
+}
@@ -0,0 +1,305 @@
+/*
+ * Runs the kernels in test/cpubench.c on the host (cpubench_native) and
+ * in a guest (test/cpubench.flat under kvmctl), a few rounds of each in
+ * turn, and reports how much slower every kernel is in the guest with a
+ * 95% confidence interval.  The results are appended to a file and set
+ * against the last ones there, so an exit path or ept change comes with
+ * a number and a verdict.
+ *
+ * usage: cpubench [-r rounds] [-l label] [-o results] [-n native]
+ *                 [-g guest command]
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define MAX_KERNELS 16
+#define MAX_SAMPLES 1024
+
+enum { HOST, GUEST };
+
+struct kernel {
+	char name[32];
+	unsigned long long check[2];
+	int checked[2];
+	double samples[2][MAX_SAMPLES];
+	int n[2];
+};
+
+static struct kernel kernels[MAX_KERNELS];
+static int nkernels;
+
+/* a previous result from the results file */
+struct result {
+	char kernel[32];
+	double ratio, lo, hi;
+};
+
+static struct kernel *find_kernel(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nkernels; i++)
+		if (!strcmp(kernels[i].name, name))
+			return &kernels[i];
+	if (nkernels == MAX_KERNELS) {
+		fprintf(stderr, "cpubench: too many kernels\n");
+		exit(1);
+	}
+	snprintf(kernels[nkernels].name, sizeof(kernels[0].name), "%s", name);
+	return &kernels[nkernels++];
+}
+
+/* "cpubench <kernel> <run> <cycles>", the guest's behind "GUEST: " */
+static int parse(const char *line, int side)
+{
+	char name[32], what[32];
+	unsigned long long v;
+	struct kernel *k;
+	const char *p = strstr(line, "cpubench ");
+	int n;
+
+	if (!p)
+		return 0;
+	n = sscanf(p, "cpubench %31s %31s %llu", name, what, &v);
+	if (n == 1 && !strcmp(name, "done"))
+		return 1;
+	if (n == 2 && !strcmp(what, "wrong")) {
+		fprintf(stderr, "cpubench: %s gave a wrong result on the %s\n",
+			name, side == HOST ? "host" : "guest");
+		exit(1);
+	}
+	if (n != 3)
+		return 0;
+	k = find_kernel(name);
+	if (!strcmp(what, "check")) {
+		k->check[side] = v;
+		k->checked[side] = 1;
+	} else if (k->n[side] < MAX_SAMPLES) {
+		k->samples[side][k->n[side]++] = v;
+	}
+	return 0;
+}
+
+/* the guest never exits, it's stopped once it says it's done */
+static void run(const char *cmd, int side)
+{
+	char line[512];
+	int fds[2], status, done = 0;
+	pid_t pid;
+	FILE *f;
+
+	if (pipe(fds)) {
+		perror("pipe");
+		exit(1);
+	}
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (!pid) {
+		/* its own group, so the stop gets whatever the shell started */
+		setpgid(0, 0);
+		dup2(fds[1], 1);
+		close(fds[0]);
+		close(fds[1]);
+		execl("/bin/sh", "sh", "-c", cmd, (char *)NULL);
+		_exit(127);
+	}
+	close(fds[1]);
+	f = fdopen(fds[0], "r");
+	while (!done && fgets(line, sizeof(line), f))
+		done = parse(line, side);
+	if (done)
+		kill(-pid, SIGTERM);
+	fclose(f);
+	waitpid(pid, &status, 0);
+	if (!done) {
+		fprintf(stderr, "cpubench: \"%s\" stopped early\n", cmd);
+		exit(1);
+	}
+}
+
+static void stats(const double *x, int n, double *mean, double *var)
+{
+	double sum = 0, sq = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += x[i];
+	*mean = sum / n;
+	for (i = 0; i < n; i++)
+		sq += (x[i] - *mean) * (x[i] - *mean);
+	*var = n > 1 ? sq / (n - 1) : 0;
+}
+
+/* two sided 95% student t, by degrees of freedom */
+static double t95(int df)
+{
+	static const double t[] = {
+		12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306,
+		2.262, 2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120,
+		2.110, 2.101, 2.093, 2.086, 2.080, 2.074, 2.069, 2.064,
+		2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+	};
+
+	if (df < 1)
+		return INFINITY;
+	if (df <= sizeof(t) / sizeof(t[0]))
+		return t[df - 1];
+	return 1.960;
+}
+
+/*
+ * guest mean over host mean, and the interval from the delta method: the
+ * ratio's relative error is the two means' relative errors added in
+ * quadrature, with the smaller side's degrees of freedom
+ */
+static void ratio(struct kernel *k, double *r, double *lo, double *hi,
+		  double *host, double *guest)
+{
+	double vh, vg, se;
+	int df;
+
+	stats(k->samples[HOST], k->n[HOST], host, &vh);
+	stats(k->samples[GUEST], k->n[GUEST], guest, &vg);
+	*r = *guest / *host;
+	se = *r * sqrt(vg / (k->n[GUEST] * *guest * *guest) +
+		       vh / (k->n[HOST] * *host * *host));
+	df = (k->n[HOST] < k->n[GUEST] ? k->n[HOST] : k->n[GUEST]) - 1;
+	*lo = *r - t95(df) * se;
+	*hi = *r + t95(df) * se;
+}
+
+/* "<time> <label> <kernel> <ratio> <lo> <hi> <host> <guest> <n>" */
+static int load_results(const char *path, struct result *last)
+{
+	char line[512], kernel[32];
+	double r, lo, hi;
+	int i, n = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f)
+		return 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%*s %*s %31s %lf %lf %lf", kernel, &r, &lo,
+			   &hi) != 4)
+			continue;
+		for (i = 0; i < n; i++)
+			if (!strcmp(last[i].kernel, kernel))
+				break;
+		if (i == n) {
+			if (n == MAX_KERNELS)
+				continue;
+			n++;
+		}
+		strcpy(last[i].kernel, kernel);
+		last[i].ratio = r;
+		last[i].lo = lo;
+		last[i].hi = hi;
+	}
+	fclose(f);
+	return n;
+}
+
+static const char *verdict(const struct result *old, double lo, double hi)
+{
+	if (!old)
+		return "new";
+	if (lo > old->hi)
+		return "slower";
+	if (hi < old->lo)
+		return "faster";
+	return "same";
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-r rounds] [-l label] [-o results] "
+		"[-n native] [-g guest command]\n", progname);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *native = "./cpubench_native";
+	const char *guest = "./kvmctl test/bootstrap test/cpubench.flat";
+	const char *results = "cpubench.results", *label = "-";
+	struct result last[MAX_KERNELS], *old;
+	double r, lo, hi, host_mean, guest_mean;
+	int rounds = 3, nlast, i, j, c;
+	time_t now = time(NULL);
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "r:l:o:n:g:")) != -1) {
+		switch (c) {
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		case 'o':
+			results = optarg;
+			break;
+		case 'n':
+			native = optarg;
+			break;
+		case 'g':
+			guest = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (rounds < 1 || optind != argc || strchr(label, ' '))
+		usage(argv[0]);
+
+	/* taking turns, so drift in the host's load hits both sides */
+	for (i = 0; i < rounds; i++) {
+		run(native, HOST);
+		run(guest, GUEST);
+	}
+
+	nlast = load_results(results, last);
+	f = fopen(results, "a");
+	if (!f)
+		perror(results);
+	printf("%-10s %12s %12s %7s %17s  %s\n", "kernel", "host cycles",
+	       "guest cycles", "ratio", "95% interval", "vs last");
+	for (i = 0; i < nkernels; i++) {
+		struct kernel *k = &kernels[i];
+
+		if (!k->n[HOST] || !k->n[GUEST])
+			continue;
+		if (k->check[HOST] != k->check[GUEST]) {
+			fprintf(stderr, "cpubench: %s gives %llu on the host "
+				"and %llu in the guest\n", k->name,
+				k->check[HOST], k->check[GUEST]);
+			continue;
+		}
+		ratio(k, &r, &lo, &hi, &host_mean, &guest_mean);
+		old = NULL;
+		for (j = 0; j < nlast; j++)
+			if (!strcmp(last[j].kernel, k->name))
+				old = &last[j];
+		printf("%-10s %12.0f %12.0f %7.4f %8.4f-%-8.4f  %s\n", k->name,
+		       host_mean, guest_mean, r, lo, hi, verdict(old, lo, hi));
+		if (f)
+			fprintf(f, "%ld %s %s %.5f %.5f %.5f %.0f %.0f %d\n",
+				(long)now, label, k->name, r, lo, hi,
+				host_mean, guest_mean, k->n[GUEST]);
+	}
+	if (f)
+		fclose(f);
+	return 0;
+}
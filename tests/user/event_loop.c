@@ -0,0 +1,416 @@
+/*
+ * kqueue event loop for device models, so the vcpu threads only run the
+ * guest and dispatch exits.  Any number of i/o threads wait on one kqueue.
+ * Every source is registered with EV_DISPATCH, so it's off while one
+ * thread runs its callback and no callback ever runs twice at once.
+ *
+ * Notifying a source is one kevent() and posting work is a compare and
+ * swap, neither takes a lock, so both are cheap enough for an exit
+ * handler.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+
+#include "kvmctl.h"
+
+#define KVM_EVENT_MAX_SOURCES	256
+#define KVM_EVENT_MAX_THREADS	16
+#define KVM_EVENT_BATCH		16
+
+/* the user event that stops every thread, past every source's ident */
+#define KVM_EVENT_STOP_IDENT	KVM_EVENT_MAX_SOURCES
+#define KVM_EVENT_STOP		((uintptr_t)-1)
+
+enum kvm_event_type {
+	KVM_EVENT_FD,
+	KVM_EVENT_TIMER,
+	KVM_EVENT_NOTIFIER,
+};
+
+struct kvm_event_source {
+	struct kvm_event_loop *loop;
+	enum kvm_event_type type;
+	int index;
+	/* bumped when the slot is freed, so stale events don't match */
+	unsigned gen;
+	struct kevent kev;
+	void (*cb)(void *opaque);
+	void *opaque;
+	/* under the loop's lock */
+	int running;
+	int removed;
+	int disabled;
+	int armed;		/* timers only */
+};
+
+struct kvm_event_loop {
+	int kq;
+	int nthreads;
+	pthread_t threads[KVM_EVENT_MAX_THREADS];
+	/* the source table and the flags in the sources */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+	struct kvm_event_source *sources[KVM_EVENT_MAX_SOURCES];
+	unsigned gens[KVM_EVENT_MAX_SOURCES];
+	/* kvm_event_post()'s stack, newest first */
+	struct kvm_event_work *posted;
+	struct kvm_event_source *post_source;
+};
+
+/* the source whose callback this thread is in */
+static __thread struct kvm_event_source *event_current;
+
+static void *event_udata(struct kvm_event_source *src)
+{
+	return (void *)((uintptr_t)src->gen << 16 | src->index);
+}
+
+static int event_ctl(struct kvm_event_source *src, int flags)
+{
+	struct kevent kev = src->kev;
+
+	kev.flags = flags;
+	if (kevent(src->loop->kq, &kev, 1, NULL, 0, NULL) == -1)
+		return -errno;
+	return 0;
+}
+
+static void event_dispatch(struct kvm_event_loop *loop, struct kevent *ev)
+{
+	uintptr_t udata = (uintptr_t)ev->udata;
+	struct kvm_event_source *src;
+	int index = udata & 0xffff, enable;
+
+	pthread_mutex_lock(&loop->lock);
+	src = index < KVM_EVENT_MAX_SOURCES ? loop->sources[index] : NULL;
+	/* removed after the kernel queued this */
+	if (!src || src->gen != udata >> 16 || src->removed) {
+		pthread_mutex_unlock(&loop->lock);
+		return;
+	}
+	src->running = 1;
+	if (src->type == KVM_EVENT_TIMER && !(src->kev.flags & EV_ONESHOT))
+		src->armed = 1;
+	else if (src->type == KVM_EVENT_TIMER)
+		src->armed = 0;
+	pthread_mutex_unlock(&loop->lock);
+
+	event_current = src;
+	src->cb(src->opaque);
+	event_current = NULL;
+
+	pthread_mutex_lock(&loop->lock);
+	src->running = 0;
+	if (src->removed) {
+		/* removed from its own callback, nobody waits for it */
+		pthread_cond_broadcast(&loop->idle);
+		if (src->removed == 2) {
+			loop->sources[src->index] = NULL;
+			free(src);
+		}
+		pthread_mutex_unlock(&loop->lock);
+		return;
+	}
+	/* a one shot timer that wasn't rearmed is gone from the kqueue */
+	enable = !src->disabled && (src->type != KVM_EVENT_TIMER || src->armed);
+	if (enable)
+		event_ctl(src, EV_ENABLE | EV_DISPATCH);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+static void *event_thread(void *opaque)
+{
+	struct kvm_event_loop *loop = opaque;
+	struct kevent evs[KVM_EVENT_BATCH];
+	int n, i;
+
+	for (;;) {
+		n = kevent(loop->kq, NULL, 0, evs, KVM_EVENT_BATCH, NULL);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1) {
+			perror("kvm event loop");
+			return NULL;
+		}
+		for (i = 0; i < n; i++) {
+			if ((uintptr_t)evs[i].udata == KVM_EVENT_STOP)
+				return NULL;
+			event_dispatch(loop, &evs[i]);
+		}
+	}
+}
+
+static struct kvm_event_source *event_new(struct kvm_event_loop *loop,
+					  enum kvm_event_type type,
+					  void (*cb)(void *), void *opaque)
+{
+	struct kvm_event_source *src;
+	int i;
+
+	src = calloc(1, sizeof(*src));
+	if (!src)
+		return NULL;
+	pthread_mutex_lock(&loop->lock);
+	for (i = 0; i < KVM_EVENT_MAX_SOURCES; i++)
+		if (!loop->sources[i])
+			break;
+	if (i == KVM_EVENT_MAX_SOURCES) {
+		pthread_mutex_unlock(&loop->lock);
+		fprintf(stderr, "kvm event loop: out of sources\n");
+		free(src);
+		return NULL;
+	}
+	src->loop = loop;
+	src->type = type;
+	src->index = i;
+	src->gen = ++loop->gens[i] & 0xffff;
+	src->cb = cb;
+	src->opaque = opaque;
+	loop->sources[i] = src;
+	pthread_mutex_unlock(&loop->lock);
+	return src;
+}
+
+static void event_free(struct kvm_event_source *src)
+{
+	struct kvm_event_loop *loop = src->loop;
+
+	pthread_mutex_lock(&loop->lock);
+	loop->sources[src->index] = NULL;
+	pthread_mutex_unlock(&loop->lock);
+	free(src);
+}
+
+static void event_run_posted(void *opaque)
+{
+	struct kvm_event_loop *loop = opaque;
+	struct kvm_event_work *list, *work, *fifo = NULL;
+
+	list = __sync_lock_test_and_set(&loop->posted, NULL);
+	/* oldest first */
+	while (list) {
+		work = list;
+		list = list->next;
+		work->next = fifo;
+		fifo = work;
+	}
+	while (fifo) {
+		work = fifo;
+		fifo = fifo->next;
+		work->fn(work);
+	}
+}
+
+struct kvm_event_loop *kvm_event_loop_create(int nthreads)
+{
+	struct kvm_event_loop *loop;
+	struct kevent kev;
+	int i;
+
+	if (nthreads < 1 || nthreads > KVM_EVENT_MAX_THREADS) {
+		fprintf(stderr, "kvm event loop: 1 to %d threads\n",
+			KVM_EVENT_MAX_THREADS);
+		return NULL;
+	}
+	loop = calloc(1, sizeof(*loop));
+	if (!loop)
+		return NULL;
+	loop->kq = kqueue();
+	if (loop->kq == -1) {
+		perror("kqueue");
+		free(loop);
+		return NULL;
+	}
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->idle, NULL);
+
+	/* level triggered, so once it fires every thread sees it */
+	EV_SET(&kev, KVM_EVENT_STOP_IDENT, EVFILT_USER, EV_ADD, 0, 0,
+	       (void *)KVM_EVENT_STOP);
+	loop->post_source = kvm_event_add_notifier(loop, event_run_posted, loop);
+	if (kevent(loop->kq, &kev, 1, NULL, 0, NULL) == -1 ||
+	    !loop->post_source) {
+		perror("kvm event loop");
+		free(loop->post_source);
+		close(loop->kq);
+		free(loop);
+		return NULL;
+	}
+
+	loop->nthreads = nthreads;
+	for (i = 0; i < nthreads; i++)
+		pthread_create(&loop->threads[i], NULL, event_thread, loop);
+	return loop;
+}
+
+void kvm_event_loop_destroy(struct kvm_event_loop *loop)
+{
+	struct kevent kev;
+	int i;
+
+	EV_SET(&kev, KVM_EVENT_STOP_IDENT, EVFILT_USER, 0, NOTE_TRIGGER, 0,
+	       (void *)KVM_EVENT_STOP);
+	kevent(loop->kq, &kev, 1, NULL, 0, NULL);
+	for (i = 0; i < loop->nthreads; i++)
+		pthread_join(loop->threads[i], NULL);
+	/* whatever was posted last still runs */
+	event_run_posted(loop);
+	close(loop->kq);
+	for (i = 0; i < KVM_EVENT_MAX_SOURCES; i++)
+		free(loop->sources[i]);
+	pthread_mutex_destroy(&loop->lock);
+	pthread_cond_destroy(&loop->idle);
+	free(loop);
+}
+
+struct kvm_event_source *kvm_event_add_fd(struct kvm_event_loop *loop,
+					  int fd, int write,
+					  void (*cb)(void *), void *opaque)
+{
+	struct kvm_event_source *src;
+	int r;
+
+	src = event_new(loop, KVM_EVENT_FD, cb, opaque);
+	if (!src)
+		return NULL;
+	EV_SET(&src->kev, fd, write ? EVFILT_WRITE : EVFILT_READ, 0, 0, 0,
+	       event_udata(src));
+	r = event_ctl(src, EV_ADD | EV_DISPATCH);
+	if (r) {
+		fprintf(stderr, "kvm event loop: fd %d: %s\n", fd, strerror(-r));
+		event_free(src);
+		return NULL;
+	}
+	return src;
+}
+
+struct kvm_event_source *kvm_event_add_timer(struct kvm_event_loop *loop,
+					     void (*cb)(void *), void *opaque)
+{
+	struct kvm_event_source *src;
+
+	src = event_new(loop, KVM_EVENT_TIMER, cb, opaque);
+	if (!src)
+		return NULL;
+	/* the index is a unique timer ident, nothing is armed yet */
+	EV_SET(&src->kev, src->index, EVFILT_TIMER, 0, NOTE_USECONDS, 0,
+	       event_udata(src));
+	return src;
+}
+
+int kvm_event_timer_set(struct kvm_event_source *src, unsigned us,
+			int periodic)
+{
+	struct kvm_event_loop *loop = src->loop;
+	int r = 0;
+
+	pthread_mutex_lock(&loop->lock);
+	if (src->armed) {
+		event_ctl(src, EV_DELETE);
+		src->armed = 0;
+	}
+	if (us) {
+		src->kev.data = us;
+		src->kev.flags = periodic ? 0 : EV_ONESHOT;
+		/*
+		 * from its own callback, the timer is armed but stays off
+		 * until the callback returns
+		 */
+		r = event_ctl(src, EV_ADD | EV_DISPATCH | src->kev.flags |
+			      (src->running ? EV_DISABLE : 0));
+		src->armed = !r;
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return r;
+}
+
+struct kvm_event_source *kvm_event_add_notifier(struct kvm_event_loop *loop,
+						void (*cb)(void *),
+						void *opaque)
+{
+	struct kvm_event_source *src;
+	int r;
+
+	src = event_new(loop, KVM_EVENT_NOTIFIER, cb, opaque);
+	if (!src)
+		return NULL;
+	EV_SET(&src->kev, src->index, EVFILT_USER, 0, 0, 0, event_udata(src));
+	/* EV_CLEAR: notifications before the callback runs are one */
+	r = event_ctl(src, EV_ADD | EV_CLEAR | EV_DISPATCH);
+	if (r) {
+		fprintf(stderr, "kvm event loop: notifier: %s\n", strerror(-r));
+		event_free(src);
+		return NULL;
+	}
+	return src;
+}
+
+void kvm_event_notify(struct kvm_event_source *src)
+{
+	struct kevent kev = src->kev;
+
+	kev.flags = 0;
+	kev.fflags = NOTE_TRIGGER;
+	kevent(src->loop->kq, &kev, 1, NULL, 0, NULL);
+}
+
+void kvm_event_set_enabled(struct kvm_event_source *src, int enabled)
+{
+	struct kvm_event_loop *loop = src->loop;
+
+	pthread_mutex_lock(&loop->lock);
+	if (src->disabled == !enabled) {
+		pthread_mutex_unlock(&loop->lock);
+		return;
+	}
+	src->disabled = !enabled;
+	/* a running callback turns it back on when it's done */
+	if (!src->running && (src->type != KVM_EVENT_TIMER || src->armed))
+		event_ctl(src, (enabled ? EV_ENABLE : EV_DISABLE) |
+			  EV_DISPATCH);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+void kvm_event_remove(struct kvm_event_source *src)
+{
+	struct kvm_event_loop *loop = src->loop;
+
+	pthread_mutex_lock(&loop->lock);
+	src->removed = 1;
+	if (src->type != KVM_EVENT_TIMER || src->armed)
+		event_ctl(src, EV_DELETE);
+	if (event_current == src) {
+		/* the thread frees it once the callback returns */
+		src->removed = 2;
+		pthread_mutex_unlock(&loop->lock);
+		return;
+	}
+	while (src->running)
+		pthread_cond_wait(&loop->idle, &loop->lock);
+	loop->sources[src->index] = NULL;
+	pthread_mutex_unlock(&loop->lock);
+	free(src);
+}
+
+void kvm_event_post(struct kvm_event_loop *loop, struct kvm_event_work *work)
+{
+	struct kvm_event_work *old;
+
+	do {
+		old = loop->posted;
+		work->next = old;
+	} while (!__sync_bool_compare_and_swap(&loop->posted, old, work));
+	/* whoever made the stack non empty wakes a thread up */
+	if (!old)
+		kvm_event_notify(loop->post_source);
+}
@@ -0,0 +1,361 @@
+/*
+ * Turns the guest rip samples written by "kvmctl --prof" into a flat
+ * profile, or into folded stacks for flamegraph.pl.
+ *
+ * usage: kvm_prof [-m System.map | -e vmlinux] [-f] [-n count] samples
+ *
+ * The kext only records rip, so every stack is one frame deep under the
+ * address space it came from: "kernel" for cpl 0, "user-<cr3>" otherwise.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+struct sym {
+	uint64_t addr;
+	uint64_t size;	/* 0 when the map doesn't say */
+	char *name;
+};
+
+struct bucket {
+	char *space;
+	const char *name;
+	uint64_t rip;	/* for [unknown] samples in folded output */
+	unsigned long count;
+};
+
+static struct sym *syms;
+static int nsyms, maxsyms;
+
+static struct bucket *buckets;
+static int nbuckets, maxbuckets;
+
+static void add_sym(uint64_t addr, uint64_t size, const char *name)
+{
+	if (nsyms == maxsyms) {
+		maxsyms = maxsyms ? maxsyms * 2 : 1024;
+		syms = realloc(syms, maxsyms * sizeof(*syms));
+		if (!syms) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	syms[nsyms].addr = addr;
+	syms[nsyms].size = size;
+	syms[nsyms].name = strdup(name);
+	nsyms++;
+}
+
+static int sym_cmp(const void *a, const void *b)
+{
+	const struct sym *x = a, *y = b;
+
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/* "ffffffff81000000 T _text", only text symbols */
+static void load_system_map(const char *path)
+{
+	char line[512], name[256], type;
+	unsigned long long addr;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%llx %c %255s", &addr, &type, name) != 3)
+			continue;
+		if (type == 'T' || type == 't')
+			add_sym(addr, 0, name);
+	}
+	fclose(f);
+}
+
+/* just enough elf to walk .symtab, for 32 and 64 bit little endian */
+#define EI_CLASS 4
+#define ELFCLASS32 1
+#define ELFCLASS64 2
+#define SHT_SYMTAB 2
+#define STT_FUNC 2
+
+struct elf64_ehdr {
+	unsigned char ident[16];
+	uint16_t type, machine;
+	uint32_t version;
+	uint64_t entry, phoff, shoff;
+	uint32_t flags;
+	uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct elf64_shdr {
+	uint32_t name, type;
+	uint64_t flags, addr, offset, size;
+	uint32_t link, info;
+	uint64_t addralign, entsize;
+};
+
+struct elf64_sym {
+	uint32_t name;
+	unsigned char info, other;
+	uint16_t shndx;
+	uint64_t value, size;
+};
+
+struct elf32_ehdr {
+	unsigned char ident[16];
+	uint16_t type, machine;
+	uint32_t version, entry, phoff, shoff, flags;
+	uint16_t ehsize, phentsize, phnum, shentsize, shnum, shstrndx;
+};
+
+struct elf32_shdr {
+	uint32_t name, type, flags, addr, offset, size, link, info;
+	uint32_t addralign, entsize;
+};
+
+struct elf32_sym {
+	uint32_t name, value, size;
+	unsigned char info, other;
+	uint16_t shndx;
+};
+
+static void *read_file(const char *path, size_t *len)
+{
+	FILE *f = fopen(path, "rb");
+	char *buf;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	*len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	buf = malloc(*len);
+	if (!buf || fread(buf, 1, *len, f) != *len) {
+		fprintf(stderr, "%s: can't read\n", path);
+		exit(1);
+	}
+	fclose(f);
+	return buf;
+}
+
+static void load_elf(const char *path)
+{
+	size_t len;
+	char *elf = read_file(path, &len);
+	int i, j, n;
+
+	if (len < 16 || memcmp(elf, "\177ELF", 4) != 0) {
+		fprintf(stderr, "%s: not an elf file\n", path);
+		exit(1);
+	}
+	if (elf[EI_CLASS] == ELFCLASS64) {
+		struct elf64_ehdr *eh = (void *)elf;
+		struct elf64_shdr *sh = (void *)(elf + eh->shoff);
+
+		for (i = 0; i < eh->shnum; i++) {
+			struct elf64_sym *st;
+			char *str;
+
+			if (sh[i].type != SHT_SYMTAB)
+				continue;
+			st = (void *)(elf + sh[i].offset);
+			str = elf + sh[sh[i].link].offset;
+			n = sh[i].size / sizeof(*st);
+			for (j = 0; j < n; j++)
+				if ((st[j].info & 0xf) == STT_FUNC && st[j].value)
+					add_sym(st[j].value, st[j].size,
+						str + st[j].name);
+		}
+	} else if (elf[EI_CLASS] == ELFCLASS32) {
+		struct elf32_ehdr *eh = (void *)elf;
+		struct elf32_shdr *sh = (void *)(elf + eh->shoff);
+
+		for (i = 0; i < eh->shnum; i++) {
+			struct elf32_sym *st;
+			char *str;
+
+			if (sh[i].type != SHT_SYMTAB)
+				continue;
+			st = (void *)(elf + sh[i].offset);
+			str = elf + sh[sh[i].link].offset;
+			n = sh[i].size / sizeof(*st);
+			for (j = 0; j < n; j++)
+				if ((st[j].info & 0xf) == STT_FUNC && st[j].value)
+					add_sym(st[j].value, st[j].size,
+						str + st[j].name);
+		}
+	}
+	free(elf);
+}
+
+/* the closest symbol at or below rip, if rip is inside it */
+static const char *lookup(uint64_t rip)
+{
+	int lo = 0, hi = nsyms - 1, mid, best = -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (syms[mid].addr <= rip) {
+			best = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (best < 0)
+		return NULL;
+	if (syms[best].size && rip >= syms[best].addr + syms[best].size)
+		return NULL;
+	return syms[best].name;
+}
+
+static void count(const char *space, const char *name, uint64_t rip)
+{
+	int i;
+
+	for (i = 0; i < nbuckets; i++) {
+		if (strcmp(buckets[i].space, space) != 0)
+			continue;
+		if (name ? buckets[i].name == name :
+		    !buckets[i].name && buckets[i].rip == rip) {
+			buckets[i].count++;
+			return;
+		}
+	}
+	if (nbuckets == maxbuckets) {
+		maxbuckets = maxbuckets ? maxbuckets * 2 : 1024;
+		buckets = realloc(buckets, maxbuckets * sizeof(*buckets));
+		if (!buckets) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	buckets[nbuckets].space = strdup(space);
+	buckets[nbuckets].name = name;
+	buckets[nbuckets].rip = name ? 0 : rip;
+	buckets[nbuckets].count = 1;
+	nbuckets++;
+}
+
+static int bucket_cmp(const void *a, const void *b)
+{
+	const struct bucket *x = a, *y = b;
+
+	return x->count > y->count ? -1 : x->count < y->count;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-m System.map | -e vmlinux] [-f] "
+		"[-n count] samples\n", progname);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long tsc, rip, cr3, first = 0, last = 0;
+	unsigned long long dropped = 0, exits = 0, overhead = 0;
+	unsigned long total = 0;
+	unsigned cpl, flags;
+	int folded = 0, top = 50;
+	char line[256], space[64];
+	FILE *f;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "m:e:fn:")) != -1) {
+		switch (c) {
+		case 'm':
+			load_system_map(optarg);
+			break;
+		case 'e':
+			load_elf(optarg);
+			break;
+		case 'f':
+			folded = 1;
+			break;
+		case 'n':
+			top = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+		usage(argv[0]);
+	qsort(syms, nsyms, sizeof(*syms), sym_cmp);
+
+	f = fopen(argv[optind], "r");
+	if (!f) {
+		perror(argv[optind]);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') {
+			sscanf(line, "# dropped %llu exits %llu overhead %llu",
+			       &dropped, &exits, &overhead);
+			continue;
+		}
+		if (sscanf(line, "%llx %llx %llx %u %u",
+			   &tsc, &rip, &cr3, &cpl, &flags) != 5)
+			continue;
+		if (!total)
+			first = tsc;
+		last = tsc;
+		total++;
+
+		/* kernel symbols don't mean anything in user mode */
+		if (cpl == 0) {
+			strcpy(space, "kernel");
+			count(space, lookup(rip), rip);
+		} else {
+			snprintf(space, sizeof(space), "user-%llx", cr3);
+			count(space, NULL, rip);
+		}
+	}
+	fclose(f);
+
+	if (!total) {
+		fprintf(stderr, "no samples\n");
+		return 1;
+	}
+	qsort(buckets, nbuckets, sizeof(*buckets), bucket_cmp);
+
+	if (folded) {
+		for (i = 0; i < nbuckets; i++) {
+			if (buckets[i].name)
+				printf("%s;%s %lu\n", buckets[i].space,
+				       buckets[i].name, buckets[i].count);
+			else
+				printf("%s;0x%llx %lu\n", buckets[i].space,
+				       (unsigned long long)buckets[i].rip,
+				       buckets[i].count);
+		}
+		return 0;
+	}
+
+	printf("%lu samples, %llu dropped, %llu timer exits\n",
+	       total, dropped, exits);
+	if (last > first)
+		printf("overhead %llu cycles, %.2f%% of the profiled time\n",
+		       overhead, 100.0 * overhead / (last - first));
+	printf("\n  %%      samples  symbol\n");
+	for (i = 0; i < nbuckets && i < top; i++) {
+		printf("%6.2f  %8lu  ", 100.0 * buckets[i].count / total,
+		       buckets[i].count);
+		if (buckets[i].name)
+			printf("%s\n", buckets[i].name);
+		else
+			printf("[%s] 0x%llx\n", buckets[i].space,
+			       (unsigned long long)buckets[i].rip);
+	}
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * Shows what every running vm is doing: time in the guest, exit rates by
+ * reason, interrupt injections and demand faults.  Reads sysctl kvm.stats,
+ * so it works from any process and never stops a vcpu.
+ *
+ * usage: kvm_top [-d seconds] [-n reasons] [-p pid] [-o]
+ *
+ * -o takes one interval, prints "pid vcpu name value" lines with rates per
+ * second, and exits.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+
+#include <linux/kvm.h>
+#include <asm/uapi_vmx.h>
+
+struct reason_name {
+	int reason;
+	const char *name;
+};
+
+static struct reason_name reason_names[] = { VMX_EXIT_REASONS };
+
+struct rate {
+	int reason;
+	double rate;
+};
+
+static const char *reason_name(int reason)
+{
+	static char buf[16];
+	int i;
+
+	for (i = 0; i < sizeof(reason_names) / sizeof(reason_names[0]); i++)
+		if (reason_names[i].reason == reason)
+			return reason_names[i].name;
+	snprintf(buf, sizeof(buf), "REASON_%d", reason);
+	return buf;
+}
+
+/* one struct kvm_vm_stats per vm, NULL and 0 when there are none */
+static struct kvm_vm_stats *read_stats(int *count)
+{
+	struct kvm_vm_stats *stats;
+	size_t len;
+
+	for (;;) {
+		if (sysctlbyname("kvm.stats", NULL, &len, NULL, 0) == -1) {
+			perror("sysctl kvm.stats");
+			exit(1);
+		}
+		/* room for a vm that starts in between */
+		len += sizeof(*stats);
+		stats = malloc(len);
+		if (!stats) {
+			perror("malloc");
+			exit(1);
+		}
+		if (sysctlbyname("kvm.stats", stats, &len, NULL, 0) == 0)
+			break;
+		free(stats);
+		if (errno != ENOMEM) {
+			perror("sysctl kvm.stats");
+			exit(1);
+		}
+	}
+	*count = len / sizeof(*stats);
+	return stats;
+}
+
+static struct kvm_vm_stats *find(struct kvm_vm_stats *stats, int count,
+				 struct kvm_vm_stats *vm)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		if (stats[i].pid == vm->pid && stats[i].vcpu == vm->vcpu)
+			return &stats[i];
+	return NULL;
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int rate_cmp(const void *a, const void *b)
+{
+	const struct rate *x = a, *y = b;
+
+	return x->rate < y->rate ? 1 : x->rate > y->rate ? -1 : 0;
+}
+
+static void show(struct kvm_vm_stats *old, struct kvm_vm_stats *cur,
+		 double secs, int reasons, int oneshot)
+{
+	struct rate rates[KVM_STATS_EXIT_REASONS];
+	double tsc = cur->tsc - old->tsc;
+	double guest, kext, throttled, total = 0;
+	int i;
+
+	if (tsc <= 0)
+		tsc = 1;
+	guest = 100.0 * (cur->guest_tsc - old->guest_tsc) / tsc;
+	/* sleeping out a cpu quota happens inside KVM_RUN too */
+	throttled = 100.0 * (cur->throttled_tsc - old->throttled_tsc) / tsc;
+	kext = 100.0 * (cur->run_tsc - old->run_tsc) / tsc - guest - throttled;
+	for (i = 0; i < KVM_STATS_EXIT_REASONS; i++) {
+		rates[i].reason = i;
+		rates[i].rate = (cur->exits[i] - old->exits[i]) / secs;
+		total += rates[i].rate;
+	}
+	qsort(rates, KVM_STATS_EXIT_REASONS, sizeof(rates[0]), rate_cmp);
+
+#define RATE(field) ((cur->field - old->field) / secs)
+	if (oneshot) {
+		printf("%u %u guest_pct %.1f\n", cur->pid, cur->vcpu, guest);
+		printf("%u %u kext_pct %.1f\n", cur->pid, cur->vcpu, kext);
+		printf("%u %u exits %.0f\n", cur->pid, cur->vcpu, total);
+		for (i = 0; i < KVM_STATS_EXIT_REASONS && rates[i].rate > 0; i++)
+			printf("%u %u exit_%s %.0f\n", cur->pid, cur->vcpu,
+			       reason_name(rates[i].reason), rates[i].rate);
+		printf("%u %u injected_irqs %.0f\n", cur->pid, cur->vcpu,
+		       RATE(injected_irqs));
+		printf("%u %u injected_nmis %.0f\n", cur->pid, cur->vcpu,
+		       RATE(injected_nmis));
+		printf("%u %u irq_lines %.0f\n", cur->pid, cur->vcpu,
+		       RATE(irq_lines));
+		printf("%u %u msis %.0f\n", cur->pid, cur->vcpu, RATE(msis));
+		printf("%u %u demand_faults %.0f\n", cur->pid, cur->vcpu,
+		       RATE(demand_faults));
+		printf("%u %u coalesced_pio %.0f\n", cur->pid, cur->vcpu,
+		       RATE(coalesced_pio));
+		printf("%u %u mmio_exits %.0f\n", cur->pid, cur->vcpu,
+		       RATE(mmio_exits));
+		printf("%u %u throttled %.0f\n", cur->pid, cur->vcpu,
+		       RATE(throttled));
+		printf("%u %u throttled_pct %.1f\n", cur->pid, cur->vcpu,
+		       throttled);
+		return;
+	}
+
+	printf("pid %-6u vcpu %u  guest %5.1f%%  kext %5.1f%%  "
+	       "user %5.1f%%  exits %9.0f/s\n", cur->pid, cur->vcpu,
+	       guest, kext, 100.0 - guest - kext - throttled, total);
+	if (cur->throttled != old->throttled)
+		printf("  throttled %5.1f%%  %6.0f/s over %6.0f periods/s\n",
+		       throttled, RATE(throttled), RATE(quota_periods));
+	printf("  injected irqs %8.0f/s  nmis %6.0f/s  irq lines %8.0f/s  "
+	       "msis %8.0f/s  demand faults %8.0f/s\n",
+	       RATE(injected_irqs), RATE(injected_nmis), RATE(irq_lines),
+	       RATE(msis), RATE(demand_faults));
+	if (cur->coalesced_pio != old->coalesced_pio)
+		printf("  coalesced pio %8.0f/s\n", RATE(coalesced_pio));
+	if (cur->mmio_exits != old->mmio_exits)
+		printf("  mmio exits %8.0f/s\n", RATE(mmio_exits));
+	for (i = 0; i < reasons && rates[i].rate > 0; i++)
+		printf("  %-24s %9.0f/s %5.1f%%\n",
+		       reason_name(rates[i].reason), rates[i].rate,
+		       100.0 * rates[i].rate / total);
+	printf("\n");
+#undef RATE
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "usage: %s [-d seconds] [-n reasons] [-p pid] [-o]\n",
+		progname);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct kvm_vm_stats *old, *cur, *prev;
+	int nold, ncur, i, c;
+	double delay = 1, t_old, t_cur;
+	int oneshot = 0, pid = 0, reasons = 10;
+
+	while ((c = getopt(argc, argv, "d:n:p:o")) != -1) {
+		switch (c) {
+		case 'd':
+			delay = atof(optarg);
+			break;
+		case 'n':
+			reasons = atoi(optarg);
+			break;
+		case 'p':
+			pid = atoi(optarg);
+			break;
+		case 'o':
+			oneshot = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (delay <= 0)
+		usage(argv[0]);
+
+	old = read_stats(&nold);
+	t_old = now();
+	for (;;) {
+		usleep(delay * 1000000);
+		cur = read_stats(&ncur);
+		t_cur = now();
+
+		if (!oneshot)
+			printf("\033[H\033[2J%d vms, every %.1fs\n\n",
+			       ncur, delay);
+		for (i = 0; i < ncur; i++) {
+			if (pid && cur[i].pid != pid)
+				continue;
+			/* new vms show up on the next round */
+			prev = find(old, nold, &cur[i]);
+			if (prev)
+				show(prev, &cur[i], t_cur - t_old, reasons,
+				     oneshot);
+		}
+		fflush(stdout);
+
+		free(old);
+		old = cur;
+		nold = ncur;
+		t_old = t_cur;
+		if (oneshot)
+			break;
+	}
+	free(old);
+	return 0;
+}
@@ -34,6 +34,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <pthread.h>
 #include "kvmctl.h"
 #include "kvm-abi-10.h"
 
@@ -41,11 +42,13 @@ static int kvm_abi = EXPECTED_KVM_API_VERSION;
 
 #define PAGE_SIZE 4096ul
 #define PAGE_MASK (~(PAGE_SIZE - 1))
+#define BITS_PER_LONG (8 * sizeof(unsigned long))
 
 /* FIXME: share this number with kvm */
 /* FIXME: or dynamically alloc/realloc regions */
 #define KVM_MAX_NUM_MEM_REGIONS 8u
-#define MAX_VCPUS 4
+/* what kvm_create() makes room for unless told otherwise */
+#define KVM_DEFAULT_MAX_VCPUS 4
 
 #include "../common.h"
 
@@ -56,25 +59,76 @@ static int kvm_abi = EXPECTED_KVM_API_VERSION;
  *
  * The verbose KVM context
  */
+/* guest ram as the device models see it */
+struct kvm_ram_slot {
+	int slot;
+	uint64_t gpa;
+	uint64_t size;
+	void *hva;
+	/// the slot was created with dirty logging
+	int log;
+	/// pages devices wrote, merged into kvm_get_dirty_pages()
+	unsigned long *dirty;
+	/// the slot was created with KVM_MEM_SHARE_ZERO
+	int share_zero;
+};
+
+/* a vcpu, and the handle callbacks get for it */
+struct kvm_vcpu {
+	kvm_context_t kvm;
+	int id;
+	/// the vm's table holds one reference, kvm_vcpu_get() the others
+	int refcount;
+	int fd;
+	struct kvm_run *run;
+	/// run->s holds the vcpu's registers, i.e. it has exited at least once
+	int regs_synced;
+	void *opaque;
+};
+
 struct kvm_context {
+	/// kvm_init() returns the first reference, kvm_get() takes more
+	int refcount;
+	/// vcpu creation and the dirty logging state
+	pthread_mutex_t lock;
 	/// Filedescriptor to /dev/kvm
 	int fd;
 	int vm_fd;
-	int vcpu_fd[MAX_VCPUS];
-	struct kvm_run *run[MAX_VCPUS];
+	/// size of vcpus, fixed once kvm_create() has allocated it
+	int max_vcpus;
+	struct kvm_vcpu **vcpus;
 	/// Callbacks that KVM uses to emulate various unvirtualizable functionality
 	struct kvm_callbacks *callbacks;
 	void *opaque;
 	/// A pointer to the memory used as the physical memory for the guest
 	void *physical_memory;
+	/// Size of the physical_memory mapping, guest address 0 is its first byte
+	unsigned long physical_memory_size;
 	/// is dirty pages logging enabled for all regions or not
 	int dirty_pages_log_all;
 	/// memory regions parameters
 	struct kvm_memory_region mem_regions[KVM_MAX_NUM_MEM_REGIONS];
+	/// every ram slot, sorted by guest address
+	struct kvm_ram_slot ram[KVM_MAX_NUM_MEM_REGIONS];
+	int nr_ram;
+	/// device threads look slots up while the vcpu thread changes them
+	pthread_rwlock_t ram_lock;
 	/// do not create in-kernel irqchip if set
 	int no_irqchip_creation;
+	/// kvm_create() registers ram with KVM_MEM_SHARE_ZERO
+	int share_zero;
 	/// in-kernel irqchip status
 	int irqchip_in_kernel;
+	/// register classes the kernel keeps in kvm_run.s for us
+	__u64 sync_regs;
+	/// ioctl ring shared with the kernel, NULL until kvm_batch_init()
+	struct kvm_batch_ring *batch_ring;
+	/// guest rip samples from the kernel, NULL unless profiling
+	struct kvm_prof_ring *prof_ring;
+	/// the kernel can queue writes to registered ports instead of exiting
+	int coalesced_pio;
+	/// one thread at a time replays the coalesced rings
+	pthread_mutex_t coalesced_lock;
 };
 
 /*
@@ -99,6 +153,81 @@ static void kvm_memory_region_clear_params(kvm_context_t kvm, int regnum)
 	kvm->mem_regions[regnum].memory_size = 0;
 }
 
+/*
+ * the ram slots device models can reach
+ */
+static int kvm_add_ram(kvm_context_t kvm, int slot, uint64_t gpa,
+		       uint64_t size, void *hva, __u32 flags)
+{
+	struct kvm_ram_slot *r;
+	unsigned long words;
+	int i;
+
+	words = (size / PAGE_SIZE + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	pthread_rwlock_wrlock(&kvm->ram_lock);
+	if (kvm->nr_ram == KVM_MAX_NUM_MEM_REGIONS) {
+		pthread_rwlock_unlock(&kvm->ram_lock);
+		return -ENOSPC;
+	}
+	for (i = kvm->nr_ram; i > 0 && kvm->ram[i - 1].gpa > gpa; i--)
+		kvm->ram[i] = kvm->ram[i - 1];
+	r = &kvm->ram[i];
+	r->slot = slot;
+	r->gpa = gpa;
+	r->size = size;
+	r->hva = hva;
+	r->log = (flags & KVM_MEM_LOG_DIRTY_PAGES) != 0;
+	r->share_zero = (flags & KVM_MEM_SHARE_ZERO) != 0;
+	r->dirty = calloc(words, sizeof(unsigned long));
+	kvm->nr_ram++;
+	pthread_rwlock_unlock(&kvm->ram_lock);
+	return 0;
+}
+
+static void kvm_del_ram(kvm_context_t kvm, int slot)
+{
+	int i;
+
+	pthread_rwlock_wrlock(&kvm->ram_lock);
+	for (i = 0; i < kvm->nr_ram; i++)
+		if (kvm->ram[i].slot == slot)
+			break;
+	if (i < kvm->nr_ram) {
+		free(kvm->ram[i].dirty);
+		kvm->nr_ram--;
+		for (; i < kvm->nr_ram; i++)
+			kvm->ram[i] = kvm->ram[i + 1];
+	}
+	pthread_rwlock_unlock(&kvm->ram_lock);
+}
+
+/* with ram_lock held for reading */
+static struct kvm_ram_slot *kvm_find_ram(kvm_context_t kvm, uint64_t gpa)
+{
+	struct kvm_ram_slot *r;
+
+	/* a handful of slots, and the first one is where most dma goes */
+	for (r = kvm->ram; r < kvm->ram + kvm->nr_ram; r++)
+		if (gpa >= r->gpa && gpa - r->gpa < r->size)
+			return r;
+	return NULL;
+}
+
+static void kvm_ram_mark_dirty(kvm_context_t kvm, struct kvm_ram_slot *r,
+			       uint64_t gpa, uint64_t len)
+{
+	unsigned long first, last, page;
+
+	if (!r->dirty || !len || !(r->log || kvm->dirty_pages_log_all))
+		return;
+	first = (gpa - r->gpa) / PAGE_SIZE;
+	last = (gpa - r->gpa + len - 1) / PAGE_SIZE;
+	/* device threads mark pages concurrently */
+	for (page = first; page <= last; page++)
+		__sync_fetch_and_or(&r->dirty[page / BITS_PER_LONG],
+				    1ul << (page % BITS_PER_LONG));
+}
+
 /* 
  * dirty pages logging control 
  */
@@ -140,10 +269,16 @@ static int kvm_dirty_pages_log_change_all(kvm_context_t kvm, __u32 flag)
  */
 int kvm_dirty_pages_log_enable_all(kvm_context_t kvm)
 {
-	if (kvm->dirty_pages_log_all)
-		return 0;
-	kvm->dirty_pages_log_all = 1;
-	return kvm_dirty_pages_log_change_all(kvm, KVM_MEM_LOG_DIRTY_PAGES);
+	int r = 0;
+
+	pthread_mutex_lock(&kvm->lock);
+	if (!kvm->dirty_pages_log_all) {
+		kvm->dirty_pages_log_all = 1;
+		r = kvm_dirty_pages_log_change_all(kvm,
+						   KVM_MEM_LOG_DIRTY_PAGES);
+	}
+	pthread_mutex_unlock(&kvm->lock);
+	return r;
 }
 
 /**
@@ -152,10 +287,15 @@ int kvm_dirty_pages_log_enable_all(kvm_context_t kvm)
  */
 int kvm_dirty_pages_log_reset(kvm_context_t kvm)
 {
-	if (!kvm->dirty_pages_log_all)
-		return 0;
-	kvm->dirty_pages_log_all = 0;
-	return kvm_dirty_pages_log_change_all(kvm, 0);
+	int r = 0;
+
+	pthread_mutex_lock(&kvm->lock);
+	if (kvm->dirty_pages_log_all) {
+		kvm->dirty_pages_log_all = 0;
+		r = kvm_dirty_pages_log_change_all(kvm, 0);
+	}
+	pthread_mutex_unlock(&kvm->lock);
+	return r;
 }
 
 
@@ -189,14 +329,23 @@ kvm_context_t kvm_init(struct kvm_callbacks *callbacks,
 	    goto out_close;
 	}
 	kvm_abi = r;
-	kvm = malloc(sizeof(*kvm));
+	kvm = calloc(1, sizeof(*kvm));
+	if (!kvm)
+		goto out_close;
+	kvm->refcount = 1;
+	pthread_mutex_init(&kvm->lock, NULL);
 	kvm->fd = fd;
 	kvm->vm_fd = -1;
+	kvm->max_vcpus = KVM_DEFAULT_MAX_VCPUS;
 	kvm->callbacks = callbacks;
 	kvm->opaque = opaque;
 	kvm->dirty_pages_log_all = 0;
 	kvm->no_irqchip_creation = 0;
 	memset(&kvm->mem_regions, 0, sizeof(kvm->mem_regions));
+	kvm->nr_ram = 0;
+	pthread_rwlock_init(&kvm->ram_lock, NULL);
+	kvm->coalesced_pio = 0;
+	pthread_mutex_init(&kvm->coalesced_lock, NULL);
 
 	return kvm;
  out_close:
@@ -204,47 +353,177 @@ kvm_context_t kvm_init(struct kvm_callbacks *callbacks,
 	return NULL;
 }
 
-void kvm_finalize(kvm_context_t kvm)
+static void kvm_destroy(kvm_context_t kvm)
 {
-    	if (kvm->vcpu_fd[0] != -1)
-		close(kvm->vcpu_fd[0]);
+	struct kvm_vcpu *vcpu;
+	int i;
+
+	for (i = 0; kvm->vcpus && i < kvm->max_vcpus; i++) {
+		vcpu = kvm->vcpus[i];
+		if (!vcpu)
+			continue;
+		close(vcpu->fd);
+		/* every other reference held one on the vm as well */
+		free(vcpu);
+	}
+	free(kvm->vcpus);
     	if (kvm->vm_fd != -1)
 		close(kvm->vm_fd);
 	close(kvm->fd);
+	while (kvm->nr_ram)
+		kvm_del_ram(kvm, kvm->ram[0].slot);
+	pthread_rwlock_destroy(&kvm->ram_lock);
+	pthread_mutex_destroy(&kvm->coalesced_lock);
+	pthread_mutex_destroy(&kvm->lock);
 	free(kvm);
 }
 
+kvm_context_t kvm_get(kvm_context_t kvm)
+{
+	__sync_fetch_and_add(&kvm->refcount, 1);
+	return kvm;
+}
+
+void kvm_put(kvm_context_t kvm)
+{
+	if (__sync_sub_and_fetch(&kvm->refcount, 1) == 0)
+		kvm_destroy(kvm);
+}
+
+void kvm_finalize(kvm_context_t kvm)
+{
+	kvm_put(kvm);
+}
+
+int kvm_set_max_vcpus(kvm_context_t kvm, int max)
+{
+	int r = 0;
+
+	if (max < 1)
+		return -EINVAL;
+	pthread_mutex_lock(&kvm->lock);
+	/* the table is sized when the vm is created */
+	if (kvm->vcpus)
+		r = -EBUSY;
+	else
+		kvm->max_vcpus = max;
+	pthread_mutex_unlock(&kvm->lock);
+	return r;
+}
+
+int kvm_get_max_vcpus(kvm_context_t kvm)
+{
+	return kvm->max_vcpus;
+}
+
+kvm_vcpu_context_t kvm_vcpu_get(kvm_context_t kvm, int vcpu)
+{
+	struct kvm_vcpu *v;
+
+	if (vcpu < 0 || vcpu >= kvm->max_vcpus || !kvm->vcpus)
+		return NULL;
+	pthread_mutex_lock(&kvm->lock);
+	v = kvm->vcpus[vcpu];
+	if (v) {
+		v->refcount++;
+		kvm_get(kvm);
+	}
+	pthread_mutex_unlock(&kvm->lock);
+	return v;
+}
+
+void kvm_vcpu_put(kvm_vcpu_context_t vcpu)
+{
+	kvm_context_t kvm = vcpu->kvm;
+
+	pthread_mutex_lock(&kvm->lock);
+	vcpu->refcount--;
+	pthread_mutex_unlock(&kvm->lock);
+	kvm_put(kvm);
+}
+
+kvm_context_t kvm_vcpu_kvm(kvm_vcpu_context_t vcpu)
+{
+	return vcpu->kvm;
+}
+
+int kvm_vcpu_id(kvm_vcpu_context_t vcpu)
+{
+	return vcpu->id;
+}
+
+void *kvm_vcpu_opaque(kvm_vcpu_context_t vcpu)
+{
+	return vcpu->opaque;
+}
+
+void kvm_vcpu_set_opaque(kvm_vcpu_context_t vcpu, void *opaque)
+{
+	vcpu->opaque = opaque;
+}
+
 void kvm_disable_irqchip_creation(kvm_context_t kvm)
 {
 	kvm->no_irqchip_creation = 1;
 }
 
+void kvm_set_share_zero(kvm_context_t kvm, int enable)
+{
+	kvm->share_zero = enable;
+}
+
 int kvm_create_vcpu(kvm_context_t kvm, int slot)
 {
+	struct kvm_vcpu *vcpu;
 	long mmap_size;
 	int r;
 
+	if (slot < 0 || slot >= kvm->max_vcpus)
+		return -EINVAL;
+	vcpu = calloc(1, sizeof(*vcpu));
+	if (!vcpu)
+		return -ENOMEM;
+	vcpu->kvm = kvm;
+	vcpu->id = slot;
+	vcpu->refcount = 1;
+
+	pthread_mutex_lock(&kvm->lock);
+	if (kvm->vcpus[slot]) {
+		r = -EEXIST;
+		goto out_free;
+	}
 	r = ioctl(kvm->vm_fd, KVM_CREATE_VCPU, slot);
 	if (r == -1) {
 		r = -errno;
 		fprintf(stderr, "kvm_create_vcpu: %m\n");
-		return r;
+		goto out_free;
 	}
-	kvm->vcpu_fd[slot] = r;
+	vcpu->fd = r;
 	mmap_size = ioctl(kvm->fd, KVM_GET_VCPU_MMAP_SIZE, 0);
 	if (mmap_size == -1) {
 		r = -errno;
 		fprintf(stderr, "get vcpu mmap size: %m\n");
-		return r;
+		close(vcpu->fd);
+		goto out_free;
 	}
-  ioctl(kvm->fd, KVM_MMAP_VCPU, &kvm->run[slot]);
-	//kvm->run[slot] = mmap(NULL, mmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, kvm->vcpu_fd[slot], 0);
-	/*if (kvm->run[slot] == MAP_FAILED) {
+  ioctl(kvm->fd, KVM_MMAP_VCPU, &vcpu->run);
+	vcpu->run->kvm_valid_regs = kvm->sync_regs;
+	//vcpu->run = mmap(NULL, mmap_size, PROT_READ|PROT_WRITE, MAP_SHARED, vcpu->fd, 0);
+	/*if (vcpu->run == MAP_FAILED) {
 		r = -errno;
 		fprintf(stderr, "mmap vcpu area: %m\n");
 		return r;
 	}*/
+	/* lookups of a slot don't take the lock, it has to be complete */
+	__sync_synchronize();
+	kvm->vcpus[slot] = vcpu;
+	pthread_mutex_unlock(&kvm->lock);
 	return 0;
+
+out_free:
+	pthread_mutex_unlock(&kvm->lock);
+	free(vcpu);
+	return r;
 }
 
 int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
@@ -275,7 +554,11 @@ int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
 	if (memory >= pcimem)
 		extended_memory.memory_size = pcimem - exmem;
 
-	kvm->vcpu_fd[0] = -1;
+	pthread_mutex_lock(&kvm->lock);
+	kvm->vcpus = calloc(kvm->max_vcpus, sizeof(*kvm->vcpus));
+	pthread_mutex_unlock(&kvm->lock);
+	if (!kvm->vcpus)
+		return -ENOMEM;
 
 	fd = ioctl(fd, KVM_CREATE_VM, 0);
 	if (fd == -1) {
@@ -284,7 +567,11 @@ int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
 	}
 	kvm->vm_fd = fd;
 
-	kvm->physical_memory = mmap(NULL, extended_memory.memory_size + exmem, 7, MAP_ANON|MAP_SHARED, -1, 0);
+	kvm->physical_memory_size = extended_memory.memory_size + exmem;
+	kvm->physical_memory = mmap(NULL, kvm->physical_memory_size, 7, MAP_ANON|MAP_SHARED, -1, 0);
+
+	if (kvm->share_zero)
+		low_memory.flags = extended_memory.flags = KVM_MEM_SHARE_ZERO;
 
 	/* 640K should be enough. */
   low_memory.userspace_addr = kvm->physical_memory;
@@ -293,6 +580,9 @@ int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
 		fprintf(stderr, "kvm_create_memory_region: %m\n");
 		return -1;
 	}
+	kvm_add_ram(kvm, low_memory.slot, low_memory.guest_phys_addr,
+		    low_memory.memory_size, kvm->physical_memory,
+		    low_memory.flags);
 	if (extended_memory.memory_size) {
     extended_memory.userspace_addr = kvm->physical_memory + exmem;
 		r = ioctl(fd, KVM_SET_USER_MEMORY_REGION, &extended_memory);
@@ -300,6 +590,11 @@ int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
 			fprintf(stderr, "kvm_create_memory_region: %m\n");
 			return -1;
 		}
+		kvm_add_ram(kvm, extended_memory.slot,
+			    extended_memory.guest_phys_addr,
+			    extended_memory.memory_size,
+			    kvm->physical_memory + exmem,
+			    extended_memory.flags);
 	}
 
   *vm_mem = kvm->physical_memory;
@@ -342,6 +637,11 @@ int kvm_create(kvm_context_t kvm, unsigned long phys_mem_bytes, void **vm_mem)
 				printf("Create kernel PIC irqchip failed\n");
 		}
 	}
+	/* __ioctl hands back the extension value the kext left in errno */
+	r = ioctl(kvm->fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS);
+	kvm->sync_regs = r & KVM_SYNC_X86_REGS;
+	r = ioctl(kvm->fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO);
+	kvm->coalesced_pio = r == 1;
 	r = kvm_create_vcpu(kvm, 0);
 	if (r < 0)
 		return r;
@@ -368,6 +668,9 @@ void *kvm_create_phys_mem(kvm_context_t kvm, unsigned long phys_start,
 	    return 0;
 
 	kvm_memory_region_save_params(kvm, &memory);
+	kvm_del_ram(kvm, slot);
+	if (!len)
+		return 0;
 
 	if (writable)
 		prot |= PROT_WRITE;
@@ -375,6 +678,7 @@ void *kvm_create_phys_mem(kvm_context_t kvm, unsigned long phys_start,
 	ptr = mmap(NULL, len, prot, MAP_SHARED, fd, phys_start);
 	if (ptr == MAP_FAILED)
 		return 0;
+	kvm_add_ram(kvm, slot, phys_start, len, ptr, memory.flags);
 	return ptr;
 }
 
@@ -429,6 +733,282 @@ int kvm_destroy_memory_alias(kvm_context_t kvm, int slot)
 	return kvm_create_memory_alias(kvm, slot, 0, 0, 0);
 }
 
+int kvm_balloon_release(kvm_context_t kvm, struct kvm_balloon_range *ranges,
+			int n)
+{
+	struct kvm_balloon_op *op;
+	unsigned long start, len;
+	void *p;
+	int i, r;
+
+	op = malloc(sizeof *op + n * sizeof *ranges);
+	if (!op)
+		return -ENOMEM;
+	op->nranges = n;
+	memcpy(op->ranges, ranges, n * sizeof *ranges);
+
+	/* the kext unwires and unmaps first so the guest can't see the new pages */
+	r = ioctl(kvm->vm_fd, KVM_BALLOON_OP, op);
+	if (r) {
+		free(op);
+		return -r;
+	}
+	r = op->npages;
+	free(op);
+
+	/* now drop the host copies, replacing the range discards the old pages */
+	for (i = 0; i < n; ++i) {
+		start = ranges[i].gfn * PAGE_SIZE;
+		len = ranges[i].npages * PAGE_SIZE;
+		if (start >= kvm->physical_memory_size)
+			continue;
+		if (len > kvm->physical_memory_size - start)
+			len = kvm->physical_memory_size - start;
+		p = mmap(kvm->physical_memory + start, len, PROT_READ|PROT_WRITE|PROT_EXEC,
+			 MAP_FIXED|MAP_ANON|MAP_SHARED, -1, 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "balloon remap: %m\n");
+			return -errno;
+		}
+	}
+
+	return r;
+}
+
+int kvm_unshare_zero(kvm_context_t kvm, unsigned long phys_start,
+		     unsigned long len)
+{
+	struct kvm_balloon_range range = {
+		.gfn = phys_start / PAGE_SIZE,
+		.npages = (phys_start + len + PAGE_SIZE - 1) / PAGE_SIZE
+			  - phys_start / PAGE_SIZE,
+	};
+	int r;
+
+	r = ioctl(kvm->vm_fd, KVM_UNSHARE_ZERO, &range);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_batch_init(kvm_context_t kvm)
+{
+	void *ring;
+	__u64 addr;
+	int r;
+
+	if (kvm->batch_ring)
+		return 0;
+	/* the kext wires and maps exactly one page */
+	if (posix_memalign(&ring, PAGE_SIZE, PAGE_SIZE))
+		return -ENOMEM;
+	memset(ring, 0, PAGE_SIZE);
+	addr = (unsigned long)ring;
+	r = ioctl(kvm->vm_fd, KVM_BATCH_SETUP, &addr);
+	if (r) {
+		free(ring);
+		return -r;
+	}
+	kvm->batch_ring = ring;
+	return 0;
+}
+
+int kvm_batch_queue(kvm_context_t kvm, unsigned long cmd, void *arg,
+		    uint64_t user_data)
+{
+	struct kvm_batch_ring *ring = kvm->batch_ring;
+	struct kvm_batch_sqe *sqe;
+
+	if (ring->sq_tail - ring->sq_head == KVM_BATCH_ENTRIES)
+		return -EBUSY;
+	if (__ioctl_has_self(cmd))
+		*(__u64 *)arg = (__u64)arg;
+
+	sqe = &ring->sqes[ring->sq_tail & (KVM_BATCH_ENTRIES - 1)];
+	sqe->cmd = cmd;
+	sqe->flags = 0;
+	sqe->addr = (unsigned long)arg;
+	sqe->user_data = user_data;
+	ring->sq_tail++;
+	return 0;
+}
+
+int kvm_batch_submit(kvm_context_t kvm)
+{
+	__u32 count = 0;
+	int r;
+
+	r = ioctl(kvm->vm_fd, KVM_BATCH_SUBMIT, &count);
+	if (r)
+		return -r;
+	return count;
+}
+
+int kvm_batch_reap(kvm_context_t kvm, uint64_t *user_data, int *result)
+{
+	struct kvm_batch_ring *ring = kvm->batch_ring;
+	struct kvm_batch_cqe *cqe;
+
+	if (ring->cq_head == ring->cq_tail)
+		return 0;
+	cqe = &ring->cqes[ring->cq_head & (KVM_BATCH_ENTRIES - 1)];
+	*user_data = cqe->user_data;
+	*result = cqe->result;
+	ring->cq_head++;
+	return 1;
+}
+
+int kvm_prof_start(kvm_context_t kvm, int mode, uint64_t period, size_t size)
+{
+	struct kvm_prof_setup setup;
+	void *ring;
+	int r;
+
+	if (kvm->prof_ring)
+		return -EBUSY;
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (posix_memalign(&ring, PAGE_SIZE, size))
+		return -ENOMEM;
+	memset(ring, 0, size);
+	setup.addr = (unsigned long)ring;
+	setup.size = size;
+	setup.mode = mode;
+	setup.period = period;
+	r = ioctl(kvm->vm_fd, KVM_PROF_SETUP, &setup);
+	if (r) {
+		free(ring);
+		return -r;
+	}
+	kvm->prof_ring = ring;
+	return 0;
+}
+
+int kvm_prof_stop(kvm_context_t kvm)
+{
+	struct kvm_prof_setup setup;
+	int r;
+
+	if (!kvm->prof_ring)
+		return 0;
+	memset(&setup, 0, sizeof(setup));
+	r = ioctl(kvm->vm_fd, KVM_PROF_SETUP, &setup);
+	if (r)
+		return -r;
+	/* the ring stays readable, kvm_prof_release() frees it */
+	return 0;
+}
+
+void kvm_prof_release(kvm_context_t kvm)
+{
+	free(kvm->prof_ring);
+	kvm->prof_ring = NULL;
+}
+
+int kvm_prof_read(kvm_context_t kvm, struct kvm_prof_sample *samples, int max)
+{
+	struct kvm_prof_ring *ring = kvm->prof_ring;
+	__u32 head;
+	int n = 0;
+
+	if (!ring)
+		return 0;
+	head = ring->head;
+	/* don't read a sample before the head that published it */
+	__sync_synchronize();
+	while (ring->tail != head && n < max) {
+		samples[n++] = ring->samples[ring->tail & (ring->entries - 1)];
+		__sync_synchronize();
+		ring->tail++;
+	}
+	return n;
+}
+
+void kvm_prof_stats(kvm_context_t kvm, uint64_t *dropped, uint64_t *exits,
+		    uint64_t *overhead)
+{
+	struct kvm_prof_ring *ring = kvm->prof_ring;
+
+	*dropped = ring ? ring->dropped : 0;
+	*exits = ring ? ring->exits : 0;
+	*overhead = ring ? ring->overhead : 0;
+}
+
+int kvm_set_cpu_quota(kvm_context_t kvm, uint64_t period, uint64_t runtime)
+{
+	struct kvm_cpu_quota quota;
+	int r;
+
+	quota.period = period;
+	quota.runtime = runtime;
+	r = ioctl(kvm->vm_fd, KVM_SET_CPU_QUOTA, &quota);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_register_coalesced_pio(kvm_context_t kvm, uint16_t port, uint32_t size)
+{
+	struct kvm_coalesced_mmio_zone zone;
+	int r;
+
+	if (!kvm->coalesced_pio)
+		return -ENOSYS;
+	memset(&zone, 0, sizeof(zone));
+	zone.addr = port;
+	zone.size = size;
+	zone.pio = 1;
+	r = ioctl(kvm->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone);
+	if (r)
+		return -r;
+	return 0;
+}
+
+static void kvm_pio_out(kvm_context_t kvm, struct kvm_vcpu *vcpu,
+			uint16_t addr, int size, void *p)
+{
+	switch (size) {
+	case 1:
+		kvm->callbacks->outb(kvm->opaque, vcpu, addr, *(uint8_t *)p);
+		break;
+	case 2:
+		kvm->callbacks->outw(kvm->opaque, vcpu, addr, *(uint16_t *)p);
+		break;
+	case 4:
+		kvm->callbacks->outl(kvm->opaque, vcpu, addr, *(uint32_t *)p);
+		break;
+	}
+}
+
+void kvm_flush_coalesced_pio(kvm_context_t kvm)
+{
+	struct kvm_coalesced_mmio_ring *ring;
+	struct kvm_coalesced_mmio *entry;
+	struct kvm_vcpu *vcpu;
+	int i;
+
+	if (!kvm->coalesced_pio || !kvm->vcpus)
+		return;
+	pthread_mutex_lock(&kvm->coalesced_lock);
+	for (i = 0; i < kvm->max_vcpus; i++) {
+		vcpu = kvm->vcpus[i];
+		if (!vcpu)
+			continue;
+		/* the writes are replayed as the vcpu that queued them */
+		ring = (void *)vcpu->run +
+			KVM_COALESCED_MMIO_PAGE_OFFSET * PAGE_SIZE;
+		while (ring->first != *(volatile __u32 *)&ring->last) {
+			/* the entry is only complete once last has moved */
+			__sync_synchronize();
+			entry = &ring->coalesced_mmio[ring->first];
+			kvm_pio_out(kvm, vcpu, entry->phys_addr, entry->len,
+				    entry->data);
+			__sync_synchronize();
+			ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
+		}
+	}
+	pthread_mutex_unlock(&kvm->coalesced_lock);
+}
+
 static int kvm_get_map(kvm_context_t kvm, int ioctl_num, int slot, void *buf)
 {
 	int r;
@@ -439,14 +1019,39 @@ static int kvm_get_map(kvm_context_t kvm, int ioctl_num, int slot, void *buf)
 	log.dirty_bitmap = buf;
 
 	r = ioctl(kvm->vm_fd, ioctl_num, &log);
-	if (r == -1)
-		return -errno;
+	if (r)
+		return -r;
 	return 0;
 }
 
 int kvm_get_dirty_pages(kvm_context_t kvm, int slot, void *buf)
 {
-	return kvm_get_map(kvm, KVM_GET_DIRTY_LOG, slot, buf);
+	unsigned long *bitmap = buf, words, i;
+	int r, j, found = 0;
+
+	/* the kext has no KVM_GET_DIRTY_LOG, then only device writes count */
+	r = kvm_get_map(kvm, KVM_GET_DIRTY_LOG, slot, buf);
+	if (r && r != -EOPNOTSUPP && r != -ENOTTY)
+		return r;
+	/* the kernel doesn't see what devices wrote, add that */
+	pthread_rwlock_rdlock(&kvm->ram_lock);
+	for (j = 0; j < kvm->nr_ram; j++) {
+		struct kvm_ram_slot *ram = &kvm->ram[j];
+
+		if (ram->slot != slot)
+			continue;
+		found = 1;
+		words = (ram->size / PAGE_SIZE + BITS_PER_LONG - 1) /
+			BITS_PER_LONG;
+		if (r)
+			memset(bitmap, 0, words * sizeof *bitmap);
+		if (!ram->dirty)
+			continue;
+		for (i = 0; i < words; i++)
+			bitmap[i] |= __sync_lock_test_and_set(&ram->dirty[i], 0);
+	}
+	pthread_rwlock_unlock(&kvm->ram_lock);
+	return found ? 0 : r;
 }
 
 int kvm_get_mem_map(kvm_context_t kvm, int slot, void *buf)
@@ -474,6 +1079,183 @@ int kvm_get_mem_map(kvm_context_t kvm, int slot, void *buf)
 #endif /* KVM_GET_MEM_MAP */
 }
 
+void *kvm_guest_ptr(kvm_context_t kvm, uint64_t gpa, size_t len)
+{
+	struct kvm_ram_slot *r;
+	void *hva = NULL;
+
+	pthread_rwlock_rdlock(&kvm->ram_lock);
+	r = kvm_find_ram(kvm, gpa);
+	if (r && len <= r->size - (gpa - r->gpa))
+		hva = r->hva + (gpa - r->gpa);
+	pthread_rwlock_unlock(&kvm->ram_lock);
+	return hva;
+}
+
+int kvm_guest_iov(kvm_context_t kvm, uint64_t gpa, size_t len,
+		  struct iovec *iov, int max, int write)
+{
+	struct kvm_ram_slot *r;
+	uint64_t n;
+	void *hva;
+	int cnt = 0, err;
+
+	if (gpa + len < gpa)
+		return -EFAULT;
+	pthread_rwlock_rdlock(&kvm->ram_lock);
+	while (len) {
+		r = kvm_find_ram(kvm, gpa);
+		if (!r) {
+			cnt = -EFAULT;
+			break;
+		}
+		n = r->size - (gpa - r->gpa);
+		if (n > len)
+			n = len;
+		hva = r->hva + (gpa - r->gpa);
+		/* slots next to each other in both spaces make one piece */
+		if (cnt && iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == hva) {
+			iov[cnt - 1].iov_len += n;
+		} else {
+			if (cnt == max) {
+				cnt = -ENOBUFS;
+				break;
+			}
+			iov[cnt].iov_base = hva;
+			iov[cnt].iov_len = n;
+			cnt++;
+		}
+		/* or the guest keeps reading the zero page */
+		if (write && r->share_zero &&
+		    (err = kvm_unshare_zero(kvm, gpa, n))) {
+			cnt = err;
+			break;
+		}
+		if (write)
+			kvm_ram_mark_dirty(kvm, r, gpa, n);
+		gpa += n;
+		len -= n;
+	}
+	pthread_rwlock_unlock(&kvm->ram_lock);
+	return cnt;
+}
+
+void kvm_guest_mark_dirty(kvm_context_t kvm, uint64_t gpa, size_t len)
+{
+	struct kvm_ram_slot *r;
+	uint64_t n;
+
+	pthread_rwlock_rdlock(&kvm->ram_lock);
+	while (len && (r = kvm_find_ram(kvm, gpa))) {
+		n = r->size - (gpa - r->gpa);
+		if (n > len)
+			n = len;
+		kvm_ram_mark_dirty(kvm, r, gpa, n);
+		gpa += n;
+		len -= n;
+	}
+	pthread_rwlock_unlock(&kvm->ram_lock);
+}
+
+/* no slot is ever split, so a range is at most one piece per slot */
+static int kvm_guest_copy(kvm_context_t kvm, uint64_t gpa, void *buf,
+			  size_t len, int write)
+{
+	struct iovec iov[KVM_MAX_NUM_MEM_REGIONS];
+	int cnt, i;
+
+	cnt = kvm_guest_iov(kvm, gpa, len, iov, KVM_MAX_NUM_MEM_REGIONS, write);
+	if (cnt < 0)
+		return cnt;
+	for (i = 0; i < cnt; i++) {
+		if (write)
+			memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+		else
+			memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+		buf += iov[i].iov_len;
+	}
+	return 0;
+}
+
+int kvm_guest_read(kvm_context_t kvm, uint64_t gpa, void *buf, size_t len)
+{
+	return kvm_guest_copy(kvm, gpa, buf, len, 0);
+}
+
+int kvm_guest_write(kvm_context_t kvm, uint64_t gpa, const void *buf,
+		    size_t len)
+{
+	return kvm_guest_copy(kvm, gpa, (void *)buf, len, 1);
+}
+
+int kvm_translate(kvm_context_t kvm, int vcpu, uint64_t gva,
+		  struct kvm_translation *tr)
+{
+	int r;
+
+	memset(tr, 0, sizeof(*tr));
+	tr->linear_address = gva;
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_TRANSLATE, tr);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_paging_mode(const struct kvm_sregs *sregs)
+{
+	if (!(sregs->cr0 & (1ULL << 31)))
+		return KVM_PAGING_NONE;
+	if (sregs->efer & (1ULL << 10))
+		return KVM_PAGING_LONG;
+	if (sregs->cr4 & (1ULL << 5))
+		return KVM_PAGING_PAE;
+	if (sregs->cr4 & (1ULL << 4))
+		return KVM_PAGING_32_PSE;
+	return KVM_PAGING_32;
+}
+
+int kvm_translate_read(kvm_context_t kvm, uint64_t cr3, int paging,
+		       struct kvm_translate_read_entry *entries, int nr)
+{
+	struct kvm_translate_read req;
+	int r, n;
+
+	/* the kext takes a bounded number at a time */
+	while (nr > 0) {
+		n = nr < KVM_TRANSLATE_READ_MAX ? nr : KVM_TRANSLATE_READ_MAX;
+		req.cr3 = cr3;
+		req.paging = paging;
+		req.nr = n;
+		req.entries = (unsigned long)entries;
+		r = ioctl(kvm->vm_fd, KVM_TRANSLATE_READ, &req);
+		if (r)
+			return -r;
+		entries += n;
+		nr -= n;
+	}
+	return 0;
+}
+
+int kvm_guest_read_virt(kvm_context_t kvm, int vcpu, uint64_t gva, void *buf,
+			size_t len)
+{
+	struct kvm_translate_read_entry e;
+	struct kvm_sregs sregs;
+	int r;
+
+	r = kvm_get_sregs(kvm, vcpu, &sregs);
+	if (r)
+		return -r;
+	memset(&e, 0, sizeof(e));
+	e.gva = gva;
+	e.addr = (unsigned long)buf;
+	e.len = len;
+	r = kvm_translate_read(kvm, sregs.cr3, kvm_paging_mode(&sregs), &e, 1);
+	if (r)
+		return r;
+	return -e.result;
+}
+
 int kvm_set_irq_level(kvm_context_t kvm, int irq, int level)
 {
 	struct kvm_irq_level event;
@@ -489,6 +1271,40 @@ int kvm_set_irq_level(kvm_context_t kvm, int irq, int level)
 	return 1;
 }
 
+int kvm_set_gsi_routing(kvm_context_t kvm,
+			struct kvm_irq_routing_entry *entries, int nr)
+{
+	struct kvm_irq_routing *routing;
+	int r;
+
+	routing = malloc(sizeof(*routing) + nr * sizeof(*entries));
+	if (!routing)
+		return -ENOMEM;
+	memset(routing, 0, sizeof(*routing));
+	routing->nr = nr;
+	memcpy(routing->entries, entries, nr * sizeof(*entries));
+	r = ioctl(kvm->vm_fd, KVM_SET_GSI_ROUTING, routing);
+	free(routing);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_signal_msi(kvm_context_t kvm, uint64_t address, uint32_t data)
+{
+	struct kvm_msi msi;
+	int r;
+
+	memset(&msi, 0, sizeof(msi));
+	msi.address_lo = address;
+	msi.address_hi = address >> 32;
+	msi.data = data;
+	r = ioctl(kvm->vm_fd, KVM_SIGNAL_MSI, &msi);
+	if (r)
+		return -r;
+	return 0;
+}
+
 int kvm_get_irqchip(kvm_context_t kvm, struct kvm_irqchip *chip)
 {
 	int r;
@@ -522,7 +1338,7 @@ int kvm_get_lapic(kvm_context_t kvm, int vcpu, struct kvm_lapic_state *s)
 	int r;
 	if (!kvm->irqchip_in_kernel)
 		return 0;
-	r = ioctl(kvm->vcpu_fd[vcpu], KVM_GET_LAPIC, s);
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_LAPIC, s);
 	if (r == -1) {
 		r = -errno;
 		perror("kvm_get_lapic");
@@ -535,7 +1351,7 @@ int kvm_set_lapic(kvm_context_t kvm, int vcpu, struct kvm_lapic_state *s)
 	int r;
 	if (!kvm->irqchip_in_kernel)
 		return 0;
-	r = ioctl(kvm->vcpu_fd[vcpu], KVM_SET_LAPIC, s);
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_LAPIC, s);
 	if (r == -1) {
 		r = -errno;
 		perror("kvm_set_lapic");
@@ -546,6 +1362,7 @@ int kvm_set_lapic(kvm_context_t kvm, int vcpu, struct kvm_lapic_state *s)
 static int handle_io_abi10(kvm_context_t kvm, struct kvm_run_abi10 *run,
 			   int vcpu)
 {
+	struct kvm_vcpu *v = kvm->vcpus[vcpu];
 	uint16_t addr = run->io.port;
 	int r;
 	int i;
@@ -556,13 +1373,13 @@ static int handle_io_abi10(kvm_context_t kvm, struct kvm_run_abi10 *run,
 		case KVM_EXIT_IO_IN:
 			switch (run->io.size) {
 			case 1:
-				r = kvm->callbacks->inb(kvm->opaque, addr, p);
+				r = kvm->callbacks->inb(kvm->opaque, v, addr, p);
 				break;
 			case 2:
-				r = kvm->callbacks->inw(kvm->opaque, addr, p);
+				r = kvm->callbacks->inw(kvm->opaque, v, addr, p);
 				break;
 			case 4:
-				r = kvm->callbacks->inl(kvm->opaque, addr, p);
+				r = kvm->callbacks->inl(kvm->opaque, v, addr, p);
 				break;
 			default:
 				fprintf(stderr, "bad I/O size %d\n", run->io.size);
@@ -572,15 +1389,15 @@ static int handle_io_abi10(kvm_context_t kvm, struct kvm_run_abi10 *run,
 		case KVM_EXIT_IO_OUT:
 		    	switch (run->io.size) {
 			case 1:
-				r = kvm->callbacks->outb(kvm->opaque, addr,
+				r = kvm->callbacks->outb(kvm->opaque, v, addr,
 						     *(uint8_t *)p);
 				break;
 			case 2:
-				r = kvm->callbacks->outw(kvm->opaque, addr,
+				r = kvm->callbacks->outw(kvm->opaque, v, addr,
 						     *(uint16_t *)p);
 				break;
 			case 4:
-				r = kvm->callbacks->outl(kvm->opaque, addr,
+				r = kvm->callbacks->outl(kvm->opaque, v, addr,
 						     *(uint32_t *)p);
 				break;
 			default:
@@ -602,6 +1419,7 @@ static int handle_io_abi10(kvm_context_t kvm, struct kvm_run_abi10 *run,
 
 static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 {
+	struct kvm_vcpu *v = kvm->vcpus[vcpu];
 	uint16_t addr = run->io.port;
 	int r;
 	int i;
@@ -612,13 +1430,13 @@ static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 		case KVM_EXIT_IO_IN:
 			switch (run->io.size) {
 			case 1:
-				r = kvm->callbacks->inb(kvm->opaque, addr, p);
+				r = kvm->callbacks->inb(kvm->opaque, v, addr, p);
 				break;
 			case 2:
-				r = kvm->callbacks->inw(kvm->opaque, addr, p);
+				r = kvm->callbacks->inw(kvm->opaque, v, addr, p);
 				break;
 			case 4:
-				r = kvm->callbacks->inl(kvm->opaque, addr, p);
+				r = kvm->callbacks->inl(kvm->opaque, v, addr, p);
 				break;
 			default:
 				fprintf(stderr, "bad I/O size %d\n", run->io.size);
@@ -628,15 +1446,15 @@ static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 		case KVM_EXIT_IO_OUT:
 		    	switch (run->io.size) {
 			case 1:
-				r = kvm->callbacks->outb(kvm->opaque, addr,
+				r = kvm->callbacks->outb(kvm->opaque, v, addr,
 						     *(uint8_t *)p);
 				break;
 			case 2:
-				r = kvm->callbacks->outw(kvm->opaque, addr,
+				r = kvm->callbacks->outw(kvm->opaque, v, addr,
 						     *(uint16_t *)p);
 				break;
 			case 4:
-				r = kvm->callbacks->outl(kvm->opaque, addr,
+				r = kvm->callbacks->outl(kvm->opaque, v, addr,
 						     *(uint32_t *)p);
 				break;
 			default:
@@ -657,37 +1475,51 @@ static int handle_io(kvm_context_t kvm, struct kvm_run *run, int vcpu)
 
 static int handle_debug(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->debug(kvm->opaque, vcpu);
+	return kvm->callbacks->debug(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
 int kvm_get_regs(kvm_context_t kvm, int vcpu, struct kvm_regs *regs)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_GET_REGS, regs);
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
+
+	if (kvm->vcpus[vcpu]->regs_synced || (run->kvm_dirty_regs & KVM_SYNC_X86_REGS)) {
+		memcpy(regs, &run->s.regs.regs, sizeof *regs);
+		return 0;
+	}
+	return ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_REGS, regs);
 }
 
 int kvm_set_regs(kvm_context_t kvm, int vcpu, struct kvm_regs *regs)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_SET_REGS, regs);
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
+
+	/* picked up by the next KVM_RUN */
+	if (run->kvm_valid_regs & KVM_SYNC_X86_REGS) {
+		memcpy(&run->s.regs.regs, regs, sizeof *regs);
+		run->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+		return 0;
+	}
+	return ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_REGS, regs);
 }
 
 int kvm_get_fpu(kvm_context_t kvm, int vcpu, struct kvm_fpu *fpu)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_GET_FPU, fpu);
+    return ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_FPU, fpu);
 }
 
 int kvm_set_fpu(kvm_context_t kvm, int vcpu, struct kvm_fpu *fpu)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_SET_FPU, fpu);
+    return ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_FPU, fpu);
 }
 
 int kvm_get_sregs(kvm_context_t kvm, int vcpu, struct kvm_sregs *sregs)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_GET_SREGS, sregs);
+    return ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_SREGS, sregs);
 }
 
 int kvm_set_sregs(kvm_context_t kvm, int vcpu, struct kvm_sregs *sregs)
 {
-    return ioctl(kvm->vcpu_fd[vcpu], KVM_SET_SREGS, sregs);
+    return ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_SREGS, sregs);
 }
 
 /*
@@ -730,7 +1562,7 @@ int kvm_get_msrs(kvm_context_t kvm, int vcpu, struct kvm_msr_entry *msrs,
     }
     kmsrs->nmsrs = n;
     memcpy(kmsrs->entries, msrs, n * sizeof *msrs);
-    r = ioctl(kvm->vcpu_fd[vcpu], KVM_GET_MSRS, kmsrs);
+    r = ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_MSRS, kmsrs);
     e = errno;
     memcpy(msrs, kmsrs->entries, n * sizeof *msrs);
     free(kmsrs);
@@ -750,7 +1582,7 @@ int kvm_set_msrs(kvm_context_t kvm, int vcpu, struct kvm_msr_entry *msrs,
     }
     kmsrs->nmsrs = n;
     memcpy(kmsrs->entries, msrs, n * sizeof *msrs);
-    r = ioctl(kvm->vcpu_fd[vcpu], KVM_SET_MSRS, kmsrs);
+    r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_MSRS, kmsrs);
     e = errno;
     free(kmsrs);
     errno = e;
@@ -774,12 +1606,12 @@ static void print_dt(FILE *file, const char *name, struct kvm_dtable *dt)
 
 void kvm_show_regs(kvm_context_t kvm, int vcpu)
 {
-	int fd = kvm->vcpu_fd[vcpu];
+	int fd = kvm->vcpus[vcpu]->fd;
 	struct kvm_regs regs;
 	struct kvm_sregs sregs;
 	int r;
 
-	r = ioctl(fd, KVM_GET_REGS, &regs);
+	r = kvm_get_regs(kvm, vcpu, &regs);
 	if (r == -1) {
 		perror("KVM_GET_REGS");
 		return;
@@ -819,9 +1651,10 @@ void kvm_show_regs(kvm_context_t kvm, int vcpu)
 static void kvm_show_code(kvm_context_t kvm, int vcpu)
 {
 #define CR0_PE_MASK	(1ULL<<0)
-	int fd = kvm->vcpu_fd[vcpu];
+	int fd = kvm->vcpus[vcpu]->fd;
 	struct kvm_regs regs;
 	struct kvm_sregs sregs;
+	struct kvm_translate_read_entry e;
 	int r;
 	unsigned char code[50];
 	int back_offset;
@@ -833,19 +1666,29 @@ static void kvm_show_code(kvm_context_t kvm, int vcpu)
 		perror("KVM_GET_SREGS");
 		return;
 	}
-	if (sregs.cr0 & CR0_PE_MASK)
-		return;
 
 	r = ioctl(fd, KVM_GET_REGS, &regs);
 	if (r == -1) {
 		perror("KVM_GET_REGS");
 		return;
 	}
-	rip = sregs.cs.base * 16 + regs.rip;
+	if (sregs.cr0 & CR0_PE_MASK)
+		rip = sregs.cs.base + regs.rip;
+	else
+		rip = sregs.cs.base * 16 + regs.rip;
 	back_offset = regs.rip;
 	if (back_offset > 20)
 	    back_offset = 20;
-	memcpy(code, kvm->physical_memory + rip - back_offset, sizeof code);
+	/* through the guest's page tables, it needn't be identity mapped */
+	memset(&e, 0, sizeof(e));
+	e.gva = rip - back_offset;
+	e.addr = (unsigned long)code;
+	e.len = sizeof code;
+	if (kvm_translate_read(kvm, sregs.cr3, kvm_paging_mode(&sregs), &e, 1)
+	    || e.result) {
+		fprintf(stderr, "code: can't read %lx\n", rip);
+		return;
+	}
 	*code_str = 0;
 	for (r = 0; r < sizeof code; ++r) {
 	    	if (r == back_offset)
@@ -855,8 +1698,10 @@ static void kvm_show_code(kvm_context_t kvm, int vcpu)
 	fprintf(stderr, "code:%s\n", code_str);
 }
 
-static int handle_mmio_abi10(kvm_context_t kvm, struct kvm_run_abi10 *kvm_run)
+static int handle_mmio_abi10(kvm_context_t kvm, struct kvm_run_abi10 *kvm_run,
+			     int vcpu)
 {
+	struct kvm_vcpu *v = kvm->vcpus[vcpu];
 	unsigned long addr = kvm_run->mmio.phys_addr;
 	void *data = kvm_run->mmio.data;
 	int r = -1;
@@ -864,31 +1709,31 @@ static int handle_mmio_abi10(kvm_context_t kvm, struct kvm_run_abi10 *kvm_run)
 	if (kvm_run->mmio.is_write) {
 		switch (kvm_run->mmio.len) {
 		case 1:
-			r = kvm->callbacks->writeb(kvm->opaque, addr, *(uint8_t *)data);
+			r = kvm->callbacks->writeb(kvm->opaque, v, addr, *(uint8_t *)data);
 			break;
 		case 2:
-			r = kvm->callbacks->writew(kvm->opaque, addr, *(uint16_t *)data);
+			r = kvm->callbacks->writew(kvm->opaque, v, addr, *(uint16_t *)data);
 			break;
 		case 4:
-			r = kvm->callbacks->writel(kvm->opaque, addr, *(uint32_t *)data);
+			r = kvm->callbacks->writel(kvm->opaque, v, addr, *(uint32_t *)data);
 			break;
 		case 8:
-			r = kvm->callbacks->writeq(kvm->opaque, addr, *(uint64_t *)data);
+			r = kvm->callbacks->writeq(kvm->opaque, v, addr, *(uint64_t *)data);
 			break;
 		}
 	} else {
 		switch (kvm_run->mmio.len) {
 		case 1:
-			r = kvm->callbacks->readb(kvm->opaque, addr, (uint8_t *)data);
+			r = kvm->callbacks->readb(kvm->opaque, v, addr, (uint8_t *)data);
 			break;
 		case 2:
-			r = kvm->callbacks->readw(kvm->opaque, addr, (uint16_t *)data);
+			r = kvm->callbacks->readw(kvm->opaque, v, addr, (uint16_t *)data);
 			break;
 		case 4:
-			r = kvm->callbacks->readl(kvm->opaque, addr, (uint32_t *)data);
+			r = kvm->callbacks->readl(kvm->opaque, v, addr, (uint32_t *)data);
 			break;
 		case 8:
-			r = kvm->callbacks->readq(kvm->opaque, addr, (uint64_t *)data);
+			r = kvm->callbacks->readq(kvm->opaque, v, addr, (uint64_t *)data);
 			break;
 		}
 		kvm_run->io_completed = 1;
@@ -896,8 +1741,9 @@ static int handle_mmio_abi10(kvm_context_t kvm, struct kvm_run_abi10 *kvm_run)
 	return r;
 }
 
-static int handle_mmio(kvm_context_t kvm, struct kvm_run *kvm_run)
+static int handle_mmio(kvm_context_t kvm, struct kvm_run *kvm_run, int vcpu)
 {
+	struct kvm_vcpu *v = kvm->vcpus[vcpu];
 	unsigned long addr = kvm_run->mmio.phys_addr;
 	void *data = kvm_run->mmio.data;
 	int r = -1;
@@ -905,70 +1751,71 @@ static int handle_mmio(kvm_context_t kvm, struct kvm_run *kvm_run)
 	if (kvm_run->mmio.is_write) {
 		switch (kvm_run->mmio.len) {
 		case 1:
-			r = kvm->callbacks->writeb(kvm->opaque, addr, *(uint8_t *)data);
+			r = kvm->callbacks->writeb(kvm->opaque, v, addr, *(uint8_t *)data);
 			break;
 		case 2:
-			r = kvm->callbacks->writew(kvm->opaque, addr, *(uint16_t *)data);
+			r = kvm->callbacks->writew(kvm->opaque, v, addr, *(uint16_t *)data);
 			break;
 		case 4:
-			r = kvm->callbacks->writel(kvm->opaque, addr, *(uint32_t *)data);
+			r = kvm->callbacks->writel(kvm->opaque, v, addr, *(uint32_t *)data);
 			break;
 		case 8:
-			r = kvm->callbacks->writeq(kvm->opaque, addr, *(uint64_t *)data);
+			r = kvm->callbacks->writeq(kvm->opaque, v, addr, *(uint64_t *)data);
 			break;
 		}
 	} else {
 		switch (kvm_run->mmio.len) {
 		case 1:
-			r = kvm->callbacks->readb(kvm->opaque, addr, (uint8_t *)data);
+			r = kvm->callbacks->readb(kvm->opaque, v, addr, (uint8_t *)data);
 			break;
 		case 2:
-			r = kvm->callbacks->readw(kvm->opaque, addr, (uint16_t *)data);
+			r = kvm->callbacks->readw(kvm->opaque, v, addr, (uint16_t *)data);
 			break;
 		case 4:
-			r = kvm->callbacks->readl(kvm->opaque, addr, (uint32_t *)data);
+			r = kvm->callbacks->readl(kvm->opaque, v, addr, (uint32_t *)data);
 			break;
 		case 8:
-			r = kvm->callbacks->readq(kvm->opaque, addr, (uint64_t *)data);
+			r = kvm->callbacks->readq(kvm->opaque, v, addr, (uint64_t *)data);
 			break;
 		}
 	}
 	return r;
 }
 
-static int handle_io_window(kvm_context_t kvm)
+static int handle_io_window(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->io_window(kvm->opaque);
+	return kvm->callbacks->io_window(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
 static int handle_halt(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->halt(kvm->opaque, vcpu);
+	return kvm->callbacks->halt(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
 static int handle_shutdown(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->shutdown(kvm->opaque, vcpu);
+	return kvm->callbacks->shutdown(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
-int try_push_interrupts(kvm_context_t kvm)
+int try_push_interrupts(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->try_push_interrupts(kvm->opaque);
+	return kvm->callbacks->try_push_interrupts(kvm->opaque,
+						   kvm->vcpus[vcpu]);
 }
 
 static void post_kvm_run(kvm_context_t kvm, int vcpu)
 {
-	kvm->callbacks->post_kvm_run(kvm->opaque, vcpu);
+	kvm->callbacks->post_kvm_run(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
 static int pre_kvm_run(kvm_context_t kvm, int vcpu)
 {
-	return kvm->callbacks->pre_kvm_run(kvm->opaque, vcpu);
+	return kvm->callbacks->pre_kvm_run(kvm->opaque, kvm->vcpus[vcpu]);
 }
 
 int kvm_get_interrupt_flag(kvm_context_t kvm, int vcpu)
 {
-	struct kvm_run *run = kvm->run[vcpu];
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
 
 	if (kvm_abi == 10)
 		return ((struct kvm_run_abi10 *)run)->if_flag;
@@ -977,7 +1824,7 @@ int kvm_get_interrupt_flag(kvm_context_t kvm, int vcpu)
 
 uint64_t kvm_get_apic_base(kvm_context_t kvm, int vcpu)
 {
-	struct kvm_run *run = kvm->run[vcpu];
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
 
 	if (kvm_abi == 10)
 		return ((struct kvm_run_abi10 *)run)->apic_base;
@@ -986,7 +1833,7 @@ uint64_t kvm_get_apic_base(kvm_context_t kvm, int vcpu)
 
 int kvm_is_ready_for_interrupt_injection(kvm_context_t kvm, int vcpu)
 {
-	struct kvm_run *run = kvm->run[vcpu];
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
 
 	if (kvm_abi == 10)
 		return ((struct kvm_run_abi10 *)run)->ready_for_interrupt_injection;
@@ -995,7 +1842,7 @@ int kvm_is_ready_for_interrupt_injection(kvm_context_t kvm, int vcpu)
 
 void kvm_set_cr8(kvm_context_t kvm, int vcpu, uint64_t cr8)
 {
-	struct kvm_run *run = kvm->run[vcpu];
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
 
 	if (kvm_abi == 10) {
 		((struct kvm_run_abi10 *)run)->cr8 = cr8;
@@ -1006,17 +1853,17 @@ void kvm_set_cr8(kvm_context_t kvm, int vcpu, uint64_t cr8)
 
 __u64 kvm_get_cr8(kvm_context_t kvm, int vcpu)
 {
-	return kvm->run[vcpu]->cr8;
+	return kvm->vcpus[vcpu]->run->cr8;
 }
 
 static int kvm_run_abi10(kvm_context_t kvm, int vcpu)
 {
 	int r;
-	int fd = kvm->vcpu_fd[vcpu];
-	struct kvm_run_abi10 *run = (struct kvm_run_abi10 *)kvm->run[vcpu];
+	int fd = kvm->vcpus[vcpu]->fd;
+	struct kvm_run_abi10 *run = (struct kvm_run_abi10 *)kvm->vcpus[vcpu]->run;
 
 again:
-	//run->request_interrupt_window = try_push_interrupts(kvm);
+	//run->request_interrupt_window = try_push_interrupts(kvm, vcpu);
 	/*r = pre_kvm_run(kvm, vcpu);
 	if (r)
 	    return r;*/
@@ -1030,7 +1877,7 @@ again:
 		return r;
 	}
 	if (r == -1) {
-		r = handle_io_window(kvm);
+		r = handle_io_window(kvm, vcpu);
 		goto more;
 	}
 	if (1) {
@@ -1061,7 +1908,7 @@ again:
 			r = handle_debug(kvm, vcpu);
 			break;
 		case KVM_EXIT_MMIO:
-			r = handle_mmio_abi10(kvm, run);
+			r = handle_mmio_abi10(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_HLT:
 			r = handle_halt(kvm, vcpu);
@@ -1087,21 +1934,24 @@ more:
 int kvm_run(kvm_context_t kvm, int vcpu)
 {
 	int r;
-	int fd = kvm->vcpu_fd[vcpu];
-	struct kvm_run *run = kvm->run[vcpu];
+	int fd = kvm->vcpus[vcpu]->fd;
+	struct kvm_run *run = kvm->vcpus[vcpu]->run;
 
 	/*if (kvm_abi == 10)
 		return kvm_run_abi10(kvm, vcpu);*/
 
 again:
 //	if (!kvm->irqchip_in_kernel)
-//		run->request_interrupt_window = try_push_interrupts(kvm);
+//		run->request_interrupt_window = try_push_interrupts(kvm, vcpu);
 	//r = pre_kvm_run(kvm, vcpu);
 	//if (r)
 	//    return r;
 	r = ioctl(fd, KVM_RUN, 0);
-  printf("here\n");
 	//post_kvm_run(kvm, vcpu);
+	if (r != -1 || errno == EINTR || errno == EAGAIN)
+		kvm->vcpus[vcpu]->regs_synced = (run->kvm_valid_regs & KVM_SYNC_X86_REGS) != 0;
+	/* queued writes happened before whatever made it exit */
+	kvm_flush_coalesced_pio(kvm);
 
 	if (r == -1 && errno != EINTR && errno != EAGAIN) {
 		r = -errno;
@@ -1109,7 +1959,7 @@ again:
 		return r;
 	}
 	if (r == -1) {
-		r = handle_io_window(kvm);
+		r = handle_io_window(kvm, vcpu);
 		goto more;
 	}
 	if (1) {
@@ -1140,7 +1990,7 @@ again:
 			r = handle_debug(kvm, vcpu);
 			break;
 		case KVM_EXIT_MMIO:
-			r = handle_mmio(kvm, run);
+			r = handle_mmio(kvm, run, vcpu);
 			break;
 		case KVM_EXIT_HLT:
 			r = handle_halt(kvm, vcpu);
@@ -1152,6 +2002,10 @@ again:
 			break;
 		case KVM_EXIT_SET_TPR:
 			break;
+		case KVM_EXIT_INTR:
+			/* a signal woke a throttled vcpu, go back in */
+			r = 0;
+			break;
 		default:
 			fprintf(stderr, "unhandled vm exit: 0x%x\n", run->exit_reason);
 			kvm_show_regs(kvm, vcpu);
@@ -1170,12 +2024,37 @@ int kvm_inject_irq(kvm_context_t kvm, int vcpu, unsigned irq)
 	struct kvm_interrupt intr;
 
 	intr.irq = irq;
-	return ioctl(kvm->vcpu_fd[vcpu], KVM_INTERRUPT, &intr);
+	return ioctl(kvm->vcpus[vcpu]->fd, KVM_INTERRUPT, &intr);
 }
 
-int kvm_guest_debug(kvm_context_t kvm, int vcpu, struct kvm_debug_guest *dbg)
+int kvm_get_debugregs(kvm_context_t kvm, int vcpu, struct kvm_debugregs *dregs)
 {
-	return ioctl(kvm->vcpu_fd[vcpu], KVM_DEBUG_GUEST, dbg);
+	int r;
+
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_GET_DEBUGREGS, dregs);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_set_debugregs(kvm_context_t kvm, int vcpu, struct kvm_debugregs *dregs)
+{
+	int r;
+
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_DEBUGREGS, dregs);
+	if (r)
+		return -r;
+	return 0;
+}
+
+int kvm_guest_debug(kvm_context_t kvm, int vcpu, struct kvm_guest_debug *dbg)
+{
+	int r;
+
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_GUEST_DEBUG, dbg);
+	if (r)
+		return -r;
+	return 0;
 }
 
 int kvm_setup_cpuid(kvm_context_t kvm, int vcpu, int nent,
@@ -1190,7 +2069,7 @@ int kvm_setup_cpuid(kvm_context_t kvm, int vcpu, int nent,
 
 	cpuid->nent = nent;
 	memcpy(cpuid->entries, entries, nent * sizeof(*entries));
-	r = ioctl(kvm->vcpu_fd[vcpu], KVM_SET_CPUID, cpuid);
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_CPUID, cpuid);
 
 	free(cpuid);
 	return r;
@@ -1202,7 +2081,7 @@ int kvm_set_signal_mask(kvm_context_t kvm, int vcpu, const sigset_t *sigset)
 	int r;
 
 	if (!sigset) {
-		r = ioctl(kvm->vcpu_fd[vcpu], KVM_SET_SIGNAL_MASK, NULL);
+		r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_SIGNAL_MASK, NULL);
 		if (r == -1)
 			r = -errno;
 		return r;
@@ -1213,7 +2092,7 @@ int kvm_set_signal_mask(kvm_context_t kvm, int vcpu, const sigset_t *sigset)
 
 	sigmask->len = 8;
 	memcpy(sigmask->sigset, sigset, sizeof(*sigset));
-	r = ioctl(kvm->vcpu_fd[vcpu], KVM_SET_SIGNAL_MASK, sigmask);
+	r = ioctl(kvm->vcpus[vcpu]->fd, KVM_SET_SIGNAL_MASK, sigmask);
 	if (r == -1)
 		r = -errno;
 	free(sigmask);
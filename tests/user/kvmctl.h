@@ -13,10 +13,15 @@
 #include <linux/kvm_para.h>
 #include <stdint.h>
 #include <signal.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 struct kvm_context;
+struct kvm_vcpu;
 
 typedef struct kvm_context *kvm_context_t;
+/// A vcpu of a kvm_context, see kvm_vcpu_get()
+typedef struct kvm_vcpu *kvm_vcpu_context_t;
 
 /*!
  * \brief KVM callbacks structure
@@ -24,49 +29,68 @@ typedef struct kvm_context *kvm_context_t;
  * This structure holds pointers to various functions that KVM will call
  * when it encounters something that cannot be virtualized, such as
  * accessing hardware devices via MMIO or regular IO.
+ *
+ * Every callback gets the opaque pointer given to kvm_init() and the vcpu
+ * that caused it, so one set of callbacks can serve any number of vms and
+ * vcpus without thread locals.  The vcpu handle is only good for the
+ * duration of the call unless a reference is taken with kvm_vcpu_get().
  */
 struct kvm_callbacks {
 	/// For 8bit IO reads from the guest (Usually when executing 'inb')
-    int (*inb)(void *opaque, uint16_t addr, uint8_t *data);
+    int (*inb)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint8_t *data);
 	/// For 16bit IO reads from the guest (Usually when executing 'inw')
-    int (*inw)(void *opaque, uint16_t addr, uint16_t *data);
+    int (*inw)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint16_t *data);
 	/// For 32bit IO reads from the guest (Usually when executing 'inl')
-    int (*inl)(void *opaque, uint16_t addr, uint32_t *data);
+    int (*inl)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint32_t *data);
 	/// For 8bit IO writes from the guest (Usually when executing 'outb')
-    int (*outb)(void *opaque, uint16_t addr, uint8_t data);
+    int (*outb)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint8_t data);
 	/// For 16bit IO writes from the guest (Usually when executing 'outw')
-    int (*outw)(void *opaque, uint16_t addr, uint16_t data);
+    int (*outw)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint16_t data);
 	/// For 32bit IO writes from the guest (Usually when executing 'outl')
-    int (*outl)(void *opaque, uint16_t addr, uint32_t data);
+    int (*outl)(void *opaque, kvm_vcpu_context_t vcpu,
+	       uint16_t addr, uint32_t data);
 	/// For 8bit memory reads from unmapped memory (For MMIO devices)
-    int (*readb)(void *opaque, uint64_t addr, uint8_t *data);
+    int (*readb)(void *opaque, kvm_vcpu_context_t vcpu,
+		 uint64_t addr, uint8_t *data);
 	/// For 16bit memory reads from unmapped memory (For MMIO devices)
-    int (*readw)(void *opaque, uint64_t addr, uint16_t *data);
+    int (*readw)(void *opaque, kvm_vcpu_context_t vcpu,
+		 uint64_t addr, uint16_t *data);
 	/// For 32bit memory reads from unmapped memory (For MMIO devices)
-    int (*readl)(void *opaque, uint64_t addr, uint32_t *data);
+    int (*readl)(void *opaque, kvm_vcpu_context_t vcpu,
+		 uint64_t addr, uint32_t *data);
 	/// For 64bit memory reads from unmapped memory (For MMIO devices)
-    int (*readq)(void *opaque, uint64_t addr, uint64_t *data);
+    int (*readq)(void *opaque, kvm_vcpu_context_t vcpu,
+		 uint64_t addr, uint64_t *data);
 	/// For 8bit memory writes to unmapped memory (For MMIO devices)
-    int (*writeb)(void *opaque, uint64_t addr, uint8_t data);
+    int (*writeb)(void *opaque, kvm_vcpu_context_t vcpu,
+		  uint64_t addr, uint8_t data);
 	/// For 16bit memory writes to unmapped memory (For MMIO devices)
-    int (*writew)(void *opaque, uint64_t addr, uint16_t data);
+    int (*writew)(void *opaque, kvm_vcpu_context_t vcpu,
+		  uint64_t addr, uint16_t data);
 	/// For 32bit memory writes to unmapped memory (For MMIO devices)
-    int (*writel)(void *opaque, uint64_t addr, uint32_t data);
+    int (*writel)(void *opaque, kvm_vcpu_context_t vcpu,
+		  uint64_t addr, uint32_t data);
 	/// For 64bit memory writes to unmapped memory (For MMIO devices)
-    int (*writeq)(void *opaque, uint64_t addr, uint64_t data);
-    int (*debug)(void *opaque, int vcpu);
+    int (*writeq)(void *opaque, kvm_vcpu_context_t vcpu,
+		  uint64_t addr, uint64_t data);
+    int (*debug)(void *opaque, kvm_vcpu_context_t vcpu);
 	/*!
 	 * \brief Called when the VCPU issues an 'hlt' instruction.
 	 *
 	 * Typically, you should yeild here to prevent 100% CPU utilization
 	 * on the host CPU.
 	 */
-    int (*halt)(void *opaque, int vcpu);
-    int (*shutdown)(void *opaque, int vcpu);
-    int (*io_window)(void *opaque);
-    int (*try_push_interrupts)(void *opaque);
-    void (*post_kvm_run)(void *opaque, int vcpu);
-    int (*pre_kvm_run)(void *opaque, int vcpu);
+    int (*halt)(void *opaque, kvm_vcpu_context_t vcpu);
+    int (*shutdown)(void *opaque, kvm_vcpu_context_t vcpu);
+    int (*io_window)(void *opaque, kvm_vcpu_context_t vcpu);
+    int (*try_push_interrupts)(void *opaque, kvm_vcpu_context_t vcpu);
+    void (*post_kvm_run)(void *opaque, kvm_vcpu_context_t vcpu);
+    int (*pre_kvm_run)(void *opaque, kvm_vcpu_context_t vcpu);
 };
 
 /*!
@@ -76,8 +100,12 @@ struct kvm_callbacks {
  * holds information about the KVM instance that gets created by this call.\n
  * This should always be your first call to KVM.
  *
+ * The context is reference counted and every call on it is safe from any
+ * thread, so a process can keep as many of them as the kernel lets it
+ * create vms.
+ *
  * \param callbacks Pointer to a valid kvm_callbacks structure
- * \param opaque Not used
+ * \param opaque Handed to every callback
  * \return NULL on failure
  */
 kvm_context_t kvm_init(struct kvm_callbacks *callbacks,
@@ -86,7 +114,9 @@ kvm_context_t kvm_init(struct kvm_callbacks *callbacks,
 /*!
  * \brief Cleanup the KVM context
  *
- * Should always be called when closing down KVM.\n
+ * Drops the reference kvm_init() returned.  The vm, its vcpus and its
+ * memory slots go away with the last reference, which may be a vcpu
+ * handle some other thread still holds.\n
  * Exception: If kvm_init() fails, this function should not be called, as the
  * context would be invalid
  *
@@ -94,6 +124,94 @@ kvm_context_t kvm_init(struct kvm_callbacks *callbacks,
  */
 void kvm_finalize(kvm_context_t kvm);
 
+/*!
+ * \brief Take a reference on a KVM context
+ *
+ * \param kvm Pointer to the kvm_context
+ * \return kvm, for convenience
+ */
+kvm_context_t kvm_get(kvm_context_t kvm);
+
+/*!
+ * \brief Drop a reference taken with kvm_get()
+ *
+ * \param kvm Pointer to the kvm_context
+ */
+void kvm_put(kvm_context_t kvm);
+
+/*!
+ * \brief Set how many vcpus the vm can have
+ *
+ * The vcpu table is allocated by kvm_create(), so this has to come
+ * before it.  Without a call the limit is 4.
+ *
+ * \param kvm Pointer to the kvm_context
+ * \param max Highest vcpu number plus one
+ * \return 0 on success, -EBUSY once the vm exists
+ */
+int kvm_set_max_vcpus(kvm_context_t kvm, int max);
+
+/*!
+ * \brief The vcpu limit of a KVM context
+ *
+ * \param kvm Pointer to the kvm_context
+ * \return the value kvm_set_max_vcpus() set, or the default
+ */
+int kvm_get_max_vcpus(kvm_context_t kvm);
+
+/*!
+ * \brief Get a handle on a vcpu
+ *
+ * The handle holds a reference on the vcpu and on its kvm_context, so both
+ * stay valid until kvm_vcpu_put(), even across kvm_finalize().
+ *
+ * \param kvm Pointer to the kvm_context
+ * \param vcpu vcpu number
+ * \return NULL if the vcpu hasn't been created
+ */
+kvm_vcpu_context_t kvm_vcpu_get(kvm_context_t kvm, int vcpu);
+
+/*!
+ * \brief Drop a handle from kvm_vcpu_get()
+ *
+ * \param vcpu The vcpu handle
+ */
+void kvm_vcpu_put(kvm_vcpu_context_t vcpu);
+
+/*!
+ * \brief The KVM context a vcpu belongs to
+ *
+ * \param vcpu The vcpu handle
+ * \return the kvm_context, without taking a reference
+ */
+kvm_context_t kvm_vcpu_kvm(kvm_vcpu_context_t vcpu);
+
+/*!
+ * \brief The number a vcpu was created with
+ *
+ * This is the vcpu argument the rest of the API takes.
+ *
+ * \param vcpu The vcpu handle
+ * \return the vcpu number
+ */
+int kvm_vcpu_id(kvm_vcpu_context_t vcpu);
+
+/*!
+ * \brief Per vcpu data for the callbacks
+ *
+ * \param vcpu The vcpu handle
+ * \return the pointer given to kvm_vcpu_set_opaque(), NULL before that
+ */
+void *kvm_vcpu_opaque(kvm_vcpu_context_t vcpu);
+
+/*!
+ * \brief Attach data to a vcpu
+ *
+ * \param vcpu The vcpu handle
+ * \param opaque Returned by kvm_vcpu_opaque()
+ */
+void kvm_vcpu_set_opaque(kvm_vcpu_context_t vcpu, void *opaque);
+
 /*!
  * \brief Disable the in-kernel IRQCHIP creation
  *
@@ -104,6 +222,22 @@ void kvm_finalize(kvm_context_t kvm);
  */
 void kvm_disable_irqchip_creation(kvm_context_t kvm);
 
+/*!
+ * \brief Back pages the guest has only read with a shared zero page
+ *
+ * Off by default.  With it on, kvm_create() registers guest ram with
+ * KVM_MEM_SHARE_ZERO, which saves the host memory of pages nobody wrote.
+ * Host writes to such a page aren't seen by the guest until the page is
+ * unshared.  kvm_guest_iov(), kvm_guest_write() and the device models built
+ * on them do that, anything writing through kvm_guest_ptr() or the ram
+ * mapping has to call kvm_unshare_zero() itself.  Call this prior to
+ * kvm_create().
+ *
+ * \param kvm Pointer to the kvm_context
+ * \param enable 1 to share zero pages
+ */
+void kvm_set_share_zero(kvm_context_t kvm, int enable);
+
 /*!
  * \brief Create new virtual machine
  *
@@ -128,8 +262,8 @@ int kvm_create(kvm_context_t kvm,
  * Should be called from a thread dedicated to the vcpu.
  *
  * \param kvm kvm context
- * \param slot vcpu number (> 0)
- * \return 0 on success, -errno on failure
+ * \param slot vcpu number (> 0, below kvm_get_max_vcpus())
+ * \return 0 on success, -EEXIST if the slot is taken, -errno on failure
  */
 int kvm_create_vcpu(kvm_context_t kvm, int slot);
 
@@ -323,7 +457,47 @@ int kvm_set_msrs(kvm_context_t, int vcpu, struct kvm_msr_entry *msrs, int n);
  */
 int kvm_inject_irq(kvm_context_t kvm, int vcpu, unsigned irq);
 
-int kvm_guest_debug(kvm_context_t, int vcpu, struct kvm_debug_guest *dbg);
+/*!
+ * \brief Read the guest's own debug registers
+ *
+ * These are what the guest wrote to DR0-3, DR6 and DR7, not what a
+ * debugger set with kvm_guest_debug().
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU to read
+ * \param dregs Where the registers go
+ * \return 0 on success, or -errno
+ */
+int kvm_get_debugregs(kvm_context_t kvm, int vcpu, struct kvm_debugregs *dregs);
+
+/*!
+ * \brief Write the guest's own debug registers
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU to write
+ * \param dregs The registers, with flags 0
+ * \return 0 on success, or -errno
+ */
+int kvm_set_debugregs(kvm_context_t kvm, int vcpu, struct kvm_debugregs *dregs);
+
+/*!
+ * \brief Set up breakpoints and single stepping for a debugger
+ *
+ * With KVM_GUESTDBG_ENABLE in dbg->control, the VCPU stops with
+ * KVM_EXIT_DEBUG on a hardware breakpoint from dbg->arch.debugreg[0-3]
+ * and [7] (KVM_GUESTDBG_USE_HW_BP), an int3 (KVM_GUESTDBG_USE_SW_BP) or
+ * after every instruction (KVM_GUESTDBG_SINGLESTEP).  The exit's
+ * debug.arch has the exception, the linear pc and dr6.  A #DB or #BP
+ * that was the guest's own goes back to it with KVM_GUESTDBG_INJECT_DB
+ * or KVM_GUESTDBG_INJECT_BP.  A control without KVM_GUESTDBG_ENABLE
+ * turns it all off.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU to debug
+ * \param dbg The KVM_GUESTDBG_* flags and debug registers
+ * \return 0 on success, or -errno
+ */
+int kvm_guest_debug(kvm_context_t kvm, int vcpu, struct kvm_guest_debug *dbg);
 
 /*!
  * \brief Setup a vcpu's cpuid instruction emulation
@@ -388,6 +562,19 @@ void *kvm_create_phys_mem(kvm_context_t, unsigned long phys_start,
 			  unsigned long len, int slot, int log, int writable);
 void kvm_destroy_phys_mem(kvm_context_t, unsigned long phys_start, 
 			  unsigned long len, int slot);
+/*!
+ * \brief Get the dirty log of a memory slot
+ *
+ * Fills buf with one bit per page of the slot, set for pages written since
+ * the last call.  The kext has no KVM_GET_DIRTY_LOG, so on it only pages
+ * written through kvm_guest_iov(), kvm_guest_write() and
+ * kvm_guest_mark_dirty() are tracked; guest writes are not.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param slot Memory slot to read the log of
+ * \param buf Bitmap with a bit for each page of the slot
+ * \return 0 on success, -errno on failure
+ */
 int kvm_get_dirty_pages(kvm_context_t, int slot, void *buf);
 
 
@@ -409,6 +596,189 @@ int kvm_create_memory_alias(kvm_context_t, int slot,
  */
 int kvm_destroy_memory_alias(kvm_context_t, int slot);
 
+/*!
+ * \brief Give guest memory back to the host
+ *
+ * Used by a balloon driver once the guest has handed over some pages.  The
+ * pages are unmapped from the guest and unwired in the kernel, then their
+ * host copies are discarded.  If the guest touches them again it gets fresh
+ * zeroed pages.
+ *
+ * The virtual CPU must not be inside kvm_run() while this is called.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param ranges Guest frame ranges to release
+ * \param n Number of entries in ranges
+ * \return Number of pages the host got back, or -errno on failure
+ */
+int kvm_balloon_release(kvm_context_t kvm, struct kvm_balloon_range *ranges,
+			int n);
+
+/*!
+ * \brief Prepare guest memory for a write from the host
+ *
+ * With kvm_set_share_zero(), guest ram created by kvm_create() is
+ * registered with KVM_MEM_SHARE_ZERO, so pages the guest has only read are
+ * backed by a shared zero page rather than by the host memory.  Writes from
+ * the host would not be seen by the guest, so call this on the range before
+ * writing guest memory once the guest has started running, unless the
+ * write goes through kvm_guest_iov() or kvm_guest_write().  Loading images
+ * before the first kvm_run() needs no call.  The range must lie inside
+ * one memory slot, otherwise this fails with -EINVAL.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param phys_start Guest physical address of the range
+ * \param len Length of the range in bytes
+ * \return 0 on success, -errno on failure
+ */
+int kvm_unshare_zero(kvm_context_t kvm, unsigned long phys_start,
+		     unsigned long len);
+
+/*!
+ * \brief Set up ioctl batching
+ *
+ * Registers a ring with the kernel which later kvm_batch_queue() calls fill.
+ * A whole batch costs one system call, which helps when a device model
+ * issues bursts of small ioctls.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \return 0 on success, -errno on failure
+ */
+int kvm_batch_init(kvm_context_t kvm);
+
+/*!
+ * \brief Queue an ioctl for the next kvm_batch_submit()
+ *
+ * Any vm or vcpu ioctl except KVM_RUN can be queued, with the argument it
+ * would be passed to ioctl().  arg must stay valid until the op completes,
+ * results are copied back to it like a normal ioctl.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param cmd ioctl number
+ * \param arg ioctl argument
+ * \param user_data Passed back by kvm_batch_reap()
+ * \return 0 on success, -EBUSY when the ring is full
+ */
+int kvm_batch_queue(kvm_context_t kvm, unsigned long cmd, void *arg,
+		    uint64_t user_data);
+
+/*!
+ * \brief Run everything queued, in order
+ *
+ * Stops early if completions haven't been reaped, in which case reap and
+ * submit again.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \return Number of ops run, or -errno on failure
+ */
+int kvm_batch_submit(kvm_context_t kvm);
+
+/*!
+ * \brief Take the next completion
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param user_data Set to the value given to kvm_batch_queue()
+ * \param result Set to 0 or the errno the ioctl would have failed with
+ * \return 1 if a completion was taken, 0 if there are none
+ */
+int kvm_batch_reap(kvm_context_t kvm, uint64_t *user_data, int *result);
+
+/*!
+ * \brief Start sampling the guest's rip into a ring shared with the kernel
+ *
+ * With KVM_PROF_TIMER the vmx preemption timer forces an exit every period
+ * nanoseconds of guest time. With KVM_PROF_INTR a sample is taken on every
+ * period'th exit for a host interrupt, which adds no exits at all.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param mode KVM_PROF_TIMER or KVM_PROF_INTR
+ * \param period Nanoseconds (at least 10000) or interrupt exits
+ * \param size Bytes for the ring, rounded up to whole pages
+ * \return 0 on success, or -errno
+ */
+int kvm_prof_start(kvm_context_t kvm, int mode, uint64_t period, size_t size);
+
+/*!
+ * \brief Stop taking samples
+ *
+ * Samples already in the ring can still be read, until kvm_prof_release().
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \return 0 on success, or -errno
+ */
+int kvm_prof_stop(kvm_context_t kvm);
+
+/*!
+ * \brief Free the sample ring after kvm_prof_stop()
+ *
+ * \param kvm Pointer to the current kvm_context
+ */
+void kvm_prof_release(kvm_context_t kvm);
+
+/*!
+ * \brief Take samples out of the ring
+ *
+ * Doesn't make a syscall or take a lock, so another thread can drain the
+ * ring while the vcpu runs.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param samples Where to copy the samples
+ * \param max Size of samples
+ * \return Number of samples copied
+ */
+int kvm_prof_read(kvm_context_t kvm, struct kvm_prof_sample *samples, int max);
+
+/*!
+ * \brief What profiling has cost so far
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param dropped Samples lost because the ring was full
+ * \param exits Exits caused only by the profiler's timer
+ * \param overhead TSC cycles spent taking samples and in those exits
+ */
+void kvm_prof_stats(kvm_context_t kvm, uint64_t *dropped, uint64_t *exits,
+		    uint64_t *overhead);
+
+/*!
+ * \brief Limit how much cpu the guest gets
+ *
+ * Every period nanoseconds the vcpu may spend runtime nanoseconds in the
+ * guest. Once that is used up, KVM_RUN sleeps in the kernel until the next
+ * period starts. A signal ends the sleep with KVM_EXIT_INTR.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param period Nanoseconds, 1ms to 1s
+ * \param runtime Nanoseconds, at least 100us and at most period, 0 lifts the limit
+ * \return 0 on success, or -errno
+ */
+int kvm_set_cpu_quota(kvm_context_t kvm, uint64_t period, uint64_t runtime);
+
+/*!
+ * \brief Lets the kernel queue guest writes to a port range
+ *
+ * Writes to the ports then go on a ring instead of exiting, and libkvm
+ * replays them through the out callbacks before it handles the next exit,
+ * so they stay in order with everything else the guest does. Only for
+ * ports whose writes have no side effect the guest could see before then.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param port First port
+ * \param size Number of ports
+ * \return 0 on success, -ENOSYS if the kernel doesn't coalesce port i/o
+ */
+int kvm_register_coalesced_pio(kvm_context_t kvm, uint16_t port, uint32_t size);
+
+/*!
+ * \brief Replays the queued port writes now
+ *
+ * kvm_run() does this on every exit. A vcpu that doesn't exit keeps its
+ * writes queued, so device threads call this to get them out anyway. Safe
+ * from any thread.
+ *
+ * \param kvm Pointer to the current kvm_context
+ */
+void kvm_flush_coalesced_pio(kvm_context_t kvm);
+
 /*!
  * \brief Get a bitmap of guest ram pages which are allocated to the guest.
  *
@@ -419,6 +789,34 @@ int kvm_destroy_memory_alias(kvm_context_t, int slot);
 int kvm_get_mem_map(kvm_context_t kvm, int slot, void *bitmap);
 int kvm_set_irq_level(kvm_context_t kvm, int irq, int level);
 
+/*!
+ * \brief Replace the GSI routing table
+ *
+ * Routes each GSI raised with kvm_set_irq_level to a PIC or IOAPIC pin
+ * (KVM_IRQ_ROUTING_IRQCHIP) or to an MSI (KVM_IRQ_ROUTING_MSI). A GSI can
+ * have several entries. Until this is called, GSIs 0-15 map to the ISA lines.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param entries The new routes, replacing all the old ones
+ * \param nr Number of entries
+ * \return 0 on success, or -errno
+ */
+int kvm_set_gsi_routing(kvm_context_t kvm,
+			struct kvm_irq_routing_entry *entries, int nr);
+
+/*!
+ * \brief Send an MSI straight to the vcpu
+ *
+ * Only fixed and lowest priority delivery to APIC id 0 or broadcast are
+ * delivered, other destinations are dropped.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param address MSI address, 0xfeexxxxx
+ * \param data MSI data, the vector is in the low byte
+ * \return 0 on success, or -errno
+ */
+int kvm_signal_msi(kvm_context_t kvm, uint64_t address, uint32_t data);
+
 /*!
  * \brief Enable dirty-pages-logging for all memory regions
  *
@@ -488,4 +886,485 @@ int kvm_get_lapic(kvm_context_t kvm, int vcpu, struct kvm_lapic_state *s);
  */
 int kvm_set_lapic(kvm_context_t kvm, int vcpu, struct kvm_lapic_state *s);
 
+/*!
+ * \brief Host address of a range of guest physical memory
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gpa Guest physical address
+ * \param len Bytes the caller wants to touch
+ * \return NULL unless the whole range is in one of the ram slots
+ */
+void *kvm_guest_ptr(kvm_context_t kvm, uint64_t gpa, size_t len);
+
+/*!
+ * \brief Host buffers behind a range of guest physical memory
+ *
+ * Splits the range at memory slot boundaries, so device models can hand
+ * guest memory straight to preadv/pwritev without bouncing it.  With
+ * write set, the pages are marked in the dirty log as they are handed
+ * out, so read the log only after the device is done with them, and zero
+ * pages the guest only read are unshared first.  Unsharing waits for a
+ * running vcpu to exit.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gpa Guest physical address
+ * \param len Length of the range
+ * \param iov Where the host buffers go
+ * \param max Room in iov
+ * \param write Whether the device is going to write the range
+ * \return Number of iovecs, -EFAULT if part of the range isn't ram or
+ * -ENOBUFS if it takes more than max
+ */
+int kvm_guest_iov(kvm_context_t kvm, uint64_t gpa, size_t len,
+		  struct iovec *iov, int max, int write);
+
+/*!
+ * \brief Note a device write to guest memory in the dirty log
+ *
+ * For writes through kvm_guest_ptr(), which doesn't mark anything.
+ * Nothing happens unless dirty logging is on for the slot.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gpa Guest physical address
+ * \param len Length of the range
+ */
+void kvm_guest_mark_dirty(kvm_context_t kvm, uint64_t gpa, size_t len);
+
+/*!
+ * \brief Copy from guest physical memory
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gpa Guest physical address
+ * \param buf Destination
+ * \param len Bytes to copy
+ * \return 0, or -EFAULT with nothing copied if part of the range isn't ram
+ */
+int kvm_guest_read(kvm_context_t kvm, uint64_t gpa, void *buf, size_t len);
+
+/*!
+ * \brief Copy to guest physical memory
+ *
+ * Marks the pages in the dirty log.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param gpa Guest physical address
+ * \param buf Source
+ * \param len Bytes to copy
+ * \return 0, or -EFAULT with nothing copied if part of the range isn't ram
+ */
+int kvm_guest_write(kvm_context_t kvm, uint64_t gpa, const void *buf,
+		    size_t len);
+
+/*!
+ * \brief Translate a guest virtual address the way the VCPU would now
+ *
+ * Uses the VCPU's current paging mode and cr3. Accessed and dirty bits
+ * in the guest page tables are left alone.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Which virtual CPU's page tables to use
+ * \param gva Guest virtual address
+ * \param tr Where the guest physical address goes, valid is 0 if the
+ * guest hasn't mapped gva
+ * \return 0 on success, or -errno
+ */
+int kvm_translate(kvm_context_t kvm, int vcpu, uint64_t gva,
+		  struct kvm_translation *tr);
+
+/*!
+ * \brief The KVM_PAGING_* mode a set of system registers is in
+ *
+ * \param sregs From kvm_get_sregs()
+ * \return KVM_PAGING_NONE, KVM_PAGING_32, KVM_PAGING_32_PSE,
+ * KVM_PAGING_PAE or KVM_PAGING_LONG
+ */
+int kvm_paging_mode(const struct kvm_sregs *sregs);
+
+/*!
+ * \brief Translate and read many guest virtual addresses at once
+ *
+ * Walks the guest page tables under cr3 for every entry's gva and copies
+ * len bytes from there to addr, page by page, in one ioctl. The kext
+ * reads the tables and the data through the memory slots without
+ * stopping the VCPUs, so this is safe from any thread while the guest
+ * runs, and what comes back is only as consistent as the guest keeps it.
+ * Each entry gets its own result, gpa and the number of bytes read.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param cr3 Root of the guest page tables
+ * \param paging KVM_PAGING_* mode of those tables, see kvm_paging_mode()
+ * \param entries What to read, and where the results go
+ * \param nr Number of entries
+ * \return 0 when every entry has its result, or -errno
+ */
+int kvm_translate_read(kvm_context_t kvm, uint64_t cr3, int paging,
+		       struct kvm_translate_read_entry *entries, int nr);
+
+/*!
+ * \brief Copy from guest virtual memory as a VCPU sees it now
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param vcpu Whose cr3 and paging mode to use
+ * \param gva Guest virtual address
+ * \param buf Destination
+ * \param len Bytes to copy
+ * \return 0, -ENOENT if part of the range isn't mapped, -ENXIO if it
+ * isn't ram, or another -errno
+ */
+int kvm_guest_read_virt(kvm_context_t kvm, int vcpu, uint64_t gva, void *buf,
+			size_t len);
+
+/*!
+ * \brief Give the virtio devices a chance at a guest port access
+ *
+ * Covers pci configuration space at 0xcf8-0xcff and every device's i/o
+ * bar. Call it from the in and out callbacks before anything else.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param addr Port
+ * \param size 1, 2 or 4
+ * \param is_write Nonzero for out
+ * \param value What the guest wrote, or where the result goes
+ * \return 1 if a device took the access
+ */
+int kvm_virtio_pio(kvm_context_t kvm, uint16_t addr, int size, int is_write,
+		   uint32_t *value);
+
+struct kvm_event_loop;
+struct kvm_event_source;
+
+/*!
+ * \brief Work handed to an event loop thread by kvm_event_post()
+ *
+ * Embed it in whatever the work is about, fn gets it back and may free it.
+ */
+struct kvm_event_work {
+	struct kvm_event_work *next;
+	void (*fn)(struct kvm_event_work *work);
+};
+
+/*!
+ * \brief Start an event loop for device models
+ *
+ * The loop's threads wait on one kqueue for fd, timer and notifier
+ * sources. A source's callback never runs on two threads at once, but
+ * different sources' callbacks can, so state they share needs a lock.
+ * Callbacks may also run when there turns out to be nothing to do.
+ *
+ * \param nthreads How many i/o threads
+ * \return The loop, or NULL
+ */
+struct kvm_event_loop *kvm_event_loop_create(int nthreads);
+
+/*!
+ * \brief Stop the loop's threads and free it
+ *
+ * Runs whatever was posted and not run yet. Remove sources first.
+ *
+ * \param loop The loop from kvm_event_loop_create()
+ */
+void kvm_event_loop_destroy(struct kvm_event_loop *loop);
+
+/*!
+ * \brief Call cb while fd is readable, or writable
+ *
+ * Level triggered: cb keeps getting called until it has drained the fd.
+ *
+ * \param loop The loop
+ * \param fd The file descriptor, one source per fd and direction
+ * \param write Wait for room to write instead of data to read
+ * \param cb Called on one of the loop's threads
+ * \param opaque Passed to cb
+ * \return The source, or NULL
+ */
+struct kvm_event_source *kvm_event_add_fd(struct kvm_event_loop *loop,
+					  int fd, int write,
+					  void (*cb)(void *), void *opaque);
+
+/*!
+ * \brief A timer source, set with kvm_event_timer_set()
+ *
+ * \param loop The loop
+ * \param cb Called on one of the loop's threads
+ * \param opaque Passed to cb
+ * \return The source, or NULL
+ */
+struct kvm_event_source *kvm_event_add_timer(struct kvm_event_loop *loop,
+					     void (*cb)(void *), void *opaque);
+
+/*!
+ * \brief Arm, rearm or disarm a timer
+ *
+ * Safe from the timer's own callback.
+ *
+ * \param src The timer from kvm_event_add_timer()
+ * \param us Microseconds from now, 0 disarms
+ * \param periodic Fire every us microseconds instead of once
+ * \return 0, or -errno
+ */
+int kvm_event_timer_set(struct kvm_event_source *src, unsigned us,
+			int periodic);
+
+/*!
+ * \brief A source that calls cb after kvm_event_notify()
+ *
+ * Notifications that come in before cb runs are folded into one call.
+ *
+ * \param loop The loop
+ * \param cb Called on one of the loop's threads
+ * \param opaque Passed to cb
+ * \return The source, or NULL
+ */
+struct kvm_event_source *kvm_event_add_notifier(struct kvm_event_loop *loop,
+						void (*cb)(void *),
+						void *opaque);
+
+/*!
+ * \brief Wake a notifier up from any thread
+ *
+ * One kevent() and no locks, cheap enough for an exit handler.
+ *
+ * \param src The notifier from kvm_event_add_notifier()
+ */
+void kvm_event_notify(struct kvm_event_source *src);
+
+/*!
+ * \brief Stop or resume calling a source's callback
+ *
+ * Events that come in meanwhile aren't lost, a notifier or fd that's
+ * ready calls back as soon as it's enabled again.
+ *
+ * \param src Any source
+ * \param enabled 0 to pause the source, 1 to resume it
+ */
+void kvm_event_set_enabled(struct kvm_event_source *src, int enabled);
+
+/*!
+ * \brief Take a source off the loop and free it
+ *
+ * Waits for a callback in progress on another thread. From the source's
+ * own callback, it's freed when the callback returns.
+ *
+ * \param src Any source
+ */
+void kvm_event_remove(struct kvm_event_source *src);
+
+/*!
+ * \brief Run work->fn on one of the loop's threads
+ *
+ * Lock free, so vcpu threads and device threads can hand over completions
+ * and interrupts without waiting for each other. Work runs in the order
+ * it was posted.
+ *
+ * \param loop The loop
+ * \param work Not touched by the caller until fn has run
+ */
+void kvm_event_post(struct kvm_event_loop *loop, struct kvm_event_work *work);
+
+struct virtio_net;
+
+/*
+ * Where a virtio-net's frames go.  The device's thread polls fd for input
+ * and calls recv only when it's readable.
+ */
+struct kvm_net_backend {
+	int fd;
+	/* one frame, 0 on success, -EAGAIN if the peer can't take it yet */
+	int (*send)(struct kvm_net_backend *be, const struct iovec *iov,
+		    int cnt);
+	/* one frame into buf, its length or -EAGAIN when there's none */
+	ssize_t (*recv)(struct kvm_net_backend *be, void *buf, size_t len);
+	void (*close)(struct kvm_net_backend *be);
+};
+
+struct kvm_virtio_net_stats {
+	uint64_t tx_packets;
+	uint64_t tx_bytes;
+	uint64_t tx_dropped;
+	uint64_t rx_packets;
+	uint64_t rx_bytes;
+	uint64_t rx_dropped;
+	/* guest notifications, and interrupts raised for either queue */
+	uint64_t kicks;
+	uint64_t interrupts;
+};
+
+/*!
+ * \brief A backend on a datagram socket that's already connected
+ *
+ * One end of socketpair(AF_UNIX, SOCK_DGRAM) for instance. The socket is
+ * made non-blocking and closed with the backend.
+ *
+ * \param fd The socket
+ * \return The backend, or NULL
+ */
+struct kvm_net_backend *kvm_net_socket_backend(int fd);
+
+/*!
+ * \brief A backend on an AF_UNIX datagram socket bound to path
+ *
+ * Frames go to whatever is bound to peer, and are dropped while nothing
+ * is. Two kvmctl processes with their paths swapped have a private wire,
+ * one with path and peer the same hears itself.
+ *
+ * \param path Where to bind, replaced if it exists and removed on close
+ * \param peer Where to send
+ * \return The backend, or NULL
+ */
+struct kvm_net_backend *kvm_net_unix_backend(const char *path,
+					     const char *peer);
+
+/*!
+ * \brief Add a virtio-net nic
+ *
+ * The nic is a legacy virtio-pci device on bus 0 with mergeable receive
+ * buffers and event idx. The event loop runs both rings, like vhost-net: a
+ * kick only notifies it, and it raises one interrupt per batch.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param loop The event loop that runs the rings
+ * \param be Where frames go, the nic owns it from now on
+ * \param mac Six bytes
+ * \param io_base First port of the VIRTIO_PCI_REGION_SIZE port bar
+ * \param irq Interrupt line, raised with KVM_IRQ_LINE
+ * \return The nic, or NULL
+ */
+struct virtio_net *kvm_virtio_net_create(kvm_context_t kvm,
+					 struct kvm_event_loop *loop,
+					 struct kvm_net_backend *be,
+					 const uint8_t *mac, uint16_t io_base,
+					 int irq);
+
+/*!
+ * \brief Take the nic off its event loop and the bus, and close its backend
+ *
+ * \param net The nic from kvm_virtio_net_create()
+ */
+void kvm_virtio_net_destroy(struct virtio_net *net);
+
+/*!
+ * \brief Counters since the nic was created
+ *
+ * \param net The nic from kvm_virtio_net_create()
+ * \param stats Where to copy them
+ */
+void kvm_virtio_net_stats(struct virtio_net *net,
+			  struct kvm_virtio_net_stats *stats);
+
+struct serial;
+
+struct kvm_serial_stats {
+	uint64_t tx_bytes;
+	/* write(2)s it took to get them out */
+	uint64_t tx_writes;
+	uint64_t rx_bytes;
+	uint64_t interrupts;
+};
+
+/*!
+ * \brief Add a 16550A uart
+ *
+ * Transmitted bytes go into a ring that the uart's own thread writes to
+ * out_fd in large chunks, a couple of milliseconds after the first one or
+ * as soon as it's half full. The same thread polls in_fd for input, which
+ * should be non-blocking. With kernel support the transmit register is
+ * coalesced, so a guest writing it only exits for the status reads in
+ * between.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param base First of the eight ports, 0x3f8 for COM1
+ * \param irq Interrupt line, 4 for COM1
+ * \param in_fd Where received bytes come from, -1 for none
+ * \param out_fd Where transmitted bytes go
+ * \return The uart, or NULL
+ */
+struct serial *kvm_serial_create(kvm_context_t kvm, uint16_t base, int irq,
+				 int in_fd, int out_fd);
+
+/*!
+ * \brief Write out what's buffered, stop the uart's thread and remove it
+ *
+ * \param s The uart from kvm_serial_create()
+ */
+void kvm_serial_destroy(struct serial *s);
+
+/*!
+ * \brief Give the uarts a chance at a guest port access
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param addr Port
+ * \param size 1, 2 or 4, wider accesses only reach the first register
+ * \param is_write Nonzero for out
+ * \param value What the guest wrote, or where the result goes
+ * \return 1 if a uart took the access
+ */
+int kvm_serial_pio(kvm_context_t kvm, uint16_t addr, int size, int is_write,
+		   uint32_t *value);
+
+/*!
+ * \brief Queue bytes on the uart's output as if the guest had sent them
+ *
+ * For other console devices that want the same buffering.
+ *
+ * \param s The uart from kvm_serial_create()
+ * \param buf Bytes
+ * \param len How many
+ */
+void kvm_serial_write(struct serial *s, const void *buf, size_t len);
+
+/*!
+ * \brief Counters since the uart was created
+ *
+ * \param s The uart from kvm_serial_create()
+ * \param stats Where to copy them
+ */
+void kvm_serial_stats(struct serial *s, struct kvm_serial_stats *stats);
+
+struct virtio_blk;
+
+struct kvm_virtio_blk_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t flushes;
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	/* guest notifications, and interrupts raised for completions */
+	uint64_t kicks;
+	uint64_t interrupts;
+};
+
+/*!
+ * \brief Add a virtio-blk disk backed by an image file
+ *
+ * The disk is a legacy virtio-pci device on bus 0. Every queue gets its
+ * own thread, which runs requests with preadv/pwritev directly on guest
+ * memory and raises one interrupt per batch of completions. The image is
+ * opened read only if it can't be opened for writing.
+ *
+ * \param kvm Pointer to the current kvm_context
+ * \param path Image file, its size is rounded down to 512 bytes
+ * \param io_base First port of the VIRTIO_PCI_REGION_SIZE port bar
+ * \param irq Interrupt line, raised with KVM_IRQ_LINE
+ * \param queues Number of request queues, 1 to 16
+ * \return The disk, or NULL
+ */
+struct virtio_blk *kvm_virtio_blk_create(kvm_context_t kvm, const char *path,
+					 uint16_t io_base, int irq, int queues);
+
+/*!
+ * \brief Stop the disk's threads and take it off the bus
+ *
+ * \param blk The disk from kvm_virtio_blk_create()
+ */
+void kvm_virtio_blk_destroy(struct virtio_blk *blk);
+
+/*!
+ * \brief Counters since the disk was created
+ *
+ * \param blk The disk from kvm_virtio_blk_create()
+ * \param stats Where to copy them
+ */
+void kvm_virtio_blk_stats(struct virtio_blk *blk,
+			  struct kvm_virtio_blk_stats *stats);
+
 #endif
@@ -29,6 +29,7 @@
 #include <signal.h>
 #include <pthread.h>
 #include <sys/syscall.h>
+#include <sys/time.h>
 //#include <linux/unistd.h>
 
 
@@ -44,13 +45,23 @@ static int tkill(int pid, int sig)
 
 kvm_context_t kvm;
 
-#define MAX_VCPUS 4
-
 #define IPI_SIGNAL (SIGRTMIN + 4)
 
+#define VIRTIO_BLK_IO_BASE 0xc000
+#define VIRTIO_BLK_IRQ 11
+#define VIRTIO_NET_IO_BASE 0xc040
+#define VIRTIO_NET_IRQ 10
+
+/* COM1, and the port the test guests' printf writes to */
+#define SERIAL_BASE 0x3f8
+#define SERIAL_IRQ 4
+#define CONSOLE_PORT 0xf1
+/* test/zero_share.flat's, the host fills the page at the address written */
+#define HOST_FILL_PORT 0xf2
+#define HOST_FILL_BYTE 0x5a
+
 static int ncpus = 1;
 static sem_t init_sem;
-static __thread int vcpu;
 static int apic_ipi_vector = 0xff;
 static sigset_t kernel_sigmask;
 static sigset_t ipi_sigmask;
@@ -64,6 +75,8 @@ struct vcpu_info *vcpus;
 
 static uint32_t apic_sipi_addr;
 
+static struct serial *serial;
+
 static int apic_range(unsigned addr)
 {
     return (addr >= APIC_BASE) && (addr < APIC_BASE + APIC_SIZE);
@@ -84,7 +97,8 @@ static void apic_send_ipi(int vcpu)
     //tkill(v->tid, IPI_SIGNAL);
 }
 
-static int apic_io(unsigned addr, int is_write, uint32_t *value)
+static int apic_io(kvm_vcpu_context_t vcpu, unsigned addr, int is_write,
+		   uint32_t *value)
 {
     if (!apic_range(addr))
 	return 0;
@@ -99,7 +113,7 @@ static int apic_io(unsigned addr, int is_write, uint32_t *value)
 	break;
     case APIC_REG_ID:
 	if (!is_write)
-	    *value = vcpu;
+	    *value = kvm_vcpu_id(vcpu);
 	break;
     case APIC_REG_SIPI_ADDR:
 	if (!is_write)
@@ -121,43 +135,76 @@ static int apic_io(unsigned addr, int is_write, uint32_t *value)
 	if (is_write)
 	    apic_send_ipi(*value);
 	break;
+    case APIC_REG_CLOCK_US:
+	if (!is_write) {
+	    struct timeval tv;
+
+	    gettimeofday(&tv, NULL);
+	    *value = tv.tv_sec * 1000000ULL + tv.tv_usec;
+	}
+	break;
     }
     return 1;
 }
 
-static int test_inb(void *opaque, uint16_t addr, uint8_t *value)
+static int test_inb(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint8_t *value)
 {
+    uint32_t v;
+
+    if (kvm_serial_pio(kvm_vcpu_kvm(vcpu), addr, 1, 0, &v) ||
+	kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 1, 0, &v)) {
+	*value = v;
+	return 0;
+    }
     printf("inb 0x%x\n", addr);
     return 0;
 }
 
-static int test_inw(void *opaque, uint16_t addr, uint16_t *value)
+static int test_inw(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint16_t *value)
 {
+    uint32_t v;
+
+    if (kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 2, 0, &v)) {
+	*value = v;
+	return 0;
+    }
     printf("inw 0x%x\n", addr);
     return 0;
 }
 
-static int test_inl(void *opaque, uint16_t addr, uint32_t *value)
+static int test_inl(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint32_t *value)
 {
-    if (apic_io(addr, 0, value))
+    if (apic_io(vcpu, addr, 0, value))
+	return 0;
+    if (kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 4, 0, value))
 	return 0;
     printf("inl 0x%x\n", addr);
     return 0;
 }
 
-static int test_outb(void *opaque, uint16_t addr, uint8_t value)
+static int test_outb(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint8_t value)
 {
     static int newline = 1;
+    uint32_t v = value;
+
+    if (kvm_serial_pio(kvm_vcpu_kvm(vcpu), addr, 1, 1, &v) ||
+	kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 1, 1, &v))
+	return 0;
 
     switch (addr) {
     case 0xff: // irq injector
 	printf("injecting interrupt 0x%x\n", value);
-	kvm_inject_irq(kvm, 0, value);
+	kvm_inject_irq(kvm_vcpu_kvm(vcpu), 0, value);
 	break;
-    case 0xf1: // serial
+    case CONSOLE_PORT:
+	/* buffered with the uart's output, written out by its thread */
 	if (newline)
-	    fputs("GUEST: ", stdout);
-	putchar(value);
+	    kvm_serial_write(serial, "GUEST: ", 7);
+	kvm_serial_write(serial, &value, 1);
 	newline = value == '\n';
 	break;
     default:
@@ -166,50 +213,67 @@ static int test_outb(void *opaque, uint16_t addr, uint8_t value)
     return 0;
 }
 
-static int test_outw(void *opaque, uint16_t addr, uint16_t value)
+static int test_outw(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint16_t value)
 {
+    uint32_t v = value;
+
+    if (kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 2, 1, &v))
+	return 0;
     printf("outw $0x%x, 0x%x\n", value, addr);
     return 0;
 }
 
-static int test_outl(void *opaque, uint16_t addr, uint32_t value)
+static int test_outl(void *opaque, kvm_vcpu_context_t vcpu, uint16_t addr,
+		     uint32_t value)
 {
-    if (apic_io(addr, 1, &value))
+    if (apic_io(vcpu, addr, 1, &value))
 	return 0;
+    if (kvm_virtio_pio(kvm_vcpu_kvm(vcpu), addr, 4, 1, &value))
+	return 0;
+    if (addr == HOST_FILL_PORT) {
+	char page[4096];
+
+	memset(page, HOST_FILL_BYTE, sizeof(page));
+	if (kvm_guest_write(kvm_vcpu_kvm(vcpu), value & ~4095u, page,
+			    sizeof(page)))
+	    printf("host fill at 0x%x failed\n", value);
+	return 0;
+    }
     printf("outl $0x%x, 0x%x\n", value, addr);
     return 0;
 }
 
-static int test_debug(void *opaque, int vcpu)
+static int test_debug(void *opaque, kvm_vcpu_context_t vcpu)
 {
     printf("test_debug\n");
     return 0;
 }
 
-static int test_halt(void *opaque, int vcpu)
+static int test_halt(void *opaque, kvm_vcpu_context_t vcpu)
 {
     int n;
 
     sigwait(&ipi_sigmask, &n);
-    kvm_inject_irq(kvm, vcpu, apic_ipi_vector);
+    kvm_inject_irq(kvm_vcpu_kvm(vcpu), kvm_vcpu_id(vcpu), apic_ipi_vector);
     return 0;
 }
 
-static int test_io_window(void *opaque)
+static int test_io_window(void *opaque, kvm_vcpu_context_t vcpu)
 {
     return 0;
 }
 
-static int test_try_push_interrupts(void *opaque)
+static int test_try_push_interrupts(void *opaque, kvm_vcpu_context_t vcpu)
 {
     return 0;
 }
 
-static void test_post_kvm_run(void *opaque, int vcpu)
+static void test_post_kvm_run(void *opaque, kvm_vcpu_context_t vcpu)
 {
 }
 
-static int test_pre_kvm_run(void *opaque, int vcpu)
+static int test_pre_kvm_run(void *opaque, kvm_vcpu_context_t vcpu)
 {
     return 0;
 }
@@ -286,7 +350,6 @@ static void init_vcpu(int n)
     sigprocmask(SIG_UNBLOCK, &ipi_sigmask, NULL);
     sigprocmask(SIG_BLOCK, &ipi_sigmask, &kernel_sigmask);*/
     vcpus[n].tid = getpid();
-    vcpu = n;
     //kvm_set_signal_mask(kvm, n, &kernel_sigmask);
     sem_post(&init_sem);
 }
@@ -314,11 +377,56 @@ static void start_vcpu(int n)
     pthread_create(&thread, NULL, do_create_vcpu, (void *)(long)n);
 }
 
+/* samples are written as text, kvm_prof reads them back */
+static FILE *prof_file;
+static volatile int prof_done;
+
+static void prof_drain(void)
+{
+    struct kvm_prof_sample samples[256];
+    int i, n;
+
+    while ((n = kvm_prof_read(kvm, samples, 256)) > 0)
+	for (i = 0; i < n; ++i)
+	    fprintf(prof_file, "%llx %llx %llx %u %u\n",
+		    (unsigned long long)samples[i].tsc,
+		    (unsigned long long)samples[i].rip,
+		    (unsigned long long)samples[i].cr3,
+		    samples[i].cpl, samples[i].flags);
+}
+
+static void *prof_thread(void *unused)
+{
+    while (!prof_done) {
+	prof_drain();
+	usleep(10000);
+    }
+    return NULL;
+}
+
+static void prof_finish(pthread_t thread)
+{
+    uint64_t dropped, exits, overhead;
+
+    prof_done = 1;
+    pthread_join(thread, NULL);
+    kvm_prof_stop(kvm);
+    prof_drain();
+    kvm_prof_stats(kvm, &dropped, &exits, &overhead);
+    fprintf(prof_file, "# dropped %llu exits %llu overhead %llu\n",
+	    (unsigned long long)dropped, (unsigned long long)exits,
+	    (unsigned long long)overhead);
+    fclose(prof_file);
+    kvm_prof_release(kvm);
+}
+
 const char *progname;
 
 static void usage()
 {
-    fprintf(stderr, "usage: %s [--smp n] [bootstrap] flatfile\n", progname);
+    fprintf(stderr, "usage: %s [--smp n] [--prof samples] [--quota runtime:period]"
+	    " [--blk image] [--net path[:peer]] [--iothreads n] [--share-zero]"
+	    " [bootstrap] flatfile\n", progname);
     exit(1);
 }
 
@@ -331,6 +439,20 @@ static int isarg(const char *arg, const char *longform, const char *shortform)
     return 0;
 }
 
+/* O_NONBLOCK on a tty's stdin would make stdout non-blocking too */
+static int console_input(void)
+{
+    int fd;
+
+    if (isatty(0))
+	fd = open("/dev/tty", O_RDONLY);
+    else
+	fd = dup(0);
+    if (fd != -1)
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
 static void sig_ignore(int sig)
 {
     write(1, "boo\n", 4);
@@ -339,7 +461,17 @@ static void sig_ignore(int sig)
 int main(int ac, char **av)
 {
 	void *vm_mem;
-	int i;
+	int i, r;
+	const char *prof_path = NULL;
+	pthread_t prof;
+	unsigned long quota_runtime = 0, quota_period = 0;
+	const char *blk_path = NULL;
+	struct virtio_blk *blk = NULL;
+	char *net_path = NULL, *net_peer;
+	struct virtio_net *net = NULL;
+	int iothreads = 1;
+	int share_zero = 0;
+	struct kvm_event_loop *loop;
 
 	progname = av[0];
 	while (ac > 1 && av[1][0] =='-') {
@@ -350,6 +482,36 @@ int main(int ac, char **av)
 		if (ncpus < 1)
 		    usage();
 		++av, --ac;
+	    } else if (isarg(av[1], "--prof", "-p")) {
+		if (ac <= 2)
+		    usage();
+		prof_path = av[2];
+		++av, --ac;
+	    } else if (isarg(av[1], "--quota", "-q")) {
+		/* microseconds, like cpu.max */
+		if (ac <= 2 || sscanf(av[2], "%lu:%lu", &quota_runtime,
+				      &quota_period) != 2)
+		    usage();
+		++av, --ac;
+	    } else if (isarg(av[1], "--blk", "-b")) {
+		if (ac <= 2)
+		    usage();
+		blk_path = av[2];
+		++av, --ac;
+	    } else if (isarg(av[1], "--net", "-n")) {
+		if (ac <= 2)
+		    usage();
+		net_path = av[2];
+		++av, --ac;
+	    } else if (isarg(av[1], "--iothreads", "-i")) {
+		if (ac <= 2)
+		    usage();
+		iothreads = atoi(av[2]);
+		if (iothreads < 1)
+		    usage();
+		++av, --ac;
+	    } else if (isarg(av[1], "--share-zero", "-z")) {
+		share_zero = 1;
 	    } else
 		usage();
 	    ++av, --ac;
@@ -369,6 +531,13 @@ int main(int ac, char **av)
 	    return 1;
 	}
   printf("kvm_init done\n");
+	/* the vcpu table is sized when the vm is created */
+	if (kvm_set_max_vcpus(kvm, ncpus) < 0) {
+	    kvm_finalize(kvm);
+	    fprintf(stderr, "kvm_set_max_vcpus failed\n");
+	    return 1;
+	}
+	kvm_set_share_zero(kvm, share_zero);
 	if (kvm_create(kvm, 128 * 1024 * 1024, &vm_mem) < 0) {
 	    kvm_finalize(kvm);
 	    fprintf(stderr, "kvm_create failed\n");
@@ -376,6 +545,49 @@ int main(int ac, char **av)
 	}
   printf("kvm_create done %p\n", vm_mem);
 
+	fflush(stdout);
+	serial = kvm_serial_create(kvm, SERIAL_BASE, SERIAL_IRQ,
+				   console_input(), 1);
+	if (!serial)
+	    return 1;
+	/* nothing comes back from the console port, let the writes queue */
+	kvm_register_coalesced_pio(kvm, CONSOLE_PORT, 1);
+
+	if (blk_path) {
+	    /* a queue per vcpu, test/virtio_blk.flat looks for it on the bus */
+	    blk = kvm_virtio_blk_create(kvm, blk_path, VIRTIO_BLK_IO_BASE,
+					VIRTIO_BLK_IRQ, ncpus);
+	    if (!blk)
+		return 1;
+	}
+
+	/* device work runs here, the vcpu threads only dispatch exits */
+	loop = kvm_event_loop_create(iothreads);
+	if (!loop)
+	    return 1;
+
+	if (net_path) {
+	    /* no peer hears itself, which is enough for one guest */
+	    struct kvm_net_backend *be;
+	    uint8_t mac[6] = { 0x52, 0x54, 0x00, 0, 0, 0 };
+
+	    net_peer = strchr(net_path, ':');
+	    if (net_peer)
+		*net_peer++ = 0;
+	    else
+		net_peer = net_path;
+	    mac[3] = getpid() >> 16;
+	    mac[4] = getpid() >> 8;
+	    mac[5] = getpid();
+	    be = kvm_net_unix_backend(net_path, net_peer);
+	    if (!be)
+		return 1;
+	    net = kvm_virtio_net_create(kvm, loop, be, mac, VIRTIO_NET_IO_BASE,
+					VIRTIO_NET_IRQ);
+	    if (!net)
+		return 1;
+	}
+
 	if (ac > 1) {
 	    if (strcmp(av[1], "-32") != 0)
 		load_file(vm_mem + 0xf0000, av[1]);
@@ -395,9 +607,59 @@ int main(int ac, char **av)
 	for (i = 0; i < ncpus; ++i)
 	    sem_wait(&init_sem);
 
+	if (quota_runtime) {
+	    r = kvm_set_cpu_quota(kvm, quota_period * 1000ULL,
+				  quota_runtime * 1000ULL);
+	    if (r) {
+		fprintf(stderr, "kvm_set_cpu_quota: %s\n", strerror(-r));
+		return 1;
+	    }
+	}
+
+	if (prof_path) {
+	    prof_file = fopen(prof_path, "w");
+	    if (!prof_file) {
+		perror(prof_path);
+		return 1;
+	    }
+	    /* 10k samples a second, 1MB holds a good few seconds of them */
+	    r = kvm_prof_start(kvm, KVM_PROF_TIMER, 100000, 1024 * 1024);
+	    if (r) {
+		fprintf(stderr, "kvm_prof_start: %s\n", strerror(-r));
+		return 1;
+	    }
+	    pthread_create(&prof, NULL, prof_thread, NULL);
+	}
+
   printf("kvm_run\n");
 	kvm_run(kvm, 0);
   printf("kvm_run done\n");
 
+	if (prof_path)
+	    prof_finish(prof);
+	if (blk)
+	    kvm_virtio_blk_destroy(blk);
+	if (net) {
+	    struct kvm_virtio_net_stats st;
+	    double frames;
+
+	    kvm_virtio_net_stats(net, &st);
+	    frames = st.tx_packets + st.rx_packets;
+	    if (frames < 1)
+		frames = 1;
+	    /* every kick is an exit, and so is the isr read an interrupt takes */
+	    printf("virtio-net: %llu frames sent, %llu received, "
+		   "%llu and %llu dropped, %.3f kicks and %.3f interrupts "
+		   "per frame\n",
+		   (unsigned long long)st.tx_packets,
+		   (unsigned long long)st.rx_packets,
+		   (unsigned long long)st.tx_dropped,
+		   (unsigned long long)st.rx_dropped,
+		   st.kicks / frames, st.interrupts / frames);
+	    kvm_virtio_net_destroy(net);
+	}
+	kvm_event_loop_destroy(loop);
+	kvm_serial_destroy(serial);
+
 	return 0;
 }
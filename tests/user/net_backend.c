@@ -0,0 +1,142 @@
+/*
+ * Frame backends for virtio-net: any datagram socket that keeps frame
+ * boundaries, one end of a socketpair, or an AF_UNIX datagram socket
+ * bound to a path and sending to another, which is how two kvmctl
+ * processes on one host get a wire between them.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "kvmctl.h"
+
+/* room for a few hundred full sized frames in flight each way */
+#define NET_SOCKET_BUF	(1024 * 1024)
+
+struct socket_backend {
+	struct kvm_net_backend be;
+	/* sendmsg's destination, unless the socket is connected */
+	struct sockaddr_un peer;
+	int has_peer;
+	/* bound path, removed on close */
+	char *path;
+};
+
+static int socket_send(struct kvm_net_backend *be, const struct iovec *iov,
+		       int cnt)
+{
+	struct socket_backend *sb = (struct socket_backend *)be;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = cnt;
+	if (sb->has_peer) {
+		msg.msg_name = &sb->peer;
+		msg.msg_namelen = sizeof(sb->peer);
+	}
+	if (sendmsg(be->fd, &msg, 0) >= 0)
+		return 0;
+	/* the receiver is behind, unix sockets say ENOBUFS for that too */
+	if (errno == EAGAIN || errno == ENOBUFS)
+		return -EAGAIN;
+	return -errno;
+}
+
+static ssize_t socket_recv(struct kvm_net_backend *be, void *buf, size_t len)
+{
+	ssize_t r;
+
+	r = recv(be->fd, buf, len, 0);
+	if (r < 0)
+		return errno == EWOULDBLOCK ? -EAGAIN : -errno;
+	return r;
+}
+
+static void socket_close(struct kvm_net_backend *be)
+{
+	struct socket_backend *sb = (struct socket_backend *)be;
+
+	close(be->fd);
+	if (sb->path) {
+		unlink(sb->path);
+		free(sb->path);
+	}
+	free(sb);
+}
+
+static struct socket_backend *socket_backend_new(int fd)
+{
+	struct socket_backend *sb;
+	int size = NET_SOCKET_BUF;
+
+	sb = calloc(1, sizeof(*sb));
+	if (!sb)
+		return NULL;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	/* the default send buffer of a unix datagram socket is 2k */
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	sb->be.fd = fd;
+	sb->be.send = socket_send;
+	sb->be.recv = socket_recv;
+	sb->be.close = socket_close;
+	return sb;
+}
+
+struct kvm_net_backend *kvm_net_socket_backend(int fd)
+{
+	struct socket_backend *sb = socket_backend_new(fd);
+
+	return sb ? &sb->be : NULL;
+}
+
+struct kvm_net_backend *kvm_net_unix_backend(const char *path,
+					     const char *peer)
+{
+	struct socket_backend *sb;
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path) ||
+	    strlen(peer) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "net: socket path too long\n");
+		return NULL;
+	}
+	fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		perror("net: socket");
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	/* left over from a guest that's gone */
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror(path);
+		close(fd);
+		return NULL;
+	}
+
+	sb = socket_backend_new(fd);
+	if (!sb) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	sb->path = strdup(path);
+	/* not connected, the peer may come and go */
+	sb->peer.sun_family = AF_UNIX;
+	strcpy(sb->peer.sun_path, peer);
+	sb->has_peer = 1;
+	return &sb->be;
+}
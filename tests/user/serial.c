@@ -0,0 +1,550 @@
+/*
+ * 16550A uart.  Output goes into a ring that a thread writes out in big
+ * chunks, input comes from an fd the same thread polls.  The transmitter
+ * is always done by the time the guest looks, so THRE never goes away and
+ * a guest polling LSR only costs the exit for the read.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "kvmctl.h"
+
+#define UART_RX		0	/* in, DLAB clear */
+#define UART_TX		0	/* out, DLAB clear */
+#define UART_DLL	0	/* DLAB set */
+#define UART_IER	1
+#define UART_DLM	1	/* DLAB set */
+#define UART_IIR	2	/* in */
+#define UART_FCR	2	/* out */
+#define UART_LCR	3
+#define UART_MCR	4
+#define UART_LSR	5
+#define UART_MSR	6
+#define UART_SCR	7
+
+#define UART_IER_RDI	0x01
+#define UART_IER_THRI	0x02
+#define UART_IER_RLSI	0x04
+#define UART_IER_MSI	0x08
+
+#define UART_IIR_NO_INT	0x01
+#define UART_IIR_MSI	0x00
+#define UART_IIR_THRI	0x02
+#define UART_IIR_RDI	0x04
+#define UART_IIR_RLSI	0x06
+#define UART_IIR_TIMEOUT 0x0c
+#define UART_IIR_FIFO	0xc0
+
+#define UART_FCR_ENABLE	0x01
+#define UART_FCR_CLEAR_RCVR 0x02
+#define UART_FCR_CLEAR_XMIT 0x04
+
+#define UART_LCR_DLAB	0x80
+
+#define UART_MCR_LOOP	0x10
+
+#define UART_LSR_DR	0x01
+#define UART_LSR_OE	0x02
+#define UART_LSR_THRE	0x20
+#define UART_LSR_TEMT	0x40
+
+/* carrier, data set ready and clear to send, there's always someone there */
+#define UART_MSR_ALIVE	0xb0
+
+#define SERIAL_FIFO_SIZE 16
+/* a power of two */
+#define SERIAL_TX_SIZE	(64 * 1024)
+/* how long output may sit in the ring waiting for more to go with it */
+#define SERIAL_FLUSH_MS	2
+/* how often queued port writes of a vcpu that doesn't exit get replayed */
+#define SERIAL_POLL_MS	10
+
+struct serial {
+	kvm_context_t kvm;
+	uint16_t base;
+	int irq;
+	int in_fd;
+	int out_fd;
+
+	/* registers, and everything below */
+	pthread_mutex_t lock;
+	uint8_t ier, lcr, mcr, scr, fcr, lsr;
+	uint16_t divisor;
+	int thr_ipending;
+	int timeout_ipending;
+	int irq_level;
+	uint8_t rx[SERIAL_FIFO_SIZE];
+	int rx_head, rx_count;
+
+	/* output ring, free running indexes */
+	char *tx;
+	unsigned tx_head, tx_tail;
+	pthread_cond_t tx_space;
+
+	pthread_t thread;
+	int wake[2];
+	int wake_pending;
+	int stop;
+
+	struct kvm_serial_stats stats;
+	struct serial *next;
+};
+
+static struct serial *serials;
+/* vms come and go while the vcpus of others do port io */
+static pthread_rwlock_t serials_lock = PTHREAD_RWLOCK_INITIALIZER;
+/* set on a uart's own thread, which can't wait for itself to make room */
+static __thread struct serial *serial_self;
+
+static unsigned now_ms(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* with lock held */
+static void serial_wake(struct serial *s)
+{
+	char c = 0;
+
+	if (s->wake_pending)
+		return;
+	s->wake_pending = 1;
+	write(s->wake[1], &c, 1);
+}
+
+static int serial_rx_trigger(struct serial *s)
+{
+	static const int levels[] = { 1, 4, 8, 14 };
+
+	if (!(s->fcr & UART_FCR_ENABLE))
+		return 1;
+	return levels[s->fcr >> 6];
+}
+
+static uint8_t serial_iir(struct serial *s)
+{
+	uint8_t iir = UART_IIR_NO_INT;
+
+	if ((s->ier & UART_IER_RLSI) && (s->lsr & UART_LSR_OE))
+		iir = UART_IIR_RLSI;
+	else if ((s->ier & UART_IER_RDI) && s->rx_count >= serial_rx_trigger(s))
+		iir = UART_IIR_RDI;
+	else if ((s->ier & UART_IER_RDI) && s->timeout_ipending)
+		iir = UART_IIR_TIMEOUT;
+	else if ((s->ier & UART_IER_THRI) && s->thr_ipending)
+		iir = UART_IIR_THRI;
+	if (s->fcr & UART_FCR_ENABLE)
+		iir |= UART_IIR_FIFO;
+	return iir;
+}
+
+/* with lock held, after anything that can change the iir */
+static void serial_update_irq(struct serial *s)
+{
+	int level = !(serial_iir(s) & UART_IIR_NO_INT);
+
+	if (level == s->irq_level)
+		return;
+	s->irq_level = level;
+	if (level)
+		s->stats.interrupts++;
+	kvm_set_irq_level(s->kvm, s->irq, level);
+}
+
+static void serial_rx_push(struct serial *s, uint8_t c)
+{
+	int size = s->fcr & UART_FCR_ENABLE ? SERIAL_FIFO_SIZE : 1;
+
+	if (s->rx_count == size) {
+		s->lsr |= UART_LSR_OE;
+		return;
+	}
+	s->rx[(s->rx_head + s->rx_count++) % SERIAL_FIFO_SIZE] = c;
+	s->stats.rx_bytes++;
+}
+
+static void serial_rx_clear(struct serial *s)
+{
+	s->rx_head = s->rx_count = 0;
+	s->timeout_ipending = 0;
+}
+
+static void serial_flush(struct serial *s);
+
+/* with lock held, waits for the thread if the ring is full */
+static void serial_tx_put(struct serial *s, const char *buf, size_t len)
+{
+	unsigned used;
+
+	while (len) {
+		while (s->tx_head - s->tx_tail == SERIAL_TX_SIZE && !s->stop) {
+			if (serial_self == s) {
+				pthread_mutex_unlock(&s->lock);
+				serial_flush(s);
+				pthread_mutex_lock(&s->lock);
+				continue;
+			}
+			serial_wake(s);
+			pthread_cond_wait(&s->tx_space, &s->lock);
+		}
+		if (s->stop)
+			return;
+		used = s->tx_head - s->tx_tail;
+		s->tx[s->tx_head++ % SERIAL_TX_SIZE] = *buf++;
+		len--;
+		/* the thread batches from the first byte, but not past half full */
+		if (used == 0 || used == SERIAL_TX_SIZE / 2)
+			serial_wake(s);
+	}
+}
+
+static void serial_write_reg(struct serial *s, int reg, uint8_t value)
+{
+	char c = value;
+
+	switch (reg) {
+	case UART_TX:
+		if (s->lcr & UART_LCR_DLAB) {
+			s->divisor = (s->divisor & 0xff00) | value;
+			break;
+		}
+		if (s->mcr & UART_MCR_LOOP) {
+			serial_rx_push(s, value);
+		} else {
+			serial_tx_put(s, &c, 1);
+			s->stats.tx_bytes++;
+		}
+		/* sent already, the register is empty again */
+		s->thr_ipending = 1;
+		break;
+	case UART_IER:
+		if (s->lcr & UART_LCR_DLAB) {
+			s->divisor = (s->divisor & 0xff) | value << 8;
+			break;
+		}
+		/* enabling it with the register empty raises it right away */
+		if (!(s->ier & UART_IER_THRI) && (value & UART_IER_THRI))
+			s->thr_ipending = 1;
+		s->ier = value & 0x0f;
+		break;
+	case UART_FCR:
+		if ((value ^ s->fcr) & UART_FCR_ENABLE)
+			value |= UART_FCR_CLEAR_RCVR;
+		if (value & UART_FCR_CLEAR_RCVR)
+			serial_rx_clear(s);
+		s->fcr = value & 0xc1;
+		break;
+	case UART_LCR:
+		s->lcr = value;
+		break;
+	case UART_MCR:
+		s->mcr = value & 0x1f;
+		break;
+	case UART_SCR:
+		s->scr = value;
+		break;
+	}
+	serial_update_irq(s);
+}
+
+static uint8_t serial_read_reg(struct serial *s, int reg)
+{
+	uint8_t value = 0xff;
+
+	switch (reg) {
+	case UART_RX:
+		if (s->lcr & UART_LCR_DLAB) {
+			value = s->divisor;
+			break;
+		}
+		value = 0;
+		s->timeout_ipending = 0;
+		if (!s->rx_count)
+			break;
+		value = s->rx[s->rx_head];
+		s->rx_head = (s->rx_head + 1) % SERIAL_FIFO_SIZE;
+		/* empty again, the thread goes back to polling the fd */
+		if (--s->rx_count == 0)
+			serial_wake(s);
+		break;
+	case UART_IER:
+		if (s->lcr & UART_LCR_DLAB)
+			value = s->divisor >> 8;
+		else
+			value = s->ier;
+		break;
+	case UART_IIR:
+		value = serial_iir(s);
+		/* reading it is the acknowledgement for THRE */
+		if ((value & 0x0f) == UART_IIR_THRI)
+			s->thr_ipending = 0;
+		break;
+	case UART_LCR:
+		value = s->lcr;
+		break;
+	case UART_MCR:
+		value = s->mcr;
+		break;
+	case UART_LSR:
+		value = s->lsr | UART_LSR_THRE | UART_LSR_TEMT;
+		if (s->rx_count)
+			value |= UART_LSR_DR;
+		s->lsr &= ~UART_LSR_OE;
+		break;
+	case UART_MSR:
+		if (s->mcr & UART_MCR_LOOP) {
+			/* rts to cts, dtr to dsr, out1 to ri, out2 to dcd */
+			value = (s->mcr & 0x02) << 3 | (s->mcr & 0x01) << 5 |
+				(s->mcr & 0x0c) << 4;
+		} else {
+			value = UART_MSR_ALIVE;
+		}
+		break;
+	case UART_SCR:
+		value = s->scr;
+		break;
+	}
+	serial_update_irq(s);
+	return value;
+}
+
+int kvm_serial_pio(kvm_context_t kvm, uint16_t addr, int size, int is_write,
+		   uint32_t *value)
+{
+	struct serial *s;
+
+	pthread_rwlock_rdlock(&serials_lock);
+	for (s = serials; s; s = s->next)
+		if (s->kvm == kvm && addr >= s->base && addr < s->base + 8)
+			break;
+	if (!s) {
+		pthread_rwlock_unlock(&serials_lock);
+		return 0;
+	}
+
+	/* byte registers, wider accesses only see the first one */
+	pthread_mutex_lock(&s->lock);
+	if (is_write)
+		serial_write_reg(s, addr - s->base, *value);
+	else
+		*value = serial_read_reg(s, addr - s->base);
+	pthread_mutex_unlock(&s->lock);
+	pthread_rwlock_unlock(&serials_lock);
+	return 1;
+}
+
+void kvm_serial_write(struct serial *s, const void *buf, size_t len)
+{
+	pthread_mutex_lock(&s->lock);
+	serial_tx_put(s, buf, len);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* everything in the ring out to out_fd */
+static void serial_flush(struct serial *s)
+{
+	unsigned head, tail, len;
+	struct pollfd pfd;
+	ssize_t r;
+
+	pthread_mutex_lock(&s->lock);
+	head = s->tx_head;
+	tail = s->tx_tail;
+	pthread_mutex_unlock(&s->lock);
+
+	while (tail != head) {
+		/* up to the end of the buffer, the rest next time round */
+		len = head - tail;
+		if (len > SERIAL_TX_SIZE - tail % SERIAL_TX_SIZE)
+			len = SERIAL_TX_SIZE - tail % SERIAL_TX_SIZE;
+		r = write(s->out_fd, s->tx + tail % SERIAL_TX_SIZE, len);
+		if (r < 0 && errno == EAGAIN) {
+			pfd.fd = s->out_fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if (r < 0 && errno == EINTR)
+			continue;
+		/* nowhere to put it, drop it rather than stall the guest */
+		if (r <= 0)
+			r = len;
+		tail += r;
+
+		pthread_mutex_lock(&s->lock);
+		s->tx_tail = tail;
+		s->stats.tx_writes++;
+		pthread_cond_broadcast(&s->tx_space);
+		pthread_mutex_unlock(&s->lock);
+	}
+}
+
+/* whatever the fd has, as far as the fifo goes */
+static void serial_receive(struct serial *s)
+{
+	char buf[SERIAL_FIFO_SIZE];
+	ssize_t r;
+	int i, room;
+
+	pthread_mutex_lock(&s->lock);
+	room = (s->fcr & UART_FCR_ENABLE ? SERIAL_FIFO_SIZE : 1) - s->rx_count;
+	pthread_mutex_unlock(&s->lock);
+	if (room <= 0)
+		return;
+
+	r = read(s->in_fd, buf, room);
+	if (r == 0) {
+		/* end of input, stop polling it */
+		s->in_fd = -1;
+		return;
+	}
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < r; i++)
+		serial_rx_push(s, buf[i]);
+	/* nothing more came, what's below the trigger level times out */
+	if (r < room && s->rx_count && s->rx_count < serial_rx_trigger(s))
+		s->timeout_ipending = 1;
+	serial_update_irq(s);
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void *serial_thread(void *opaque)
+{
+	struct serial *s = opaque;
+	struct pollfd pfd[2];
+	unsigned flush_at = 0, now;
+	int nfds, timeout, pending, stop, armed = 0;
+	char buf[64];
+
+	serial_self = s;
+	for (;;) {
+		pthread_mutex_lock(&s->lock);
+		pending = s->tx_head - s->tx_tail;
+		stop = s->stop;
+		nfds = 1;
+		if (s->in_fd != -1 && s->rx_count <
+		    (s->fcr & UART_FCR_ENABLE ? SERIAL_FIFO_SIZE : 1)) {
+			pfd[1].fd = s->in_fd;
+			pfd[1].events = POLLIN;
+			nfds = 2;
+		}
+		pthread_mutex_unlock(&s->lock);
+
+		now = now_ms();
+		if (!pending) {
+			armed = 0;
+		} else if (!armed) {
+			flush_at = now + SERIAL_FLUSH_MS;
+			armed = 1;
+		}
+		if (stop || pending >= SERIAL_TX_SIZE / 2 ||
+		    (pending && (int)(now - flush_at) >= 0)) {
+			serial_flush(s);
+			if (stop)
+				return NULL;
+			continue;
+		}
+
+		timeout = pending ? (int)(flush_at - now) : SERIAL_POLL_MS;
+		pfd[0].fd = s->wake[0];
+		pfd[0].events = POLLIN;
+		if (poll(pfd, nfds, timeout) < 0 && errno != EINTR)
+			break;
+		if (pfd[0].revents & POLLIN) {
+			pthread_mutex_lock(&s->lock);
+			s->wake_pending = 0;
+			pthread_mutex_unlock(&s->lock);
+			read(s->wake[0], buf, sizeof(buf));
+		}
+		if (nfds == 2 && (pfd[1].revents & (POLLIN | POLLHUP)))
+			serial_receive(s);
+		/* a vcpu that never exits still has to get its output out */
+		kvm_flush_coalesced_pio(s->kvm);
+	}
+	return NULL;
+}
+
+struct serial *kvm_serial_create(kvm_context_t kvm, uint16_t base, int irq,
+				 int in_fd, int out_fd)
+{
+	struct serial *s;
+
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->tx = malloc(SERIAL_TX_SIZE);
+	if (!s->tx || pipe(s->wake)) {
+		free(s->tx);
+		free(s);
+		return NULL;
+	}
+	s->kvm = kvm;
+	s->base = base;
+	s->irq = irq;
+	s->in_fd = in_fd;
+	s->out_fd = out_fd;
+	/* 115200 8n1 */
+	s->divisor = 1;
+	s->lcr = 0x03;
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->tx_space, NULL);
+
+	/* nothing the guest reads back depends on a transmit being seen */
+	kvm_register_coalesced_pio(kvm, base + UART_TX, 1);
+
+	pthread_rwlock_wrlock(&serials_lock);
+	s->next = serials;
+	serials = s;
+	pthread_rwlock_unlock(&serials_lock);
+	pthread_create(&s->thread, NULL, serial_thread, s);
+	return s;
+}
+
+void kvm_serial_destroy(struct serial *s)
+{
+	struct serial **p;
+
+	kvm_flush_coalesced_pio(s->kvm);
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	s->wake_pending = 0;
+	serial_wake(s);
+	pthread_cond_broadcast(&s->tx_space);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	/* a transmit stuck waiting for room gave up on stop */
+	pthread_rwlock_wrlock(&serials_lock);
+	for (p = &serials; *p; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&serials_lock);
+	close(s->wake[0]);
+	close(s->wake[1]);
+	pthread_mutex_destroy(&s->lock);
+	pthread_cond_destroy(&s->tx_space);
+	free(s->tx);
+	free(s);
+}
+
+void kvm_serial_stats(struct serial *s, struct kvm_serial_stats *stats)
+{
+	pthread_mutex_lock(&s->lock);
+	*stats = s->stats;
+	pthread_mutex_unlock(&s->lock);
+}
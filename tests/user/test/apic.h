@@ -10,5 +10,6 @@
 #define APIC_REG_SEND_SIPI   0x0c
 #define APIC_REG_IPI_VECTOR  0x10
 #define APIC_REG_SEND_IPI    0x14
+#define APIC_REG_CLOCK_US    0x18 /* host clock in microseconds, wraps */
 
 #endif
@@ -0,0 +1,142 @@
+/*
+ * CPU bound kernels for comparing a guest with the host it runs on.  The
+ * same file is the flat guest payload and, built with -DCPUBENCH_HOST,
+ * the native program cpubench_native.  Both print a line per timed run,
+ *
+ *   cpubench <kernel> <run> <tsc cycles>
+ *
+ * which the cpubench driver collects from each side and turns into an
+ * overhead ratio.  An untimed run before them prints "cpubench <kernel>
+ * check <result>", which has to be the same on both sides.  None of the
+ * kernels does i/o, so what the guest loses is what ept, host interrupts
+ * and the kext's own exits cost it.  There's no fpu or sse kernel yet:
+ * cstart64 doesn't enable sse and the kext doesn't switch fpu state.
+ */
+
+#ifdef CPUBENCH_HOST
+#include <stdio.h>
+#else
+#include "printf.h"
+#endif
+
+#define RUNS 10
+#define SIEVE_SIZE 1000000
+#define COPY_SIZE (1 << 20)
+#define COPY_ROUNDS 32
+#define COLLATZ_N 200000
+
+static char sieve_data[SIEVE_SIZE];
+static char copy_a[COPY_SIZE] __attribute__((aligned(64)));
+static char copy_b[COPY_SIZE] __attribute__((aligned(64)));
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned a, d;
+
+	asm volatile ("lfence; rdtsc" : "=a"(a), "=d"(d) : : "memory");
+	return a | ((unsigned long long)d << 32);
+}
+
+/* test/sieve.c's, primes below SIEVE_SIZE */
+static unsigned long sieve(void)
+{
+	int i, j, r = 0;
+
+	for (i = 0; i < SIEVE_SIZE; ++i)
+		sieve_data[i] = 1;
+	sieve_data[0] = sieve_data[1] = 0;
+	for (i = 2; i < SIEVE_SIZE; ++i)
+		if (sieve_data[i]) {
+			++r;
+			for (j = i * 2; j < SIEVE_SIZE; j += i)
+				sieve_data[j] = 0;
+		}
+	return r;
+}
+
+/* rep movsb, what a kernel's memcpy comes down to, back and forth */
+static unsigned long copy(void)
+{
+	void *src, *dst;
+	unsigned long n;
+	int i;
+
+	/* something to check, filled in by the untimed run */
+	if (!copy_a[1])
+		for (i = 0; i < COPY_SIZE; i++)
+			copy_a[i] = i * 7 + 1;
+	for (i = 0; i < COPY_ROUNDS; i++) {
+		src = i & 1 ? copy_b : copy_a;
+		dst = i & 1 ? copy_a : copy_b;
+		n = COPY_SIZE;
+		asm volatile ("rep movsb"
+			      : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+	}
+	return (unsigned char)copy_a[COPY_SIZE - 1] +
+	       (unsigned char)copy_b[4095];
+}
+
+/* data dependent branches, steps to reach 1 from everything below N */
+static unsigned long collatz(void)
+{
+	unsigned long n, x, steps = 0;
+
+	for (n = 1; n < COLLATZ_N; n++) {
+		x = n;
+		while (x != 1) {
+			if (x & 1)
+				x = 3 * x + 1;
+			else
+				x >>= 1;
+			steps++;
+		}
+	}
+	return steps;
+}
+
+static struct kernel {
+	const char *name;
+	unsigned long (*fn)(void);
+} kernels[] = {
+	{ "sieve", sieve },
+	{ "memcpy", copy },
+	{ "collatz", collatz },
+};
+
+/* printf here has neither %llu nor widths */
+static const char *utoa(unsigned long long n, char *buf)
+{
+	char *p = buf + 24;
+
+	*--p = 0;
+	do
+		*--p = '0' + n % 10;
+	while (n /= 10);
+	return p;
+}
+
+int main()
+{
+	unsigned long long t;
+	unsigned long check;
+	char buf[24];
+	int i, run;
+
+	for (i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		/* caches, tlb and, in the guest, ept faults on the first run */
+		check = kernels[i].fn();
+		printf("cpubench %s check %s\n", kernels[i].name,
+		       utoa(check, buf));
+		for (run = 0; run < RUNS; run++) {
+			t = rdtsc();
+			if (kernels[i].fn() != check)
+				printf("cpubench %s wrong\n", kernels[i].name);
+			t = rdtsc() - t;
+			printf("cpubench %s %d %s\n", kernels[i].name, run,
+			       utoa(t, buf));
+		}
+	}
+	/* the guest halts rather than exits, this is when to stop it */
+	printf("cpubench done\n");
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * Memory bandwidth and latency over working sets from 4k up to all the
+ * guest has, once through the 2M pages cstart64 maps and once through
+ * 4k pages.  Every size gets four numbers, in tsc cycles per access:
+ *
+ *   seq         independent 8 byte loads, front to back
+ *   seq-chase   dependent loads, a cache line each, front to back
+ *   rand        independent loads of random lines
+ *   rand-chase  dependent loads around a random cycle of all the lines
+ *
+ * The chases are latency and the others throughput.  Once a working set
+ * is past what the tlb reaches, every rand-chase load walks the guest page
+ * tables and the ept behind them.  Built with -DMEMBENCH_HOST the same
+ * loops run as a host program, "membench [mb]", and print the same lines,
+ * so the guest's numbers over the host's are the ept's cost at each size.
+ */
+
+#ifdef MEMBENCH_HOST
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#ifdef __APPLE__
+#include <mach/vm_statistics.h>
+#endif
+#else
+#include "printf.h"
+#endif
+
+#define PAGE_SIZE 4096ul
+#define LARGE_PAGE_SIZE (512 * PAGE_SIZE)
+#define LINE 64
+#define LINE_WORDS (LINE / sizeof(unsigned long))
+#define MIN_WS PAGE_SIZE
+/* enough that rdtsc and the loop around it vanish */
+#define SEQ_ACCESSES (1ul << 23)
+#define RAND_ACCESSES (1ul << 21)
+/* best of, the first one also faults everything in */
+#define RUNS 3
+
+static unsigned long sink;
+static unsigned long rand_state = 0x2545f4914f6cdd1dul;
+
+static inline unsigned long long rdtsc(void)
+{
+	unsigned a, d;
+
+	asm volatile ("lfence; rdtsc" : "=a"(a), "=d"(d) : : "memory");
+	return a | ((unsigned long long)d << 32);
+}
+
+static inline unsigned long xorshift(unsigned long x)
+{
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return x;
+}
+
+/* hundredths of a cycle per access, from here on */
+static unsigned long seq(unsigned long *buf, unsigned long ws)
+{
+	unsigned long n = ws / sizeof(*buf), passes, p, i, sum = 0;
+	unsigned long long t;
+
+	passes = SEQ_ACCESSES / n;
+	if (!passes)
+		passes = 1;
+	t = rdtsc();
+	for (p = 0; p < passes; p++)
+		for (i = 0; i < n; i++)
+			sum += buf[i];
+	t = rdtsc() - t;
+	sink += sum;
+	return t * 100 / (passes * n);
+}
+
+static unsigned long rand_loads(unsigned long *buf, unsigned long ws)
+{
+	unsigned long mask = ws / LINE - 1, x = rand_state, i, sum = 0;
+	unsigned long long t;
+
+	t = rdtsc();
+	for (i = 0; i < RAND_ACCESSES; i++) {
+		x = xorshift(x);
+		sum += buf[(x & mask) * LINE_WORDS];
+	}
+	t = rdtsc() - t;
+	sink += sum;
+	return t * 100 / RAND_ACCESSES;
+}
+
+/* the first word of every line points at the next line to load */
+static void build_chase(unsigned long *buf, unsigned long ws, int random)
+{
+	unsigned long lines = ws / LINE, i, j, tmp;
+
+	for (i = 0; i < lines; i++)
+		buf[i * LINE_WORDS] = random ? i : (i + 1) % lines;
+	if (random) {
+		/* sattolo's shuffle, which leaves a single cycle */
+		for (i = lines - 1; i > 0; i--) {
+			rand_state = xorshift(rand_state);
+			j = rand_state % i;
+			tmp = buf[i * LINE_WORDS];
+			buf[i * LINE_WORDS] = buf[j * LINE_WORDS];
+			buf[j * LINE_WORDS] = tmp;
+		}
+	}
+	for (i = 0; i < lines; i++)
+		buf[i * LINE_WORDS] = (unsigned long)
+			&buf[buf[i * LINE_WORDS] * LINE_WORDS];
+}
+
+static unsigned long chase(unsigned long *buf, unsigned long ws)
+{
+	unsigned long *p = buf, i;
+	unsigned long long t;
+
+	t = rdtsc();
+	for (i = 0; i < RAND_ACCESSES; i++)
+		p = (unsigned long *)*p;
+	t = rdtsc() - t;
+	sink += (unsigned long)p;
+	return t * 100 / RAND_ACCESSES;
+}
+
+static unsigned long best(unsigned long (*fn)(unsigned long *, unsigned long),
+			  unsigned long *buf, unsigned long ws)
+{
+	unsigned long r, min = ~0ul;
+	int i;
+
+	for (i = 0; i < RUNS; i++) {
+		r = fn(buf, ws);
+		if (r < min)
+			min = r;
+	}
+	return min;
+}
+
+static void print_cycles(unsigned long h)
+{
+	printf("\t%d.%d%d", (int)(h / 100), (int)(h / 10 % 10), (int)(h % 10));
+}
+
+static void bench(const char *pages, unsigned long *buf, unsigned long max)
+{
+	unsigned long ws, s, sc, r, rc;
+
+	for (ws = MIN_WS; ws <= max; ws *= 2) {
+		s = best(seq, buf, ws);
+		r = best(rand_loads, buf, ws);
+		build_chase(buf, ws, 0);
+		sc = best(chase, buf, ws);
+		build_chase(buf, ws, 1);
+		rc = best(chase, buf, ws);
+		printf("%s\t%d", pages, (int)(ws >> 10));
+		print_cycles(s);
+		print_cycles(sc);
+		print_cycles(r);
+		print_cycles(rc);
+		printf("\n");
+	}
+}
+
+static unsigned long pow2_below(unsigned long n)
+{
+	unsigned long p = MIN_WS;
+
+	while (p * 2 <= n)
+		p *= 2;
+	return p;
+}
+
+static void header(unsigned long max)
+{
+	printf("# membench: working sets 4k to %dk, tsc cycles per access\n",
+	       (int)(max >> 10));
+	printf("# pages\tkb\tseq\tseq-chase\trand\trand-chase\n");
+}
+
+#ifdef MEMBENCH_HOST
+
+static void *map(unsigned long size, int large)
+{
+	void *p;
+
+	if (!large)
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE, -1, 0);
+#if defined(VM_FLAGS_SUPERPAGE_SIZE_2MB)
+	else
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE, VM_FLAGS_SUPERPAGE_SIZE_2MB, 0);
+#elif defined(MAP_HUGETLB)
+	else
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_ANON | MAP_PRIVATE | MAP_HUGETLB, -1, 0);
+#else
+	else
+		p = MAP_FAILED;
+#endif
+	return p == MAP_FAILED ? NULL : p;
+}
+
+int main(int ac, char **av)
+{
+	/* what a guest with 128M gets to use */
+	unsigned long mb = ac > 1 ? strtoul(av[1], NULL, 0) : 64;
+	unsigned long max = pow2_below(mb << 20);
+	unsigned long *buf;
+
+	header(max);
+	buf = map(max, 1);
+	if (buf) {
+		bench("2m", buf, max);
+		munmap(buf, max);
+	} else {
+		fprintf(stderr, "membench: no 2M pages, only 4k\n");
+	}
+	buf = map(max, 0);
+	if (!buf) {
+		perror("mmap");
+		return 1;
+	}
+	bench("4k", buf, max);
+	munmap(buf, max);
+	return 0;
+}
+
+#else
+
+/* flat.lds gives the guest 128M, and that's all the 4k tables cover */
+#define MAX_RAM (128ul << 20)
+#define PTE_TABLE 0x7ul		/* present, writable, user */
+#define PTE_4K 0x67ul		/* the same, accessed and dirty like cstart64's */
+
+extern char edata, end_of_memory;
+
+static unsigned long pml4[512] __attribute__((aligned(4096)));
+static unsigned long pdpt[512] __attribute__((aligned(4096)));
+static unsigned long pd[512] __attribute__((aligned(4096)));
+static unsigned long pt[MAX_RAM / LARGE_PAGE_SIZE][512]
+	__attribute__((aligned(4096)));
+
+static inline unsigned long read_cr3(void)
+{
+	unsigned long cr3;
+
+	asm volatile ("mov %%cr3, %0" : "=r"(cr3));
+	return cr3;
+}
+
+static inline void load_cr3(unsigned long cr3)
+{
+	asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+/* the same identity map cstart64 has, in 4k pages */
+static void map_4k(unsigned long ram)
+{
+	unsigned long phys, i;
+
+	for (phys = 0; phys < ram; phys += PAGE_SIZE)
+		pt[phys / LARGE_PAGE_SIZE][phys / PAGE_SIZE % 512] =
+			phys | PTE_4K;
+	for (i = 0; i < ram / LARGE_PAGE_SIZE; i++)
+		pd[i] = (unsigned long)pt[i] | PTE_TABLE;
+	pdpt[0] = (unsigned long)pd | PTE_TABLE;
+	pml4[0] = (unsigned long)pdpt | PTE_TABLE;
+}
+
+int main()
+{
+	unsigned long ram = (unsigned long)&end_of_memory, start, max, cr3;
+	unsigned long *buf;
+
+	if (ram > MAX_RAM)
+		ram = MAX_RAM;
+	/* both page sizes see the buffer at the same, 2M aligned, place */
+	start = ((unsigned long)&edata + LARGE_PAGE_SIZE - 1) &
+		~(LARGE_PAGE_SIZE - 1);
+	max = pow2_below(ram - start);
+	buf = (unsigned long *)start;
+
+	header(max);
+	bench("2m", buf, max);
+
+	map_4k(ram);
+	cr3 = read_cr3();
+	load_cr3((unsigned long)pml4);
+	bench("4k", buf, max);
+	load_cr3(cr3);
+	return 0;
+}
+
+#endif
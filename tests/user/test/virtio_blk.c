@@ -0,0 +1,236 @@
+/*
+ * dd for the virtio-blk disk from "kvmctl --blk image": finds it on the
+ * pci bus, keeps QUEUE_DEPTH requests in flight on queue 0 and polls for
+ * completions.  The write pass overwrites the start of the image.
+ */
+
+#include "printf.h"
+#include "apic.h"
+#include "../virtio.h"
+
+#define QUEUE_DEPTH 32
+#define MAX_BS (64 * 1024)
+
+static unsigned char ring_mem[4 * 4096] __attribute__((aligned(4096)));
+static unsigned char data[QUEUE_DEPTH][MAX_BS] __attribute__((aligned(4096)));
+static struct virtio_blk_outhdr hdrs[QUEUE_DEPTH];
+static volatile unsigned char status[QUEUE_DEPTH];
+
+static unsigned short io_base, num;
+static unsigned long capacity;
+static struct vring_desc *desc;
+static struct vring_avail *avail;
+static volatile struct vring_used *used;
+static unsigned short last_used;
+
+static inline void outb(unsigned char v, unsigned short port)
+{
+	asm volatile ("outb %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline void outw(unsigned short v, unsigned short port)
+{
+	asm volatile ("outw %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline void outl(unsigned v, unsigned short port)
+{
+	asm volatile ("outl %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline unsigned char inb(unsigned short port)
+{
+	unsigned char v;
+
+	asm volatile ("inb %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static inline unsigned short inw(unsigned short port)
+{
+	unsigned short v;
+
+	asm volatile ("inw %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static inline unsigned inl(unsigned short port)
+{
+	unsigned v;
+
+	asm volatile ("inl %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static unsigned clock_us(void)
+{
+	return inl(APIC_BASE + APIC_REG_CLOCK_US);
+}
+
+static unsigned pci_read(int slot, int reg)
+{
+	outl(0x80000000 | slot << 11 | reg, 0xcf8);
+	return inl(0xcfc);
+}
+
+static void pci_write(int slot, int reg, unsigned v)
+{
+	outl(0x80000000 | slot << 11 | reg, 0xcf8);
+	outl(v, 0xcfc);
+}
+
+static int blk_init(void)
+{
+	unsigned features;
+	int slot;
+
+	for (slot = 0; slot < 32; slot++)
+		if (pci_read(slot, 0) ==
+		    (VIRTIO_PCI_DEVICE_ID_BLK << 16 | VIRTIO_PCI_VENDOR_ID))
+			break;
+	if (slot == 32) {
+		printf("no virtio-blk on the bus, run with --blk\n");
+		return -1;
+	}
+	io_base = pci_read(slot, 0x10) & ~3;
+	pci_write(slot, 0x04, 1);
+
+	outb(0, io_base + VIRTIO_PCI_STATUS);
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE, io_base + VIRTIO_PCI_STATUS);
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER,
+	     io_base + VIRTIO_PCI_STATUS);
+	features = inl(io_base + VIRTIO_PCI_HOST_FEATURES);
+	outl(features & (1 << VIRTIO_BLK_F_FLUSH | 1 << VIRTIO_BLK_F_RO),
+	     io_base + VIRTIO_PCI_GUEST_FEATURES);
+
+	outw(0, io_base + VIRTIO_PCI_QUEUE_SEL);
+	num = inw(io_base + VIRTIO_PCI_QUEUE_NUM);
+	if (vring_size(num) > sizeof(ring_mem) || num < 3 * QUEUE_DEPTH) {
+		printf("queue size %d doesn't fit\n", num);
+		return -1;
+	}
+	desc = (void *)ring_mem;
+	avail = (void *)(ring_mem + num * sizeof(struct vring_desc));
+	used = (void *)(ring_mem + vring_used_offset(num));
+	/* the loop polls, no interrupts */
+	avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	/* identity mapped */
+	outl((unsigned long)ring_mem >> VIRTIO_PCI_QUEUE_ADDR_SHIFT,
+	     io_base + VIRTIO_PCI_QUEUE_PFN);
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+	     VIRTIO_CONFIG_S_DRIVER_OK, io_base + VIRTIO_PCI_STATUS);
+
+	capacity = inl(io_base + VIRTIO_PCI_CONFIG) |
+		   (unsigned long)inl(io_base + VIRTIO_PCI_CONFIG + 4) << 32;
+	printf("virtio-blk at 0x%x, %d MB, queue size %d%s\n", io_base,
+	       (int)(capacity >> 11), num,
+	       features & (1 << VIRTIO_BLK_F_RO) ? ", read only" : "");
+	return features & (1 << VIRTIO_BLK_F_RO) ? 1 : 0;
+}
+
+/* slot i uses descriptors 3i to 3i+2: header, data, status */
+static void queue(int i, int type, int bs, unsigned long sector)
+{
+	struct vring_desc *d = &desc[3 * i];
+
+	hdrs[i].type = type;
+	hdrs[i].ioprio = 0;
+	hdrs[i].sector = sector;
+	status[i] = 0xff;
+
+	d[0].addr = (unsigned long)&hdrs[i];
+	d[0].len = sizeof(hdrs[i]);
+	d[0].flags = VRING_DESC_F_NEXT;
+	d[0].next = 3 * i + 1;
+	d[1].addr = (unsigned long)data[i];
+	d[1].len = bs;
+	d[1].flags = VRING_DESC_F_NEXT |
+		     (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+	d[1].next = 3 * i + 2;
+	d[2].addr = (unsigned long)&status[i];
+	d[2].len = 1;
+	d[2].flags = VRING_DESC_F_WRITE;
+
+	avail->ring[avail->idx % num] = 3 * i;
+	asm volatile ("" : : : "memory");
+	avail->idx++;
+}
+
+static void kick(void)
+{
+	asm volatile ("mfence" : : : "memory");
+	if (!(used->flags & VRING_USED_F_NO_NOTIFY))
+		outw(0, io_base + VIRTIO_PCI_QUEUE_NOTIFY);
+}
+
+static unsigned long next_sector(int random, int bs, int n)
+{
+	static unsigned long seed = 1;
+	unsigned long blocks;
+
+	if (!bs)
+		return 0;
+	blocks = capacity / (bs / VIRTIO_BLK_SECTOR_SIZE);
+	if (random) {
+		seed = seed * 6364136223846793005ul + 1442695040888963407ul;
+		return (seed >> 17) % blocks * (bs / VIRTIO_BLK_SECTOR_SIZE);
+	}
+	return n % blocks * (bs / VIRTIO_BLK_SECTOR_SIZE);
+}
+
+static int run(const char *name, int type, int bs, int count, int random)
+{
+	int submitted = 0, completed = 0, errors = 0, i, more;
+	unsigned start, us;
+
+	if (capacity < bs / VIRTIO_BLK_SECTOR_SIZE) {
+		printf("%s: disk too small\n", name);
+		return -1;
+	}
+	start = clock_us();
+	for (i = 0; i < QUEUE_DEPTH && submitted < count; i++, submitted++)
+		queue(i, type, bs, next_sector(random, bs, submitted));
+	kick();
+	while (completed < count) {
+		more = 0;
+		while (last_used != used->idx) {
+			i = used->ring[last_used % num].id / 3;
+			last_used++;
+			completed++;
+			if (status[i] != VIRTIO_BLK_S_OK)
+				errors++;
+			if (submitted < count) {
+				queue(i, type, bs, next_sector(random, bs, submitted));
+				submitted++;
+				more = 1;
+			}
+		}
+		if (more)
+			kick();
+	}
+	us = clock_us() - start;
+	if (!us)
+		us = 1;
+
+	printf("%s: %d x %dk in %d ms, %d iops, %d MB/s, %d errors\n",
+	       name, count, bs / 1024, us / 1000,
+	       (int)(count * 1000000ul / us),
+	       (int)((unsigned long)count * bs / us), errors);
+	return errors ? -1 : 0;
+}
+
+int main()
+{
+	int ro;
+
+	ro = blk_init();
+	if (ro < 0)
+		return 1;
+	run("4k random read", VIRTIO_BLK_T_IN, 4096, 20000, 1);
+	run("64k sequential read", VIRTIO_BLK_T_IN, MAX_BS, 4000, 0);
+	if (!ro) {
+		run("64k sequential write", VIRTIO_BLK_T_OUT, MAX_BS, 2000, 0);
+		run("flush", VIRTIO_BLK_T_FLUSH, 0, 1, 0);
+	}
+	return 0;
+}
@@ -0,0 +1,354 @@
+/*
+ * Packet blaster for the virtio-net card from "kvmctl --net path[:peer]":
+ * streams COUNT frames out of queue 1 while taking whatever arrives on
+ * queue 0, polling both rings.  Run two guests pointed at each other, or
+ * one without a peer, which then gets its own frames back.  With event
+ * idx the guest only kicks when the device thread has gone to sleep, so
+ * the kicks per frame are the exits each frame costs.
+ */
+
+#include "printf.h"
+#include "apic.h"
+#include "../virtio.h"
+
+#define COUNT 200000
+#define FRAME_LEN 1514
+#define BUF_SIZE 2048
+#define MAX_QUEUE 256
+#define ETH_P_BENCH 0x88b5	/* local experimental ethertype */
+#define SYNC_US 10000000
+#define DRAIN_US 500000
+
+enum { FRAME_HELLO, FRAME_DATA };
+
+/* behind the virtio-net header, which is hdr_len bytes */
+struct frame {
+	unsigned char dst[6], src[6];
+	unsigned short proto;	/* big endian */
+	unsigned char type;
+	unsigned seq;
+} __attribute__((packed));
+
+struct queue {
+	int index;
+	unsigned short num;
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	volatile struct vring_used *used;
+	unsigned short last_used;
+	/* descriptors the device hasn't got, a stack */
+	unsigned short free[MAX_QUEUE];
+	int nfree;
+	unsigned char *bufs;
+};
+
+static unsigned char ring_mem[2][4 * 4096] __attribute__((aligned(4096)));
+static unsigned char rx_bufs[MAX_QUEUE * BUF_SIZE] __attribute__((aligned(4096)));
+static unsigned char tx_bufs[MAX_QUEUE * BUF_SIZE] __attribute__((aligned(4096)));
+
+static struct queue rxq, txq;
+static unsigned short io_base;
+static unsigned char mac[6];
+static int event_idx, hdr_len;
+static int kicks, synced, received, progress;
+
+static inline void outb(unsigned char v, unsigned short port)
+{
+	asm volatile ("outb %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline void outw(unsigned short v, unsigned short port)
+{
+	asm volatile ("outw %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline void outl(unsigned v, unsigned short port)
+{
+	asm volatile ("outl %0, %1" : : "a"(v), "dN"(port));
+}
+
+static inline unsigned char inb(unsigned short port)
+{
+	unsigned char v;
+
+	asm volatile ("inb %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static inline unsigned short inw(unsigned short port)
+{
+	unsigned short v;
+
+	asm volatile ("inw %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static inline unsigned inl(unsigned short port)
+{
+	unsigned v;
+
+	asm volatile ("inl %1, %0" : "=a"(v) : "dN"(port));
+	return v;
+}
+
+static unsigned short htons(unsigned short v)
+{
+	return v >> 8 | v << 8;
+}
+
+static unsigned clock_us(void)
+{
+	return inl(APIC_BASE + APIC_REG_CLOCK_US);
+}
+
+static unsigned pci_read(int slot, int reg)
+{
+	outl(0x80000000 | slot << 11 | reg, 0xcf8);
+	return inl(0xcfc);
+}
+
+static void pci_write(int slot, int reg, unsigned v)
+{
+	outl(0x80000000 | slot << 11 | reg, 0xcf8);
+	outl(v, 0xcfc);
+}
+
+static int queue_init(struct queue *q, int index, unsigned char *bufs)
+{
+	int i;
+
+	outw(index, io_base + VIRTIO_PCI_QUEUE_SEL);
+	q->num = inw(io_base + VIRTIO_PCI_QUEUE_NUM);
+	if (vring_size(q->num) > sizeof(ring_mem[0]) || q->num > MAX_QUEUE) {
+		printf("queue size %d doesn't fit\n", q->num);
+		return -1;
+	}
+	q->index = index;
+	q->desc = (void *)ring_mem[index];
+	q->avail = (void *)(ring_mem[index] + q->num * sizeof(struct vring_desc));
+	q->used = (void *)(ring_mem[index] + vring_used_offset(q->num));
+	q->bufs = bufs;
+	/* the loop polls, no interrupts */
+	q->avail->flags = VRING_AVAIL_F_NO_INTERRUPT;
+	vring_used_event(q->avail, q->num) = 0x8000;
+	for (i = 0; i < q->num; i++) {
+		q->desc[i].addr = (unsigned long)(bufs + i * BUF_SIZE);
+		q->desc[i].len = BUF_SIZE;
+		q->free[q->nfree++] = i;
+	}
+	/* identity mapped */
+	outl((unsigned long)ring_mem[index] >> VIRTIO_PCI_QUEUE_ADDR_SHIFT,
+	     io_base + VIRTIO_PCI_QUEUE_PFN);
+	return 0;
+}
+
+static int net_init(void)
+{
+	unsigned features, wanted;
+	int slot, i;
+
+	for (slot = 0; slot < 32; slot++)
+		if (pci_read(slot, 0) ==
+		    (VIRTIO_PCI_DEVICE_ID_NET << 16 | VIRTIO_PCI_VENDOR_ID))
+			break;
+	if (slot == 32) {
+		printf("no virtio-net on the bus, run with --net\n");
+		return -1;
+	}
+	io_base = pci_read(slot, 0x10) & ~3;
+	pci_write(slot, 0x04, 1);
+
+	outb(0, io_base + VIRTIO_PCI_STATUS);
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE, io_base + VIRTIO_PCI_STATUS);
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER,
+	     io_base + VIRTIO_PCI_STATUS);
+	features = inl(io_base + VIRTIO_PCI_HOST_FEATURES);
+	wanted = features & (1 << VIRTIO_NET_F_MAC |
+			     1 << VIRTIO_NET_F_MRG_RXBUF |
+			     1 << VIRTIO_RING_F_EVENT_IDX);
+	outl(wanted, io_base + VIRTIO_PCI_GUEST_FEATURES);
+	event_idx = !!(wanted & (1 << VIRTIO_RING_F_EVENT_IDX));
+	hdr_len = wanted & (1 << VIRTIO_NET_F_MRG_RXBUF) ?
+		  sizeof(struct virtio_net_hdr_mrg_rxbuf) :
+		  sizeof(struct virtio_net_hdr);
+	for (i = 0; i < 6; i++)
+		mac[i] = wanted & (1 << VIRTIO_NET_F_MAC) ?
+			 inb(io_base + VIRTIO_PCI_CONFIG + i) : 0x02;
+
+	if (queue_init(&rxq, VIRTIO_NET_RX_QUEUE, rx_bufs) ||
+	    queue_init(&txq, VIRTIO_NET_TX_QUEUE, tx_bufs))
+		return -1;
+	for (i = 0; i < rxq.num; i++)
+		rxq.desc[i].flags = VRING_DESC_F_WRITE;
+	outb(VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+	     VIRTIO_CONFIG_S_DRIVER_OK, io_base + VIRTIO_PCI_STATUS);
+
+	printf("virtio-net at 0x%x, mac %x:%x:%x:%x:%x:%x%s%s\n", io_base,
+	       mac[0], mac[1], mac[2], mac[3], mac[4], mac[5],
+	       hdr_len == sizeof(struct virtio_net_hdr) ? "" : ", mergeable",
+	       event_idx ? ", event idx" : "");
+	return 0;
+}
+
+static void add(struct queue *q, int len)
+{
+	int i = q->free[--q->nfree];
+
+	q->desc[i].len = len;
+	q->avail->ring[q->avail->idx % q->num] = i;
+	asm volatile ("" : : : "memory");
+	q->avail->idx++;
+}
+
+static void kick(struct queue *q, unsigned short old)
+{
+	int need;
+
+	asm volatile ("mfence" : : : "memory");
+	if (event_idx)
+		need = vring_need_event(vring_avail_event(q->used, q->num),
+					q->avail->idx, old);
+	else
+		need = !(q->used->flags & VRING_USED_F_NO_NOTIFY);
+	if (need) {
+		outw(q->index, io_base + VIRTIO_PCI_QUEUE_NOTIFY);
+		kicks++;
+	}
+}
+
+/* takes one used entry, returns its descriptor */
+static int reap(struct queue *q, unsigned *len)
+{
+	volatile struct vring_used_elem *e;
+
+	if (q->last_used == q->used->idx)
+		return -1;
+	asm volatile ("" : : : "memory");
+	e = &q->used->ring[q->last_used % q->num];
+	q->last_used++;
+	progress++;
+	/* far enough ahead that the device never interrupts */
+	vring_used_event(q->avail, q->num) = q->last_used + 0x8000;
+	if (len)
+		*len = e->len;
+	q->free[q->nfree++] = e->id;
+	return e->id;
+}
+
+static void poll_rx(void)
+{
+	unsigned short old = rxq.avail->idx;
+	struct virtio_net_hdr_mrg_rxbuf *hdr;
+	struct frame *f;
+	unsigned len;
+	int id, more;
+
+	while ((id = reap(&rxq, &len)) >= 0) {
+		hdr = (void *)(rxq.bufs + id * BUF_SIZE);
+		f = (void *)hdr + hdr_len;
+		/* frames this small never take more than one buffer */
+		more = hdr_len == sizeof(*hdr) ? hdr->num_buffers - 1 : 0;
+		while (more-- > 0)
+			reap(&rxq, 0);
+		synced = 1;
+		if (len >= hdr_len + sizeof(*f) &&
+		    f->proto == htons(ETH_P_BENCH) && f->type == FRAME_DATA)
+			received++;
+	}
+	while (rxq.nfree)
+		add(&rxq, BUF_SIZE);
+	if (rxq.avail->idx != old)
+		kick(&rxq, old);
+}
+
+/* queues up to max frames, returns how many */
+static int send(int type, unsigned seq, int max)
+{
+	unsigned short old = txq.avail->idx;
+	unsigned char *hdr;
+	struct frame *f;
+	int n = 0, i;
+
+	while (reap(&txq, 0) >= 0)
+		;
+	while (txq.nfree && n < max) {
+		hdr = txq.bufs + txq.free[txq.nfree - 1] * BUF_SIZE;
+		f = (void *)hdr + hdr_len;
+		/* no offloads, so an all zero header */
+		for (i = 0; i < hdr_len; i++)
+			hdr[i] = 0;
+		for (i = 0; i < 6; i++) {
+			f->dst[i] = 0xff;
+			f->src[i] = mac[i];
+		}
+		f->proto = htons(ETH_P_BENCH);
+		f->type = type;
+		f->seq = seq + n;
+		add(&txq, hdr_len + FRAME_LEN);
+		n++;
+	}
+	if (n)
+		kick(&txq, old);
+	return n;
+}
+
+static void print_ratio(const char *what, int n, int d)
+{
+	unsigned long r = d ? n * 1000ul / d : 0;
+
+	printf("%s%d.%d%d%d", what, (int)(r / 1000), (int)(r / 100 % 10),
+	       (int)(r / 10 % 10), (int)(r % 10));
+}
+
+int main()
+{
+	unsigned start, us, last_io, hello = 0;
+	int sent = 0, sync_kicks;
+
+	if (net_init())
+		return 1;
+	poll_rx();
+
+	/* whoever is on the other end, or our own frames with no peer */
+	start = clock_us();
+	while (!synced) {
+		if (clock_us() - start > SYNC_US) {
+			printf("nobody answered\n");
+			return 1;
+		}
+		if (clock_us() - hello > 10000) {
+			send(FRAME_HELLO, 0, 1);
+			hello = clock_us();
+		}
+		poll_rx();
+	}
+	sync_kicks = kicks;
+	kicks = 0;
+
+	/* the peer's stream may have started already, that counts too */
+	start = clock_us();
+	last_io = start;
+	while (sent < COUNT || ((txq.nfree < txq.num || received < COUNT) &&
+				clock_us() - last_io < DRAIN_US)) {
+		/* the last frames have to be out before the guest goes away */
+		progress = 0;
+		sent += send(FRAME_DATA, sent, COUNT - sent);
+		poll_rx();
+		/* the clock is an exit too, only read it when it matters */
+		if (progress)
+			last_io = clock_us();
+	}
+	/* not counting the wait for frames that never came */
+	us = last_io - start;
+	if (!us)
+		us = 1;
+
+	printf("tx: %d frames of %d bytes in %d ms, %d pps, %d MB/s\n",
+	       sent, FRAME_LEN, us / 1000, (int)(sent * 1000000ul / us),
+	       (int)((unsigned long)sent * FRAME_LEN / us));
+	printf("rx: %d frames, %d pps, %d lost\n", received,
+	       (int)(received * 1000000ul / us), COUNT - received);
+	print_ratio("kicks per frame: ", kicks, sent + received);
+	printf(" (%d while waiting for the peer)\n", sync_kicks);
+	return 0;
+}
@@ -0,0 +1,35 @@
+/*
+ * Host writes to a page the guest has only read, run with
+ * "kvmctl --share-zero".  The guest reads a page nobody has touched, which
+ * maps the kext's shared zero page, then has the host fill it through
+ * kvm_guest_write() and checks that it sees the new bytes rather than the
+ * zeros it read before.
+ */
+
+#include "printf.h"
+
+/* main.c's, the host writes HOST_FILL_BYTE over the page at that address */
+#define HOST_FILL_PORT 0xf2
+#define HOST_FILL_BYTE 0x5a
+
+static volatile unsigned char page[4096] __attribute__((aligned(4096)));
+
+static inline void outl(unsigned v, unsigned short port)
+{
+	asm volatile ("outl %0, %1" : : "a"(v), "dN"(port) : "memory");
+}
+
+int main()
+{
+	int i, zeros = 0, bad = 0;
+
+	for (i = 0; i < sizeof(page); i++)
+		zeros += page[i] == 0;
+	outl((unsigned long)page, HOST_FILL_PORT);
+	for (i = 0; i < sizeof(page); i++)
+		bad += page[i] != HOST_FILL_BYTE;
+	printf("zero_share: read %d zeros, %d bytes missed the host's write\n",
+	       zeros, bad);
+	printf("zero_share: %s\n", bad ? "FAIL" : "PASS");
+	return bad ? 1 : 0;
+}
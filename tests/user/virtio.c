@@ -0,0 +1,450 @@
+/*
+ * Legacy virtio-pci transport for the libkvm device models, and just enough
+ * of pci configuration mechanism #1 for a guest to find them.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "virtio_dev.h"
+
+#define PCI_CONFIG_ADDRESS	0xcf8
+#define PCI_CONFIG_DATA		0xcfc
+#define PCI_COMMAND_IO		1
+
+/* the config address latch at 0xcf8, one per vm with devices */
+struct pci_host {
+	kvm_context_t kvm;
+	uint32_t config_address;
+	int ndevs;
+	struct pci_host *next;
+};
+
+static struct virtio_dev *virtio_devs;
+static struct pci_host *pci_hosts;
+/* vms come and go while the vcpus of others do port io */
+static pthread_rwlock_t virtio_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct pci_host *pci_host_find(kvm_context_t kvm)
+{
+	struct pci_host *host;
+
+	for (host = pci_hosts; host; host = host->next)
+		if (host->kvm == kvm)
+			break;
+	return host;
+}
+
+int virtio_register(struct virtio_dev *dev, uint16_t queue_size)
+{
+	struct virtio_dev **p;
+	struct pci_host *host;
+	int i, slot = 1;
+
+	dev->vqs = calloc(dev->nqueues, sizeof(*dev->vqs));
+	if (!dev->vqs)
+		return -ENOMEM;
+	for (i = 0; i < dev->nqueues; i++) {
+		dev->vqs[i].kvm = dev->kvm;
+		dev->vqs[i].num = queue_size;
+	}
+	pthread_mutex_init(&dev->isr_lock, NULL);
+
+	pthread_rwlock_wrlock(&virtio_lock);
+	/* slot 0 is where a host bridge would be, every vm has its own bus */
+	for (p = &virtio_devs; *p; p = &(*p)->next)
+		if ((*p)->kvm == dev->kvm)
+			slot = (*p)->slot + 1;
+	host = pci_host_find(dev->kvm);
+	if (!host && slot < 32) {
+		host = calloc(1, sizeof(*host));
+		if (host) {
+			host->kvm = dev->kvm;
+			host->next = pci_hosts;
+			pci_hosts = host;
+		}
+	}
+	if (slot >= 32 || !host) {
+		pthread_rwlock_unlock(&virtio_lock);
+		pthread_mutex_destroy(&dev->isr_lock);
+		free(dev->vqs);
+		return slot >= 32 ? -ENOSPC : -ENOMEM;
+	}
+	host->ndevs++;
+	dev->slot = slot;
+	dev->next = NULL;
+	*p = dev;
+	pthread_rwlock_unlock(&virtio_lock);
+	return 0;
+}
+
+void virtio_unregister(struct virtio_dev *dev)
+{
+	struct virtio_dev **p;
+	struct pci_host **h, *host;
+
+	pthread_rwlock_wrlock(&virtio_lock);
+	for (p = &virtio_devs; *p; p = &(*p)->next) {
+		if (*p == dev) {
+			*p = dev->next;
+			break;
+		}
+	}
+	for (h = &pci_hosts; *h; h = &(*h)->next) {
+		host = *h;
+		if (host->kvm == dev->kvm) {
+			if (!--host->ndevs) {
+				*h = host->next;
+				free(host);
+			}
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&virtio_lock);
+	pthread_mutex_destroy(&dev->isr_lock);
+	free(dev->vqs);
+}
+
+static void virtio_set_pfn(struct virtio_dev *dev, struct virtqueue *vq,
+			   uint32_t pfn)
+{
+	uint64_t base = (uint64_t)pfn << VIRTIO_PCI_QUEUE_ADDR_SHIFT;
+	void *ring;
+
+	vq->pfn = pfn;
+	vq->last_avail = 0;
+	vq->signalled_used_valid = 0;
+	vq->desc = NULL;
+	vq->avail = NULL;
+	vq->used = NULL;
+	if (!pfn)
+		return;
+	ring = kvm_guest_ptr(dev->kvm, base, vring_size(vq->num));
+	if (!ring) {
+		fprintf(stderr, "virtio: queue at 0x%llx isn't in guest ram\n",
+			(unsigned long long)base);
+		vq->pfn = 0;
+		return;
+	}
+	vq->desc = ring;
+	vq->avail = ring + vq->num * sizeof(struct vring_desc);
+	vq->used = ring + vring_used_offset(vq->num);
+	vq->used_gpa = base + vring_used_offset(vq->num);
+}
+
+static void virtio_reset(struct virtio_dev *dev)
+{
+	int i;
+
+	if (dev->reset)
+		dev->reset(dev);
+	for (i = 0; i < dev->nqueues; i++)
+		virtio_set_pfn(dev, &dev->vqs[i], 0);
+	dev->guest_features = 0;
+	dev->queue_sel = 0;
+	dev->status = 0;
+	pthread_mutex_lock(&dev->isr_lock);
+	if (dev->isr)
+		kvm_set_irq_level(dev->kvm, dev->irq, 0);
+	dev->isr = 0;
+	pthread_mutex_unlock(&dev->isr_lock);
+}
+
+static uint32_t virtio_read(struct virtio_dev *dev, int offset, int size)
+{
+	struct virtqueue *vq = dev->queue_sel < dev->nqueues ?
+		&dev->vqs[dev->queue_sel] : NULL;
+	uint32_t value = 0;
+
+	switch (offset) {
+	case VIRTIO_PCI_HOST_FEATURES:
+		return dev->host_features;
+	case VIRTIO_PCI_GUEST_FEATURES:
+		return dev->guest_features;
+	case VIRTIO_PCI_QUEUE_PFN:
+		return vq ? vq->pfn : 0;
+	case VIRTIO_PCI_QUEUE_NUM:
+		return vq ? vq->num : 0;
+	case VIRTIO_PCI_QUEUE_SEL:
+		return dev->queue_sel;
+	case VIRTIO_PCI_STATUS:
+		return dev->status;
+	case VIRTIO_PCI_ISR:
+		/* reading acknowledges, and takes the line down */
+		pthread_mutex_lock(&dev->isr_lock);
+		value = dev->isr;
+		if (dev->isr)
+			kvm_set_irq_level(dev->kvm, dev->irq, 0);
+		dev->isr = 0;
+		pthread_mutex_unlock(&dev->isr_lock);
+		return value;
+	}
+	offset -= VIRTIO_PCI_CONFIG;
+	if (offset >= 0 && offset + size <= dev->config_len)
+		memcpy(&value, dev->config + offset, size);
+	return value;
+}
+
+static void virtio_write(struct virtio_dev *dev, int offset, uint32_t value)
+{
+	switch (offset) {
+	case VIRTIO_PCI_GUEST_FEATURES:
+		dev->guest_features = value & dev->host_features;
+		break;
+	case VIRTIO_PCI_QUEUE_PFN:
+		if (dev->queue_sel < dev->nqueues)
+			virtio_set_pfn(dev, &dev->vqs[dev->queue_sel], value);
+		break;
+	case VIRTIO_PCI_QUEUE_SEL:
+		dev->queue_sel = value;
+		break;
+	case VIRTIO_PCI_QUEUE_NOTIFY:
+		if (value < dev->nqueues && dev->vqs[value].pfn &&
+		    (dev->status & VIRTIO_CONFIG_S_DRIVER_OK))
+			dev->notify(dev, value);
+		break;
+	case VIRTIO_PCI_STATUS:
+		if (value == 0)
+			virtio_reset(dev);
+		else
+			dev->status = value;
+		break;
+	}
+}
+
+static uint32_t pci_config_read(struct virtio_dev *dev, int reg)
+{
+	switch (reg) {
+	case 0x00:
+		return dev->device_id << 16 | VIRTIO_PCI_VENDOR_ID;
+	case 0x04:
+		return dev->pci_command;
+	case 0x08:
+		return dev->class << 8;
+	case 0x10:
+		/* bar 0 is VIRTIO_PCI_REGION_SIZE ports */
+		if (dev->bar_sizing)
+			return ~(VIRTIO_PCI_REGION_SIZE - 1) | 1;
+		return dev->io_base | 1;
+	case 0x2c:
+		return dev->type << 16 | VIRTIO_PCI_VENDOR_ID;
+	case 0x3c:
+		/* intA */
+		return 1 << 8 | dev->irq;
+	}
+	return 0;
+}
+
+static void pci_config_write(struct virtio_dev *dev, int reg, uint32_t value)
+{
+	switch (reg) {
+	case 0x04:
+		dev->pci_command = value;
+		break;
+	case 0x10:
+		dev->bar_sizing = value == 0xffffffff;
+		if (!dev->bar_sizing)
+			dev->io_base = value & 0xfffc;
+		break;
+	}
+}
+
+/* with virtio_lock held for reading */
+static int pci_config_io(kvm_context_t kvm, uint16_t addr, int size,
+			 int is_write, uint32_t *value)
+{
+	struct pci_host *host = pci_host_find(kvm);
+	struct virtio_dev *dev = NULL;
+	int shift, reg, slot;
+	uint32_t mask, dword, address;
+
+	/* an empty bus still answers, with nothing on it */
+	if (addr == PCI_CONFIG_ADDRESS && size == 4) {
+		if (is_write && host)
+			host->config_address = *value;
+		else if (!is_write)
+			*value = host ? host->config_address : 0;
+		return 1;
+	}
+	if (addr < PCI_CONFIG_DATA || addr + size > PCI_CONFIG_DATA + 4)
+		return 0;
+
+	address = host ? host->config_address : 0;
+	slot = (address >> 11) & 0x1f;
+	reg = address & 0xfc;
+	for (dev = virtio_devs; host && dev; dev = dev->next)
+		if (dev->kvm == kvm && dev->slot == slot)
+			break;
+	/* enabled, bus 0, function 0 */
+	if (!(address & 0x80000000) || (address & 0x00ff0700) || !dev) {
+		if (!is_write)
+			*value = 0xffffffff;
+		return 1;
+	}
+
+	shift = (addr - PCI_CONFIG_DATA) * 8;
+	mask = size == 4 ? 0xffffffff : ((1u << (size * 8)) - 1) << shift;
+	dword = pci_config_read(dev, reg);
+	if (is_write)
+		pci_config_write(dev, reg, (dword & ~mask) |
+				 ((*value << shift) & mask));
+	else
+		*value = (dword & mask) >> shift;
+	return 1;
+}
+
+int kvm_virtio_pio(kvm_context_t kvm, uint16_t addr, int size, int is_write,
+		   uint32_t *value)
+{
+	struct virtio_dev *dev;
+	int r = 1;
+
+	pthread_rwlock_rdlock(&virtio_lock);
+	if (pci_config_io(kvm, addr, size, is_write, value))
+		goto out;
+	for (dev = virtio_devs; dev; dev = dev->next) {
+		if (dev->kvm != kvm || !(dev->pci_command & PCI_COMMAND_IO))
+			continue;
+		if (addr < dev->io_base ||
+		    addr >= dev->io_base + VIRTIO_PCI_REGION_SIZE)
+			continue;
+		if (is_write)
+			virtio_write(dev, addr - dev->io_base, *value);
+		else
+			*value = virtio_read(dev, addr - dev->io_base, size);
+		goto out;
+	}
+	r = 0;
+out:
+	pthread_rwlock_unlock(&virtio_lock);
+	return r;
+}
+
+int virtqueue_pop(struct virtio_dev *dev, struct virtqueue *vq,
+		  struct iovec *iov, int max, int *out_num, int *in_num)
+{
+	struct vring_desc *desc;
+	uint16_t head, i;
+	int n = 0, chain = 0, cnt;
+
+	if (vq->last_avail == vring_avail_idx(vq))
+		return -1;
+	/* read the entry only after seeing the index move */
+	__sync_synchronize();
+	head = vq->avail->ring[vq->last_avail % vq->num];
+	vq->last_avail++;
+
+	*out_num = *in_num = 0;
+	for (i = head; ; i = desc->next) {
+		if (i >= vq->num || ++chain > vq->num)
+			goto bad;
+		desc = &vq->desc[i];
+		/* the device reads everything before the first write buffer */
+		if (!(desc->flags & VRING_DESC_F_WRITE) && *in_num)
+			goto bad;
+		if (desc->flags & VRING_DESC_F_INDIRECT)
+			goto bad;
+		/* a buffer across a slot boundary takes more than one iovec */
+		cnt = kvm_guest_iov(dev->kvm, desc->addr, desc->len, &iov[n],
+				    max - n, desc->flags & VRING_DESC_F_WRITE);
+		if (cnt < 0)
+			goto bad;
+		n += cnt;
+		if (desc->flags & VRING_DESC_F_WRITE)
+			*in_num += cnt;
+		else
+			*out_num += cnt;
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			break;
+	}
+	return head;
+
+bad:
+	fprintf(stderr, "virtio: bad descriptor chain at %d\n", head);
+	return -EINVAL;
+}
+
+void virtqueue_unpop(struct virtqueue *vq, int n)
+{
+	vq->last_avail -= n;
+}
+
+int virtqueue_last_head(struct virtqueue *vq)
+{
+	return vq->avail->ring[(uint16_t)(vq->last_avail - 1) % vq->num];
+}
+
+void virtqueue_fill(struct virtqueue *vq, int head, uint32_t len, int idx)
+{
+	struct vring_used_elem *elem;
+
+	elem = &vq->used->ring[(uint16_t)(vq->used->idx + idx) % vq->num];
+	elem->id = head;
+	elem->len = len;
+}
+
+void virtqueue_flush(struct virtqueue *vq, int n)
+{
+	/* the elements have to be there before the guest sees the index */
+	__sync_synchronize();
+	vq->used->idx += n;
+	kvm_guest_mark_dirty(vq->kvm, vq->used_gpa,
+			     sizeof(struct vring_used) +
+			     vq->num * sizeof(struct vring_used_elem));
+}
+
+void virtqueue_push(struct virtqueue *vq, int head, uint32_t len)
+{
+	virtqueue_fill(vq, head, len, 0);
+	virtqueue_flush(vq, 1);
+}
+
+void virtqueue_disable_notify(struct virtio_dev *dev, struct virtqueue *vq)
+{
+	/* with event idx, avail_event just stays behind */
+	if (!virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+}
+
+int virtqueue_enable_notify(struct virtio_dev *dev, struct virtqueue *vq)
+{
+	/* kick when you queue past what we've taken */
+	if (virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX))
+		vring_avail_event(vq->used, vq->num) = vq->last_avail;
+	else
+		vq->used->flags &= ~VRING_USED_F_NO_NOTIFY;
+	__sync_synchronize();
+	return vring_avail_idx(vq) != vq->last_avail;
+}
+
+int virtio_notify(struct virtio_dev *dev, struct virtqueue *vq)
+{
+	uint16_t old, new_idx;
+
+	__sync_synchronize();
+	if (virtio_has_feature(dev, VIRTIO_RING_F_EVENT_IDX)) {
+		/* only if the used index went past where the guest asked for one */
+		old = vq->signalled_used;
+		new_idx = vq->used->idx;
+		vq->signalled_used = new_idx;
+		if (vq->signalled_used_valid &&
+		    !vring_need_event(*(volatile uint16_t *)
+				      &vring_used_event(vq->avail, vq->num),
+				      new_idx, old))
+			return 0;
+		vq->signalled_used_valid = 1;
+	} else if (vq->avail->flags & VRING_AVAIL_F_NO_INTERRUPT) {
+		return 0;
+	}
+	/* an isr the guest hasn't read yet already covers this */
+	pthread_mutex_lock(&dev->isr_lock);
+	if (!dev->isr)
+		kvm_set_irq_level(dev->kvm, dev->irq, 1);
+	dev->isr |= VIRTIO_ISR_QUEUE;
+	pthread_mutex_unlock(&dev->isr_lock);
+	return 1;
+}
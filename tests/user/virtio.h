@@ -0,0 +1,191 @@
+/*
+ * Legacy virtio-pci register layout, split rings, the virtio-blk request
+ * format and the virtio-net header.  Only fixed size types, so freestanding
+ * test guests can include it as well as libkvm.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#ifndef VIRTIO_H
+#define VIRTIO_H
+
+#include <stdint.h>
+
+#define VIRTIO_PCI_VENDOR_ID		0x1af4
+/* legacy device ids are 0x1000 + anything, the type is the subsystem id */
+#define VIRTIO_PCI_DEVICE_ID_NET	0x1000
+#define VIRTIO_PCI_DEVICE_ID_BLK	0x1001
+
+#define VIRTIO_ID_NET			1
+#define VIRTIO_ID_BLOCK			2
+
+/* the legacy i/o bar, without msi-x */
+#define VIRTIO_PCI_HOST_FEATURES	0x00	/* 32, ro */
+#define VIRTIO_PCI_GUEST_FEATURES	0x04	/* 32 */
+#define VIRTIO_PCI_QUEUE_PFN		0x08	/* 32, ring address >> 12 */
+#define VIRTIO_PCI_QUEUE_NUM		0x0c	/* 16, ro */
+#define VIRTIO_PCI_QUEUE_SEL		0x0e	/* 16 */
+#define VIRTIO_PCI_QUEUE_NOTIFY		0x10	/* 16 */
+#define VIRTIO_PCI_STATUS		0x12	/* 8, 0 resets */
+#define VIRTIO_PCI_ISR			0x13	/* 8, reading clears */
+#define VIRTIO_PCI_CONFIG		0x14	/* device config follows */
+#define VIRTIO_PCI_REGION_SIZE		0x40
+
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT	12
+#define VIRTIO_PCI_VRING_ALIGN		4096
+
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE	1
+#define VIRTIO_CONFIG_S_DRIVER		2
+#define VIRTIO_CONFIG_S_DRIVER_OK	4
+#define VIRTIO_CONFIG_S_FAILED		0x80
+
+#define VIRTIO_ISR_QUEUE		1
+#define VIRTIO_ISR_CONFIG		2
+
+#define VIRTIO_RING_F_INDIRECT_DESC	28
+#define VIRTIO_RING_F_EVENT_IDX		29
+
+#define VRING_DESC_F_NEXT		1
+#define VRING_DESC_F_WRITE		2	/* device writes, guest reads */
+#define VRING_DESC_F_INDIRECT		4
+
+#define VRING_USED_F_NO_NOTIFY		1
+#define VRING_AVAIL_F_NO_INTERRUPT	1
+
+struct vring_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+struct vring_avail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+	/* uint16_t used_event, with VIRTIO_RING_F_EVENT_IDX */
+};
+
+struct vring_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+struct vring_used {
+	uint16_t flags;
+	uint16_t idx;
+	struct vring_used_elem ring[];
+	/* uint16_t avail_event, with VIRTIO_RING_F_EVENT_IDX */
+};
+
+/* desc table, avail ring, then the used ring on the next aligned page */
+static inline unsigned long vring_size(unsigned int num)
+{
+	unsigned long size;
+
+	size = num * sizeof(struct vring_desc);
+	size += sizeof(struct vring_avail) + (num + 1) * sizeof(uint16_t);
+	size = (size + VIRTIO_PCI_VRING_ALIGN - 1) & ~(VIRTIO_PCI_VRING_ALIGN - 1);
+	size += sizeof(struct vring_used) +
+		num * sizeof(struct vring_used_elem) + sizeof(uint16_t);
+	return size;
+}
+
+static inline unsigned long vring_used_offset(unsigned int num)
+{
+	unsigned long size;
+
+	size = num * sizeof(struct vring_desc);
+	size += sizeof(struct vring_avail) + (num + 1) * sizeof(uint16_t);
+	return (size + VIRTIO_PCI_VRING_ALIGN - 1) & ~(VIRTIO_PCI_VRING_ALIGN - 1);
+}
+
+/* with VIRTIO_RING_F_EVENT_IDX, the entries past the end of the rings */
+#define vring_used_event(avail, num)	((avail)->ring[num])
+#define vring_avail_event(used, num)	(*(uint16_t *)&(used)->ring[num])
+
+/* whether moving an index from old to new_idx passed event */
+static inline int vring_need_event(uint16_t event, uint16_t new_idx,
+				   uint16_t old)
+{
+	return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old);
+}
+
+/* virtio-blk */
+#define VIRTIO_BLK_F_SIZE_MAX		1
+#define VIRTIO_BLK_F_SEG_MAX		2
+#define VIRTIO_BLK_F_RO			5
+#define VIRTIO_BLK_F_BLK_SIZE		6
+#define VIRTIO_BLK_F_FLUSH		9
+#define VIRTIO_BLK_F_MQ			12
+
+#define VIRTIO_BLK_T_IN			0
+#define VIRTIO_BLK_T_OUT		1
+#define VIRTIO_BLK_T_FLUSH		4
+#define VIRTIO_BLK_T_GET_ID		8
+
+#define VIRTIO_BLK_S_OK			0
+#define VIRTIO_BLK_S_IOERR		1
+#define VIRTIO_BLK_S_UNSUPP		2
+
+#define VIRTIO_BLK_ID_BYTES		20
+#define VIRTIO_BLK_SECTOR_SIZE		512
+
+/* at VIRTIO_PCI_CONFIG */
+struct virtio_blk_config {
+	uint64_t capacity;		/* in 512 byte sectors */
+	uint32_t size_max;
+	uint32_t seg_max;
+	uint16_t cylinders;
+	uint8_t heads;
+	uint8_t sectors;
+	uint32_t blk_size;
+	uint8_t physical_block_exp;
+	uint8_t alignment_offset;
+	uint16_t min_io_size;
+	uint32_t opt_io_size;
+	uint8_t writeback;
+	uint8_t unused0;
+	uint16_t num_queues;
+} __attribute__((packed));
+
+/* first descriptor of every request, the status byte is the last one */
+struct virtio_blk_outhdr {
+	uint32_t type;
+	uint32_t ioprio;
+	uint64_t sector;
+};
+
+/* virtio-net, queue 0 receives and queue 1 transmits */
+#define VIRTIO_NET_F_MAC		5
+#define VIRTIO_NET_F_MRG_RXBUF		15
+#define VIRTIO_NET_F_STATUS		16
+
+#define VIRTIO_NET_S_LINK_UP		1
+
+#define VIRTIO_NET_RX_QUEUE		0
+#define VIRTIO_NET_TX_QUEUE		1
+
+/* at VIRTIO_PCI_CONFIG */
+struct virtio_net_config {
+	uint8_t mac[6];
+	uint16_t status;
+} __attribute__((packed));
+
+/* in front of every frame, no offloads so only num_buffers matters */
+struct virtio_net_hdr {
+	uint8_t flags;
+	uint8_t gso_type;
+	uint16_t hdr_len;
+	uint16_t gso_size;
+	uint16_t csum_start;
+	uint16_t csum_offset;
+};
+
+/* with VIRTIO_NET_F_MRG_RXBUF, num_buffers is how many buffers a frame took */
+struct virtio_net_hdr_mrg_rxbuf {
+	struct virtio_net_hdr hdr;
+	uint16_t num_buffers;
+};
+
+#endif
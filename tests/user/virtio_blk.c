@@ -0,0 +1,344 @@
+/*
+ * virtio-blk backed by an image file.  Every queue has its own thread,
+ * which drains the ring into preadv/pwritev straight on guest memory and
+ * then raises one interrupt for everything it completed.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "virtio_dev.h"
+
+#define VIRTIO_BLK_QUEUE_SIZE	128
+/* the header and the status byte take two descriptors */
+#define VIRTIO_BLK_SEG_MAX	(VIRTIO_BLK_QUEUE_SIZE - 2)
+#define VIRTIO_BLK_MAX_QUEUES	16
+
+struct blk_queue {
+	struct virtio_blk *blk;
+	int index;
+	pthread_t thread;
+	/* kicked and stop, the thread sleeps on cond */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int kicked;
+	int stop;
+	/* held while the thread touches the ring, so reset can wait it out */
+	pthread_mutex_t ring_lock;
+};
+
+struct virtio_blk {
+	struct virtio_dev dev;
+	struct virtio_blk_config config;
+	int fd;
+	int read_only;
+	uint64_t size;
+	struct blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+	struct kvm_virtio_blk_stats stats;
+};
+
+/* whole transfers, or -errno */
+static ssize_t blk_rw(int fd, struct iovec *iov, int cnt, off_t offset,
+		      int write)
+{
+	ssize_t r, done = 0;
+
+	while (cnt) {
+		r = write ? pwritev(fd, iov, cnt, offset) :
+			    preadv(fd, iov, cnt, offset);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			return -errno;
+		if (r == 0)
+			return -EIO;
+		done += r;
+		offset += r;
+		while (cnt && r >= iov->iov_len) {
+			r -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base += r;
+			iov->iov_len -= r;
+		}
+	}
+	return done;
+}
+
+static size_t iov_size(struct iovec *iov, int cnt)
+{
+	size_t len = 0;
+
+	while (cnt--)
+		len += iov++->iov_len;
+	return len;
+}
+
+/* runs one request, returns the bytes written into the guest's buffers */
+static uint32_t blk_request(struct virtio_blk *blk, struct iovec *iov,
+			    int out, int in)
+{
+	struct virtio_blk_outhdr hdr;
+	struct iovec *status_iov;
+	uint8_t status = VIRTIO_BLK_S_OK;
+	uint32_t written = 0;
+	uint64_t offset;
+	size_t len;
+	ssize_t r;
+
+	if (out < 1 || in < 1 || iov[0].iov_len < sizeof(hdr) ||
+	    iov[out + in - 1].iov_len < 1) {
+		fprintf(stderr, "virtio-blk: malformed request\n");
+		return 0;
+	}
+	memcpy(&hdr, iov[0].iov_base, sizeof(hdr));
+	/* the status byte is the last one the guest gave us */
+	status_iov = &iov[out + in - 1];
+	status_iov->iov_len--;
+	offset = hdr.sector * VIRTIO_BLK_SECTOR_SIZE;
+
+	switch (hdr.type) {
+	case VIRTIO_BLK_T_IN:
+		len = iov_size(&iov[out], in);
+		if (offset + len > blk->size || offset + len < offset) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		r = blk_rw(blk->fd, &iov[out], in, offset, 0);
+		if (r < 0) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		written = r;
+		__sync_fetch_and_add(&blk->stats.reads, 1);
+		__sync_fetch_and_add(&blk->stats.read_bytes, r);
+		break;
+	case VIRTIO_BLK_T_OUT:
+		len = iov_size(&iov[1], out - 1);
+		if (blk->read_only || offset + len > blk->size ||
+		    offset + len < offset) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		r = blk_rw(blk->fd, &iov[1], out - 1, offset, 1);
+		if (r < 0) {
+			status = VIRTIO_BLK_S_IOERR;
+			break;
+		}
+		__sync_fetch_and_add(&blk->stats.writes, 1);
+		__sync_fetch_and_add(&blk->stats.write_bytes, r);
+		break;
+	case VIRTIO_BLK_T_FLUSH:
+		if (fsync(blk->fd))
+			status = VIRTIO_BLK_S_IOERR;
+		__sync_fetch_and_add(&blk->stats.flushes, 1);
+		break;
+	case VIRTIO_BLK_T_GET_ID: {
+		static const char id[VIRTIO_BLK_ID_BYTES] = "kvm-kext-virtio-blk";
+
+		len = iov_size(&iov[out], in);
+		if (len > sizeof(id))
+			len = sizeof(id);
+		/* the guest normally hands over one 20 byte buffer */
+		if (iov[out].iov_len < len)
+			len = iov[out].iov_len;
+		memcpy(iov[out].iov_base, id, len);
+		written = len;
+		break;
+	}
+	default:
+		status = VIRTIO_BLK_S_UNSUPP;
+		break;
+	}
+
+	*(uint8_t *)(status_iov->iov_base + status_iov->iov_len) = status;
+	return written + 1;
+}
+
+/* everything the guest has queued, one interrupt at the end */
+static void blk_drain(struct blk_queue *q)
+{
+	struct virtio_blk *blk = q->blk;
+	struct virtqueue *vq = &blk->dev.vqs[q->index];
+	struct iovec iov[VIRTIO_BLK_SEG_MAX + 2];
+	int head, out, in, done = 0;
+
+	if (!vq->pfn)
+		return;
+	for (;;) {
+		/* we're looking anyway, the guest doesn't have to kick */
+		virtqueue_disable_notify(&blk->dev, vq);
+		while ((head = virtqueue_pop(&blk->dev, vq, iov,
+					     sizeof(iov) / sizeof(iov[0]),
+					     &out, &in)) != -1) {
+			/* a broken chain goes back untouched, or the guest
+			 * waits on it forever */
+			if (head < 0)
+				virtqueue_push(vq, virtqueue_last_head(vq), 0);
+			else
+				virtqueue_push(vq, head,
+					       blk_request(blk, iov, out, in));
+			done++;
+		}
+		/* and look once more, in case it queued without kicking */
+		if (!virtqueue_enable_notify(&blk->dev, vq))
+			break;
+	}
+	if (done && virtio_notify(&blk->dev, vq))
+		__sync_fetch_and_add(&blk->stats.interrupts, 1);
+}
+
+static void *blk_thread(void *opaque)
+{
+	struct blk_queue *q = opaque;
+
+	for (;;) {
+		pthread_mutex_lock(&q->lock);
+		while (!q->kicked && !q->stop)
+			pthread_cond_wait(&q->cond, &q->lock);
+		q->kicked = 0;
+		if (q->stop) {
+			pthread_mutex_unlock(&q->lock);
+			return NULL;
+		}
+		pthread_mutex_unlock(&q->lock);
+
+		pthread_mutex_lock(&q->ring_lock);
+		blk_drain(q);
+		pthread_mutex_unlock(&q->ring_lock);
+	}
+}
+
+static void blk_notify(struct virtio_dev *dev, int queue)
+{
+	struct virtio_blk *blk = (struct virtio_blk *)dev;
+	struct blk_queue *q = &blk->queues[queue];
+
+	__sync_fetch_and_add(&blk->stats.kicks, 1);
+	pthread_mutex_lock(&q->lock);
+	q->kicked = 1;
+	pthread_cond_signal(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+static void blk_reset(struct virtio_dev *dev)
+{
+	struct virtio_blk *blk = (struct virtio_blk *)dev;
+	int i;
+
+	/* a batch in flight finishes, then the rings go away under the lock */
+	for (i = 0; i < dev->nqueues; i++)
+		pthread_mutex_lock(&blk->queues[i].ring_lock);
+	for (i = 0; i < dev->nqueues; i++) {
+		dev->vqs[i].pfn = 0;
+		pthread_mutex_unlock(&blk->queues[i].ring_lock);
+	}
+}
+
+struct virtio_blk *kvm_virtio_blk_create(kvm_context_t kvm, const char *path,
+					 uint16_t io_base, int irq, int queues)
+{
+	struct virtio_blk *blk;
+	struct stat st;
+	int i;
+
+	if (queues < 1 || queues > VIRTIO_BLK_MAX_QUEUES) {
+		fprintf(stderr, "virtio-blk: 1 to %d queues\n",
+			VIRTIO_BLK_MAX_QUEUES);
+		return NULL;
+	}
+	blk = calloc(1, sizeof(*blk));
+	if (!blk)
+		return NULL;
+	blk->fd = open(path, O_RDWR);
+	if (blk->fd == -1) {
+		blk->fd = open(path, O_RDONLY);
+		blk->read_only = 1;
+	}
+	if (blk->fd == -1 || fstat(blk->fd, &st) == -1) {
+		perror(path);
+		goto fail;
+	}
+	blk->size = st.st_size & ~(uint64_t)(VIRTIO_BLK_SECTOR_SIZE - 1);
+
+	blk->config.capacity = blk->size / VIRTIO_BLK_SECTOR_SIZE;
+	blk->config.seg_max = VIRTIO_BLK_SEG_MAX;
+	blk->config.blk_size = VIRTIO_BLK_SECTOR_SIZE;
+	blk->config.num_queues = queues;
+
+	blk->dev.kvm = kvm;
+	blk->dev.device_id = VIRTIO_PCI_DEVICE_ID_BLK;
+	blk->dev.type = VIRTIO_ID_BLOCK;
+	blk->dev.class = 0x018000;	/* other mass storage */
+	blk->dev.io_base = io_base;
+	blk->dev.irq = irq;
+	blk->dev.host_features = 1 << VIRTIO_BLK_F_SEG_MAX |
+				 1 << VIRTIO_BLK_F_BLK_SIZE |
+				 1 << VIRTIO_BLK_F_FLUSH |
+				 1 << VIRTIO_RING_F_EVENT_IDX;
+	if (queues > 1)
+		blk->dev.host_features |= 1 << VIRTIO_BLK_F_MQ;
+	if (blk->read_only)
+		blk->dev.host_features |= 1 << VIRTIO_BLK_F_RO;
+	blk->dev.nqueues = queues;
+	blk->dev.config = &blk->config;
+	blk->dev.config_len = sizeof(blk->config);
+	blk->dev.notify = blk_notify;
+	blk->dev.reset = blk_reset;
+	if (virtio_register(&blk->dev, VIRTIO_BLK_QUEUE_SIZE))
+		goto fail;
+
+	for (i = 0; i < queues; i++) {
+		struct blk_queue *q = &blk->queues[i];
+
+		q->blk = blk;
+		q->index = i;
+		pthread_mutex_init(&q->lock, NULL);
+		pthread_mutex_init(&q->ring_lock, NULL);
+		pthread_cond_init(&q->cond, NULL);
+		pthread_create(&q->thread, NULL, blk_thread, q);
+	}
+	return blk;
+
+fail:
+	if (blk->fd != -1)
+		close(blk->fd);
+	free(blk);
+	return NULL;
+}
+
+void kvm_virtio_blk_destroy(struct virtio_blk *blk)
+{
+	int i;
+
+	for (i = 0; i < blk->dev.nqueues; i++) {
+		struct blk_queue *q = &blk->queues[i];
+
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_signal(&q->cond);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(q->thread, NULL);
+		pthread_mutex_destroy(&q->lock);
+		pthread_mutex_destroy(&q->ring_lock);
+		pthread_cond_destroy(&q->cond);
+	}
+	virtio_unregister(&blk->dev);
+	close(blk->fd);
+	free(blk);
+}
+
+void kvm_virtio_blk_stats(struct virtio_blk *blk,
+			  struct kvm_virtio_blk_stats *stats)
+{
+	*stats = blk->stats;
+}
@@ -0,0 +1,114 @@
+/*
+ * The legacy virtio-pci transport the libkvm device models share.  A model
+ * fills in its ids, features, config and hooks, virtio_register() puts it
+ * on pci bus 0, and kvm_virtio_pio() hands it the guest's port i/o.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#ifndef VIRTIO_DEV_H
+#define VIRTIO_DEV_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "kvmctl.h"
+#include "virtio.h"
+
+struct virtqueue {
+	kvm_context_t kvm;
+	uint16_t num;
+	uint32_t pfn;		/* 0 until the guest sets the queue up */
+	struct vring_desc *desc;
+	struct vring_avail *avail;
+	struct vring_used *used;
+	uint64_t used_gpa;	/* the part the device writes */
+	uint16_t last_avail;	/* next avail entry the device takes */
+	/* used index at the last interrupt, for VIRTIO_RING_F_EVENT_IDX */
+	uint16_t signalled_used;
+	int signalled_used_valid;
+};
+
+struct virtio_dev {
+	kvm_context_t kvm;
+	uint16_t device_id;
+	uint16_t type;		/* VIRTIO_ID_*, the pci subsystem id */
+	uint32_t class;		/* pci class, subclass and prog if */
+	uint16_t io_base;
+	int irq;
+	uint32_t host_features;
+	uint32_t guest_features;
+	uint8_t status;
+	uint16_t queue_sel;
+	int nqueues;
+	struct virtqueue *vqs;
+
+	/* the device's own config, after VIRTIO_PCI_CONFIG */
+	void *config;
+	int config_len;
+
+	/* the guest wrote the queue's index to QUEUE_NOTIFY, on a vcpu thread */
+	void (*notify)(struct virtio_dev *dev, int queue);
+	/* the guest wrote 0 to STATUS, stop touching the rings before returning */
+	void (*reset)(struct virtio_dev *dev);
+
+	/* vcpu and device threads both raise and lower the line */
+	pthread_mutex_t isr_lock;
+	uint8_t isr;
+
+	/* transport state */
+	int slot;
+	uint16_t pci_command;
+	int bar_sizing;
+	struct virtio_dev *next;
+};
+
+/* the guest moves it behind our back */
+static inline uint16_t vring_avail_idx(struct virtqueue *vq)
+{
+	return *(volatile uint16_t *)&vq->avail->idx;
+}
+
+static inline int virtio_has_feature(struct virtio_dev *dev, int bit)
+{
+	return (dev->guest_features >> bit) & 1;
+}
+
+/* register before any vcpu runs, with nqueues set */
+int virtio_register(struct virtio_dev *dev, uint16_t queue_size);
+void virtio_unregister(struct virtio_dev *dev);
+
+/*
+ * Takes the next available chain and maps it into iov, the buffers the
+ * device reads first and then the ones it writes.  Returns the chain's
+ * head for virtqueue_push(), -1 when the ring is empty, or -EINVAL for a
+ * chain that points outside guest ram or doesn't fit.
+ */
+int virtqueue_pop(struct virtio_dev *dev, struct virtqueue *vq,
+		  struct iovec *iov, int max, int *out_num, int *in_num);
+/* gives back the last n chains popped, when they can't be used yet */
+void virtqueue_unpop(struct virtqueue *vq, int n);
+/* the head of the chain popped last, also when virtqueue_pop() rejected it */
+int virtqueue_last_head(struct virtqueue *vq);
+/* len is the number of bytes written to the guest's buffers */
+void virtqueue_push(struct virtqueue *vq, int head, uint32_t len);
+/*
+ * Puts a chain idx entries past the used index without publishing it,
+ * virtqueue_flush() then hands the guest all n at once.
+ */
+void virtqueue_fill(struct virtqueue *vq, int head, uint32_t len, int idx);
+void virtqueue_flush(struct virtqueue *vq, int n);
+
+/*
+ * The device is going to look at the ring anyway, the guest can stop
+ * kicking.  virtqueue_enable_notify() asks for kicks again and returns
+ * nonzero if something was queued in between, then the device has to go
+ * round once more.
+ */
+void virtqueue_disable_notify(struct virtio_dev *dev, struct virtqueue *vq);
+int virtqueue_enable_notify(struct virtio_dev *dev, struct virtqueue *vq);
+
+/* one interrupt for everything pushed since the last one, 1 if it was sent */
+int virtio_notify(struct virtio_dev *dev, struct virtqueue *vq);
+
+#endif
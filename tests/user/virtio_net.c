@@ -0,0 +1,379 @@
+/*
+ * virtio-net with its rings run on an event loop thread, the way vhost-net
+ * does it: a kick only notifies the loop, which sends everything the guest
+ * queued, fills the receive ring from the backend and raises one interrupt
+ * per batch.  With event idx the guest only kicks, and only gets
+ * interrupts, when the loop has caught up and is about to sleep.
+ *
+ * This work is licensed under the GNU LGPL license, version 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "virtio_dev.h"
+
+#define VIRTIO_NET_QUEUE_SIZE	256
+/* no offloads, but the peer's frames can be anything a datagram holds */
+#define VIRTIO_NET_MAX_FRAME	(64 * 1024)
+/* an interrupt this often while a long receive batch is still going */
+#define VIRTIO_NET_RX_BATCH	64
+/* how often a guest that set a ring up without kicking gets looked at */
+#define VIRTIO_NET_IDLE_MS	100
+#define VIRTIO_NET_RETRY_MS	1
+
+struct virtio_net {
+	struct virtio_dev dev;
+	struct virtio_net_config config;
+	struct kvm_net_backend *be;
+
+	struct kvm_event_source *kick;
+	struct kvm_event_source *rx_ready;
+	struct kvm_event_source *timer;
+	/*
+	 * held while the loop touches the rings, so reset can wait it out;
+	 * the sources can fire on different loop threads, so it covers the
+	 * rest of the state below too
+	 */
+	pthread_mutex_t ring_lock;
+	int kicked;
+	unsigned timer_us;
+	int stop;
+
+	/* a received frame behind room for the header, until it fits */
+	char *frame;
+	ssize_t frame_len;
+
+	struct kvm_virtio_net_stats stats;
+};
+
+static size_t net_hdr_len(struct virtio_net *net)
+{
+	if (virtio_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF))
+		return sizeof(struct virtio_net_hdr_mrg_rxbuf);
+	return sizeof(struct virtio_net_hdr);
+}
+
+/* drops len bytes off the front, returns how many buffers are left */
+static int iov_skip(struct iovec **iovp, int cnt, size_t len)
+{
+	struct iovec *iov = *iovp;
+
+	while (cnt && len >= iov->iov_len) {
+		len -= iov->iov_len;
+		iov++;
+		cnt--;
+	}
+	if (cnt) {
+		iov->iov_base += len;
+		iov->iov_len -= len;
+	}
+	*iovp = iov;
+	return cnt;
+}
+
+static size_t iov_from_buf(struct iovec *iov, int cnt, const char *buf,
+			   size_t len)
+{
+	size_t done = 0, n;
+
+	while (cnt-- && done < len) {
+		n = iov->iov_len < len - done ? iov->iov_len : len - done;
+		memcpy(iov->iov_base, buf + done, n);
+		done += n;
+		iov++;
+	}
+	return done;
+}
+
+/* everything on the transmit ring, returns 1 if the backend pushed back */
+static int net_tx(struct virtio_net *net)
+{
+	struct virtqueue *vq = &net->dev.vqs[VIRTIO_NET_TX_QUEUE];
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE], *frame;
+	int head, out, in, cnt, r, done = 0, blocked = 0;
+
+	if (!vq->pfn)
+		return 0;
+	for (;;) {
+		virtqueue_disable_notify(&net->dev, vq);
+		while ((head = virtqueue_pop(&net->dev, vq, iov,
+					     VIRTIO_NET_QUEUE_SIZE,
+					     &out, &in)) >= 0) {
+			frame = iov;
+			cnt = iov_skip(&frame, out, net_hdr_len(net));
+			r = cnt ? net->be->send(net->be, frame, cnt) : -EINVAL;
+			if (r == -EAGAIN) {
+				/* back on the ring until the peer catches up */
+				virtqueue_unpop(vq, 1);
+				blocked = 1;
+				goto out;
+			}
+			if (r == 0) {
+				net->stats.tx_packets++;
+				while (cnt--)
+					net->stats.tx_bytes += frame++->iov_len;
+			} else {
+				/* no peer, like a cable that isn't plugged in */
+				net->stats.tx_dropped++;
+			}
+			virtqueue_push(vq, head, 0);
+			done++;
+		}
+		if (head != -1)
+			break;
+		if (!virtqueue_enable_notify(&net->dev, vq))
+			break;
+	}
+out:
+	if (done && virtio_notify(&net->dev, vq))
+		net->stats.interrupts++;
+	return blocked;
+}
+
+/*
+ * Puts net->frame on the receive ring, in as many buffers as it takes with
+ * mergeable buffers, or in one.  0 if the guest hasn't given us the room.
+ */
+static int net_rx_frame(struct virtio_net *net, struct virtqueue *vq)
+{
+	struct iovec iov[VIRTIO_NET_QUEUE_SIZE];
+	struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
+	int mergeable = virtio_has_feature(&net->dev, VIRTIO_NET_F_MRG_RXBUF);
+	size_t total = net_hdr_len(net) + net->frame_len, copied = 0, len;
+	int head, out, in, n = 0;
+
+	memset(net->frame, 0, net_hdr_len(net));
+	while (copied < total) {
+		head = virtqueue_pop(&net->dev, vq, iov, VIRTIO_NET_QUEUE_SIZE,
+				     &out, &in);
+		if (head == -1) {
+			virtqueue_unpop(vq, n);
+			return 0;
+		}
+		if (head < 0 || out || (n == 0 && iov[0].iov_len < net_hdr_len(net))) {
+			/* the guest's problem, the frame is lost */
+			if (head >= 0)
+				virtqueue_fill(vq, head, 0, n++);
+			net->stats.rx_dropped++;
+			break;
+		}
+		if (n == 0 && mergeable)
+			mhdr = iov[0].iov_base;
+		len = iov_from_buf(iov, in, net->frame + copied, total - copied);
+		virtqueue_fill(vq, head, len, n++);
+		copied += len;
+		if (!mergeable && copied < total) {
+			/* buffers that small need mergeable buffers */
+			net->stats.rx_dropped++;
+			break;
+		}
+	}
+	if (mhdr)
+		mhdr->num_buffers = n;
+	if (copied == total) {
+		net->stats.rx_packets++;
+		net->stats.rx_bytes += net->frame_len;
+	}
+	virtqueue_flush(vq, n);
+	return 1;
+}
+
+/* what the backend has, returns 1 if it stopped for lack of buffers */
+static int net_rx(struct virtio_net *net)
+{
+	struct virtqueue *vq = &net->dev.vqs[VIRTIO_NET_RX_QUEUE];
+	size_t hdr_len;
+	int done = 0, starved = 0;
+
+	if (!vq->pfn || !(net->dev.status & VIRTIO_CONFIG_S_DRIVER_OK))
+		return 1;
+	hdr_len = net_hdr_len(net);
+	/* new buffers only matter once we've run out */
+	virtqueue_disable_notify(&net->dev, vq);
+	for (;;) {
+		if (!net->frame_len) {
+			net->frame_len = net->be->recv(net->be,
+						       net->frame + hdr_len,
+						       VIRTIO_NET_MAX_FRAME);
+			if (net->frame_len <= 0) {
+				net->frame_len = 0;
+				break;
+			}
+		}
+		if (!net_rx_frame(net, vq)) {
+			/* kick us when there's room, unless there's some already */
+			if (virtqueue_enable_notify(&net->dev, vq))
+				continue;
+			starved = 1;
+			break;
+		}
+		net->frame_len = 0;
+		if (++done % VIRTIO_NET_RX_BATCH == 0 &&
+		    virtio_notify(&net->dev, vq))
+			net->stats.interrupts++;
+	}
+	if (done % VIRTIO_NET_RX_BATCH && virtio_notify(&net->dev, vq))
+		net->stats.interrupts++;
+	return starved;
+}
+
+/* every source ends up here, there's nothing else to do than both rings */
+static void net_run(struct virtio_net *net)
+{
+	int tx_blocked, rx_starved;
+	unsigned us;
+
+	pthread_mutex_lock(&net->ring_lock);
+	if (net->stop) {
+		/* the other sources may be gone already */
+		pthread_mutex_unlock(&net->ring_lock);
+		return;
+	}
+	tx_blocked = net_tx(net);
+	rx_starved = net_rx(net);
+	/* no room for frames, so wait for the guest's kick instead */
+	kvm_event_set_enabled(net->rx_ready, !rx_starved);
+	/*
+	 * a datagram socket is writable whether or not the peer has room,
+	 * so a backend that pushed back gets retried on a timer
+	 */
+	us = tx_blocked ? VIRTIO_NET_RETRY_MS * 1000 :
+	     rx_starved ? VIRTIO_NET_IDLE_MS * 1000 : 0;
+	if (us != net->timer_us) {
+		kvm_event_timer_set(net->timer, us, 0);
+		net->timer_us = us;
+	}
+	pthread_mutex_unlock(&net->ring_lock);
+}
+
+static void net_kick(void *opaque)
+{
+	struct virtio_net *net = opaque;
+
+	/* kicks from now on notify again */
+	__sync_lock_release(&net->kicked);
+	net_run(net);
+}
+
+static void net_rx_ready(void *opaque)
+{
+	net_run(opaque);
+}
+
+static void net_timer(void *opaque)
+{
+	struct virtio_net *net = opaque;
+
+	pthread_mutex_lock(&net->ring_lock);
+	net->timer_us = 0;
+	pthread_mutex_unlock(&net->ring_lock);
+	net_run(net);
+}
+
+static void net_notify(struct virtio_dev *dev, int queue)
+{
+	struct virtio_net *net = (struct virtio_net *)dev;
+
+	__sync_fetch_and_add(&net->stats.kicks, 1);
+	if (!__sync_lock_test_and_set(&net->kicked, 1))
+		kvm_event_notify(net->kick);
+}
+
+static void net_reset(struct virtio_dev *dev)
+{
+	struct virtio_net *net = (struct virtio_net *)dev;
+	int i;
+
+	/* a batch in flight finishes, then the rings go away under the lock */
+	pthread_mutex_lock(&net->ring_lock);
+	for (i = 0; i < dev->nqueues; i++)
+		dev->vqs[i].pfn = 0;
+	net->frame_len = 0;
+	pthread_mutex_unlock(&net->ring_lock);
+}
+
+struct virtio_net *kvm_virtio_net_create(kvm_context_t kvm,
+					 struct kvm_event_loop *loop,
+					 struct kvm_net_backend *be,
+					 const uint8_t *mac, uint16_t io_base,
+					 int irq)
+{
+	struct virtio_net *net;
+
+	net = calloc(1, sizeof(*net));
+	if (!net)
+		return NULL;
+	net->frame = malloc(sizeof(struct virtio_net_hdr_mrg_rxbuf) +
+			    VIRTIO_NET_MAX_FRAME);
+	if (!net->frame)
+		goto fail;
+	net->be = be;
+	memcpy(net->config.mac, mac, sizeof(net->config.mac));
+	net->config.status = VIRTIO_NET_S_LINK_UP;
+
+	net->dev.kvm = kvm;
+	net->dev.device_id = VIRTIO_PCI_DEVICE_ID_NET;
+	net->dev.type = VIRTIO_ID_NET;
+	net->dev.class = 0x020000;	/* ethernet */
+	net->dev.io_base = io_base;
+	net->dev.irq = irq;
+	net->dev.host_features = 1 << VIRTIO_NET_F_MAC |
+				 1 << VIRTIO_NET_F_MRG_RXBUF |
+				 1 << VIRTIO_NET_F_STATUS |
+				 1 << VIRTIO_RING_F_EVENT_IDX;
+	net->dev.nqueues = 2;
+	net->dev.config = &net->config;
+	net->dev.config_len = sizeof(net->config);
+	net->dev.notify = net_notify;
+	net->dev.reset = net_reset;
+	pthread_mutex_init(&net->ring_lock, NULL);
+	/* the backend is only looked at once the guest has given us buffers */
+	net->kick = kvm_event_add_notifier(loop, net_kick, net);
+	net->rx_ready = kvm_event_add_fd(loop, be->fd, 0, net_rx_ready, net);
+	net->timer = kvm_event_add_timer(loop, net_timer, net);
+	if (!net->kick || !net->rx_ready || !net->timer)
+		goto fail_sources;
+	kvm_event_set_enabled(net->rx_ready, 0);
+	if (virtio_register(&net->dev, VIRTIO_NET_QUEUE_SIZE))
+		goto fail_sources;
+	return net;
+
+fail_sources:
+	if (net->kick)
+		kvm_event_remove(net->kick);
+	if (net->rx_ready)
+		kvm_event_remove(net->rx_ready);
+	if (net->timer)
+		kvm_event_remove(net->timer);
+	pthread_mutex_destroy(&net->ring_lock);
+fail:
+	free(net->frame);
+	free(net);
+	return NULL;
+}
+
+void kvm_virtio_net_destroy(struct virtio_net *net)
+{
+	pthread_mutex_lock(&net->ring_lock);
+	net->stop = 1;
+	pthread_mutex_unlock(&net->ring_lock);
+	/* each waits for a callback in progress */
+	kvm_event_remove(net->kick);
+	kvm_event_remove(net->rx_ready);
+	kvm_event_remove(net->timer);
+	virtio_unregister(&net->dev);
+	net->be->close(net->be);
+	pthread_mutex_destroy(&net->ring_lock);
+	free(net->frame);
+	free(net);
+}
+
+void kvm_virtio_net_stats(struct virtio_net *net,
+			  struct kvm_virtio_net_stats *stats)
+{
+	*stats = net->stats;
+}